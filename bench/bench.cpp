@@ -0,0 +1,456 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/**
+    Benchmark suite of Image Alignment.
+ 
+    Sweeps aligners, warps, template sizes and pyramid levels. Each benchmark repeatedly 
+    aligns a template cut from a random target with a known warp, starting from a 
+    perturbed warp. Reported per benchmark are
+        - prepare_ns: mean time of AlignBase::prepare.
+        - pyramid_ns: part of prepare_ns spent building image pyramids.
+        - align_ns: mean time of AlignBase::align.
+        - iterations: mean number of iterations summed over all levels.
+        - ns_per_pixel_iteration: align_ns divided by the number of template pixels 
+          processed, i.e. iterations weighted by the template size of their level.
+        - prepare_allocs, align_allocs: mean number of heap allocations per call.
+        - success_rate: fraction of runs ending within one pixel of the true warp.
+ 
+    Usage
+        bench [--filter=<substring>] [--min_time=<seconds>] [--format=console|json] [--out=<file>]
+ 
+    Allocations are counted as described in tests/allocation_counter.h. Iterations and pyramid
+    timings are taken from AlignBase::stats, so the suite requires statistics.
+ */
+
+#include <imagealign/imagealign.h>
+
+#if defined(IA_NO_STATS)
+    #error "The benchmark suite requires alignment statistics, disable IMAGEALIGN_NO_STATS."
+#endif
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/opencv.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+
+#include "../tests/allocation_counter.h"
+
+namespace ia = imagealign;
+
+// Warp setup
+
+template<class W>
+struct WarpSetup;
+
+template<class Scalar>
+struct WarpSetup< ia::Warp<ia::WARP_TRANSLATION, Scalar> > {
+    typedef ia::Warp<ia::WARP_TRANSLATION, Scalar> W;
+    
+    static const char *name() { return "translation"; }
+    
+    static W groundTruth(cv::RNG &rng, cv::Size tplSize, cv::Size targetSize) {
+        typename W::Traits::ParamType p;
+        p(0,0) = (Scalar)rng.uniform(8.0, double(targetSize.width - tplSize.width - 8));
+        p(1,0) = (Scalar)rng.uniform(8.0, double(targetSize.height - tplSize.height - 8));
+        W w;
+        w.setParameters(p);
+        return w;
+    }
+    
+    static W perturbed(cv::RNG &rng, const W &truth) {
+        typename W::Traits::ParamType p = truth.parameters();
+        p(0,0) += (Scalar)rng.gaussian(2.0);
+        p(1,0) += (Scalar)rng.gaussian(2.0);
+        W w;
+        w.setParameters(p);
+        return w;
+    }
+};
+
+template<class Scalar>
+struct WarpSetup< ia::Warp<ia::WARP_EUCLIDEAN, Scalar> > {
+    typedef ia::Warp<ia::WARP_EUCLIDEAN, Scalar> W;
+    
+    static const char *name() { return "euclidean"; }
+    
+    static W groundTruth(cv::RNG &rng, cv::Size tplSize, cv::Size targetSize) {
+        typename W::Traits::ParamType p;
+        p(0,0) = (Scalar)rng.uniform(tplSize.width * 0.5, double(targetSize.width - tplSize.width * 1.5));
+        p(1,0) = (Scalar)rng.uniform(tplSize.height * 0.5, double(targetSize.height - tplSize.height * 1.5));
+        p(2,0) = (Scalar)rng.uniform(0.1, 0.4);
+        W w;
+        w.setParameters(p);
+        return w;
+    }
+    
+    static W perturbed(cv::RNG &rng, const W &truth) {
+        typename W::Traits::ParamType p = truth.parameters();
+        p(0,0) += (Scalar)rng.gaussian(2.0);
+        p(1,0) += (Scalar)rng.gaussian(2.0);
+        p(2,0) += (Scalar)rng.gaussian(0.03);
+        W w;
+        w.setParameters(p);
+        return w;
+    }
+};
+
+template<class Scalar>
+struct WarpSetup< ia::Warp<ia::WARP_SIMILARITY, Scalar> > {
+    typedef ia::Warp<ia::WARP_SIMILARITY, Scalar> W;
+    
+    static const char *name() { return "similarity"; }
+    
+    static W groundTruth(cv::RNG &rng, cv::Size tplSize, cv::Size targetSize) {
+        typename W::Traits::ParamType p;
+        p(0,0) = (Scalar)rng.uniform(tplSize.width * 0.5, double(targetSize.width - tplSize.width * 1.5));
+        p(1,0) = (Scalar)rng.uniform(tplSize.height * 0.5, double(targetSize.height - tplSize.height * 1.5));
+        p(2,0) = (Scalar)rng.uniform(0.1, 0.4);
+        p(3,0) = (Scalar)rng.uniform(0.9, 1.1);
+        W w;
+        w.setParametersInCanonicalRepresentation(p);
+        return w;
+    }
+    
+    static W perturbed(cv::RNG &rng, const W &truth) {
+        // Parameters are tx, ty, a and b. Perturb the canonical form instead.
+        W t(truth);
+        typename W::Traits::ParamType p = t.parametersInCanonicalRepresentation();
+        p(0,0) += (Scalar)rng.gaussian(2.0);
+        p(1,0) += (Scalar)rng.gaussian(2.0);
+        p(2,0) += (Scalar)rng.gaussian(0.03);
+        p(3,0) += (Scalar)rng.gaussian(0.01);
+        W w;
+        w.setParametersInCanonicalRepresentation(p);
+        return w;
+    }
+};
+
+// Aligner names
+
+template<class A>
+struct AlignerName;
+
+template<class W, class L>
+struct AlignerName< ia::AlignForwardAdditive<W, L> > {
+    static const char *name() { return "forward_additive"; }
+};
+
+template<class W, class L>
+struct AlignerName< ia::AlignForwardCompositional<W, L> > {
+    static const char *name() { return "forward_compositional"; }
+};
+
+template<class W, class L>
+struct AlignerName< ia::AlignInverseCompositional<W, L> > {
+    static const char *name() { return "inverse_compositional"; }
+};
+
+template<class W, class L>
+struct AlignerName< ia::AlignESM<W, L> > {
+    static const char *name() { return "esm"; }
+};
+
+struct Options {
+    std::string filter;
+    double minTime;
+    bool json;
+    std::string out;
+    
+    Options()
+        : minTime(0.2), json(false)
+    {}
+};
+
+struct Result {
+    std::string name;
+    std::string aligner;
+    std::string warp;
+    int templateSize;
+    int levels;
+    int runs;
+    double prepareNs;
+    double pyramidNs;
+    double alignNs;
+    double iterations;
+    double nsPerPixelIteration;
+    double prepareAllocs;
+    double alignAllocs;
+    double successRate;
+};
+
+/**
+    Run a single benchmark.
+ */
+template<class A, class W>
+Result runBenchmark(const Options &opts, const cv::Mat &target, int tplSize, int levels)
+{
+    typedef WarpSetup<W> Setup;
+    
+    std::ostringstream name;
+    name << AlignerName<A>::name() << "/" << Setup::name() << "/" << tplSize << "/" << levels;
+    
+    Result r;
+    r.name = name.str();
+    r.aligner = AlignerName<A>::name();
+    r.warp = Setup::name();
+    r.templateSize = tplSize;
+    r.levels = levels;
+    
+    // Template pixels per level, same as cv::pyrDown
+    std::vector<double> levelPixels(levels);
+    cv::Size s(tplSize, tplSize);
+    for (int l = 0; l < levels; ++l) {
+        levelPixels[l] = double(s.area());
+        s = cv::Size((s.width + 1) / 2, (s.height + 1) / 2);
+    }
+    
+    ia::TerminationCriteria criteria(30);
+    criteria.setMinDisplacement(0.01);
+    
+    cv::RNG rng(0x1234);
+    cv::Mat tpl(tplSize, tplSize, CV_8UC1);
+    
+    A a;
+    
+    const double freq = cv::getTickFrequency();
+    const int minRuns = 3;
+    const int maxRuns = 10000;
+    
+    double prepareTicks = 0, alignTicks = 0, pyramidSeconds = 0, pixelIterations = 0, iterations = 0;
+    int prepareAllocs = 0, alignAllocs = 0, successes = 0, runs = 0;
+    
+    // The first run warms up caches and buffers and is not recorded
+    for (int run = -1; run < maxRuns; ++run) {
+        const W truth = Setup::groundTruth(rng, tpl.size(), target.size());
+        ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tpl, tpl.size(), truth);
+        W w = Setup::perturbed(rng, truth);
+        
+        const int alloc0 = allocations();
+        const int64 t0 = cv::getTickCount();
+        a.prepare(tpl, target, w, levels);
+        const int64 t1 = cv::getTickCount();
+        const int alloc1 = allocations();
+        a.align(w, criteria);
+        const int64 t2 = cv::getTickCount();
+        const int alloc2 = allocations();
+        
+        if (run < 0)
+            continue;
+        
+        prepareTicks += double(t1 - t0);
+        alignTicks += double(t2 - t1);
+        prepareAllocs += alloc1 - alloc0;
+        alignAllocs += alloc2 - alloc1;
+        pyramidSeconds += a.stats().pyramidSeconds;
+        
+        const ia::AlignStats &stats = a.stats();
+        for (size_t l = 0; l < stats.levels.size(); ++l) {
+            iterations += stats.levels[l].iterations;
+            pixelIterations += stats.levels[l].iterations * levelPixels[l];
+        }
+        
+        if (ia::cornerDisplacement(w, truth, tpl.size()) < 1.0)
+            ++successes;
+        
+        ++runs;
+        if (runs >= minRuns && (prepareTicks + alignTicks) / freq >= opts.minTime)
+            break;
+    }
+    
+    const double nsPerTick = 1e9 / freq;
+    r.runs = runs;
+    r.prepareNs = prepareTicks * nsPerTick / runs;
+    r.pyramidNs = pyramidSeconds * 1e9 / runs;
+    r.alignNs = alignTicks * nsPerTick / runs;
+    r.iterations = iterations / runs;
+    r.nsPerPixelIteration = pixelIterations > 0 ? alignTicks * nsPerTick / pixelIterations : 0;
+    r.prepareAllocs = double(prepareAllocs) / runs;
+    r.alignAllocs = double(alignAllocs) / runs;
+    r.successRate = double(successes) / runs;
+    
+    return r;
+}
+
+/**
+    Run aligner for all template sizes and levels.
+ */
+template<class A, class W>
+void sweep(const Options &opts, const cv::Mat &target, std::vector<Result> &results)
+{
+    const int sizes[] = {32, 64, 128};
+    const int levels[] = {1, 2, 3};
+    
+    for (int s = 0; s < 3; ++s) {
+        for (int l = 0; l < 3; ++l) {
+            std::ostringstream name;
+            name << AlignerName<A>::name() << "/" << WarpSetup<W>::name() << "/" << sizes[s] << "/" << levels[l];
+            
+            if (!opts.filter.empty() && name.str().find(opts.filter) == std::string::npos)
+                continue;
+            
+            results.push_back(runBenchmark<A, W>(opts, target, sizes[s], levels[l]));
+            
+            if (!opts.json) {
+                const Result &r = results.back();
+                std::cout << std::left << std::setw(40) << r.name << std::right
+                          << std::setw(12) << std::fixed << std::setprecision(0) << r.prepareNs
+                          << std::setw(12) << r.pyramidNs
+                          << std::setw(12) << r.alignNs
+                          << std::setw(8) << std::setprecision(1) << r.iterations
+                          << std::setw(10) << std::setprecision(2) << r.nsPerPixelIteration
+                          << std::setw(8) << std::setprecision(1) << r.prepareAllocs
+                          << std::setw(8) << r.alignAllocs
+                          << std::setw(8) << std::setprecision(2) << r.successRate
+                          << std::endl;
+            }
+        }
+    }
+}
+
+/**
+    Run all aligners for one warp.
+ */
+template<class W>
+void sweepAligners(const Options &opts, const cv::Mat &target, std::vector<Result> &results)
+{
+    sweep< ia::AlignForwardAdditive<W>, W >(opts, target, results);
+    sweep< ia::AlignForwardCompositional<W>, W >(opts, target, results);
+    sweep< ia::AlignInverseCompositional<W>, W >(opts, target, results);
+    sweep< ia::AlignESM<W>, W >(opts, target, results);
+}
+
+void writeJSON(std::ostream &os, const std::vector<Result> &results)
+{
+    char date[64];
+    const std::time_t now = std::time(0);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+    
+    os << "{" << std::endl
+       << "  \"context\": {" << std::endl
+       << "    \"date\": \"" << date << "\"," << std::endl
+       << "    \"num_threads\": " << cv::getNumThreads() << "," << std::endl
+       << "    \"simd\": \"" << ia::simdInstructionSet() << "\"" << std::endl
+       << "  }," << std::endl
+       << "  \"benchmarks\": [" << std::endl;
+    
+    os << std::setprecision(6);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        os << "    {"
+           << "\"name\": \"" << r.name << "\", "
+           << "\"aligner\": \"" << r.aligner << "\", "
+           << "\"warp\": \"" << r.warp << "\", "
+           << "\"template_size\": " << r.templateSize << ", "
+           << "\"levels\": " << r.levels << ", "
+           << "\"runs\": " << r.runs << ", "
+           << "\"prepare_ns\": " << r.prepareNs << ", "
+           << "\"pyramid_ns\": " << r.pyramidNs << ", "
+           << "\"align_ns\": " << r.alignNs << ", "
+           << "\"iterations\": " << r.iterations << ", "
+           << "\"ns_per_pixel_iteration\": " << r.nsPerPixelIteration << ", "
+           << "\"prepare_allocs\": " << r.prepareAllocs << ", "
+           << "\"align_allocs\": " << r.alignAllocs << ", "
+           << "\"success_rate\": " << r.successRate
+           << "}" << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    
+    os << "  ]" << std::endl << "}" << std::endl;
+}
+
+bool parseOptions(int argc, char **argv, Options &opts)
+{
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        
+        if (arg.compare(0, 9, "--filter=") == 0) {
+            opts.filter = arg.substr(9);
+        } else if (arg.compare(0, 11, "--min_time=") == 0) {
+            opts.minTime = std::atof(arg.c_str() + 11);
+        } else if (arg == "--format=json") {
+            opts.json = true;
+        } else if (arg == "--format=console") {
+            opts.json = false;
+        } else if (arg.compare(0, 6, "--out=") == 0) {
+            opts.out = arg.substr(6);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--filter=<substring>] [--min_time=<seconds>] [--format=console|json] [--out=<file>]" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    Options opts;
+    if (!parseOptions(argc, argv, opts))
+        return 1;
+    
+    // Same target for all benchmarks
+    cv::theRNG().state = 42;
+    cv::Mat target(480, 640, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5, 5));
+    
+    if (!opts.json) {
+        std::cout << "SIMD: " << ia::simdInstructionSet() << ", threads: " << cv::getNumThreads() << std::endl;
+        std::cout << std::left << std::setw(40) << "benchmark" << std::right
+                  << std::setw(12) << "prepare ns"
+                  << std::setw(12) << "pyramid ns"
+                  << std::setw(12) << "align ns"
+                  << std::setw(8) << "iters"
+                  << std::setw(10) << "ns/px/it"
+                  << std::setw(8) << "p alloc"
+                  << std::setw(8) << "a alloc"
+                  << std::setw(8) << "success"
+                  << std::endl;
+    }
+    
+    std::vector<Result> results;
+    sweepAligners<ia::WarpTranslationF>(opts, target, results);
+    sweepAligners<ia::WarpEuclideanF>(opts, target, results);
+    sweepAligners<ia::WarpSimilarityF>(opts, target, results);
+    
+    if (opts.json) {
+        if (opts.out.empty()) {
+            writeJSON(std::cout, results);
+        } else {
+            std::ofstream f(opts.out.c_str());
+            writeJSON(f, results);
+        }
+    } else if (!opts.out.empty()) {
+        std::ofstream f(opts.out.c_str());
+        writeJSON(f, results);
+    }
+    
+    return 0;
+}
\ No newline at end of file
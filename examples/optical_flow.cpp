@@ -56,7 +56,14 @@ void drawRectOfTemplate(cv::Mat &img, const ia::Warp<WarpType, Scalar> &w, cv::S
     cv::line(img, toP(c3), toP(c0), color, 1, CV_AA);
 }
 
-void opticalFlowIA(cv::Mat &prevGray,
+// Will be using pure translational motion
+typedef ia::WarpTranslationF WarpType;
+
+// All templates are aligned in a single batch using the inverse compositional algorithm
+typedef ia::BatchAligner< WarpType > AlignType;
+
+void opticalFlowIA(AlignType &aligner,
+                   cv::Mat &prevGray,
                    cv::Mat &gray,
                    std::vector<cv::Point2f> &prevPoints,
                    std::vector<cv::Point2f> &points,
@@ -64,30 +71,17 @@ void opticalFlowIA(cv::Mat &prevGray,
                    std::vector<float> &err)
 {
     const int LEVELS = 3;
-
-    // Will be using pure translational motion
-    typedef ia::WarpTranslationF WarpType;
-    
-    // In conjunction with inverse compositional algorithm
-    typedef ia::AlignInverseCompositional< WarpType > AlignType;
     
-    // We will also make use of the face, that we can share gray among all aligners
+    // We will also make use of the fact, that we can share gray among all templates
     ia::ImagePyramid target;
     target.create(gray, LEVELS);
     
-    // Create an aligner for each point
-    std::vector<AlignType> aligners(prevPoints.size());
-    
-    // Create a warp for each point. Note we use identity transform here.
+    // One template and one warp per point.
+    std::vector<cv::Mat> templates(prevPoints.size());
     std::vector<WarpType> warps(prevPoints.size());
+    std::vector<cv::Point2f> offsets(prevPoints.size());
     
-    // Prepare outputs
-    points.resize(prevPoints.size());
-    status.resize(prevPoints.size());
-    err.resize(prevPoints.size());
-    
-    #pragma omp parallel for
-    for (int i = 0; i < (int)aligners.size(); ++i) {
+    for (size_t i = 0; i < prevPoints.size(); ++i) {
         
         // The template will be a rectangular region around the point
         const int windowOff = 15;
@@ -105,29 +99,31 @@ void opticalFlowIA(cv::Mat &prevGray,
         b = std::min<int>(gray.rows - 1, std::max<int>(0, b));
         cv::Rect roi(l, t, r - l, b - t);
 
-        if (roi.area() < 10) {
-            status[i] = 0;
-            continue;
+        // Too small templates are left empty and reported as lost.
+        if (roi.area() >= 10) {
+            templates[i] = prevGray(roi);
         }
         
         // Move corner to top left
-        float offsetX = (float)l - p.x;
-        float offsetY = (float)t - p.y;
+        offsets[i] = cv::Point2f((float)l - p.x, (float)t - p.y);
         
         // Initialize warp
-        ia::WarpTranslationF::Traits::ParamType wp(p.x + offsetX, p.y + offsetY);
+        ia::WarpTranslationF::Traits::ParamType wp(p.x + offsets[i].x, p.y + offsets[i].y);
         warps[i].setParameters(wp);
+    }
+    
+    // Prepare all templates at once and align them in parallel. The aligner is owned
+    // by the caller and kept across frames, so that its memory is reused.
+    aligner.prepare(templates, WarpType(), LEVELS);
+    aligner.align(target, warps, 20, 0.03f, &status, &err);
 
-        // Initialize aligner
-        aligners[i].prepare(prevGray(roi), target, warps[i], LEVELS);
-        aligners[i].align(warps[i], 20, 0.03f);
-
-        // Extract result
-        wp = warps[i].parameters();
-        points[i].x = wp(0) - offsetX;
-        points[i].y = wp(1) - offsetY;
-        err[i] = aligners[i].lastError();
-        status[i] = err[i] < 40*40;
+    // Extract results
+    points.resize(prevPoints.size());
+    for (size_t i = 0; i < prevPoints.size(); ++i) {
+        ia::WarpTranslationF::Traits::ParamType wp = warps[i].parameters();
+        points[i].x = wp(0) - offsets[i].x;
+        points[i].y = wp(1) - offsets[i].y;
+        status[i] = status[i] && err[i] < 40*40;
     }
     
 }
@@ -183,6 +179,7 @@ int main(int argc, char **argv)
     
     cv::Mat gray, prevGray, image, frame;
     std::vector<cv::Point2f> points[2];
+    AlignType aligner;
     
     bool init = false;
     bool done = false;
@@ -215,7 +212,7 @@ int main(int argc, char **argv)
             std::vector<float> err;
             
             // Perform optical flow
-            opticalFlowIA(prevGray, gray, points[0], points[1], status, err);
+            opticalFlowIA(aligner, prevGray, gray, points[0], points[1], status, err);
             //opticalFlowCV(prevGray, gray, points[0], points[1], status, err);
             drawOpticalFlow(image, points[0], points[1], status);
             
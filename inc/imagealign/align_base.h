@@ -23,8 +23,18 @@
 #include <imagealign/warp.h>
 #include <imagealign/config.h>
 #include <imagealign/image_pyramid.h>
+#include <imagealign/streaming_pyramid.h>
+#include <imagealign/sampling.h>
+#include <imagealign/parallel.h>
+#include <imagealign/termination.h>
+#include <imagealign/loss.h>
+#include <imagealign/align_stats.h>
+#include <imagealign/pixel_selection.h>
+#include <imagealign/translation_search.h>
 
 #include <limits>
+#include <vector>
+#include <cmath>
 
 
 namespace imagealign {
@@ -39,7 +49,679 @@ namespace imagealign {
          : numConstraints(0)
         {}
     };
+    
+    /**
+        Template row warped into the target image.
+     
+        Holds the columns of template pixels whose warped positions fall inside the
+        target image, the warped positions and the target intensities sampled there.
+        Aligners sampling gradients per pixel store them in gx and gy.
+        Buffers grow on demand and are reused across rows and iterations.
+     */
+    template<class Scalar>
+    struct WarpedRow {
+        std::vector<int> cols;
+        std::vector<Scalar> x;
+        std::vector<Scalar> y;
+        std::vector<float> intensities;
+        std::vector<Scalar> gx;
+        std::vector<Scalar> gy;
+        int size;
+        
+        WarpedRow()
+         : size(0)
+        {}
+        
+        void reserve(int n) {
+            n = std::max<int>(n, 1);
+            if ((int)cols.size() < n) {
+                cols.resize(n);
+                x.resize(n);
+                y.resize(n);
+                intensities.resize(n);
+                gx.resize(n);
+                gy.resize(n);
+            }
+        }
+    };
+    
+    /**
+        Partial sums of a chunk of template rows, see RowChunks.
+     
+        Additionally holds scratch buffers used while processing the chunk. Aligners keep 
+        one instance per chunk and reuse it across iterations.
+     */
+    template<class W>
+    struct RowChunkSums {
+        typedef typename W::Traits::ScalarType ScalarType;
+        
+        typename W::Traits::ParamType b;
+        typename W::Traits::HessianType hessian;
+        ScalarType sumErrors;
+        int numConstraints;
+        
+        WarpedRow<ScalarType> row;
+        std::vector<float> buffer;
+        
+        RowChunkSums()
+         : sumErrors(0), numConstraints(0)
+        {}
+        
+        /** Zero all sums. The Hessian is only touched when requested. */
+        void reset(int nParams, bool withHessian) {
+            b = W::Traits::zeroParam(nParams);
+            if (withHessian)
+                hessian = W::Traits::zeroHessian(nParams);
+            sumErrors = 0;
+            numConstraints = 0;
+        }
+        
+        /** Add sums of another chunk. */
+        void add(const RowChunkSums &other, bool withHessian) {
+            b += other.b;
+            if (withHessian)
+                hessian += other.hessian;
+            sumErrors += other.sumErrors;
+            numConstraints += other.numConstraints;
+        }
+    };
+    
+    /**
+        Sum partial results of all chunks in chunk order.
+     
+        \param chunks Partial sums, one per chunk.
+        \param count Number of chunks used.
+        \param nParams Number of warp parameters.
+        \param total Receives the sums.
+        \param withHessian Whether to sum Hessians.
+     */
+    template<class W>
+    inline void reduceRowChunks(const std::vector< RowChunkSums<W> > &chunks, int count, int nParams, RowChunkSums<W> &total, bool withHessian) {
+        total.reset(nParams, withHessian);
+        for (int c = 0; c < count; ++c) {
+            total.add(chunks[c], withHessian);
+        }
+    }
+    
+    /**
+        Test if coordinates are in image.
+     
+        \param p Image coordinates
+        \param imgSize Size of image
+        \param r Minimum distance from image border pixels.
+     */
+    template<class PointType>
+    inline bool isInImage(const PointType &p, cv::Size imgSize, int r) {
+        typedef typename PointType::value_type ScalarType;
+        
+        // Equivalent to testing floor(p - 0.5) against [r, size - r), but
+        // without the cost of floor in the inner loops.
+        const ScalarType lo = ScalarType(r) + ScalarType(0.5);
+        
+        return p(0) >= lo &&
+               p(1) >= lo &&
+               p(0) < ScalarType(imgSize.width - r) + ScalarType(0.5) &&
+               p(1) < ScalarType(imgSize.height - r) + ScalarType(0.5);
+    }
+    
+    /**
+        Range of template pixels in a row whose warped positions are valid.
+     
+        Valid positions are at least one pixel away from the target border, see isInImage.
+        For planar warps the range is computed from the row start and step. Pixels at
+        both ends of the range are verified, so that the range is exact. For other
+        warps, all pixels are reported and have to be tested individually.
+     
+        \param ws Scanline evaluator of the current warp. Positioned at (xBegin, y) on return.
+        \param y Template row
+        \param xBegin First template column
+        \param xEnd One past last template column
+        \param targetSize Size of target image
+        \param first Receives first valid column.
+        \param last Receives one past last valid column.
+     */
+    template<class W>
+    inline void validRowSpan(WarpScanline<W> &ws, int y, int xBegin, int xEnd, cv::Size targetSize, int &first, int &last) {
+        typedef typename W::Traits::ScalarType ScalarType;
+        
+        const int n = std::max<int>(xEnd - xBegin, 0);
+        
+        ws.start(xBegin, y);
+        ws.span(n,
+                ScalarType(1.5),
+                ScalarType(targetSize.width - 1) + ScalarType(0.5),
+                ScalarType(targetSize.height - 1) + ScalarType(0.5),
+                first, last);
+        
+        if (WarpScanline<W>::ExactSpans) {
+            // Fix rounding issues at both ends of range
+            while (first < last && (ws.seek(first), !isInImage(ws.point(), targetSize, 1)))
+                ++first;
+            while (last > first && (ws.seek(last - 1), !isInImage(ws.point(), targetSize, 1)))
+                --last;
+            while (first > 0 && (ws.seek(first - 1), isInImage(ws.point(), targetSize, 1)))
+                --first;
+            while (last < n && (ws.seek(last), isInImage(ws.point(), targetSize, 1)))
+                ++last;
+        }
+        
+        first += xBegin;
+        last += xBegin;
+        
+        ws.seek(0);
+    }
+    
+    /**
+        Warp a template row into the target image.
+     
+        Visits template pixels [xBegin, xEnd) of row y and records all pixels whose
+        warped position is at least one pixel away from the target border. Target
+        intensities are not sampled, see warpRow.
+     
+        For planar warps only the valid range of pixels is visited, see validRowSpan.
+     
+        \param ws Scanline evaluator of the current warp.
+        \param y Template row
+        \param xBegin First template column
+        \param xEnd One past last template column
+        \param targetSize Size of target image
+        \param row Receives the warped pixels.
+     */
+    template<class W>
+    inline void warpRowPositions(WarpScanline<W> &ws, int y, int xBegin, int xEnd, cv::Size targetSize, WarpedRow<typename W::Traits::ScalarType> &row) {
+        typedef typename W::Traits::PointType PointType;
+        
+        row.reserve(xEnd - xBegin);
+        
+        int first, last;
+        validRowSpan(ws, y, xBegin, xEnd, targetSize, first, last);
+        
+        int n = 0;
+        if (WarpScanline<W>::ExactSpans) {
+            // Branch-free over valid pixels
+            ws.seek(first - xBegin);
+            for (int x = first; x < last; ++x, ws.next(), ++n) {
+                const PointType p = ws.point();
+                row.cols[n] = x;
+                row.x[n] = p(0);
+                row.y[n] = p(1);
+            }
+        } else {
+            for (int x = first; x < last; ++x, ws.next()) {
+                const PointType p = ws.point();
+                
+                if (!isInImage(p, targetSize, 1))
+                    continue;
+                
+                row.cols[n] = x;
+                row.x[n] = p(0);
+                row.y[n] = p(1);
+                ++n;
+            }
+        }
+        
+        row.size = n;
+    }
+    
+    /**
+        Count template pixels whose warped positions are valid.
+     
+        \param w Warp
+        \param templateSize Size of template image. Border pixels are not counted.
+        \param targetSize Size of target image.
+     */
+    template<class W>
+    inline int countValidPixels(const W &w, cv::Size templateSize, cv::Size targetSize) {
+        typedef typename W::Traits::PointType PointType;
+        
+        WarpScanline<W> ws(w);
+        
+        int count = 0;
+        for (int y = 1; y < templateSize.height - 1; ++y) {
+            int first, last;
+            validRowSpan(ws, y, 1, templateSize.width - 1, targetSize, first, last);
+            
+            if (WarpScanline<W>::ExactSpans) {
+                count += last - first;
+            } else {
+                for (int x = first; x < last; ++x, ws.next()) {
+                    const PointType p = ws.point();
+                    if (isInImage(p, targetSize, 1))
+                        ++count;
+                }
+            }
+        }
+        
+        return count;
+    }
+    
+    namespace detail {
+        
+        /**
+            Test if too few template pixels warp into the target.
+         
+            \param w Warp
+            \param templateSize Size of template image.
+            \param targetSize Size of target image.
+            \param fraction Minimum fraction of inner template pixels. Zero disables the test.
+         */
+        template<class W>
+        inline bool tooFewValidPixels(const W &w, cv::Size templateSize, cv::Size targetSize, double fraction) {
+            if (fraction <= 0)
+                return false;
+            
+            const double inner = double(std::max<int>(templateSize.width - 2, 0)) * double(std::max<int>(templateSize.height - 2, 0));
+            
+            return double(countValidPixels(w, templateSize, targetSize)) < fraction * inner;
+        }
+    }
+    
+    /**
+        Maximum distance the template corners move between two warps.
+     
+        \param a First warp
+        \param b Second warp
+        \param size Size of template.
+     */
+    template<class W>
+    inline double cornerDisplacement(const W &a, const W &b, cv::Size size) {
+        typedef typename W::Traits::PointType PointType;
+        typedef typename W::Traits::ScalarType ScalarType;
+        
+        const ScalarType cx[] = {ScalarType(0), ScalarType(size.width - 1), ScalarType(0), ScalarType(size.width - 1)};
+        const ScalarType cy[] = {ScalarType(0), ScalarType(0), ScalarType(size.height - 1), ScalarType(size.height - 1)};
+        
+        double d = 0;
+        for (int i = 0; i < 4; ++i) {
+            const PointType p(cx[i], cy[i]);
+            const PointType pa = a(p);
+            const PointType pb = b(p);
+            const double dx = double(pa(0) - pb(0));
+            const double dy = double(pa(1) - pb(1));
+            d = std::max<double>(d, std::sqrt(dx * dx + dy * dy));
+        }
+        return d;
+    }
+    
+    /**
+        Warp a template row into the target image and sample target intensities.
+     
+        Same as warpRowPositions, followed by bilinear sampling of the target at all
+        recorded positions in a single batch.
+     */
+    template<class W>
+    inline void warpRow(WarpScanline<W> &ws, int y, int xBegin, int xEnd, const cv::Mat &target, WarpedRow<typename W::Traits::ScalarType> &row) {
+        warpRowPositions(ws, y, xBegin, xEnd, target.size(), row);
+        
+        if (row.size > 0) {
+            Sampler<SAMPLE_BILINEAR> s;
+            s.sampleToFloat(target, &row.x[0], &row.y[0], row.size, &row.intensities[0]);
+        }
+    }
    
+    namespace detail {
+        
+        /**
+            Iteration strategy of AlignBase::align taking a number of iterations and eps.
+         
+            Iterations are split evenly among the levels used. A step shorter than eps ends
+            the level without being applied, except for the first step of a level.
+         */
+        template<class W>
+        class EpsilonTermination {
+        public:
+            typedef typename W::Traits::ScalarType ScalarType;
+            typedef typename W::Traits::ParamType ParamType;
+            
+            enum {
+                /** Whether converged and skipFinerLevels need step displacements. */
+                UsesDisplacement = 0
+            };
+            
+            EpsilonTermination(int maxIterations, ScalarType eps)
+                : _maxIterations(maxIterations), _iterationsPerLevel(0), _eps(eps)
+            {}
+            
+            void beginAlignment(int numLevels) {
+                _iterationsPerLevel = _maxIterations / std::max<int>(numLevels, 1);
+            }
+            
+            int levelIterations(int /*level*/) const {
+                return _iterationsPerLevel;
+            }
+            
+            bool accepts(int iteration, const ParamType &delta) const {
+                return iteration == 0 || (ScalarType)parameterNorm(delta) >= _eps;
+            }
+            
+            bool converged(const TerminationStep &/*s*/) const {
+                return false;
+            }
+            
+            bool skipFinerLevels(int /*level*/, int /*iterations*/, int /*accepted*/, double /*displacement*/) const {
+                return false;
+            }
+            
+        private:
+            int _maxIterations;
+            int _iterationsPerLevel;
+            ScalarType _eps;
+        };
+        
+        /**
+            Iteration strategy forwarding to a termination policy, see TerminationCriteria.
+         
+            Every step that does not increase the error is applied.
+         */
+        template<class W, class Policy>
+        class PolicyTermination {
+        public:
+            typedef typename W::Traits::ParamType ParamType;
+            
+            enum {
+                UsesDisplacement = 1
+            };
+            
+            explicit PolicyTermination(Policy &policy)
+                : _policy(policy)
+            {}
+            
+            void beginAlignment(int numLevels) {
+                _policy.beginAlignment(numLevels);
+            }
+            
+            int levelIterations(int level) {
+                return _policy.levelIterations(level);
+            }
+            
+            bool accepts(int /*iteration*/, const ParamType &/*delta*/) const {
+                return true;
+            }
+            
+            bool converged(const TerminationStep &s) {
+                return _policy.converged(s);
+            }
+            
+            bool skipFinerLevels(int level, int iterations, int accepted, double displacement) {
+                return _policy.skipFinerLevels(level, iterations, accepted, displacement);
+            }
+            
+        private:
+            Policy &_policy;
+        };
+        
+        /** Applies steps of inverse compositional aligners, see AlignLoop::update. */
+        template<class W>
+        struct InverseCompositionalUpdate {
+            void apply(W &w, const SingleStepResult<W> &s) const {
+                w.updateInverseCompositional(s.delta);
+            }
+        };
+        
+        /**
+            Multi-level iteration shared by all aligners, see AlignBase::align.
+         
+            Holds the state of a single alignment: the current level, the warp at the resolution
+            of that level, the error of the level and the iteration counts. Starts at the given
+            coarsest level. Leaving a level tests the cascade and the strategy for skipping finer 
+            levels, see endLevel. Once done, the warp refers to the finest pyramid level.
+         
+            Aligners computing one step at a time call run. Aligners computing steps of many 
+            alignments at once drive the loop themselves:
+         
+                while (loop.nextLevel()) {
+                    while (loop.iterating())
+                        loop.update(step(loop.warp()), updater, templateSize);
+                    loop.endLevel(cascade);
+                }
+         
+            \tparam W Type of warp motion.
+            \tparam Strategy Iteration strategy, see EpsilonTermination and PolicyTermination.
+         */
+        template<class W, class Strategy>
+        class AlignLoop {
+        public:
+            typedef typename W::Traits::ScalarType ScalarType;
+            
+            /**
+                Begin alignment.
+             
+                \param w Initial warp at the finest level.
+                \param coarsest Coarsest level to align.
+                \param finest Finest level to align. The cascade is not consulted for it.
+                \param strategy Iteration strategy.
+                \param stats Optional statistics receiving iterations and levels. The caller resets them.
+             */
+            AlignLoop(const W &w, int coarsest, int finest, const Strategy &strategy, AlignStats *stats = 0)
+                : _strategy(strategy), _stats(stats), _ws(w.scaled(-(coarsest + 1))),
+                  _coarsest(coarsest), _finest(finest), _level(coarsest + 1),
+                  _iterations(0), _iteration(0), _performed(0), _accepted(0), _numConstraints(0),
+                  _displacement(0),
+                  _error(std::numeric_limits<ScalarType>::max()), _previousError(std::numeric_limits<ScalarType>::max()),
+                  _reason(TERMINATION_NONE), _running(false), _rejected(false), _done(false)
+            {
+                _strategy.beginAlignment(coarsest + 1);
+            }
+            
+            /**
+                Enter the next finer level.
+             
+                \return false once alignment is done.
+             */
+            bool nextLevel() {
+                if (_done)
+                    return false;
+                
+                --_level;
+                _ws = _ws.scaled(1); // Scale up
+                
+                // Errors between levels are not compatible.
+                _error = std::numeric_limits<ScalarType>::max();
+                _previousError = std::numeric_limits<ScalarType>::max();
+                
+                _iterations = _strategy.levelIterations(_level);
+                _iteration = _performed = _accepted = _numConstraints = 0;
+                _displacement = 0;
+                _reason = TERMINATION_MAX_ITERATIONS;
+                _running = _iterations > 0;
+                
+                return true;
+            }
+            
+            /** Test if another step is requested on the current level. */
+            bool iterating() const {
+                return _running;
+            }
+            
+            /**
+                Stop because too few template pixels warp into the target, see AlignBase::setMinValidFraction.
+             */
+            void reject() {
+                // Bring warp to finest level directly
+                _ws = _ws.scaled(_level);
+                _rejected = true;
+                _running = false;
+                _reason = TERMINATION_REJECTED;
+            }
+            
+            /**
+                Evaluate a step computed for the current warp.
+             
+                Steps that increase the error or fail the strategy end the level without being 
+                applied.
+             
+                \param s Step computed for warp().
+                \param u Applies steps to the warp using u.apply(w, s).
+                \param templateSize Size of the template on the current level.
+                \return true when the step was applied.
+             */
+            template<class Update>
+            bool update(const SingleStepResult<W> &s, const Update &u, cv::Size templateSize) {
+                ++_performed;
+                _numConstraints = s.numConstraints;
+                
+                const ScalarType newError = s.sumErrors / ScalarType(s.numConstraints);
+                const ScalarType errorChange = _error - newError;
+                
+                if (!(s.numConstraints > 0 &&
+                      errorChange >= ScalarType(0) &&
+                      _strategy.accepts(_iteration, s.delta)))
+                {
+                    IA_STATS(if (_stats) _stats->addIteration(_level, s.numConstraints, double(newError), false));
+                    _reason = failedStepReason(s.numConstraints, double(errorChange));
+                    _running = false;
+                    return false;
+                }
+                
+                const int iteration = _iteration++;
+                _running = _iteration < _iterations;
+                ++_accepted;
+                
+                if (!Strategy::UsesDisplacement) {
+                    u.apply(_ws, s);
+                    _error = newError;
+                    IA_STATS(if (_stats) _stats->addIteration(_level, s.numConstraints, double(newError), true));
+                    return true;
+                }
+                
+                W before(_ws);
+                u.apply(_ws, s);
+                _error = newError;
+                IA_STATS(if (_stats) _stats->addIteration(_level, s.numConstraints, double(newError), true));
+                
+                TerminationStep ts;
+                ts.level = _level;
+                ts.iteration = iteration;
+                ts.displacement = cornerDisplacement(before, _ws, templateSize) * double(1 << _level);
+                ts.previousError = (_previousError == std::numeric_limits<ScalarType>::max()) ? std::numeric_limits<double>::max() : double(_previousError);
+                ts.error = double(newError);
+                
+                _displacement += ts.displacement;
+                _previousError = newError;
+                
+                if (_strategy.converged(ts)) {
+                    _reason = TERMINATION_CONVERGED;
+                    _running = false;
+                }
+                
+                return true;
+            }
+            
+            /**
+                Leave the current level.
+             
+                Ends alignment when the level was rejected, fails the cascade, the strategy skips 
+                finer levels or the finest level is reached. The warp is then brought to the finest
+                pyramid level.
+             */
+            void endLevel(const CascadeCriteria &cascade) {
+                IA_STATS(if (_stats) _stats->endLevel(_level, _reason));
+                _running = false;
+                
+                if (_rejected) {
+                    _done = true;
+                    return;
+                }
+                
+                if (cascade.rejects(double(_error), _numConstraints)) {
+                    _ws = _ws.scaled(_level);
+                    _rejected = true;
+                    _done = true;
+                    _reason = TERMINATION_CASCADE_REJECTED;
+                    IA_STATS(if (_stats) _stats->endLevel(_level, TERMINATION_CASCADE_REJECTED));
+                    return;
+                }
+                
+                const bool skip = _strategy.skipFinerLevels(_level, _performed, _accepted, _displacement);
+                
+                if ((skip && _level > _finest) || (_level == _finest && _finest > 0)) {
+                    _ws = _ws.scaled(_level);
+                    _reason = TERMINATION_SKIPPED_FINER_LEVELS;
+                    IA_STATS(if (_stats) _stats->reason = TERMINATION_SKIPPED_FINER_LEVELS);
+                }
+                
+                _done = skip || _level == _finest;
+            }
+            
+            /**
+                Run all levels computing one step at a time.
+             
+                \param steps Provides
+                    - setLevel(level, w, coarsest) invoked when entering a level,
+                    - rejects(w) tested before every step, see reject,
+                    - step(w) computing the next step,
+                    - apply(w, s) applying a step,
+                    - templateSize() of the current level.
+                \param cascade Cascade criteria, see endLevel.
+                \param trajectory Optional container receiving the warp after every applied step.
+             */
+            template<class Steps>
+            void run(Steps &steps, const CascadeCriteria &cascade, std::vector<W> *trajectory = 0) {
+                while (nextLevel()) {
+                    steps.setLevel(_level, _ws, _level == _coarsest);
+                    
+                    while (_running) {
+                        if (steps.rejects(_ws)) {
+                            reject();
+                            break;
+                        }
+                        
+                        if (update(steps.step(_ws), steps, steps.templateSize()) && trajectory)
+                            trajectory->push_back(_ws.scaled(_level));
+                    }
+                    
+                    endLevel(cascade);
+                }
+            }
+            
+            /** Current warp. Refers to the finest pyramid level once done. */
+            W &warp() {
+                return _ws;
+            }
+            
+            /** Current level. */
+            int level() const {
+                return _level;
+            }
+            
+            /** Mean error of the last applied step on the current level. */
+            ScalarType error() const {
+                return _error;
+            }
+            
+            /** Number of constraints of the last step. */
+            int numConstraints() const {
+                return _numConstraints;
+            }
+            
+            /** Reason for leaving the current level. Refers to the whole alignment once done. */
+            ETerminationReason reason() const {
+                return _reason;
+            }
+            
+            /** Test if alignment was stopped by reject or the cascade. */
+            bool rejected() const {
+                return _rejected;
+            }
+            
+            /** Test if alignment is done. */
+            bool done() const {
+                return _done;
+            }
+            
+        private:
+            Strategy _strategy;
+            AlignStats *_stats;
+            W _ws;
+            int _coarsest, _finest, _level;
+            int _iterations, _iteration, _performed, _accepted, _numConstraints;
+            double _displacement;
+            ScalarType _error, _previousError;
+            ETerminationReason _reason;
+            bool _running, _rejected, _done;
+        };
+    }
+    
     /**
         Base class for alignment algorithms.
      
@@ -61,13 +743,43 @@ namespace imagealign {
         does not assume warp functions can be scaled in general, we rather scale image coordintes before
         dealing with the warp. This effectively means that the warp always operates on the finest pyramid
         level.
+     
+        ## Masked templates
+        
+        Non-rectangular templates pass a mask to prepare. Masks are downsampled along with the
+        template pyramid and compacted into spans of valid pixels per level, see TemplatePixels.
+        Alignment loops iterate those spans only, so background pixels neither cost time nor
+        bias the solution.
+        
+        ## Robust alignment
+     
+        The loss applied to intensity errors is a template parameter, see LossSquared. Robust 
+        losses such as LossHuber and LossTukey turn every iteration into a step of iteratively 
+        reweighted least squares. The default squared loss compiles to the unweighted code path.
+     
+        ## Statistics
+     
+        Iterations, constraints, errors and termination reasons per level as well as timings of
+        the most recent calls are collected in AlignStats, see stats. Define IA_NO_STATS to
+        remove collection at compile time.
      */
-    template<class D, class W>
+    template<class D, class W, class L = LossSquared>
     class AlignBase {
     public:
         
-        typedef AlignBase<D, W> SelfType;
+        typedef AlignBase<D, W, L> SelfType;
+        typedef W WarpType;
         typedef typename W::Traits::ScalarType ScalarType;
+        typedef L LossType;
+        
+        /** Non-zero for aligners sampling gradients of the target pyramid, see ImagePyramid::createGradients. */
+        enum { RequiresTargetGradients = 0 };
+        
+        AlignBase()
+            : _levels(0), _level(0), _error(std::numeric_limits<ScalarType>::max()), _templateShared(false), _templateAdopted(false),
+              _targetShared(false), _targetGeneration(0),
+              _minValidFraction(0), _rejected(false), _reason(TERMINATION_NONE), _coarsest(-1), _targetDepth(CV_32F)
+        {}
         
         /** 
             Prepare for alignment.
@@ -79,8 +791,10 @@ namespace imagealign {
             \param target Single channel target image to align template with.
             \param w The warp.
             \param pyramidLevels Maximum number of pyramid levels to generate.
+            \param mask Optional single channel 8 bit mask of template size. Only template pixels
+                   of non-zero mask take part in alignment, see templatePixels.
          */
-        void prepare(cv::InputArray tmpl, cv::InputArray target, const W &w, int pyramidLevels)
+        void prepare(cv::InputArray tmpl, cv::InputArray target, const W &w, int pyramidLevels, cv::InputArray mask = cv::noArray())
         {
             // Do the basic thing everyone needs
             CV_Assert(tmpl.channels() == 1);
@@ -92,13 +806,21 @@ namespace imagealign {
             
             _levels = std::max<int>(1, std::min<int>(pyramidLevels, maxLevels));
             
-            _templatePyramid.create(tmpl, _levels);
-            _targetPyramid.create(target, _levels);            
+            IA_STATS(const int64 t0 = cv::getTickCount());
+            
+            createTemplatePyramid(tmpl);
+            createTemplatePixels(mask);
+            createTargetPyramid(target);
+            
+            IA_STATS(_stats.pyramidSeconds = detail::secondsSince(t0));
             
             setLevel(0);
             
             // Invoke prepare of derived
+            static_cast<D*>(this)->prepareTargetImpl();
             static_cast<D*>(this)->prepareImpl(w);
+            
+            IA_STATS(_stats.prepareSeconds = detail::secondsSince(t0));
         }
         
         /**
@@ -115,8 +837,9 @@ namespace imagealign {
             \param target Pre-built image pyramid of target image.
             \param w The warp.
             \param pyramidLevels Maximum number of pyramid levels to generate.
+            \param mask Optional single channel 8 bit mask of template size.
          */
-        void prepare(cv::InputArray tmpl, const ImagePyramid &target, const W &w, int pyramidLevels)
+        void prepare(cv::InputArray tmpl, const ImagePyramid &target, const W &w, int pyramidLevels, cv::InputArray mask = cv::noArray())
         {
             // Do the basic thing everyone needs
             CV_Assert(target.numLevels() > 0);
@@ -129,18 +852,170 @@ namespace imagealign {
                                           target.numLevels());
 
             _levels = std::max<int>(1, std::min<int>(pyramidLevels, maxLevels));
-            _templatePyramid.create(tmpl, _levels);
+            
+            IA_STATS(const int64 t0 = cv::getTickCount());
+            
+            createTemplatePyramid(tmpl);
+            createTemplatePixels(mask);
+            
+            IA_STATS(_stats.pyramidSeconds = detail::secondsSince(t0));
 
             if (target.numLevels() > _levels) {
                 _targetPyramid = target.slice(0, _levels);
             } else {
                 _targetPyramid = target;
             }
+            _targetShared = true;
             
             setLevel(0);
             
             // Invoke prepare of derived
+            static_cast<D*>(this)->prepareTargetImpl();
             static_cast<D*>(this)->prepareImpl(w);
+            
+            IA_STATS(_stats.prepareSeconds = detail::secondsSince(t0));
+        }
+        
+        /**
+            Replace the target image.
+         
+            Rebuilds the target pyramid, while template data precomputed by prepare remains
+            untouched. Pyramid buffers are reused when the size of the target does not change,
+            so that tracking in a video of constant frame size does not allocate any memory.
+         
+            The number of pyramid levels is limited by the new target and never exceeds the
+            levels of the template pyramid. Levels dropped for a small target return with the 
+            next target large enough. Requires a previous call to prepare.
+         
+            \param target Single channel target image to align template with.
+         */
+        void updateTarget(cv::InputArray target)
+        {
+            CV_Assert(_levels > 0);
+            CV_Assert(target.channels() == 1);
+            
+            _levels = std::max<int>(1, std::min<int>(_templatePyramid.numLevels(), ImagePyramid::maxLevelsForImageSize(target.size())));
+            
+            IA_STATS(const int64 t0 = cv::getTickCount());
+            
+            createTargetPyramid(target);
+            
+            IA_STATS(_stats.pyramidSeconds = detail::secondsSince(t0));
+            
+            setLevel(0);
+            
+            static_cast<D*>(this)->prepareTargetImpl();
+            
+            IA_STATS(_stats.prepareSeconds = detail::secondsSince(t0));
+        }
+        
+        /**
+            Replace the target image by a pre built image pyramid.
+         
+            Same as updateTarget above, but shares the given pyramid. Only image headers are
+            copied. Algorithms requiring target gradients compute them into buffers of their own
+            when the pyramid lacks them, see ImagePyramid::createGradients.
+         
+            \param target Pre-built image pyramid of target image.
+         */
+        void updateTarget(const ImagePyramid &target)
+        {
+            CV_Assert(_levels > 0);
+            CV_Assert(target.numLevels() > 0);
+            CV_Assert(target[0].channels() == 1);
+            
+            _levels = std::min<int>(_templatePyramid.numLevels(), target.numLevels());
+            
+            IA_STATS(const int64 t0 = cv::getTickCount());
+            
+            _targetPyramid = target;
+            _targetShared = true;
+            
+            IA_STATS(_stats.pyramidSeconds = 0);
+            
+            setLevel(0);
+            
+            static_cast<D*>(this)->prepareTargetImpl();
+            
+            IA_STATS(_stats.prepareSeconds = detail::secondsSince(t0));
+        }
+        
+        /**
+            Replace the target image by the current frame of a streaming pyramid.
+         
+            Computes all required levels of the stream and shares them. Only image headers
+            are copied. The generation of the stream is recorded, see isTargetStale.
+         
+            \param target Streaming pyramid holding the current frame.
+         */
+        void updateTarget(const StreamingPyramid &target)
+        {
+            CV_Assert(_levels > 0);
+            CV_Assert(target.numLevels() > 0);
+            
+            _levels = std::min<int>(_templatePyramid.numLevels(), target.numLevels());
+            
+            IA_STATS(const int64 t0 = cv::getTickCount());
+            
+            target.toPyramid(_targetPyramid, _levels);
+            _targetShared = true;
+            _targetGeneration = target.generation();
+            
+            IA_STATS(_stats.pyramidSeconds = detail::secondsSince(t0));
+            
+            setLevel(0);
+            
+            static_cast<D*>(this)->prepareTargetImpl();
+            
+            IA_STATS(_stats.prepareSeconds = detail::secondsSince(t0));
+        }
+        
+        /**
+            Test if the target is outdated with respect to a streaming pyramid.
+         
+            \return true when the stream received new frames since the last call to 
+                    updateTarget with this stream.
+         */
+        bool isTargetStale(const StreamingPyramid &target) const {
+            return _targetGeneration != target.generation();
+        }
+        
+        /**
+            Replace the template image.
+         
+            Rebuilds the template pyramid and all template dependent data. The target is left 
+            untouched. Buffers are reused when the size of the template does not change and 
+            they are not shared with copies of this aligner.
+         
+            The number of template pyramid levels may shrink to fit the new template, but never grows.
+            Template data is computed for all template levels, so that levels limited by the
+            current target return with a larger target. Requires a previous call to prepare.
+         
+            \param tmpl Single channel template image
+            \param w The warp.
+            \param mask Optional single channel 8 bit mask of template size.
+         */
+        void updateTemplate(cv::InputArray tmpl, const W &w, cv::InputArray mask = cv::noArray())
+        {
+            CV_Assert(_levels > 0);
+            CV_Assert(tmpl.channels() == 1);
+            
+            _levels = std::max<int>(1, std::min<int>(_templatePyramid.numLevels(), ImagePyramid::maxLevelsForImageSize(tmpl.size())));
+            
+            IA_STATS(const int64 t0 = cv::getTickCount());
+            
+            createTemplatePyramid(tmpl);
+            createTemplatePixels(mask);
+            
+            IA_STATS(_stats.pyramidSeconds = detail::secondsSince(t0));
+            
+            setLevel(0);
+            
+            static_cast<D*>(this)->prepareImpl(w);
+            
+            _levels = std::min<int>(_levels, _targetPyramid.numLevels());
+            
+            IA_STATS(_stats.prepareSeconds = detail::secondsSince(t0));
         }
         
         /**
@@ -158,53 +1033,57 @@ namespace imagealign {
                 - the length of delta parameter vector estimated is less than eps
                 - an increase of error is observed (with exception between two pyramid layers)
          
+            Alignment stops on all levels when too few template pixels warp into the target, see
+            setMinValidFraction, or when the cascade rejects a level, see setCascade.
+            Alignment starts at the level given by setCoarsestLevel, optionally preceded by an
+            integer translation search, see setTranslationSearch.
+         
             \param w Current state of warp estimation. Will be modified to hold result.
             \param maxIterations Maximum number of iterations in all levels.
             \param eps Minimum length of incremental parameter vector to continue on current level.
             \param steps Optional container to receiver intermediate steps for debugging purposes.
+         
+            See the overload taking a termination policy for finer control.
          */
         SelfType &align(W &w, int maxIterations, ScalarType eps, std::vector<W> *steps = 0)
         {
-            int iterationsPerLevel = maxIterations / numLevels();
+            IA_STATS(const int64 t0 = cv::getTickCount());
+            IA_STATS(_stats.beginAlignment(numLevels()));
             
-            // Start at the coarsest level + 1
-            W ws = w.scaled(-numLevels());
-
-            for (int lev = numLevels() - 1; lev >= 0; --lev) {
-                setLevel(lev);
-                ws = ws.scaled(1); // Scale up
-
-                for (int iter = 0; iter < iterationsPerLevel; ++iter) {
-                    
-                    SingleStepResult<W> s = static_cast<D*>(this)->alignImpl(ws);
-                    
-                    const ScalarType newError = s.sumErrors / ScalarType(s.numConstraints);
-                    const ScalarType errorChange = lastError() - newError;
-                   
-                    if (s.numConstraints > 0 &&
-                        errorChange >= ScalarType(0) &&
-                        (iter == 0 || (ScalarType)cv::norm(s.delta) >= eps))
-                    {
-                        static_cast<D*>(this)->applyStep(ws, s);
-                        _error = newError;
-                        
-                        if (steps) steps->push_back(ws.scaled(lev));
-                        
-                    } else {
-                        // Next level
-                        break;
-                    }
-                }
-                
-
-            }
-            w = ws;
+            detail::AlignLoop<W, detail::EpsilonTermination<W> > loop(w, coarsestLevel(), finestLevel(), detail::EpsilonTermination<W>(maxIterations, eps), &_stats);
+            runLoop(loop, w, steps);
             
+            IA_STATS(_stats.alignSeconds = detail::secondsSince(t0));
             
             return *this;
         }
     
         
+        /**
+            Align template and target using a termination policy.
+         
+            Same as align above, except that the number of iterations per level and convergence
+            are controlled by the policy, see TerminationCriteria. A step is still rejected
+            when it would increase the error.
+         
+            \param w Current state of warp estimation. Will be modified to hold result.
+            \param policy Termination policy.
+            \param steps Optional container to receiver intermediate steps for debugging purposes.
+         */
+        template<class Policy>
+        SelfType &align(W &w, Policy &policy, std::vector<W> *steps = 0)
+        {
+            IA_STATS(const int64 t0 = cv::getTickCount());
+            IA_STATS(_stats.beginAlignment(numLevels()));
+            
+            detail::AlignLoop<W, detail::PolicyTermination<W, Policy> > loop(w, coarsestLevel(), finestLevel(), detail::PolicyTermination<W, Policy>(policy), &_stats);
+            runLoop(loop, w, steps);
+            
+            IA_STATS(_stats.alignSeconds = detail::secondsSince(t0));
+            
+            return *this;
+        }
+        
         /** 
             Return the total number of levels.
          */
@@ -212,6 +1091,116 @@ namespace imagealign {
             return _levels;
         }
         
+        /**
+            Set parameters of the loss function, e.g. thresholds of robust losses.
+         */
+        SelfType &setLoss(const L &loss) {
+            _loss = loss;
+            return *this;
+        }
+        
+        /** Access the loss function. */
+        const L &loss() const {
+            return _loss;
+        }
+        
+        /**
+            Set the depth of target pyramids built from target images.
+         
+            8 and 16 bit pyramids take a quarter or half of the memory and bandwidth of 
+            floating point pyramids. Targets are then interpolated in fixed point, see 
+            Sampler::sampleToFloat. Target pyramids passed in by the user keep their depth.
+         
+            \param depth One of CV_32F, CV_8U or CV_16U.
+         */
+        SelfType &setTargetDepth(int depth) {
+            CV_Assert(depth == CV_32F || depth == CV_8U || depth == CV_16U);
+            _targetDepth = depth;
+            return *this;
+        }
+        
+        /** Depth of target pyramids built from target images. */
+        int targetDepth() const {
+            return _targetDepth;
+        }
+        
+        /**
+            Reject alignments with too few valid constraints.
+         
+            Before every iteration the number of template pixels that warp into the target
+            is counted, which is cheap for planar warps, see validRowSpan. When it falls 
+            below the given fraction of template pixels, alignment stops and rejected() 
+            returns true.
+         
+            \param fraction Minimum fraction of template pixels in [0, 1]. Zero disables the test.
+         */
+        SelfType &setMinValidFraction(double fraction) {
+            _minValidFraction = fraction;
+            return *this;
+        }
+        
+        /**
+            Reject hopeless alignments at coarse levels and optionally stop at a coarse level.
+         
+            After every level the mean error and the number of constraints of the last 
+            iteration are tested. Rejected alignments skip all finer levels and rejected() 
+            returns true. Alignment ends at the finest level of the cascade, the warp is 
+            reported at the resolution of the finest pyramid level nonetheless.
+         
+            \param cascade Cascade criteria. Defaults disable the cascade.
+         */
+        SelfType &setCascade(const CascadeCriteria &cascade) {
+            _cascade = cascade;
+            return *this;
+        }
+        
+        /**
+            Set the coarsest pyramid level to start alignment at.
+         
+            Good initial estimates, e.g. predicted from previous frames, require fewer levels.
+            Passing a negative value, the default, starts at the coarsest level available.
+            Iterations passed to align are split among the levels actually used.
+         */
+        SelfType &setCoarsestLevel(int level) {
+            _coarsest = level;
+            return *this;
+        }
+        
+        /**
+            Search integer translations at the coarsest level before iterating.
+            
+            Tests all integer offsets within the radius of the initial estimate at the coarsest 
+            level used and starts iterating at the best one, see TranslationSearch. At level l
+            the radius covers radius * 2^l pixels of the finest level. Requires translational warps.
+            
+            \param radius Search radius in pixels of the coarsest level. Zero, the default, disables the search.
+            \param score Score of candidates, see ESearchScore.
+         */
+        SelfType &setTranslationSearch(int radius, int score = SEARCH_NCC) {
+            CV_Assert(radius <= 0 || IsTranslationWarp<W>::value);
+            _search.setRadius(radius).setScore(score);
+            return *this;
+        }
+        
+        /** Access the integer translation search. */
+        const TranslationSearch &translationSearch() const {
+            return _search;
+        }
+        
+        /** Access the cascade criteria. */
+        const CascadeCriteria &cascade() const {
+            return _cascade;
+        }
+        
+        /**
+            Test if the last invocation of align was stopped because too few template pixels
+            warped into the target or because the cascade rejected a level. See setMinValidFraction
+            and setCascade.
+         */
+        bool rejected() const {
+            return _rejected;
+        }
+        
         /**
             Access the error value from last iteration.
          
@@ -221,9 +1210,36 @@ namespace imagealign {
             return _error;
         }
         
+        /**
+            Reason for the last invocation of align to stop.
+         
+            Same as AlignStats::reason, but available when compiled with IA_NO_STATS.
+         */
+        ETerminationReason lastReason() const {
+            return _reason;
+        }
+        
+        /**
+            Return statistics of the most recent calls.
+         
+            Empty when compiled with IA_NO_STATS.
+         */
+        const AlignStats &stats() const {
+            return _stats;
+        }
+        
     protected:
         
         typedef typename W::Traits::PointType PointType;
+        
+        /**
+            Prepare target dependent data.
+         
+            Invoked whenever the target changes. Derived classes hide this method when they
+            need to precompute data from the target pyramid.
+         */
+        void prepareTargetImpl()
+        {}
     
         int level() const {
             return _level;
@@ -252,6 +1268,39 @@ namespace imagealign {
             return _templatePyramid;
         }
         
+        /**
+            Take the template pyramid of the next call to prepare from shared images.
+         
+            Only headers are copied. The pyramid is neither computed nor allocated and its 
+            pixels are never written to, subsequent calls to updateTemplate build a pyramid 
+            of their own. Masks are not supported.
+         
+            \param levels Single channel floating point template images, finest first.
+         */
+        void adoptTemplateLevels(const std::vector<cv::Mat> &levels)
+        {
+            CV_Assert(!levels.empty());
+            
+            _templatePyramid.assign(levels, std::vector<cv::Mat>(), (int)levels.size());
+            _templateShared = true;
+            _templateAdopted = true;
+        }
+        
+        /** Template pixels taking part in alignment on the current level. */
+        const TemplatePixels &templatePixels() const {
+            return _templatePixels[_level];
+        }
+        
+        /** Template pixels taking part in alignment on the given level. */
+        const TemplatePixels &templatePixels(int level) const {
+            return _templatePixels[level];
+        }
+        
+        /** Template mask of the given level. Empty when no mask was given. */
+        cv::Mat templateMask(int level) const {
+            return _templateMasks.empty() ? cv::Mat() : _templateMasks[level];
+        }
+        
         ImagePyramid &targetImagePyramid() {
             return _targetPyramid;
         }
@@ -264,24 +1313,179 @@ namespace imagealign {
             \param r Minimum distance from image border pixels.
         */
         inline bool isInImage(const PointType &p, cv::Size imgSize, int r) const {
-            int x = (int)std::floor(p(0)-ScalarType(0.5));
-            int y = (int)std::floor(p(1)-ScalarType(0.5));
-            
-            return x >= r &&
-                   y >= r &&
-                   x < imgSize.width - r &&
-                   y < imgSize.height - r;
+            return imagealign::isInImage(p, imgSize, r);
+        }
+        
+        /**
+            Warp a template row into the target image. See imagealign::warpRowPositions.
+         */
+        inline void warpRowPositions(WarpScanline<W> &ws, int y, int xBegin, int xEnd, cv::Size targetSize, WarpedRow<ScalarType> &row) const {
+            imagealign::warpRowPositions(ws, y, xBegin, xEnd, targetSize, row);
+        }
+        
+        /**
+            Warp a template row into the target image and sample target intensities. See imagealign::warpRow.
+         */
+        inline void warpRow(WarpScanline<W> &ws, int y, int xBegin, int xEnd, const cv::Mat &target, WarpedRow<ScalarType> &row) const {
+            imagealign::warpRow(ws, y, xBegin, xEnd, target, row);
         }
-
         
     private:
         
+        /** Coarsest level to align, see setCoarsestLevel. Never finer than finestLevel. */
+        int coarsestLevel() const {
+            const int c = (_coarsest < 0) ? numLevels() - 1 : std::min<int>(_coarsest, numLevels() - 1);
+            return std::max<int>(c, finestLevel());
+        }
+        
+        /** Move translational warps to the best integer offset, see setTranslationSearch. */
+        void searchTranslation(W &ws) {
+            if (IsTranslationWarp<W>::value && _search.radius() > 0)
+                _search.apply(templateImage(), targetImage(), ws);
+        }
+        
+        /** Finest level to align, see setCascade. */
+        int finestLevel() const {
+            return std::max<int>(0, std::min<int>(_cascade.finestLevel, numLevels() - 1));
+        }
+        
+        /** 
+            Steps of the multi-level iteration, see detail::AlignLoop::run.
+         */
+        class LevelSteps {
+        public:
+            explicit LevelSteps(AlignBase &base)
+                : _base(base)
+            {}
+            
+            void setLevel(int lev, W &ws, bool coarsest) {
+                _base.setLevel(lev);
+                if (coarsest)
+                    _base.searchTranslation(ws);
+            }
+            
+            bool rejects(const W &ws) {
+                return _base.tooFewValidPixels(ws);
+            }
+            
+            SingleStepResult<W> step(W &ws) {
+                return static_cast<D&>(_base).alignImpl(ws);
+            }
+            
+            void apply(W &ws, const SingleStepResult<W> &s) const {
+                static_cast<D&>(_base).applyStep(ws, s);
+            }
+            
+            cv::Size templateSize() {
+                return _base.templateImage().size();
+            }
+            
+        private:
+            AlignBase &_base;
+        };
+        
+        /** Run all levels and store the result, see align. */
+        template<class Loop>
+        void runLoop(Loop &loop, W &w, std::vector<W> *steps) {
+            LevelSteps levelSteps(*this);
+            loop.run(levelSteps, _cascade, steps);
+            
+            _rejected = loop.rejected();
+            _reason = loop.reason();
+            _error = loop.error();
+            w = loop.warp();
+        }
+        
+        /** Test the current level for too few valid constraints. See setMinValidFraction. */
+        bool tooFewValidPixels(const W &ws) {
+            return detail::tooFewValidPixels(ws, templateImage().size(), targetImage().size(), _minValidFraction);
+        }
+        
+        /**
+            Build template pixels of all levels from an optional mask.
+         */
+        void createTemplatePixels(cv::InputArray mask)
+        {
+            _templatePixels.resize(_levels);
+            
+            if (mask.empty()) {
+                _templateMasks.clear();
+                for (int i = 0; i < _levels; ++i) {
+                    _templatePixels[i].create(_templatePyramid[i].size());
+                }
+                return;
+            }
+            
+            CV_Assert(mask.size() == _templatePyramid[0].size());
+            
+            ImagePyramid::createMasks(mask, _levels, _templateMasks);
+            for (int i = 0; i < _levels; ++i) {
+                _templatePixels[i].create(_templateMasks[i]);
+            }
+        }
+        
+        /**
+            Build template pyramid from image, reusing owned buffers.
+         
+            Buffers shared with copies of this aligner or adopted by adoptTemplateLevels are 
+            never written to.
+         */
+        void createTemplatePyramid(cv::InputArray tmpl)
+        {
+            if (_templateAdopted) {
+                _templateAdopted = false;
+                if (_templatePyramid.numLevels() > _levels) {
+                    _templatePyramid = _templatePyramid.slice(0, _levels);
+                }
+                return;
+            }
+            
+            if (_templateShared || _templatePyramid.isShared()) {
+                _templatePyramid = ImagePyramid();
+                _templateShared = false;
+            }
+            
+            _templatePyramid.create(tmpl, _levels);
+        }
+        
+        /**
+            Build target pyramid from image, reusing owned buffers.
+         
+            Buffers of a pyramid passed in by the user are never written to.
+         */
+        void createTargetPyramid(cv::InputArray target)
+        {
+            const bool gradients = _targetPyramid.hasGradients();
+            
+            if (_targetShared) {
+                _targetPyramid = ImagePyramid();
+                _targetShared = false;
+            }
+            
+            _targetPyramid.create(target, _levels, gradients, _targetDepth);
+        }
+        
         ImagePyramid _templatePyramid;
         ImagePyramid _targetPyramid;
+        std::vector<cv::Mat> _templateMasks;
+        std::vector<TemplatePixels> _templatePixels;
         
         int _levels;
         int _level;
         ScalarType _error;
+        bool _templateShared;
+        bool _templateAdopted;
+        bool _targetShared;
+        uint64 _targetGeneration;
+        double _minValidFraction;
+        bool _rejected;
+        ETerminationReason _reason;
+        CascadeCriteria _cascade;
+        int _coarsest;
+        TranslationSearch _search;
+        int _targetDepth;
+        L _loss;
+        AlignStats _stats;
     };
     
     
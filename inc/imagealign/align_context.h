@@ -0,0 +1,313 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef IMAGE_ALIGN_ALIGN_CONTEXT_H
+#define IMAGE_ALIGN_ALIGN_CONTEXT_H
+
+#include <imagealign/prepared_template.h>
+#include <imagealign/inverse_compositional.h>
+#include <imagealign/image_pyramid.h>
+#include <imagealign/align_stats.h>
+#include <imagealign/termination.h>
+#include <imagealign/loss.h>
+#include <limits>
+#include <vector>
+
+namespace imagealign {
+    
+    /**
+        Mutable state of inverse compositional alignment against shared template data.
+        
+        AlignInverseCompositional owns its template data, so a prepared aligner serves one 
+        thread at a time. AlignContext separates the two: template data is a const 
+        PreparedTemplate shared by any number of threads, while each thread or task owns a 
+        cheap context holding the scratch buffers, the loss and the results of its last 
+        alignment. Contexts never write to the template data or the target pyramid, so 
+        many contexts may align the same prepared template against different targets or 
+        from different initial warps concurrently.
+        
+        Results are identical to AlignInverseCompositional prepared with the same template.
+        
+        \tparam W Type of warp motion to use during alignment.
+        \tparam L Loss applied to intensity errors. See LossSquared.
+     */
+    template<class W, class L = LossSquared>
+    class AlignContext {
+    public:
+        
+        typedef AlignContext<W, L> SelfType;
+        typedef typename W::Traits::ScalarType ScalarType;
+        
+        AlignContext()
+            : _levels(0), _level(0), _error(std::numeric_limits<ScalarType>::max()), _rejected(false), _reason(TERMINATION_NONE), _coarsest(-1), _minValidFraction(0)
+        {}
+        
+        /**
+            Set parameters of the loss function, e.g. thresholds of robust losses.
+         */
+        SelfType &setLoss(const L &loss) {
+            _loss = loss;
+            return *this;
+        }
+        
+        /** Access the loss function. */
+        const L &loss() const {
+            return _loss;
+        }
+        
+        /**
+            Reject hopeless alignments at coarse levels and optionally stop at a coarse level.
+            Same as AlignBase::setCascade.
+         */
+        SelfType &setCascade(const CascadeCriteria &cascade) {
+            _cascade = cascade;
+            return *this;
+        }
+        
+        /** Access the cascade criteria. */
+        const CascadeCriteria &cascade() const {
+            return _cascade;
+        }
+        
+        /**
+            Set the coarsest pyramid level to start alignment at. Same as AlignBase::setCoarsestLevel.
+         */
+        SelfType &setCoarsestLevel(int level) {
+            _coarsest = level;
+            return *this;
+        }
+        
+        /**
+            Reject alignments with too few valid constraints. Same as AlignBase::setMinValidFraction.
+         */
+        SelfType &setMinValidFraction(double fraction) {
+            _minValidFraction = fraction;
+            return *this;
+        }
+        
+        /**
+            Search integer translations at the coarsest level before iterating. Same as 
+            AlignBase::setTranslationSearch.
+         */
+        SelfType &setTranslationSearch(int radius, int score = SEARCH_NCC) {
+            CV_Assert(radius <= 0 || IsTranslationWarp<W>::value);
+            _search.setRadius(radius).setScore(score);
+            return *this;
+        }
+        
+        /** Access the integer translation search. */
+        const TranslationSearch &translationSearch() const {
+            return _search;
+        }
+        
+        /**
+            Restrict alignment to masked template pixels.
+            
+            Masks belong to the context, so that tasks sharing template data may mask 
+            different pixels, e.g. occluded parts. Builds the template pixels and inverse 
+            Hessians of masked pixels for all levels of the template data. Has to be called 
+            again when aligning different template data.
+            
+            \param tmpl Shared template data. Only read.
+            \param mask Single channel 8 bit mask of template size. Empty restores all pixels.
+         */
+        SelfType &setMask(const PreparedTemplate<W> &tmpl, cv::InputArray mask) {
+            if (mask.empty()) {
+                _masks.clear();
+                _pixels.clear();
+                _invHessians.clear();
+                return *this;
+            }
+            
+            CV_Assert(!tmpl.empty());
+            CV_Assert(mask.size() == tmpl.templateImage(0).size());
+            
+            const int levels = tmpl.numLevels();
+            ImagePyramid::createMasks(mask, levels, _masks);
+            _pixels.resize(levels);
+            _invHessians.resize(levels);
+            
+            for (int i = 0; i < levels; ++i) {
+                _pixels[i].create(_masks[i]);
+                
+                typename W::Traits::HessianType hessian = W::Traits::zeroHessian(tmpl.numParameters());
+                detail::inverseCompositionalMaskedHessian<W>(_pixels[i], tmpl.sdi(i), hessian);
+                _invHessians[i] = hessian.inv();
+            }
+            
+            return *this;
+        }
+        
+        /** Test if alignment is restricted to masked pixels. See setMask. */
+        bool masked() const {
+            return !_pixels.empty();
+        }
+        
+        /**
+            Align prepared template data with a target.
+            
+            Follows the same multi-level strategy as AlignBase::align. The number of levels
+            is limited by the levels of the template data and of the target.
+            
+            \param tmpl Shared template data. Only read.
+            \param target Target image pyramid. Only read.
+            \param w Current state of warp estimation. Will be modified to hold result.
+            \param maxIterations Maximum number of iterations in all levels.
+            \param eps Minimum length of incremental parameter vector to continue on current level.
+         */
+        SelfType &align(const PreparedTemplate<W> &tmpl, const ImagePyramid &target, W &w, int maxIterations, ScalarType eps)
+        {
+            CV_Assert(!tmpl.empty());
+            CV_Assert(target.numLevels() > 0);
+            CV_Assert(target[0].channels() == 1);
+            
+            _levels = std::min<int>(tmpl.numLevels(), target.numLevels());
+            CV_Assert(!masked() || (int)_masks.size() >= _levels);
+            
+            const int finest = std::max<int>(0, std::min<int>(_cascade.finestLevel, _levels - 1));
+            const int coarsest = std::max<int>(finest, (_coarsest < 0) ? _levels - 1 : std::min<int>(_coarsest, _levels - 1));
+            
+            IA_STATS(const int64 t0 = cv::getTickCount());
+            IA_STATS(_stats.beginAlignment(coarsest + 1));
+            
+            detail::AlignLoop<W, detail::EpsilonTermination<W> > loop(w, coarsest, finest, detail::EpsilonTermination<W>(maxIterations, eps), &_stats);
+            LevelSteps steps(*this, tmpl, target);
+            loop.run(steps, _cascade);
+            
+            _level = loop.level();
+            _error = loop.error();
+            _rejected = loop.rejected();
+            _reason = loop.reason();
+            w = loop.warp();
+            
+            IA_STATS(_stats.alignSeconds = detail::secondsSince(t0));
+            
+            return *this;
+        }
+        
+        /**
+            Access the error value from last iteration.
+         
+            \return the error value corresponding to last invocation of align.
+         */
+        ScalarType lastError() const {
+            return _error;
+        }
+        
+        /** 
+            Test if the last alignment was stopped because too few template pixels warped into
+            the target or because the cascade rejected a level. See setMinValidFraction and setCascade.
+         */
+        bool rejected() const {
+            return _rejected;
+        }
+        
+        /** Reason for the last alignment to stop, see AlignBase::lastReason. */
+        ETerminationReason lastReason() const {
+            return _reason;
+        }
+        
+        /** Number of levels used by the last alignment. */
+        int numLevels() const {
+            return _levels;
+        }
+        
+        /** Level of the last iteration. */
+        int level() const {
+            return _level;
+        }
+        
+        /**
+            Return statistics of the last alignment.
+         
+            Empty when compiled with IA_NO_STATS.
+         */
+        const AlignStats &stats() const {
+            return _stats;
+        }
+        
+    private:
+        
+        /**
+            Steps of the multi-level iteration, see detail::AlignLoop::run.
+         */
+        class LevelSteps : public detail::InverseCompositionalUpdate<W> {
+        public:
+            LevelSteps(AlignContext &ctx, const PreparedTemplate<W> &tmpl, const ImagePyramid &target)
+                : _ctx(ctx), _tmpl(tmpl), _target(target), _level(0)
+            {}
+            
+            void setLevel(int lev, W &ws, bool coarsest) {
+                _level = lev;
+                _tpl = _tmpl.templateImage(lev);
+                _tgt = _target[lev];
+                _sdi = _tmpl.sdi(lev);
+                
+                if (_ctx.masked())
+                    CV_Assert(_ctx._masks[lev].size() == _tpl.size());
+                
+                if (coarsest && IsTranslationWarp<W>::value && _ctx._search.radius() > 0)
+                    _ctx._search.apply(_tpl, _tgt, ws);
+            }
+            
+            bool rejects(const W &ws) const {
+                return detail::tooFewValidPixels(ws, _tpl.size(), _tgt.size(), _ctx._minValidFraction);
+            }
+            
+            SingleStepResult<W> step(const W &ws) {
+                if (_ctx.masked())
+                    return detail::inverseCompositionalStep(ws, _tpl, _tgt, _sdi, _ctx._invHessians[_level], _ctx._loss, _ctx._chunks, &_ctx._pixels[_level]);
+                
+                return detail::inverseCompositionalStep(ws, _tpl, _tgt, _sdi, _tmpl.invHessian(_level), _ctx._loss, _ctx._chunks);
+            }
+            
+            cv::Size templateSize() const {
+                return _tpl.size();
+            }
+            
+        private:
+            AlignContext &_ctx;
+            const PreparedTemplate<W> &_tmpl;
+            const ImagePyramid &_target;
+            int _level;
+            cv::Mat _tpl, _tgt;
+            SDIPlanes _sdi;
+        };
+        
+        int _levels;
+        int _level;
+        ScalarType _error;
+        bool _rejected;
+        ETerminationReason _reason;
+        int _coarsest;
+        double _minValidFraction;
+        CascadeCriteria _cascade;
+        TranslationSearch _search;
+        L _loss;
+        AlignStats _stats;
+        std::vector<cv::Mat> _masks;
+        std::vector<TemplatePixels> _pixels;
+        std::vector<typename W::Traits::HessianType> _invHessians;
+        std::vector< RowChunkSums<W> > _chunks;
+    };
+
+}
+
+#endif
\ No newline at end of file
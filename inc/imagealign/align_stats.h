@@ -0,0 +1,188 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef IMAGE_ALIGN_ALIGN_STATS_H
+#define IMAGE_ALIGN_ALIGN_STATS_H
+
+#include <imagealign/config.h>
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+#include <vector>
+
+/**
+    Wraps statements collecting alignment statistics. 
+ 
+    Define IA_NO_STATS before including any Image Alignment header to remove statistics 
+    collection at compile time. AlignBase::stats then reports empty statistics.
+ 
+    Aligners precompiled into ialign, see precompiled.h, are compiled with the definitions 
+    of the library. Enable IMAGEALIGN_NO_STATS in CMake instead of defining IA_NO_STATS 
+    per translation unit, so that ialign and all targets linking it agree on the macro.
+ */
+#if defined(IA_NO_STATS)
+    #define IA_STATS(stmt)
+#else
+    #define IA_STATS(stmt) stmt
+#endif
+
+namespace imagealign {
+    
+    /** Reasons for alignment to stop iterating. */
+    enum ETerminationReason {
+        /** No iteration was performed. */
+        TERMINATION_NONE = 0,
+        /** Iteration budget of the level was exhausted. */
+        TERMINATION_MAX_ITERATIONS = 1,
+        /** Steps became smaller than requested. */
+        TERMINATION_CONVERGED = 2,
+        /** The next step would have increased the error. */
+        TERMINATION_ERROR_INCREASE = 3,
+        /** No template pixel warped into the target. */
+        TERMINATION_NO_CONSTRAINTS = 4,
+        /** Too few template pixels warped into the target, see AlignBase::setMinValidFraction. */
+        TERMINATION_REJECTED = 5,
+        /** The termination policy or the cascade skipped the remaining finer levels. */
+        TERMINATION_SKIPPED_FINER_LEVELS = 6,
+        /** Error or number of constraints of a level failed the cascade, see AlignBase::setCascade. */
+        TERMINATION_CASCADE_REJECTED = 7
+    };
+    
+    /**
+        Statistics of one pyramid level.
+     */
+    struct AlignLevelStats {
+        /** Number of iterations, including the final step that was not applied. */
+        int iterations;
+        /** Number of steps applied. */
+        int accepted;
+        /** Number of constraints of the last iteration. */
+        int numConstraints;
+        /** Reason for leaving the level. */
+        ETerminationReason reason;
+        
+        AlignLevelStats()
+            : iterations(0), accepted(0), numConstraints(0), reason(TERMINATION_NONE)
+        {}
+    };
+    
+    /**
+        Single iteration of the error trajectory.
+     */
+    struct AlignIterationStats {
+        /** Pyramid level. Level 0 is the finest level. */
+        int level;
+        /** Mean error of the iteration. Undefined without constraints. */
+        double error;
+        /** Number of constraints. */
+        int numConstraints;
+        /** True when the step was applied. */
+        bool accepted;
+    };
+    
+    /**
+        Statistics of the most recent calls of an aligner. See AlignBase::stats.
+     
+        Buffers are reused between calls, so that collecting statistics does not allocate 
+        memory once the number of levels and iterations stabilizes.
+     */
+    struct AlignStats {
+        /** Statistics per level of the last alignment. Element 0 refers to the finest level. */
+        std::vector<AlignLevelStats> levels;
+        
+        /** All iterations of the last alignment in order of execution, i.e. coarse to fine. */
+        std::vector<AlignIterationStats> trajectory;
+        
+        /** Reason for the last alignment to stop. */
+        ETerminationReason reason;
+        
+        /** Duration of the last prepare, updateTemplate or updateTarget call in seconds. */
+        double prepareSeconds;
+        
+        /** Part of prepareSeconds spent building image pyramids. */
+        double pyramidSeconds;
+        
+        /** Duration of the last alignment in seconds. */
+        double alignSeconds;
+        
+        AlignStats()
+            : reason(TERMINATION_NONE), prepareSeconds(0), pyramidSeconds(0), alignSeconds(0)
+        {}
+        
+        /** Total number of iterations of the last alignment. */
+        inline int totalIterations() const {
+            int n = 0;
+            for (size_t i = 0; i < levels.size(); ++i) {
+                n += levels[i].iterations;
+            }
+            return n;
+        }
+        
+        /** Reset alignment statistics. */
+        inline void beginAlignment(int numLevels) {
+            levels.assign(numLevels, AlignLevelStats());
+            trajectory.clear();
+            reason = TERMINATION_NONE;
+            alignSeconds = 0;
+        }
+        
+        /** Record an iteration. */
+        inline void addIteration(int level, int numConstraints, double error, bool accepted) {
+            AlignLevelStats &l = levels[level];
+            l.iterations += 1;
+            l.accepted += accepted ? 1 : 0;
+            l.numConstraints = numConstraints;
+            
+            AlignIterationStats it;
+            it.level = level;
+            it.error = error;
+            it.numConstraints = numConstraints;
+            it.accepted = accepted;
+            trajectory.push_back(it);
+        }
+        
+        /** Record leaving a level. */
+        inline void endLevel(int level, ETerminationReason r) {
+            levels[level].reason = r;
+            reason = r;
+        }
+    };
+    
+    namespace detail {
+        
+        /** Seconds elapsed since the given tick count. */
+        inline double secondsSince(int64 t0) {
+            return double(cv::getTickCount() - t0) / cv::getTickFrequency();
+        }
+        
+        /** Classify a step that was not applied. */
+        inline ETerminationReason failedStepReason(int numConstraints, double errorChange) {
+            if (numConstraints == 0)
+                return TERMINATION_NO_CONSTRAINTS;
+            return errorChange < 0 ? TERMINATION_ERROR_INCREASE : TERMINATION_CONVERGED;
+        }
+    }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,416 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_BATCH_ALIGNER_H
+#define IMAGE_ALIGN_BATCH_ALIGNER_H
+
+#include <imagealign/inverse_compositional.h>
+#include <imagealign/image_pyramid.h>
+#include <imagealign/sdi.h>
+#include <imagealign/termination.h>
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+#include <limits>
+#include <vector>
+
+namespace imagealign {
+    
+    namespace detail {
+        template<class W> class OclBatchHost;
+    }
+    
+    /**
+        Inverse compositional alignment of many templates against one shared target.
+        
+        Tracking hundreds of small patches with individual AlignInverseCompositional objects
+        spends most time allocating and preparing. BatchAligner prepares all templates at
+        once and keeps template pyramids, steepest descent images and inverse Hessians of
+        all tracks in a single arena. The arena is reused by subsequent calls to prepare
+        as long as it is large enough.
+        
+        All tracks are aligned against a single ImagePyramid of the target. Work is
+        distributed over threads by track using cv::parallel_for_. Results are reported per
+        track, similar to cv::calcOpticalFlowPyrLK.
+        
+        Each track follows the same multi-level strategy as AlignBase::align and yields
+        results identical to an AlignInverseCompositional prepared with the same template.
+        
+        \tparam W Type of warp motion to use during alignment.
+     */
+    template<class W>
+    class BatchAligner {
+    public:
+        
+        typedef typename W::Traits::ScalarType ScalarType;
+        typedef typename W::Traits::HessianType HessianType;
+        
+        BatchAligner()
+            : _arena(0), _arenaCapacity(0)
+        {}
+        
+        /**
+            Prepare templates for alignment.
+            
+            Builds the template pyramid, steepest descent images and inverse Hessian for
+            every template. Templates may differ in size. Templates smaller than 3x3 pixels
+            are accepted, but will be reported as lost by align.
+            
+            \param templates Single channel template images, one per track.
+            \param w Warp used to determine the number of parameters.
+            \param pyramidLevels Maximum number of pyramid levels per template.
+         */
+        void prepare(const std::vector<cv::Mat> &templates, const W &w, int pyramidLevels)
+        {
+            const int n = (int)templates.size();
+            
+            _tracks.resize(n);
+            _levels.clear();
+            
+            // 1. Layout of arena
+            size_t size = 0;
+            for (int t = 0; t < n; ++t) {
+                CV_Assert(templates[t].channels() == 1);
+                
+                Track &track = _tracks[t];
+                track.firstLevel = (int)_levels.size();
+                track.numLevels = 0;
+                
+                cv::Size s = templates[t].size();
+                if (s.width < 3 || s.height < 3)
+                    continue;
+                
+                const int levels = std::max<int>(1, std::min<int>(pyramidLevels, ImagePyramid::maxLevelsForImageSize(s)));
+                
+                for (int i = 0; i < levels && s.width >= 3 && s.height >= 3; ++i) {
+                    TrackLevel l;
+                    l.width = s.width;
+                    l.height = s.height;
+                    l.tplStride = SDIPlanes::alignedRowStride(s.width);
+                    l.tplOffset = size;
+                    size += size_t(l.tplStride) * size_t(s.height);
+                    l.sdiOffset = size;
+                    size += SDIPlanes::requiredSize(w.numParameters(), s.width - 2, s.height - 2);
+                    
+                    _levels.push_back(l);
+                    ++track.numLevels;
+                    
+                    // Same as cv::pyrDown
+                    s = cv::Size((s.width + 1) / 2, (s.height + 1) / 2);
+                }
+            }
+            
+            // 2. Grow arena if necessary
+            if (size > _arenaCapacity || !_arena) {
+                const size_t bytes = std::max<size_t>(size, 1) * sizeof(float) + SDIPlanes::Alignment;
+                detail::createBytes(_arenaData, bytes);
+                _arena = cv::alignPtr(reinterpret_cast<float*>(_arenaData.ptr()), SDIPlanes::Alignment);
+                _arenaCapacity = std::max<size_t>(size, 1);
+            }
+            
+            _invHessians.resize(_levels.size());
+            
+            // 3. Scratch buffers of alignment, one per stripe of tracks
+            _chunks.resize(numStripes());
+            
+            // 4. Fill arena
+            PrepareBody body(*this, templates, w);
+            cv::parallel_for_(cv::Range(0, n), body, std::max<int>(1, n / TracksPerStripe));
+        }
+        
+        /**
+            Align all tracks with the target.
+            
+            \param target Target image pyramid shared among all tracks. Tracks use at most
+                   as many levels as available in target.
+            \param warps One warp per track. Holds the initial estimates and receives results.
+            \param maxIterations Maximum number of iterations in all levels per track.
+            \param eps Minimum length of incremental parameter vector to continue on current level.
+            \param status Optional. Receives 1 for every track that produced a valid error on
+                   the finest level and 0 otherwise. Tracks rejected by the cascade receive 0.
+            \param errors Optional. Receives the mean squared intensity error on the finest level
+                   per track.
+         
+            Scratch buffers allocated by prepare are reused, so a single aligner must not align 
+            from multiple threads at once.
+         */
+        void align(const ImagePyramid &target,
+                   std::vector<W> &warps,
+                   int maxIterations,
+                   ScalarType eps,
+                   std::vector<uchar> *status = 0,
+                   std::vector<ScalarType> *errors = 0)
+        {
+            CV_Assert(warps.size() == _tracks.size());
+            CV_Assert(target.numLevels() > 0);
+            CV_Assert(target[0].channels() == 1);
+            
+            const int n = (int)_tracks.size();
+            
+            if (status) status->resize(n);
+            if (errors) errors->resize(n);
+            
+            AlignBody body(*this, target, warps, maxIterations, eps, status, errors);
+            cv::parallel_for_(cv::Range(0, numStripes()), body);
+        }
+        
+        /**
+            Reject hopeless tracks at coarse levels and optionally stop at a coarse level.
+         
+            Same as AlignBase::setCascade, applied to every track individually. Rejected tracks
+            skip all finer levels.
+         */
+        void setCascade(const CascadeCriteria &cascade) {
+            _cascade = cascade;
+        }
+        
+        /** Access the cascade criteria. */
+        const CascadeCriteria &cascade() const {
+            return _cascade;
+        }
+        
+        /**
+            Number of tracks prepared.
+         */
+        int numTracks() const {
+            return (int)_tracks.size();
+        }
+        
+        /**
+            Number of pyramid levels prepared for a track.
+         */
+        int numLevels(int track) const {
+            return _tracks[track].numLevels;
+        }
+    
+    private:
+        
+        template<class> friend class detail::OclBatchHost;
+        
+        enum {
+            /** Number of tracks grouped into a single unit of parallel work. */
+            TracksPerStripe = 16
+        };
+        
+        /** Placement of one pyramid level of a track in the arena. */
+        struct TrackLevel {
+            size_t tplOffset;
+            size_t sdiOffset;
+            int width, height;
+            int tplStride;
+        };
+        
+        struct Track {
+            int firstLevel;
+            int numLevels;
+        };
+        
+        /** Template image of a track level. Refers to arena memory. */
+        cv::Mat templateImage(const TrackLevel &l) const {
+            return cv::Mat(l.height, l.width, CV_32FC1, _arena + l.tplOffset, size_t(l.tplStride) * sizeof(float));
+        }
+        
+        /** Steepest descent images of a track level. Refers to arena memory. */
+        SDIPlanes sdiPlanes(const TrackLevel &l, int numParameters) const {
+            SDIPlanes sdi;
+            sdi.wrap(_arena + l.sdiOffset, numParameters, l.width - 2, l.height - 2);
+            return sdi;
+        }
+        
+        /**
+            Prepare a single track.
+         */
+        void prepareTrack(int t, const cv::Mat &tmpl, const W &w)
+        {
+            const Track &track = _tracks[t];
+            
+            W w0(w);
+            w0.setIdentity();
+            
+            for (int i = 0; i < track.numLevels; ++i) {
+                const int idx = track.firstLevel + i;
+                const TrackLevel &l = _levels[idx];
+                
+                // 1. Build template pyramid level in place
+                cv::Mat tpl = templateImage(l);
+                if (i == 0) {
+                    tmpl.convertTo(tpl, CV_32F);
+                } else {
+                    cv::pyrDown(templateImage(_levels[idx - 1]), tpl, tpl.size());
+                }
+                
+                // 2. Compute steepest descent images and Hessian
+                SDIPlanes sdi = sdiPlanes(l, w.numParameters());
+                HessianType hessian = W::Traits::zeroHessian(w.numParameters());
+                detail::inverseCompositionalSDI(w0, tpl, sdi, hessian);
+                
+                // 3. Store inverse Hessian
+                _invHessians[idx] = hessian.inv();
+                
+                w0 = w0.scaled(-1);
+            }
+        }
+        
+        /** Number of stripes of tracks aligned in parallel. */
+        int numStripes() const {
+            return std::max<int>(1, ((int)_tracks.size() + TracksPerStripe - 1) / TracksPerStripe);
+        }
+        
+        /** 
+            Steps of a single track, see detail::AlignLoop::run.
+         */
+        class TrackSteps : public detail::InverseCompositionalUpdate<W> {
+        public:
+            TrackSteps(const BatchAligner &ba, const Track &track, const ImagePyramid &target, int numParameters, std::vector< RowChunkSums<W> > &chunks)
+                : _ba(ba), _track(track), _target(target), _numParameters(numParameters), _chunks(chunks), _invHessian(0)
+            {}
+            
+            void setLevel(int lev, W &/*ws*/, bool /*coarsest*/) {
+                const TrackLevel &l = _ba._levels[_track.firstLevel + lev];
+                _tpl = _ba.templateImage(l);
+                _tgt = _target[lev];
+                _sdi = _ba.sdiPlanes(l, _numParameters);
+                _invHessian = &_ba._invHessians[_track.firstLevel + lev];
+            }
+            
+            bool rejects(const W &/*ws*/) const {
+                return false;
+            }
+            
+            SingleStepResult<W> step(const W &ws) {
+                return detail::inverseCompositionalStep(ws, _tpl, _tgt, _sdi, *_invHessian, _chunks);
+            }
+            
+            cv::Size templateSize() const {
+                return _tpl.size();
+            }
+            
+        private:
+            const BatchAligner &_ba;
+            const Track &_track;
+            const ImagePyramid &_target;
+            int _numParameters;
+            std::vector< RowChunkSums<W> > &_chunks;
+            cv::Mat _tpl, _tgt;
+            SDIPlanes _sdi;
+            const HessianType *_invHessian;
+        };
+        
+        /**
+            Align a single track. Same strategy as AlignBase::align.
+            
+            \return Mean squared error on finest level.
+         */
+        ScalarType alignTrack(int t,
+                              const ImagePyramid &target,
+                              W &w,
+                              int maxIterations,
+                              ScalarType eps,
+                              std::vector< RowChunkSums<W> > &chunks) const
+        {
+            const Track &track = _tracks[t];
+            const int levels = std::min<int>(track.numLevels, target.numLevels());
+            
+            if (levels == 0)
+                return std::numeric_limits<ScalarType>::max();
+            
+            const int finest = std::max<int>(0, std::min<int>(_cascade.finestLevel, levels - 1));
+            
+            detail::AlignLoop<W, detail::EpsilonTermination<W> > loop(w, levels - 1, finest, detail::EpsilonTermination<W>(maxIterations, eps));
+            TrackSteps steps(*this, track, target, w.numParameters(), chunks);
+            loop.run(steps, _cascade);
+            
+            w = loop.warp();
+            return loop.rejected() ? std::numeric_limits<ScalarType>::max() : loop.error();
+        }
+        
+        class PrepareBody : public cv::ParallelLoopBody {
+        public:
+            PrepareBody(BatchAligner &ba, const std::vector<cv::Mat> &templates, const W &w)
+                : _ba(ba), _templates(templates), _w(w)
+            {}
+            
+            void operator()(const cv::Range &r) const {
+                for (int t = r.start; t < r.end; ++t) {
+                    _ba.prepareTrack(t, _templates[t], _w);
+                }
+            }
+        
+        private:
+            BatchAligner &_ba;
+            const std::vector<cv::Mat> &_templates;
+            const W &_w;
+        };
+        
+        class AlignBody : public cv::ParallelLoopBody {
+        public:
+            AlignBody(BatchAligner &ba,
+                      const ImagePyramid &target,
+                      std::vector<W> &warps,
+                      int maxIterations,
+                      ScalarType eps,
+                      std::vector<uchar> *status,
+                      std::vector<ScalarType> *errors)
+                : _ba(ba), _target(target), _warps(warps), _maxIterations(maxIterations), _eps(eps), _status(status), _errors(errors)
+            {}
+            
+            void operator()(const cv::Range &r) const {
+                for (int stripe = r.start; stripe < r.end; ++stripe) {
+                    // Scratch buffers are per stripe, each thread works on its own.
+                    std::vector< RowChunkSums<W> > &chunks = _ba._chunks[stripe];
+                    
+                    const int end = std::min<int>(_ba.numTracks(), (stripe + 1) * TracksPerStripe);
+                    for (int t = stripe * TracksPerStripe; t < end; ++t) {
+                        const ScalarType e = _ba.alignTrack(t, _target, _warps[t], _maxIterations, _eps, chunks);
+                        
+                        if (_status) (*_status)[t] = e < std::numeric_limits<ScalarType>::max() ? 1 : 0;
+                        if (_errors) (*_errors)[t] = e;
+                    }
+                }
+            }
+        
+        private:
+            BatchAligner &_ba;
+            const ImagePyramid &_target;
+            std::vector<W> &_warps;
+            int _maxIterations;
+            ScalarType _eps;
+            std::vector<uchar> *_status;
+            std::vector<ScalarType> *_errors;
+        };
+        
+        std::vector<Track> _tracks;
+        std::vector<TrackLevel> _levels;
+        std::vector<HessianType> _invHessians;
+        std::vector< std::vector< RowChunkSums<W> > > _chunks;
+        CascadeCriteria _cascade;
+        
+        cv::Mat _arenaData;
+        float *_arena;
+        size_t _arenaCapacity;
+    };
+
+}
+
+#endif
\ No newline at end of file
@@ -44,5 +44,39 @@
     #define IA_CV_VERSION 3
 #endif
 
+// SIMD instruction sets used by the sampling kernels. Define IA_NO_SIMD to
+// fall back to plain C++ code paths.
+//
+// When IA_USE_DISPATCH is defined, the kernels of simd_kernels.h are taken from
+// ialign, which provides variants for multiple instruction sets and selects one
+// at runtime. When IA_PRECOMPILED is defined, common aligners are declared as
+// explicit instantiations provided by ialign, see precompiled.h. The CMake build
+// defines both according to IMAGEALIGN_DISPATCH and IMAGEALIGN_PRECOMPILED.
+// IA_USE_OPENCL enables OclBatchAligner, see IMAGEALIGN_USE_OPENCL.
+//
+// With IA_USE_DISPATCH, AVX2 and AVX-512 are only used by the kernel sources of
+// ialign, which define IA_KERNEL_NAMESPACE before including simd_kernels.h. All
+// other code uses the baseline instruction set regardless of compiler flags, so
+// that inline functions are identical in every translation unit.
+#ifndef IA_NO_SIMD
+    #if !defined(IA_USE_DISPATCH) || defined(IA_KERNEL_NAMESPACE)
+        #if defined(__AVX512F__)
+            #define IA_USE_AVX512
+        #endif
+        
+        #if defined(__AVX2__)
+            #define IA_USE_AVX2
+        #endif
+    #endif
+    
+    #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        #define IA_USE_SSE2
+    #endif
+    
+    #if defined(__ARM_NEON) || defined(__ARM_NEON__)
+        #define IA_USE_NEON
+    #endif
+#endif
+
 
 #endif
\ No newline at end of file
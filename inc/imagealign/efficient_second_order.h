@@ -0,0 +1,268 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_EFFICIENT_SECOND_ORDER_H
+#define IMAGE_ALIGN_EFFICIENT_SECOND_ORDER_H
+
+#include <imagealign/align_base.h>
+#include <imagealign/sampling.h>
+#include <imagealign/gradient.h>
+#include <imagealign/solve.h>
+#include <imagealign/warp_image.h>
+#include <imagealign/inverse_compositional.h>
+#include <imagealign/jacobian_table.h>
+#include <imagealign/sdi.h>
+#include <opencv2/core/core.hpp>
+
+namespace imagealign {
+    
+    /** 
+        Efficient second-order minimization (ESM) image alignment.
+        
+        'Best' aligns a template image with a target image through minimization of the sum of 
+        squared intensity errors between the warped target image and the template image with 
+        respect to the warp parameters.
+     
+        ESM approximates the second order Taylor expansion of the error function without
+        computing second derivatives. It does so by using the mean of the template gradient and the 
+        gradient of the warped target image when forming steepest descent images
+     
+            SD(x) = 0.5 * (grad T(x) + grad I(W(x, p))) * dW/dp(x, 0)
+     
+        The update is composed in the forward direction
+     
+            W(x, p) = W(x, p) * W(x, delta)
+     
+        Compared to the inverse compositional algorithm ESM typically converges in fewer 
+        iterations and has a wider basin of convergence, at the cost of accumulating the Hessian 
+        in every iteration.
+     
+        The template dependent half of the steepest descent images, grad T(x) * dW/dp(x, 0),
+        and the per-pixel Jacobians are precomputed the same way AlignInverseCompositional does.
+     
+        \tparam WarpType Type of warp motion to use during alignment. See EWarpType.
+        \tparam LossType Loss applied to intensity errors. See LossSquared.
+     
+        ## Based on
+     
+        [1] Benhimane, Selim, and Ezio Malis.
+            "Real-time image-based tracking of planes using efficient second-order minimization."
+            Intelligent Robots and Systems, 2004. IROS 2004.
+     
+        [2] Baker, Simon, and Iain Matthews. 
+            Lucas-Kanade 20 years on: A unifying framework: Part 1.
+            Technical Report CMU-RI-TR-02-16, Carnegie Mellon University Robotics Institute, 2002.
+     */
+    template<class W, class L = LossSquared>
+    class AlignESM : public AlignBase< AlignESM<W, L>, W, L > {
+    protected:
+        
+        typedef typename W::Traits::ParamType ParamType;
+        typedef typename W::Traits::HessianType HessianType;
+        typedef typename W::Traits::PixelSDIType PixelSDIType;
+        typedef typename W::Traits::GradientType GradientType;
+        typedef typename W::Traits::JacobianType JacobianType;
+        typedef typename W::Traits::PointType PointType;
+        typedef typename W::Traits::ScalarType ScalarType;
+        
+        /**
+            Prepare for alignment.
+         
+            Precomputes per-pixel Jacobians and template steepest descent images for every
+            template level.
+         */
+        void prepareImpl(const W &w)
+        {
+            W w0(w);
+            w0.setIdentity();
+            
+            _jacobianPyramid.resize(this->numLevels());
+            _sdiPyramid.resize(this->numLevels());
+            _warpedTargetImages.resize(this->numLevels());
+            
+            for (int i = 0; i < this->numLevels(); ++i) {
+                
+                cv::Mat tpl = this->templateImagePyramid()[i];
+                
+                // 1. Evaluate Jacobians at W(x, 0). Kept as long as the template size does not change.
+                _jacobianPyramid[i].create(w0, tpl.cols, tpl.rows);
+                
+                // 2. Compute template steepest descent images. The Hessian of the template is not needed.
+                _sdiPyramid[i].create(w.numParameters(), tpl.cols - 2, tpl.rows - 2);
+                
+                HessianType hessian = W::Traits::zeroHessian(w.numParameters());
+                detail::inverseCompositionalSDI<W>(_jacobianPyramid[i], tpl, _sdiPyramid[i], hessian);
+                
+                w0 = w0.scaled(-1);
+            }
+        }
+        
+        /** 
+            Perform a single alignment step.
+         
+            This method takes the current state of the warp parameters and refines
+            them by minimizing the sum of squared intensity differences.
+         
+            \param w Current state of warp estimation. Will be modified to hold updated warp.
+         */
+        SingleStepResult<W> alignImpl(W &w)
+        {
+            cv::Mat tpl = this->templateImage();
+            cv::Mat target = this->targetImage();
+            
+            // 1. Warp target image back onto the template. One buffer per level.
+            cv::Mat &warpedTargetImage = _warpedTargetImages[this->level()];
+            warpImage<float, SAMPLE_BILINEAR>(target, warpedTargetImage, tpl.size(), w);
+            
+            // Large templates are processed in chunks of rows in parallel
+            const RowChunks rc(1, tpl.rows - 1, tpl.cols);
+            if ((int)_chunks.size() < rc.count + 1)
+                _chunks.resize(rc.count + 1);
+            
+            parallelForRows(rc, Rows(w, tpl, target.size(), this->templatePixels(), warpedTargetImage, _jacobianPyramid[this->level()], _sdiPyramid[this->level()], this->loss(), _chunks));
+            
+            RowChunkSums<W> &total = _chunks[rc.count];
+            reduceRowChunks(_chunks, rc.count, w.numParameters(), total, true);
+            
+            // 7. Solve Ax = b, only the upper triangle of A has been accumulated
+            ParamType delta = solveSymmetric(total.hessian, total.b);
+            
+            SingleStepResult<W> step;
+            step.delta = delta;
+            step.sumErrors = total.sumErrors;
+            step.numConstraints = total.numConstraints;
+            
+            return step;
+        }
+        
+        void applyStep(W &w, const SingleStepResult<W> &s) {
+            w.updateForwardCompositional(s.delta);
+        }
+        
+    private:
+        friend class AlignBase< AlignESM<W, L>, W, L >;
+        
+        /**
+            Accumulates b and Hessian for a chunk of template rows.
+         
+            Only template pixels whose warped position falls inside the target contribute,
+            see warpRowPositions.
+         */
+        class Rows {
+        public:
+            Rows(const W &w, 
+                 const cv::Mat &tpl, 
+                 cv::Size targetSize,
+                 const TemplatePixels &pixels,
+                 const cv::Mat &warpedTarget, 
+                 const JacobianTable<W> &jacobians, 
+                 const SDIPlanes &sdi, 
+                 const L &loss,
+                 std::vector< RowChunkSums<W> > &chunks)
+                : _w(w), _tpl(tpl), _targetSize(targetSize), _pixels(pixels), _warpedTarget(warpedTarget), _jacobians(jacobians), _sdi(sdi), _loss(loss), _chunks(chunks)
+            {}
+            
+            void operator()(int chunk, int rowBegin, int rowEnd) const {
+                Sampler<SAMPLE_NEAREST> s;
+                
+                const int nParams = _w.numParameters();
+                
+                RowChunkSums<W> &sums = _chunks[chunk];
+                sums.reset(nParams, true);
+                
+                WarpedRow<ScalarType> &row = sums.row;
+                WarpScanline<W> ws(_w);
+                
+                for (int y = rowBegin; y < rowEnd; ++y) {
+                    
+                    const float *tplRow = _tpl.ptr<float>(y);
+                    const JacobianType *jacobianRow = _jacobians.row(y);
+                    
+                    for (int i = _pixels.rowBegin(y); i < _pixels.rowEnd(y); ++i) {
+                        // Restrict the span to pixels warped inside the target
+                        const PixelSpan &span = _pixels.span(i);
+                        warpRowPositions(ws, y, span.xBegin, span.xEnd, _targetSize, row);
+                        
+                        if (row.size == 0)
+                            continue;
+                        
+                        // 2. Lookup target intensities and gradients using the already back warped image.
+                        for (int j = 0; j < row.size; ++j) {
+                            row.x[j] = ScalarType(row.cols[j]);
+                            row.y[j] = ScalarType(y);
+                        }
+                        s.sample<float>(_warpedTarget, &row.x[0], &row.y[0], row.size, &row.intensities[0]);
+                        gradient<float>(_warpedTarget, &row.x[0], &row.y[0], row.size, &row.gx[0], &row.gy[0], s);
+                        
+                        for (int j = 0; j < row.size; ++j) {
+                            const int x = row.cols[j];
+                            const float templateIntensity = tplRow[x];
+                            const float targetIntensity = row.intensities[j];
+                            
+                            // 3. Compute the error
+                            const float err = templateIntensity - targetIntensity;
+                            sums.sumErrors += ScalarType(_loss.rho(err));
+                            sums.numConstraints += 1;
+                            
+                            // 4. Compute the steepest descent image of the warped target
+                            const GradientType grad = W::Traits::initGradient(row.gx[j], row.gy[j]);
+                            PixelSDIType sd = grad * jacobianRow[x - 1];
+                            
+                            // 5. Average with the precomputed steepest descent image of the template
+                            for (int k = 0; k < nParams; ++k) {
+                                ScalarType &v = W::Traits::at(sd, 0, k);
+                                v = ScalarType(0.5) * (v + ScalarType(_sdi.ptr(k, y - 1)[x - 1]));
+                            }
+                            
+                            // 6. Update running sums of SDI times error and Hessian
+                            if (L::IsWeighted) {
+                                const float weight = _loss.weight(err);
+                                sums.b += sd.t() * (err * weight);
+                                accumulateUpper(sums.hessian, sd, ScalarType(weight));
+                            } else {
+                                sums.b += sd.t() * err;
+                                accumulateUpper(sums.hessian, sd, ScalarType(1));
+                            }
+                        }
+                    }
+                }
+            }
+            
+        private:
+            const W &_w;
+            const cv::Mat &_tpl;
+            cv::Size _targetSize;
+            const TemplatePixels &_pixels;
+            const cv::Mat &_warpedTarget;
+            const JacobianTable<W> &_jacobians;
+            const SDIPlanes &_sdi;
+            const L &_loss;
+            std::vector< RowChunkSums<W> > &_chunks;
+        };
+        
+        std::vector< JacobianTable<W> > _jacobianPyramid;
+        std::vector<SDIPlanes> _sdiPyramid;
+        std::vector< RowChunkSums<W> > _chunks;
+        
+        std::vector<cv::Mat> _warpedTargetImages;
+    };
+    
+}
+
+#endif
\ No newline at end of file
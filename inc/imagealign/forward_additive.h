@@ -24,6 +24,7 @@
 #include <imagealign/warp.h>
 #include <imagealign/sampling.h>
 #include <imagealign/gradient.h>
+#include <imagealign/solve.h>
 #include <opencv2/core/core.hpp>
 
 namespace imagealign {
@@ -40,6 +41,7 @@ namespace imagealign {
         direction of the warp is forward and warp parameters are summed.
      
         \tparam WarpType Type of warp motion to use during alignment. See EWarpType.
+        \tparam LossType Loss applied to intensity errors. See LossSquared.
      
         ## Based on
      
@@ -52,8 +54,13 @@ namespace imagealign {
         International journal of computer vision 56.3 (2004): 221-255.
 
      */
-    template<class W>
-    class AlignForwardAdditive : public AlignBase< AlignForwardAdditive<W>, W> {
+    template<class W, class L = LossSquared>
+    class AlignForwardAdditive : public AlignBase< AlignForwardAdditive<W, L>, W, L> {
+    public:
+        
+        /** Target gradients are sampled in every step, see prepareTargetImpl. */
+        enum { RequiresTargetGradients = 1 };
+        
     protected:
         
         typedef typename W::Traits::ParamType ParamType;
@@ -68,12 +75,35 @@ namespace imagealign {
             Prepare for alignment.
          
             In the forward additive algorithm not much data can be pre-calculated, which is
-            why this algorithm is not the fastest. The only thing that could be calculated
-            beforehand are the gradients of the target image.
+            why this algorithm is not the fastest. The only thing that can be calculated
+            beforehand are the gradients of the target image, see prepareTargetImpl.
          */
         void prepareImpl(const W &w)
         {
-            // Nothing todo here. Gradient is computed on the fly.
+        }
+        
+        /**
+            Prepare target dependent data.
+         
+            Requires interleaved intensity and gradient images of the target. These are taken 
+            from the target pyramid, when it was created with gradients, and are computed otherwise.
+            Computed gradients are stored in buffers of this aligner, which are reused for targets 
+            of equal size.
+         */
+        void prepareTargetImpl()
+        {
+            ImagePyramid &target = this->targetImagePyramid();
+            if (target.hasGradients())
+                return;
+            
+            const int levels = target.numLevels();
+            _targetImages.resize(levels);
+            _targetGradients.resize(levels);
+            for (int i = 0; i < levels; ++i) {
+                _targetImages[i] = target[i];
+                ImagePyramid::computeGradientImage(_targetImages[i], _targetGradients[i]);
+            }
+            target.assign(_targetImages, _targetGradients, levels);
         }
         
         /** 
@@ -87,63 +117,25 @@ namespace imagealign {
         SingleStepResult<W> alignImpl(const W &w)
         {
             cv::Mat tpl = this->templateImage();
-            cv::Mat target = this->targetImage();
+            cv::Mat targetGrad = this->targetImagePyramid().gradientImage(this->level());
             
-            Sampler<SAMPLE_BILINEAR> s;
+            // Large templates are processed in chunks of rows in parallel
+            const RowChunks rc(1, tpl.rows - 1, tpl.cols);
+            if ((int)_chunks.size() < rc.count + 1)
+                _chunks.resize(rc.count + 1);
             
-            HessianType hessian = W::Traits::zeroHessian(w.numParameters());
-            ParamType b = W::Traits::zeroParam(w.numParameters());
-
-            ScalarType sumErrors = 0;
-            int sumConstraints = 0;
+            parallelForRows(rc, Rows(w, tpl, this->templatePixels(), targetGrad, this->loss(), _chunks));
             
-            for (int y = 1; y < tpl.rows - 1; ++y) {
-                
-                const float *tplRow = tpl.ptr<float>(y);
-                
-                for (int x = 1; x < tpl.cols - 1; ++x) {
-                    const float templateIntensity = tplRow[x];
-
-                    PointType ptpl;
-                    ptpl << ScalarType(x), ScalarType(y);
-                    
-                    // 1. Warp target pixel back to template using w
-                    PointType ptgt = w(ptpl);
-                    
-                    if (!this->isInImage(ptgt, target.size(), 1))
-                        continue;
-                    
-                    const float targetIntensity = s.sample<float>(target, ptgt);
-                    
-                    // 2. Compute the error
-                    const float err = templateIntensity - targetIntensity;
-                    sumErrors += ScalarType(err * err);
-                    sumConstraints += 1;
-                    
-                    // 3. Compute the target gradient warped back
-                    const GradientType grad = gradient<float, SAMPLE_BILINEAR, typename W::Traits>(target, ptgt);
-                    
-                    // 4. Compute the jacobian for the template pixel position
-                    JacobianType jacobian = w.jacobian(ptpl);
-                    
-                    // 5. Compute the steepest descent image (SDI) for current pixel location
-                    const PixelSDIType sd = grad * jacobian;
-                    
-                    // 6. Update running sum of SDI times error
-                    b += sd.t() * err;
-                    
-                    // 7. Update Hessian
-                    hessian += sd.t() * sd;
-                }
-            }
+            RowChunkSums<W> &total = _chunks[rc.count];
+            reduceRowChunks(_chunks, rc.count, w.numParameters(), total, true);
             
-            // 8. Solve Ax = b
-            ParamType delta = hessian.inv() * b;
+            // 8. Solve Ax = b, only the upper triangle of A has been accumulated
+            ParamType delta = solveSymmetric(total.hessian, total.b);
             
             SingleStepResult<W> step;
             step.delta = delta;
-            step.sumErrors = sumErrors;
-            step.numConstraints = sumConstraints;
+            step.sumErrors = total.sumErrors;
+            step.numConstraints = total.numConstraints;
             
             return step;
         }
@@ -153,7 +145,94 @@ namespace imagealign {
         }
         
     private:
-        friend class AlignBase< AlignForwardAdditive<W>, W>;
+        friend class AlignBase< AlignForwardAdditive<W, L>, W, L>;
+        
+        /**
+            Accumulates b and Hessian for a chunk of template rows.
+         */
+        class Rows {
+        public:
+            Rows(const W &w, const cv::Mat &tpl, const TemplatePixels &pixels, const cv::Mat &targetGrad, const L &loss, std::vector< RowChunkSums<W> > &chunks)
+                : _w(w), _tpl(tpl), _pixels(pixels), _targetGrad(targetGrad), _loss(loss), _chunks(chunks)
+            {}
+            
+            void operator()(int chunk, int rowBegin, int rowEnd) const {
+                Sampler<SAMPLE_BILINEAR> s;
+                
+                RowChunkSums<W> &sums = _chunks[chunk];
+                sums.reset(_w.numParameters(), true);
+                
+                WarpedRow<ScalarType> &row = sums.row;
+                
+                if (sums.buffer.size() < size_t(4 * _tpl.cols))
+                    sums.buffer.resize(4 * std::max<int>(1, _tpl.cols));
+                float *samples = &sums.buffer[0];
+                
+                WarpScanline<W> ws(_w);
+                
+                for (int y = rowBegin; y < rowEnd; ++y) {
+                    
+                    const float *tplRow = _tpl.ptr<float>(y);
+                    
+                    for (int i = _pixels.rowBegin(y); i < _pixels.rowEnd(y); ++i) {
+                        // 1. Warp template span using w
+                        const PixelSpan &span = _pixels.span(i);
+                        warpRowPositions(ws, y, span.xBegin, span.xEnd, _targetGrad.size(), row);
+                        
+                        if (row.size == 0)
+                            continue;
+                        
+                        // 2. Sample target intensity and target gradient warped back with a single lookup
+                        s.sampleInterleaved<float, 4>(_targetGrad, &row.x[0], &row.y[0], row.size, samples);
+                        
+                        for (int k = 0; k < row.size; ++k) {
+                            const int x = row.cols[k];
+                            const float templateIntensity = tplRow[x];
+                            const float *sample = &samples[4 * k];
+                            const float targetIntensity = sample[0];
+                            
+                            PointType ptpl;
+                            ptpl << ScalarType(x), ScalarType(y);
+                            
+                            // 3. Compute the error
+                            const float err = templateIntensity - targetIntensity;
+                            sums.sumErrors += ScalarType(_loss.rho(err));
+                            sums.numConstraints += 1;
+                            
+                            const GradientType grad = W::Traits::initGradient(ScalarType(sample[1]), ScalarType(sample[2]));
+                            
+                            // 4. Compute the jacobian for the template pixel position
+                            JacobianType jacobian = _w.jacobian(ptpl);
+                            
+                            // 5. Compute the steepest descent image (SDI) for current pixel location
+                            const PixelSDIType sd = grad * jacobian;
+                            
+                            // 6. Update running sum of SDI times error and 7. Update Hessian
+                            if (L::IsWeighted) {
+                                const float weight = _loss.weight(err);
+                                sums.b += sd.t() * (err * weight);
+                                accumulateUpper(sums.hessian, sd, ScalarType(weight));
+                            } else {
+                                sums.b += sd.t() * err;
+                                accumulateUpper(sums.hessian, sd, ScalarType(1));
+                            }
+                        }
+                    }
+                }
+            }
+            
+        private:
+            const W &_w;
+            const cv::Mat &_tpl;
+            const TemplatePixels &_pixels;
+            const cv::Mat &_targetGrad;
+            const L &_loss;
+            std::vector< RowChunkSums<W> > &_chunks;
+        };
+        
+        std::vector< RowChunkSums<W> > _chunks;
+        std::vector<cv::Mat> _targetImages;
+        std::vector<cv::Mat> _targetGradients;
     };
     
     
@@ -23,7 +23,10 @@
 #include <imagealign/align_base.h>
 #include <imagealign/sampling.h>
 #include <imagealign/gradient.h>
+#include <imagealign/solve.h>
+#include <imagealign/image_pyramid.h>
 #include <imagealign/warp_image.h>
+#include <imagealign/jacobian_table.h>
 #include <opencv2/core/core.hpp>
 
 namespace imagealign {
@@ -57,7 +60,12 @@ namespace imagealign {
               warped.
             - The way the new warp is calculated is by composition rather than addition of parameters.
      
+        Gradients of the warped target change little while the warp moves by fractions of a
+        pixel. setGradientReuseThreshold allows to keep them across iterations, so that only
+        intensities are warped anew.
+     
         \tparam WarpType Type of warp motion to use during alignment. See EWarpType.
+        \tparam LossType Loss applied to intensity errors. See LossSquared.
      
         ## Based on
      
@@ -70,8 +78,34 @@ namespace imagealign {
             Technical Report CMU-RI-TR-02-16, Carnegie Mellon University Robotics Institute, 2002.
 
      */
-    template<class W>
-    class AlignForwardCompositional : public AlignBase< AlignForwardCompositional<W>, W> {
+    template<class W, class L = LossSquared>
+    class AlignForwardCompositional : public AlignBase< AlignForwardCompositional<W, L>, W, L> {
+    public:
+        
+        AlignForwardCompositional()
+            : _gradientReuseThreshold(0)
+        {}
+        
+        /**
+            Reuse gradients of the warped target between iterations.
+         
+            Gradients are recomputed once the template corners moved by at least the given
+            number of pixels of the current level since the gradients were computed. Subpixel
+            thresholds keep convergence intact, since errors are always computed with the
+            current warp. Zero, the default, recomputes gradients in every iteration.
+         
+            \param pixels Threshold displacement of template corners.
+         */
+        AlignForwardCompositional &setGradientReuseThreshold(double pixels) {
+            _gradientReuseThreshold = std::max<double>(pixels, 0);
+            return *this;
+        }
+        
+        /** Access the gradient reuse threshold. */
+        double gradientReuseThreshold() const {
+            return _gradientReuseThreshold;
+        }
+        
     protected:
         
         typedef typename W::Traits::ParamType ParamType;
@@ -93,24 +127,30 @@ namespace imagealign {
             w0.setIdentity();
             
             _jacobianPyramid.resize(this->numLevels());
+            _warpedTargetImages.resize(this->numLevels());
+            _warpedGradientImages.resize(this->numLevels());
+            _gradientWarps.resize(this->numLevels());
+            _gradientsValid.assign(this->numLevels(), 0);
             
             for (int i = 0; i < this->numLevels(); ++i) {
 
                 cv::Size s = this->templateImagePyramid()[i].size();
-            
-                _jacobianPyramid[i].resize((s.width-2) * (s.height-2));
-            
-                int idx = 0;
-                for (int y = 1; y < s.height - 1; ++y) {
-                    for (int x = 1; x < s.width - 1; ++x, ++idx) {
-                        _jacobianPyramid[i][idx] = w0.jacobian(PointType(ScalarType(x), ScalarType(y)));
-                    }
-                }
+                
+                // Kept as long as the template size does not change.
+                _jacobianPyramid[i].create(w0, s.width, s.height);
 
                 w0 = w0.scaled(-1);
             }
         }
         
+        /**
+            Prepare target dependent data. Gradients of previous targets are outdated.
+         */
+        void prepareTargetImpl()
+        {
+            _gradientsValid.assign(_gradientsValid.size(), 0);
+        }
+        
         /** 
             Perform a single alignment step.
          
@@ -127,58 +167,38 @@ namespace imagealign {
             // Computing the gradient happens on the warped image. Since evaluating the
             // the gradient in both directions takes 4 bilinear lookups, we are better off
             // warping the entire target image explicitely here.
-            warpImage<float, SAMPLE_BILINEAR>(target, _warpedTargetImage, tpl.size(), w);
+            // One buffer per level, so switching levels does not reallocate.
+            cv::Mat &warpedTargetImage = _warpedTargetImages[this->level()];
+            warpImage<float, SAMPLE_BILINEAR>(target, warpedTargetImage, tpl.size(), w);
             
-            HessianType hessian = W::Traits::zeroHessian(w.numParameters());
-            ParamType b = W::Traits::zeroParam(w.numParameters());
+            // Gradients are kept as long as the warp moved less than the reuse threshold.
+            const int lev = this->level();
+            cv::Mat &warpedGradientImage = _warpedGradientImages[lev];
+            if (!_gradientsValid[lev] ||
+                cornerDisplacement(_gradientWarps[lev], w, tpl.size()) >= _gradientReuseThreshold)
+            {
+                ImagePyramid::computeGradientImage(warpedTargetImage, warpedGradientImage);
+                _gradientWarps[lev] = w;
+                _gradientsValid[lev] = 1;
+            }
             
-            Sampler<SAMPLE_NEAREST> s;
-
-            ScalarType sumErrors = 0;
-            int sumConstraints = 0;
+            // Large templates are processed in chunks of rows in parallel
+            const RowChunks rc(1, tpl.rows - 1, tpl.cols);
+            if ((int)_chunks.size() < rc.count + 1)
+                _chunks.resize(rc.count + 1);
             
-            int idx = 0;
-            for (int y = 1; y < tpl.rows - 1; ++y) {
-                
-                const float *tplRow = tpl.ptr<float>(y);
-                
-                for (int x = 1; x < tpl.cols - 1; ++x, ++idx) {
-                    PointType ptpl;
-                    ptpl << ScalarType(x), ScalarType(y);
-                    const float templateIntensity = tplRow[x];
-                    
-                    // 1. Lookup the target intensity using the already back warped image.
-                    const float targetIntensity = s.sample<float>(_warpedTargetImage, ptpl);
-                    
-                    // 2. Compute the error
-                    const float err = templateIntensity - targetIntensity;
-                    sumErrors += ScalarType(err * err);
-                    sumConstraints += 1;
-                    
-                    // 3. Compute the target gradient on the warped image
-                    const GradientType grad = gradient<float, SAMPLE_NEAREST, typename W::Traits>(_warpedTargetImage, ptpl);
-                    
-                    // 4. Lookup the prec-computed Jacobian for the template pixel position corresponding to finest level.
-                    const JacobianType &jacobian = _jacobianPyramid[this->level()][idx];
-                    
-                    // 5. Compute the steepest descent image (SDI) for current pixel location
-                    const PixelSDIType sd = grad * jacobian;
-                    
-                    // 6. Update running sum of SDI times error
-                    b += sd.t() * err;
-                    
-                    // 7. Update Hessian
-                    hessian += sd.t() * sd;
-                }
-            }
+            parallelForRows(rc, Rows(w, tpl, this->templatePixels(), warpedTargetImage, warpedGradientImage, _jacobianPyramid[this->level()], this->loss(), _chunks));
+            
+            RowChunkSums<W> &total = _chunks[rc.count];
+            reduceRowChunks(_chunks, rc.count, w.numParameters(), total, true);
             
-            // 8. Solve Ax = b
-            ParamType delta = hessian.inv() * b;
+            // 8. Solve Ax = b, only the upper triangle of A has been accumulated
+            ParamType delta = solveSymmetric(total.hessian, total.b);
             
             SingleStepResult<W> step;
             step.delta = delta;
-            step.sumErrors = sumErrors;
-            step.numConstraints = sumConstraints;
+            step.sumErrors = total.sumErrors;
+            step.numConstraints = total.numConstraints;
             
             return step;
         }
@@ -188,12 +208,86 @@ namespace imagealign {
         }
         
     private:
-        friend class AlignBase< AlignForwardCompositional<W>, W>;
+        friend class AlignBase< AlignForwardCompositional<W, L>, W, L>;
+        
+        /**
+            Accumulates b and Hessian for a chunk of template rows.
+         */
+        class Rows {
+        public:
+            Rows(const W &w, const cv::Mat &tpl, const TemplatePixels &pixels, const cv::Mat &warpedTarget, const cv::Mat &warpedGradients, const JacobianTable<W> &jacobians, const L &loss, std::vector< RowChunkSums<W> > &chunks)
+                : _w(w), _tpl(tpl), _pixels(pixels), _warpedTarget(warpedTarget), _warpedGradients(warpedGradients), _jacobians(jacobians), _loss(loss), _chunks(chunks)
+            {}
+            
+            void operator()(int chunk, int rowBegin, int rowEnd) const {
+                RowChunkSums<W> &sums = _chunks[chunk];
+                sums.reset(_w.numParameters(), true);
+                
+                for (int y = rowBegin; y < rowEnd; ++y) {
+                    
+                    const float *tplRow = _tpl.ptr<float>(y);
+                    const float *targetRow = _warpedTarget.ptr<float>(y);
+                    const float *gradRow = _warpedGradients.ptr<float>(y);
+                    
+                    // Jacobians corresponding to pixels in row
+                    const JacobianType *jacobianRow = _jacobians.row(y);
+                    
+                    for (int i = _pixels.rowBegin(y); i < _pixels.rowEnd(y); ++i) {
+                        const PixelSpan &span = _pixels.span(i);
+                        
+                        for (int x = span.xBegin; x < span.xEnd; ++x) {
+                            const float templateIntensity = tplRow[x];
+                            
+                            // 1. Lookup the target intensity using the already back warped image.
+                            const float targetIntensity = targetRow[x];
+                            
+                            // 2. Compute the error
+                            const float err = templateIntensity - targetIntensity;
+                            sums.sumErrors += ScalarType(_loss.rho(err));
+                            sums.numConstraints += 1;
+                            
+                            // 3. Lookup the target gradient of the warped image
+                            const GradientType grad = W::Traits::initGradient(ScalarType(gradRow[4 * x + 1]), ScalarType(gradRow[4 * x + 2]));
+                            
+                            // 4. Lookup the prec-computed Jacobian for the template pixel position corresponding to finest level.
+                            const JacobianType &jacobian = jacobianRow[x - 1];
+                            
+                            // 5. Compute the steepest descent image (SDI) for current pixel location
+                            const PixelSDIType sd = grad * jacobian;
+                            
+                            // 6. Update running sum of SDI times error and 7. Update Hessian
+                            if (L::IsWeighted) {
+                                const float weight = _loss.weight(err);
+                                sums.b += sd.t() * (err * weight);
+                                accumulateUpper(sums.hessian, sd, ScalarType(weight));
+                            } else {
+                                sums.b += sd.t() * err;
+                                accumulateUpper(sums.hessian, sd, ScalarType(1));
+                            }
+                        }
+                    }
+                }
+            }
+            
+        private:
+            const W &_w;
+            const cv::Mat &_tpl;
+            const TemplatePixels &_pixels;
+            const cv::Mat &_warpedTarget;
+            const cv::Mat &_warpedGradients;
+            const JacobianTable<W> &_jacobians;
+            const L &_loss;
+            std::vector< RowChunkSums<W> > &_chunks;
+        };
         
-        typedef std::vector< typename W::Traits::JacobianType > VecOfJacobians;
-        std::vector<VecOfJacobians> _jacobianPyramid;
+        std::vector< JacobianTable<W> > _jacobianPyramid;
+        std::vector< RowChunkSums<W> > _chunks;
         
-        cv::Mat _warpedTargetImage;
+        std::vector<cv::Mat> _warpedTargetImages;
+        std::vector<cv::Mat> _warpedGradientImages;
+        std::vector<W> _gradientWarps;
+        std::vector<uchar> _gradientsValid;
+        double _gradientReuseThreshold;
     };
     
     
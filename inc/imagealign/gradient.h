@@ -47,6 +47,50 @@ namespace imagealign {
         return WTraits::initGradient(x, y);
     }
     
+    /**
+        Image gradient approximation for a batch of image coordinates.
+     
+        Batched version of the above. Central differences are evaluated through the batched
+        sampling interface, processing coordinates in small blocks kept on the stack.
+     
+        \param img Image to compute gradient for.
+        \param x Array of x coordinates.
+        \param y Array of y coordinates.
+        \param n Number of coordinates.
+        \param gx Array receiving n derivatives in x direction.
+        \param gy Array receiving n derivatives in y direction.
+        \param s Sampler to use.
+     */
+    template<class ChannelType, int SampleMethod, class Scalar>
+    void gradient(const cv::Mat &img,
+                  const Scalar *x, const Scalar *y, int n,
+                  Scalar *gx, Scalar *gy,
+                  const Sampler<SampleMethod> &s = Sampler<SampleMethod>())
+    {
+        const int BlockSize = 64;
+        
+        Scalar shifted[BlockSize];
+        ChannelType fwd[BlockSize], bwd[BlockSize];
+        
+        for (int i = 0; i < n; i += BlockSize) {
+            const int m = std::min<int>(BlockSize, n - i);
+            
+            // Derivative in x
+            for (int k = 0; k < m; ++k) shifted[k] = x[i + k] + Scalar(1);
+            s.template sample<ChannelType>(img, shifted, y + i, m, fwd);
+            for (int k = 0; k < m; ++k) shifted[k] = x[i + k] - Scalar(1);
+            s.template sample<ChannelType>(img, shifted, y + i, m, bwd);
+            for (int k = 0; k < m; ++k) gx[i + k] = (Scalar(fwd[k]) - Scalar(bwd[k])) * Scalar(0.5);
+            
+            // Derivative in y
+            for (int k = 0; k < m; ++k) shifted[k] = y[i + k] + Scalar(1);
+            s.template sample<ChannelType>(img, x + i, shifted, m, fwd);
+            for (int k = 0; k < m; ++k) shifted[k] = y[i + k] - Scalar(1);
+            s.template sample<ChannelType>(img, x + i, shifted, m, bwd);
+            for (int k = 0; k < m; ++k) gy[i + k] = (Scalar(fwd[k]) - Scalar(bwd[k])) * Scalar(0.5);
+        }
+    }
+    
 }
 
 #endif
\ No newline at end of file
@@ -21,6 +21,7 @@
 #define IMAGE_IMAGE_PYRAMID_H
 
 #include <imagealign/config.h>
+#include <imagealign/parallel.h>
 #include <vector>
 
 IA_DISABLE_PRAGMA_WARN(4190)
@@ -32,11 +33,135 @@ IA_DISABLE_PRAGMA_WARN_END
 
 namespace imagealign {
     
+    namespace detail {
+        
+        /**
+            Scratch buffers for tiled processing.
+         
+            Copies start out empty, so that pyramids sharing image data never share scratch
+            buffers.
+         */
+        struct TileBuffers {
+            std::vector<cv::Mat> tiles;
+            
+            TileBuffers() {}
+            TileBuffers(const TileBuffers &) {}
+            TileBuffers &operator=(const TileBuffers &) { return *this; }
+        };
+        
+        /**
+            Test if the buffer of an image is referenced by other matrix headers.
+         
+            External memory is not reference counted and never reported as shared.
+         */
+        inline bool isBufferShared(const cv::Mat &m) {
+#if IA_CV_VERSION == 2
+            return m.refcount && *m.refcount > 1;
+#else
+            return m.u && m.u->refcount > 1;
+#endif
+        }
+        
+        /**
+            Converts chunks of rows to the depth of the destination.
+         */
+        class ConvertRows {
+        public:
+            ConvertRows(const cv::Mat &src, cv::Mat &dst)
+                : _src(src), _dst(dst)
+            {}
+            
+            void operator()(int /*chunk*/, int rowBegin, int rowEnd) const {
+                cv::Mat d = _dst.rowRange(rowBegin, rowEnd);
+                _src.rowRange(rowBegin, rowEnd).convertTo(d, _dst.type());
+            }
+            
+        private:
+            const cv::Mat &_src;
+            cv::Mat &_dst;
+        };
+        
+        /**
+            Computes chunks of rows of cv::pyrDown.
+         
+            Each chunk applies cv::pyrDown to a band of source rows extended by the filter
+            support and keeps only those rows that are not affected by the band borders. 
+            Results are identical to applying cv::pyrDown to the entire image.
+         */
+        class PyrDownRows {
+        public:
+            PyrDownRows(const cv::Mat &src, cv::Mat &dst, std::vector<cv::Mat> &tiles)
+                : _src(src), _dst(dst), _tiles(tiles)
+            {}
+            
+            void operator()(int chunk, int rowBegin, int rowEnd) const {
+                // Output row y depends on source rows 2y - 2 ... 2y + 2
+                const int srcBegin = std::max<int>(0, 2 * rowBegin - 2);
+                const int srcEnd = std::min<int>(_src.rows, 2 * rowEnd + 1);
+                
+                cv::Mat &tile = _tiles[chunk];
+                cv::pyrDown(_src.rowRange(srcBegin, srcEnd), tile);
+                
+                const int first = rowBegin - srcBegin / 2;
+                cv::Mat d = _dst.rowRange(rowBegin, rowEnd);
+                tile.rowRange(first, first + (rowEnd - rowBegin)).copyTo(d);
+            }
+            
+        private:
+            const cv::Mat &_src;
+            cv::Mat &_dst;
+            std::vector<cv::Mat> &_tiles;
+        };
+        
+        /**
+            Computes chunks of rows of interleaved gradient images.
+         
+            \tparam T Pixel type of the source image. Gradients are always floating point.
+         */
+        template<class T>
+        class GradientRows {
+        public:
+            GradientRows(const cv::Mat &img, cv::Mat &dst)
+                : _img(img), _dst(dst)
+            {}
+            
+            void operator()(int /*chunk*/, int rowBegin, int rowEnd) const {
+                const cv::Mat &img = _img;
+                
+                for (int y = rowBegin; y < rowEnd; ++y) {
+                    const T *r = img.ptr<T>(y);
+                    const T *rp = img.ptr<T>(cv::borderInterpolate(y - 1, img.rows, cv::BORDER_REFLECT_101));
+                    const T *rn = img.ptr<T>(cv::borderInterpolate(y + 1, img.rows, cv::BORDER_REFLECT_101));
+                    float *d = _dst.ptr<float>(y);
+                    
+                    for (int x = 0; x < img.cols; ++x, d += 4) {
+                        const int xp = (x > 0) ? x - 1 : cv::borderInterpolate(x - 1, img.cols, cv::BORDER_REFLECT_101);
+                        const int xn = (x < img.cols - 1) ? x + 1 : cv::borderInterpolate(x + 1, img.cols, cv::BORDER_REFLECT_101);
+                        
+                        d[0] = float(r[x]);
+                        d[1] = (float(r[xn]) - float(r[xp])) * 0.5f;
+                        d[2] = (float(rn[x]) - float(rp[x])) * 0.5f;
+                        d[3] = 0.f;
+                    }
+                }
+            }
+            
+        private:
+            const cv::Mat &_img;
+            cv::Mat &_dst;
+        };
+    }
+    
     /** 
         Hierarchical image pyramid.
      
         Lower levels correspond to coarser images. Levels are generated recursively,
         by smoothing and shrinking parent levels successively.
+     
+        Levels are single precision by default. Pyramids of 8 or 16 bit levels require a 
+        quarter or half of the memory and bandwidth. Samplers interpolate those in fixed 
+        point and return floating point values, see Sampler::sampleToFloat. Gradient 
+        images are always floating point.
     */
     class ImagePyramid {
     public:
@@ -48,27 +173,126 @@ namespace imagealign {
             :_pyr(imgs)
         {}
         
-        /** Create image pyramid from image. */
-        inline void create(cv::InputArray img, int levels) {
+        inline ImagePyramid(const std::vector<cv::Mat> &imgs, const std::vector<cv::Mat> &grads)
+            :_pyr(imgs), _grads(grads)
+        {}
+        
+        /** 
+            Create image pyramid from image. 
+         
+            \param img Single channel image
+            \param levels Number of levels to generate
+            \param gradients When true, gradient images are precomputed for all levels. See createGradients.
+            \param depth Depth of levels. One of CV_32F, CV_8U or CV_16U.
+         
+            Buffers of previous calls are reused when image sizes do not change. Note that
+            this also overwrites the images of copies that share buffers with this pyramid.
+         */
+        inline void create(cv::InputArray img, int levels, bool gradients = false, int depth = CV_32F) {
+            
+            CV_Assert(depth == CV_32F || depth == CV_8U || depth == CV_16U);
             
             levels = std::max<int>(levels, 1);
             _pyr.resize(levels);
             
-            // All images are floating point
-            img.getMat().convertTo(_pyr[0], CV_32F);
+            cv::Mat src = img.getMat();
+            if (src.data == _pyr[0].data) {
+                src = src.clone();
+            }
+            _pyr[0].create(src.size(), CV_MAKETYPE(depth, 1));
+            parallelForRows(RowChunks(0, src.rows, src.cols), detail::ConvertRows(src, _pyr[0]));
+            
+            // Large levels are computed in tiles of rows in parallel
+            for (int i = 1; i < levels; ++i) {
+                pyrDown(_pyr[i-1], _pyr[i], _tiles.tiles);
+            }
+            
+            if (gradients) {
+                createGradients();
+            } else {
+                _grads.clear();
+            }
+        }
+        
+        /**
+            Create pyramid of template masks matching the levels of create.
+            
+            Masks are binarized to 0 and 255 and smoothed and shrunk like images. A pixel of
+            a coarser level is valid when the majority of its smoothing support is valid.
+            
+            \param mask Single channel 8 bit mask. Non-zero pixels are valid.
+            \param levels Number of levels to generate.
+            \param dst Receives one mask per level.
+         */
+        inline static void createMasks(cv::InputArray mask, int levels, std::vector<cv::Mat> &dst) {
+            cv::Mat m = mask.getMat();
+            CV_Assert(m.type() == CV_8UC1);
+            
+            levels = std::max<int>(levels, 1);
+            dst.resize(levels);
             
+            binarizeMask(m, dst[0], 1);
             for (int i = 1; i < levels; ++i) {
-                cv::pyrDown(_pyr[i-1], _pyr[i]);
+                cv::Mat smoothed;
+                cv::pyrDown(dst[i - 1], smoothed, cv::Size((dst[i - 1].cols + 1) / 2, (dst[i - 1].rows + 1) / 2));
+                binarizeMask(smoothed, dst[i], 128);
             }
+        }
+        
+        /**
+            Precompute gradient images for all levels.
+         
+            For each level an interleaved four channel floating point image holding
+            (intensity, gradient x, gradient y, 0) per pixel is generated. Gradients are
+            central differences with reflected borders. Interleaving allows algorithms to
+            fetch intensity and gradient with a single bilinear lookup. The fourth channel 
+            is padding, so that one pixel fits a SIMD register.
+         */
+        inline void createGradients() {
+            _grads.resize(_pyr.size());
             
+            for (size_t i = 0; i < _pyr.size(); ++i) {
+                computeGradientImage(_pyr[i], _grads[i]);
+            }
+        }
+        
+        /**
+            Test if any level or gradient buffer is referenced elsewhere, e.g. by a copy of this pyramid.
+         */
+        inline bool isShared() const {
+            for (size_t i = 0; i < _pyr.size(); ++i) {
+                if (detail::isBufferShared(_pyr[i]))
+                    return true;
+            }
+            for (size_t i = 0; i < _grads.size(); ++i) {
+                if (detail::isBufferShared(_grads[i]))
+                    return true;
+            }
+            return false;
+        }
+        
+        /**
+            Depth of levels. CV_32F for empty pyramids.
+         */
+        inline int depth() const {
+            return _pyr.empty() || _pyr[0].empty() ? CV_32F : _pyr[0].depth();
+        }
+        
+        /**
+            Test if gradient images are available.
+         */
+        inline bool hasGradients() const {
+            return !_pyr.empty() && _grads.size() == _pyr.size();
         }
 
         inline ImagePyramid slice(int startLevel, int numLevels) const {
-            std::vector<cv::Mat> imgs;
+            std::vector<cv::Mat> imgs, grads;
             for (int i = startLevel; i < (startLevel + numLevels); ++i) {
                 imgs.push_back(_pyr[i]);
+                if (hasGradients())
+                    grads.push_back(_grads[i]);
             }
-            return ImagePyramid(imgs);
+            return ImagePyramid(imgs, grads);
         }
         
         /**
@@ -85,6 +309,15 @@ namespace imagealign {
             return _pyr[level];
         }
         
+        /**
+            Return the interleaved intensity and gradient image corresponding to the i-th level.
+         
+            Requires hasGradients() to be true.
+         */
+        inline cv::Mat gradientImage(size_t level) const {
+            return _grads[level];
+        }
+        
         /** 
             Return the maximum number of levels for image size.
         */
@@ -98,8 +331,99 @@ namespace imagealign {
             return level;
         }
         
+        /**
+            Replace levels by image headers of another pyramid representation.
+         
+            Only headers are copied, pixels are shared. No memory is allocated when the 
+            number of levels does not change.
+         
+            \param imgs Floating point images, finest first.
+            \param grads Interleaved gradient images per level or empty.
+            \param levels Number of leading levels to take.
+         */
+        inline void assign(const std::vector<cv::Mat> &imgs, const std::vector<cv::Mat> &grads, int levels) {
+            _pyr.resize(levels);
+            for (int i = 0; i < levels; ++i) {
+                _pyr[i] = imgs[i];
+            }
+            
+            if ((int)grads.size() >= levels) {
+                _grads.resize(levels);
+                for (int i = 0; i < levels; ++i) {
+                    _grads[i] = grads[i];
+                }
+            } else {
+                _grads.clear();
+            }
+        }
+        
+        /** Set pixels of at least the given value to 255, all others to 0. */
+        inline static void binarizeMask(const cv::Mat &src, cv::Mat &dst, int threshold) {
+            cv::Mat tmp(src.size(), CV_8UC1);
+            for (int y = 0; y < src.rows; ++y) {
+                const uchar *r = src.ptr<uchar>(y);
+                uchar *d = tmp.ptr<uchar>(y);
+                for (int x = 0; x < src.cols; ++x) {
+                    d[x] = r[x] >= threshold ? 255 : 0;
+                }
+            }
+            dst = tmp;
+        }
+        
+        /** 
+            Compute interleaved (intensity, gradient x, gradient y, 0) image. 
+         
+            \param img Single channel 8 bit, 16 bit or floating point image.
+            \param dst Four channel floating point image receiving the result.
+         */
+        inline static void computeGradientImage(const cv::Mat &img, cv::Mat &dst) {
+            dst.create(img.size(), CV_32FC4);
+            
+            const RowChunks rc(0, img.rows, img.cols);
+            switch (img.depth()) {
+                case CV_8U:
+                    parallelForRows(rc, detail::GradientRows<uchar>(img, dst));
+                    break;
+                case CV_16U:
+                    parallelForRows(rc, detail::GradientRows<ushort>(img, dst));
+                    break;
+                default:
+                    CV_Assert(img.depth() == CV_32F);
+                    parallelForRows(rc, detail::GradientRows<float>(img, dst));
+                    break;
+            }
+        }
+        
+        /**
+            Same as cv::pyrDown, but large images are processed in tiles of rows in parallel.
+         
+            Results are identical to cv::pyrDown. 
+         
+            \param src Source image.
+            \param dst Destination image.
+            \param tiles Scratch buffers, one per tile. Grown on demand.
+         */
+        inline static void pyrDown(const cv::Mat &src, cv::Mat &dst, std::vector<cv::Mat> &tiles) {
+            const cv::Size s((src.cols + 1) / 2, (src.rows + 1) / 2);
+            const RowChunks rc(0, s.height, s.width);
+            
+            if (rc.count == 1) {
+                cv::pyrDown(src, dst, s);
+                return;
+            }
+            
+            dst.create(s, src.type());
+            if ((int)tiles.size() < rc.count)
+                tiles.resize(rc.count);
+            
+            parallelForRows(rc, detail::PyrDownRows(src, dst, tiles));
+        }
+        
     private:
+        
         std::vector<cv::Mat> _pyr;
+        std::vector<cv::Mat> _grads;
+        detail::TileBuffers _tiles;
     };
     
 }
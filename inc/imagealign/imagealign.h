@@ -24,5 +24,14 @@
 #include <imagealign/forward_additive.h>
 #include <imagealign/forward_compositional.h>
 #include <imagealign/inverse_compositional.h>
+#include <imagealign/efficient_second_order.h>
+#include <imagealign/batch_aligner.h>
+#include <imagealign/ocl_batch_aligner.h>
+#include <imagealign/prepared_template.h>
+#include <imagealign/align_context.h>
+#include <imagealign/sequence_tracker.h>
+#include <imagealign/multi_hypothesis.h>
+#include <imagealign/tiled_aligner.h>
+#include <imagealign/precompiled.h>
 
 #endif
\ No newline at end of file
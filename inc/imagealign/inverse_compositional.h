@@ -23,11 +23,610 @@
 #include <imagealign/align_base.h>
 #include <imagealign/sampling.h>
 #include <imagealign/gradient.h>
+#include <imagealign/solve.h>
+#include <imagealign/sdi.h>
+#include <imagealign/jacobian_table.h>
+#include <imagealign/pixel_selection.h>
 #include <opencv2/core/core.hpp>
 #include <iostream>
 
 namespace imagealign {
     
+    template<class W>
+    class PreparedTemplate;
+    
+    namespace detail {
+        
+        /**
+            Compute steepest descent images and Hessian of one template pyramid level.
+         
+            \param jacobians Jacobians at identity for the pyramid level. Either a JacobianTable or WarpJacobians.
+            \param tpl Floating point template image of that level.
+            \param sdi Planes of size (tpl.cols - 2) x (tpl.rows - 2) receiving the SDI of inner pixels.
+            \param hessian Zero initialized Hessian. Receives SDI^T * SDI.
+         */
+        template<class W, class Jacobians>
+        void inverseCompositionalSDI(const Jacobians &jacobians, const cv::Mat &tpl, SDIPlanes &sdi, typename W::Traits::HessianType &hessian)
+        {
+            typedef typename W::Traits::PixelSDIType PixelSDIType;
+            typedef typename W::Traits::GradientType GradientType;
+            typedef typename W::Traits::PointType PointType;
+            typedef typename W::Traits::ScalarType ScalarType;
+            
+            const int nParams = sdi.numParameters();
+            
+            if (IsTranslationWarp<W>::value) {
+                // Jacobian is the identity, steepest descent images are the template gradients
+                for (int y = 1; y < tpl.rows - 1 ; ++y) {
+                    const float *r = tpl.ptr<float>(y);
+                    const float *up = tpl.ptr<float>(y - 1);
+                    const float *down = tpl.ptr<float>(y + 1);
+                    float *gx = sdi.ptr(0, y - 1);
+                    float *gy = sdi.ptr(1, y - 1);
+                    
+                    for (int x = 1; x < tpl.cols - 1; ++x) {
+                        gx[x - 1] = float((ScalarType(r[x + 1]) - ScalarType(r[x - 1])) * ScalarType(0.5));
+                        gy[x - 1] = float((ScalarType(down[x]) - ScalarType(up[x])) * ScalarType(0.5));
+                    }
+                }
+            } else {
+                for (int y = 1; y < tpl.rows - 1 ; ++y) {
+                    for (int x = 1; x < tpl.cols - 1; ++x) {
+                        PointType p;
+                        p << ScalarType(x), ScalarType(y);
+                        
+                        // 1. Compute the gradient of the template
+                        const GradientType grad = gradient<float, SAMPLE_NEAREST, typename W::Traits>(tpl, p);
+                        
+                        // 2. Compute steepest descent images using the Jacobian at W(x, 0)
+                        PixelSDIType psdi = grad * jacobians.jacobian(x, y);
+                        
+                        // 3. Store steepest descent images, one plane per parameter
+                        for (int k = 0; k < nParams; ++k) {
+                            sdi.ptr(k, y - 1)[x - 1] = float(W::Traits::at(psdi, 0, k));
+                        }
+                    }
+                }
+            }
+            
+            // 4. Compute Hessian from SDI planes
+            for (int r = 0; r < nParams; ++r) {
+                for (int c = r; c < nParams; ++c) {
+                    const ScalarType v = ScalarType(sdi.dot(r, c));
+                    W::Traits::at(hessian, r, c) = v;
+                    W::Traits::at(hessian, c, r) = v;
+                }
+            }
+        }
+        
+        /**
+            Compute steepest descent images and Hessian of one template pyramid level.
+            
+            Evaluates Jacobians on the fly.
+         
+            \param w0 Identity warp scaled to the pyramid level.
+            \param tpl Floating point template image of that level.
+            \param sdi Planes of size (tpl.cols - 2) x (tpl.rows - 2) receiving the SDI of inner pixels.
+            \param hessian Zero initialized Hessian. Receives SDI^T * SDI.
+         */
+        template<class W>
+        void inverseCompositionalSDI(const W &w0, const cv::Mat &tpl, SDIPlanes &sdi, typename W::Traits::HessianType &hessian)
+        {
+            inverseCompositionalSDI<W>(WarpJacobians<W>(w0), tpl, sdi, hessian);
+        }
+        
+        /**
+            Hessian of template pixels computed from steepest descent images.
+            
+            Same as the Hessian computed by inverseCompositionalMaskSDI, but leaves the 
+            steepest descent images untouched, so that shared template data can be masked.
+            
+            \param pixels Template pixels of the level.
+            \param sdi Steepest descent images of inner pixels of the level.
+            \param hessian Receives SDI^T * SDI of template pixels.
+         */
+        template<class W>
+        void inverseCompositionalMaskedHessian(const TemplatePixels &pixels, const SDIPlanes &sdi, typename W::Traits::HessianType &hessian)
+        {
+            typedef typename W::Traits::ScalarType ScalarType;
+            
+            const int nParams = sdi.numParameters();
+            
+            for (int r = 0; r < nParams; ++r) {
+                for (int c = r; c < nParams; ++c) {
+                    double sum = 0;
+                    for (int y = 0; y < sdi.height(); ++y) {
+                        for (int i = pixels.rowBegin(y + 1); i < pixels.rowEnd(y + 1); ++i) {
+                            const PixelSpan &span = pixels.span(i);
+                            sum += dotProduct(sdi.ptr(r, y) + span.xBegin - 1, sdi.ptr(c, y) + span.xBegin - 1, span.xEnd - span.xBegin);
+                        }
+                    }
+                    W::Traits::at(hessian, r, c) = ScalarType(sum);
+                    W::Traits::at(hessian, c, r) = ScalarType(sum);
+                }
+            }
+        }
+        
+        /**
+            Restrict steepest descent images and Hessian to template pixels.
+            
+            Steepest descent images of pixels outside of spans are set to zero and the Hessian
+            is recomputed from the remaining pixels.
+            
+            \param pixels Template pixels of the level.
+            \param sdi Steepest descent images of inner pixels of the level.
+            \param hessian Receives SDI^T * SDI of template pixels.
+         */
+        template<class W>
+        void inverseCompositionalMaskSDI(const TemplatePixels &pixels, SDIPlanes &sdi, typename W::Traits::HessianType &hessian)
+        {
+            typedef typename W::Traits::ScalarType ScalarType;
+            
+            const int nParams = sdi.numParameters();
+            
+            for (int y = 0; y < sdi.height(); ++y) {
+                for (int p = 0; p < nParams; ++p) {
+                    float *r = sdi.ptr(p, y);
+                    
+                    // Gaps between spans of template row y + 1
+                    int x = 0;
+                    for (int i = pixels.rowBegin(y + 1); i < pixels.rowEnd(y + 1); ++i) {
+                        const PixelSpan &span = pixels.span(i);
+                        std::fill(r + x, r + span.xBegin - 1, 0.f);
+                        x = span.xEnd - 1;
+                    }
+                    std::fill(r + x, r + sdi.width(), 0.f);
+                }
+            }
+            
+            for (int r = 0; r < nParams; ++r) {
+                for (int c = r; c < nParams; ++c) {
+                    const ScalarType v = ScalarType(sdi.dot(r, c));
+                    W::Traits::at(hessian, r, c) = v;
+                    W::Traits::at(hessian, c, r) = v;
+                }
+            }
+        }
+        
+        /**
+            Accumulate b, and for weighted losses the Hessian, of one row of steepest descent images.
+            
+            Errors are given for valid pixels only. All other pixels of the row receive zero error 
+            and weight, so that sums can be formed over entire rows by dot products without 
+            branching. Weighted losses compute all weights of a row at once and accumulate the 
+            upper triangle of SDI^T * diag(weights) * SDI.
+         
+            \param sdi Steepest descent images.
+            \param y Row of SDI planes.
+            \param offset First column of SDI planes.
+            \param n Number of columns.
+            \param cols Columns of valid pixels. Relative to offset after subtracting colOffset.
+            \param colOffset Value subtracted from cols.
+            \param errors Errors of valid pixels.
+            \param m Number of valid pixels.
+            \param loss Loss function.
+            \param buffer Scratch buffer. Grown on demand.
+            \param sums Receives sums.
+         */
+        template<class W, class L>
+        inline void accumulateSDIRow(const SDIPlanes &sdi, int y, int offset, int n,
+                                     const int *cols, int colOffset, const float *errors, int m,
+                                     const L &loss, std::vector<float> &buffer, RowChunkSums<W> &sums)
+        {
+            typedef typename W::Traits::ScalarType ScalarType;
+            
+            const int nParams = sdi.numParameters();
+            const int slots = L::IsWeighted ? 4 : 1;
+            
+            if (buffer.size() < size_t(slots * std::max<int>(n, 1)))
+                buffer.resize(slots * std::max<int>(n, 1));
+            
+            // Dense per-row (weighted) error
+            float *e = &buffer[0];
+            std::fill(e, e + n, 0.f);
+            
+            sums.numConstraints += m;
+            
+            if (m == 0)
+                return;
+            
+            if (!L::IsWeighted) {
+                for (int k = 0; k < m; ++k) {
+                    sums.sumErrors += ScalarType(loss.rho(errors[k]));
+                    e[cols[k] - colOffset] = errors[k];
+                }
+                
+                for (int p = 0; p < nParams; ++p) {
+                    W::Traits::at(sums.b, p, 0) += ScalarType(dotProduct(sdi.ptr(p, y) + offset, e, n));
+                }
+            } else {
+                float *weights = e + n;
+                float *scaled = weights + n;
+                float *packed = scaled + n;
+                
+                // Weights of all valid pixels at once
+                loss.weights(errors, packed, m);
+                
+                std::fill(weights, weights + n, 0.f);
+                for (int k = 0; k < m; ++k) {
+                    const int i = cols[k] - colOffset;
+                    sums.sumErrors += ScalarType(loss.rho(errors[k]));
+                    e[i] = errors[k] * packed[k];
+                    weights[i] = packed[k];
+                }
+                
+                for (int p = 0; p < nParams; ++p) {
+                    const float *sp = sdi.ptr(p, y) + offset;
+                    W::Traits::at(sums.b, p, 0) += ScalarType(dotProduct(sp, e, n));
+                    
+                    // Upper triangle of weighted Hessian
+                    multiply(weights, sp, scaled, n);
+                    for (int q = p; q < nParams; ++q) {
+                        W::Traits::at(sums.hessian, p, q) += ScalarType(dotProduct(scaled, sdi.ptr(q, y) + offset, n));
+                    }
+                }
+            }
+        }
+        
+        /**
+            Solve for parameter update.
+         
+            Unweighted losses use the precomputed inverse Hessian. Weighted losses use the Hessian
+            accumulated in this iteration, of which only the upper triangle has been summed.
+         */
+        template<class W, class L>
+        inline typename W::Traits::ParamType solveInverseCompositional(RowChunkSums<W> &total, const typename W::Traits::HessianType &invHessian, const L &)
+        {
+            if (!L::IsWeighted)
+                return invHessian * total.b;
+            
+            return solveSymmetric(total.hessian, total.b);
+        }
+        
+        /**
+            Accumulates SDI^T * error for a chunk of template rows.
+         */
+        template<class W, class L>
+        class InverseCompositionalRows {
+        public:
+            typedef typename W::Traits::ScalarType ScalarType;
+            
+            InverseCompositionalRows(const W &w,
+                                     const cv::Mat &tpl,
+                                     const cv::Mat &target,
+                                     const SDIPlanes &sdi,
+                                     const L &loss,
+                                     std::vector< RowChunkSums<W> > &chunks,
+                                     const TemplatePixels *pixels)
+                : _w(w), _tpl(tpl), _target(target), _sdi(sdi), _loss(loss), _chunks(chunks), _pixels(pixels)
+            {}
+            
+            void operator()(int chunk, int rowBegin, int rowEnd) const {
+                const int nParams = _w.numParameters();
+                
+                RowChunkSums<W> &sums = _chunks[chunk];
+                sums.reset(nParams, L::IsWeighted != 0);
+                
+                WarpScanline<W> ws(_w);
+                
+                for (int y = rowBegin; y < rowEnd; ++y) {
+                    if (_pixels) {
+                        for (int i = _pixels->rowBegin(y); i < _pixels->rowEnd(y); ++i) {
+                            const PixelSpan &span = _pixels->span(i);
+                            accumulateSpan(ws, y, span.xBegin, span.xEnd, sums);
+                        }
+                    } else {
+                        accumulateSpan(ws, y, 1, _tpl.cols - 1, sums);
+                    }
+                }
+            }
+        
+        private:
+            
+            void accumulateSpan(WarpScanline<W> &ws, int y, int xBegin, int xEnd, RowChunkSums<W> &sums) const {
+                const float *tplRow = _tpl.ptr<float>(y);
+                WarpedRow<ScalarType> &row = sums.row;
+                
+                // 1. Warp template row using w and sample target intensities
+                warpRow(ws, y, xBegin, xEnd, _target, row);
+                
+                // 2. Compute the errors in place. Roles reverse compared to forward additive / compositional
+                for (int k = 0; k < row.size; ++k) {
+                    row.intensities[k] -= tplRow[row.cols[k]];
+                }
+                
+                // 3. Update b, and the Hessian for weighted losses, using dot products per SDI plane
+                accumulateSDIRow(_sdi, y - 1, xBegin - 1, xEnd - xBegin, row.size > 0 ? &row.cols[0] : 0, xBegin, row.size > 0 ? &row.intensities[0] : 0, row.size, _loss, sums.buffer, sums);
+            }
+            
+            const W &_w;
+            const cv::Mat &_tpl;
+            const cv::Mat &_target;
+            const SDIPlanes &_sdi;
+            const L &_loss;
+            std::vector< RowChunkSums<W> > &_chunks;
+            const TemplatePixels *_pixels;
+        };
+        
+        /**
+            Perform a single inverse compositional step.
+         
+            Large templates are processed in chunks of rows in parallel, see RowChunks.
+         
+            \param w Current state of warp estimation.
+            \param tpl Template image of current level.
+            \param target Target image of current level.
+            \param sdi Steepest descent images of current level.
+            \param invHessian Inverse Hessian of current level. Unused for weighted losses.
+            \param loss Loss function.
+            \param chunks Partial sums and scratch buffers per chunk. Grown on demand.
+            \param pixels Optional template pixels to iterate. All inner pixels when null.
+         */
+        template<class W, class L>
+        SingleStepResult<W> inverseCompositionalStep(const W &w,
+                                                     const cv::Mat &tpl,
+                                                     const cv::Mat &target,
+                                                     const SDIPlanes &sdi,
+                                                     const typename W::Traits::HessianType &invHessian,
+                                                     const L &loss,
+                                                     std::vector< RowChunkSums<W> > &chunks,
+                                                     const TemplatePixels *pixels = 0)
+        {
+            const RowChunks rc(1, tpl.rows - 1, tpl.cols);
+            if ((int)chunks.size() < rc.count + 1)
+                chunks.resize(rc.count + 1);
+            
+            // 1.-3. Accumulate b per chunk
+            parallelForRows(rc, InverseCompositionalRows<W, L>(w, tpl, target, sdi, loss, chunks, pixels));
+            
+            RowChunkSums<W> &total = chunks[rc.count];
+            reduceRowChunks(chunks, rc.count, w.numParameters(), total, L::IsWeighted != 0);
+            
+            // 4. Solve Ax = b
+            SingleStepResult<W> step;
+            step.delta = solveInverseCompositional(total, invHessian, loss);
+            step.sumErrors = total.sumErrors;
+            step.numConstraints = total.numConstraints;
+            
+            return step;
+        }
+        
+        /**
+            Perform a single inverse compositional step minimizing the sum of squared differences.
+         */
+        template<class W>
+        SingleStepResult<W> inverseCompositionalStep(const W &w,
+                                                     const cv::Mat &tpl,
+                                                     const cv::Mat &target,
+                                                     const SDIPlanes &sdi,
+                                                     const typename W::Traits::HessianType &invHessian,
+                                                     std::vector< RowChunkSums<W> > &chunks)
+        {
+            return inverseCompositionalStep(w, tpl, target, sdi, invHessian, LossSquared(), chunks);
+        }
+        
+        /**
+            Selected template pixels of one pyramid level in packed form.
+         
+            Stores coordinates, template intensities and steepest descent images of the
+            selected pixels only. Steepest descent images are kept as SDIPlanes of a single
+            row, one value per selected pixel.
+         */
+        template<class Scalar>
+        struct SparseTemplate {
+            std::vector<Scalar> x;
+            std::vector<Scalar> y;
+            std::vector<float> intensities;
+            SDIPlanes sdi;
+            
+            /** Number of selected pixels. Zero when all pixels are used. */
+            int size() const {
+                return (int)x.size();
+            }
+            
+            /** Use all pixels. */
+            void clear() {
+                x.clear();
+                y.clear();
+                intensities.clear();
+            }
+        };
+        
+        /**
+            Select template pixels of one pyramid level and pack their data.
+            
+            \param tpl Floating point template image of that level.
+            \param pixels Template pixels of that level. Pixels outside are never selected.
+            \param dense Steepest descent images of all inner pixels, see inverseCompositionalSDI.
+            \param selection Selection strategy.
+            \param scores Scratch buffer.
+            \param indices Scratch buffer.
+            \param sparse Receives the selected pixels. Cleared when all pixels are selected.
+            \param hessian Zero initialized Hessian. Receives SDI^T * SDI of selected pixels. Untouched
+                   when all pixels are selected.
+         */
+        template<class W>
+        void inverseCompositionalSelectPixels(const cv::Mat &tpl,
+                                              const TemplatePixels &pixels,
+                                              const SDIPlanes &dense,
+                                              const PixelSelection &selection,
+                                              std::vector<float> &scores,
+                                              std::vector<int> &indices,
+                                              SparseTemplate<typename W::Traits::ScalarType> &sparse,
+                                              typename W::Traits::HessianType &hessian)
+        {
+            typedef typename W::Traits::GradientType GradientType;
+            typedef typename W::Traits::PointType PointType;
+            typedef typename W::Traits::ScalarType ScalarType;
+            
+            const int nParams = dense.numParameters();
+            const int width = dense.width();
+            const int height = dense.height();
+            const int available = width * height;
+            const int k = selection.numPixels(pixels.numPixels(), nParams);
+            
+            if (k >= pixels.numPixels()) {
+                sparse.clear();
+                return;
+            }
+            
+            // 1. Score inner pixels
+            scores.resize(available);
+            for (int y = 0; y < height; ++y) {
+                for (int x = 0; x < width; ++x) {
+                    float v = 0.f;
+                    if (selection.score == PIXEL_SCORE_SDI) {
+                        for (int p = 0; p < nParams; ++p) {
+                            const float sd = dense.ptr(p, y)[x];
+                            v += sd * sd;
+                        }
+                    } else {
+                        PointType pt;
+                        pt << ScalarType(x + 1), ScalarType(y + 1);
+                        const GradientType g = gradient<float, SAMPLE_NEAREST, typename W::Traits>(tpl, pt);
+                        const float gx = float(W::Traits::at(g, 0, 0));
+                        const float gy = float(W::Traits::at(g, 0, 1));
+                        v = gx * gx + gy * gy;
+                    }
+                    // Pixels outside of the template rank below all others
+                    scores[y * width + x] = (!pixels.masked() || pixels.contains(x + 1, y + 1)) ? v : -1.f;
+                }
+            }
+            
+            // 2. Keep best pixels in memory order
+            selectTopScores(scores, k, indices);
+            
+            // 3. Pack coordinates, intensities and steepest descent images
+            sparse.x.resize(k);
+            sparse.y.resize(k);
+            sparse.intensities.resize(k);
+            sparse.sdi.create(nParams, k, 1);
+            
+            for (int i = 0; i < k; ++i) {
+                const int x = indices[i] % width;
+                const int y = indices[i] / width;
+                
+                sparse.x[i] = ScalarType(x + 1);
+                sparse.y[i] = ScalarType(y + 1);
+                sparse.intensities[i] = tpl.at<float>(y + 1, x + 1);
+                
+                for (int p = 0; p < nParams; ++p) {
+                    sparse.sdi.ptr(p, 0)[i] = dense.ptr(p, y)[x];
+                }
+            }
+            
+            // 4. Compute Hessian from selected pixels
+            for (int r = 0; r < nParams; ++r) {
+                for (int c = r; c < nParams; ++c) {
+                    const ScalarType v = ScalarType(sparse.sdi.dot(r, c));
+                    W::Traits::at(hessian, r, c) = v;
+                    W::Traits::at(hessian, c, r) = v;
+                }
+            }
+        }
+        
+        /**
+            Accumulates SDI^T * error for a range of selected pixels.
+         */
+        template<class W, class L>
+        class InverseCompositionalSparseRows {
+        public:
+            typedef typename W::Traits::ScalarType ScalarType;
+            typedef typename W::Traits::PointType PointType;
+            
+            InverseCompositionalSparseRows(const W &w,
+                                           const cv::Mat &target,
+                                           const SparseTemplate<ScalarType> &sparse,
+                                           const L &loss,
+                                           std::vector< RowChunkSums<W> > &chunks)
+                : _w(w), _target(target), _sparse(sparse), _loss(loss), _chunks(chunks)
+            {}
+            
+            void operator()(int chunk, int begin, int end) const {
+                const int nParams = _w.numParameters();
+                const int n = end - begin;
+                
+                RowChunkSums<W> &sums = _chunks[chunk];
+                sums.reset(nParams, L::IsWeighted != 0);
+                
+                // 1. Warp selected pixels and sample target intensities
+                WarpedRow<ScalarType> &row = sums.row;
+                row.reserve(n);
+                
+                int m = 0;
+                for (int i = begin; i < end; ++i) {
+                    const PointType p = _w(PointType(_sparse.x[i], _sparse.y[i]));
+                    
+                    if (!isInImage(p, _target.size(), 1))
+                        continue;
+                    
+                    row.cols[m] = i - begin;
+                    row.x[m] = p(0);
+                    row.y[m] = p(1);
+                    ++m;
+                }
+                row.size = m;
+                
+                if (m == 0)
+                    return;
+                
+                Sampler<SAMPLE_BILINEAR> s;
+                s.sampleToFloat(_target, &row.x[0], &row.y[0], m, &row.intensities[0]);
+                
+                // 2. Compute the errors in place
+                for (int k = 0; k < m; ++k) {
+                    row.intensities[k] -= _sparse.intensities[begin + row.cols[k]];
+                }
+                
+                // 3. Update b, and the Hessian for weighted losses, using dot products per SDI plane
+                accumulateSDIRow(_sparse.sdi, 0, begin, n, &row.cols[0], 0, &row.intensities[0], m, _loss, sums.buffer, sums);
+            }
+            
+        private:
+            const W &_w;
+            const cv::Mat &_target;
+            const SparseTemplate<ScalarType> &_sparse;
+            const L &_loss;
+            std::vector< RowChunkSums<W> > &_chunks;
+        };
+        
+        /**
+            Perform a single inverse compositional step on selected pixels.
+         
+            \param w Current state of warp estimation.
+            \param target Target image of current level.
+            \param sparse Selected pixels of current level.
+            \param invHessian Inverse Hessian of selected pixels. Unused for weighted losses.
+            \param loss Loss function.
+            \param chunks Partial sums and scratch buffers per chunk. Grown on demand.
+         */
+        template<class W, class L>
+        SingleStepResult<W> inverseCompositionalSparseStep(const W &w,
+                                                           const cv::Mat &target,
+                                                           const SparseTemplate<typename W::Traits::ScalarType> &sparse,
+                                                           const typename W::Traits::HessianType &invHessian,
+                                                           const L &loss,
+                                                           std::vector< RowChunkSums<W> > &chunks)
+        {
+            // Packed pixels are partitioned as a single column image
+            const RowChunks rc(0, sparse.size(), 1);
+            if ((int)chunks.size() < rc.count + 1)
+                chunks.resize(rc.count + 1);
+            
+            parallelForRows(rc, InverseCompositionalSparseRows<W, L>(w, target, sparse, loss, chunks));
+            
+            RowChunkSums<W> &total = chunks[rc.count];
+            reduceRowChunks(chunks, rc.count, w.numParameters(), total, L::IsWeighted != 0);
+            
+            SingleStepResult<W> step;
+            step.delta = solveInverseCompositional(total, invHessian, loss);
+            step.sumErrors = total.sumErrors;
+            step.numConstraints = total.numConstraints;
+            
+            return step;
+        }
+    }
+    
     /** 
         Inverse-compositional image alignment.
         
@@ -56,7 +655,21 @@ namespace imagealign {
             - The pixel wise steepest descent images (SDI) are computed from the template image.
             - The Hessian is computed from the SDI above.
      
+        Steepest descent images are stored in structure-of-arrays layout, one plane per
+        parameter, see SDIPlanes. The hot loop reduces to one dot product per parameter and
+        template row.
+     
+        Optionally only a subset of template pixels is used, see setPixelSelection. Selected
+        pixels are packed with their intensities and steepest descent images, so that
+        iterations touch selected pixels only.
+     
+        Weighted losses recompute only the weighted Hessian per iteration from the cached
+        steepest descent images. Unweighted losses use the Hessian computed in prepareImpl.
+     
+        Template data can be prepared once and shared by many aligners, see PreparedTemplate.
+     
         \tparam WarpType Type of warp motion to use during alignment. See EWarpType.
+        \tparam LossType Loss applied to intensity errors. See LossSquared.
      
         ## Based on
      
@@ -69,8 +682,77 @@ namespace imagealign {
             Technical Report CMU-RI-TR-02-16, Carnegie Mellon University Robotics Institute, 2002.
 
      */
-    template<class W>
-    class AlignInverseCompositional : public AlignBase< AlignInverseCompositional<W>, W > {
+    template<class W, class L = LossSquared>
+    class AlignInverseCompositional : public AlignBase< AlignInverseCompositional<W, L>, W, L > {
+    public:
+        
+        typedef AlignBase< AlignInverseCompositional<W, L>, W, L > BaseType;
+        
+        using BaseType::prepare;
+        
+        AlignInverseCompositional()
+            : _usePrepared(false)
+        {}
+        
+        /**
+            Prepare for alignment using shared template data.
+         
+            Template levels, steepest descent images and inverse Hessians are referenced, not 
+            computed. No template pyramid is built and no template memory is allocated.
+            Prepared templates store all pixels, so the pixel selection must use all pixels,
+            see setPixelSelection. Subsequent calls to updateTemplate compute template data 
+            as usual.
+         
+            \param tmpl Prepared template data.
+            \param target Single channel target image to align template with.
+         */
+        void prepare(const PreparedTemplate<W> &tmpl, cv::InputArray target)
+        {
+            // Validate before referencing shared data, so that failures leave no pending state
+            CV_Assert(target.channels() == 1);
+            
+            usePreparedTemplate(tmpl);
+            BaseType::prepare(tmpl.templateImage(0), target, tmpl.warp(), tmpl.numLevels());
+        }
+        
+        /**
+            Prepare for alignment using shared template data and a pre-built target pyramid.
+         
+            \param tmpl Prepared template data.
+            \param target Pre-built image pyramid of target image.
+         */
+        void prepare(const PreparedTemplate<W> &tmpl, const ImagePyramid &target)
+        {
+            CV_Assert(target.numLevels() > 0);
+            CV_Assert(target[0].channels() == 1);
+            
+            usePreparedTemplate(tmpl);
+            BaseType::prepare(tmpl.templateImage(0), target, tmpl.warp(), tmpl.numLevels());
+        }
+        
+        /**
+            Restrict alignment to selected template pixels.
+         
+            Takes effect on the next call to prepare or updateTemplate. Defaults to all pixels.
+            Preparing from a PreparedTemplate requires all pixels.
+         
+            \param selection Selection strategy, see PixelSelection.
+         */
+        void setPixelSelection(const PixelSelection &selection) {
+            _selection = selection;
+        }
+        
+        /** Access the pixel selection strategy. */
+        const PixelSelection &pixelSelection() const {
+            return _selection;
+        }
+        
+        /** Number of template pixels used on the given level. */
+        int numSelectedPixels(int level) const {
+            const int n = _sparsePyramid[level].size();
+            return n > 0 ? n : _sdiPyramid[level].width() * _sdiPyramid[level].height();
+        }
+        
     protected:
         
         typedef typename W::Traits::ParamType ParamType;
@@ -84,53 +766,59 @@ namespace imagealign {
         /**
             Prepare for alignment.
          
-            In the forward compositional algorithm only the Jacobian of the warp can be precomputed.
+            Precomputes per-pixel Jacobians, steepest descent images and inverse Hessians for every
+            template level.
          */
         void prepareImpl(const W &w)
         {
             W w0(w);
             w0.setIdentity();
             
+            _jacobianPyramid.resize(this->numLevels());
             _sdiPyramid.resize(this->numLevels());
+            _sparsePyramid.resize(this->numLevels());
             _invHessians.resize(this->numLevels());
             
+            // Shared template data was set up by usePreparedTemplate. Levels of the template 
+            // pyramid are adopted from the prepared template, all pixels are used.
+            if (_usePrepared) {
+                _usePrepared = false;
+                for (int i = 0; i < this->numLevels(); ++i) {
+                    _sparsePyramid[i].clear();
+                }
+                return;
+            }
+            
+            _preparedStorage.release();
+            
             for (int i = 0; i < this->numLevels(); ++i) {
                 
                 cv::Mat tpl = this->templateImagePyramid()[i];
-                cv::Size s = tpl.size();
                 
-                _sdiPyramid[i].resize((s.width-2) * (s.height-2));
+                // 1. Evaluate Jacobians at W(x, 0). Kept as long as the template size does not change.
+                //    Not needed for translations whose steepest descent images are the gradients.
+                if (!IsTranslationWarp<W>::value)
+                    _jacobianPyramid[i].create(w0, tpl.cols, tpl.rows);
                 
+                _sdiPyramid[i].create(w.numParameters(), tpl.cols - 2, tpl.rows - 2);
+                
+                // 2. Compute steepest descent images and Hessian
                 HessianType hessian = W::Traits::zeroHessian(w.numParameters());
+                detail::inverseCompositionalSDI<W>(_jacobianPyramid[i], tpl, _sdiPyramid[i], hessian);
                 
-                int idx = 0;
-                for (int y = 1; y < tpl.rows - 1 ; ++y) {
-                    for (int x = 1; x < tpl.cols - 1; ++x, ++idx) {
-                        PointType p;
-                        p << ScalarType(x), ScalarType(y);
-                        
-                        // 1. Compute the gradient of the template
-                        const GradientType grad = gradient<float, SAMPLE_NEAREST, typename W::Traits>(tpl, p);
-                        
-                        // 2. Evaluate the Jacobian of image location.
-                        // Note: Jacobians are computed with pixel positions corresponding
-                        // to the finest pyramid level.
-                        JacobianType jacobian = w0.jacobian(p);
-                        
-                        // 3. Compute steepest descent images
-                        PixelSDIType sdi = grad * jacobian;
-                        
-                        // 4. Update inverse Hessian
-                        hessian += sdi.t() * sdi;
-                        
-                        // 5. Store steepest descent images
-                        _sdiPyramid[i][idx] = sdi;
-                    }
-                }
-
-                // 6. Store inverse Hessian
+                // 3. Optionally restrict to masked pixels
+                if (this->templatePixels(i).masked())
+                    detail::inverseCompositionalMaskSDI<W>(this->templatePixels(i), _sdiPyramid[i], hessian);
+                
+                // 4. Optionally keep selected pixels only. Replaces the Hessian by the one of selected pixels.
+                HessianType sparseHessian = W::Traits::zeroHessian(w.numParameters());
+                detail::inverseCompositionalSelectPixels<W>(tpl, this->templatePixels(i), _sdiPyramid[i], _selection, _scores, _indices, _sparsePyramid[i], sparseHessian);
+                if (_sparsePyramid[i].size() > 0)
+                    hessian = sparseHessian;
+                
+                // 5. Store inverse Hessian
                 _invHessians[i] = hessian.inv();
-
+                
                 w0 = w0.scaled(-1);
                 
             }
@@ -146,55 +834,25 @@ namespace imagealign {
          */
         SingleStepResult<W>  alignImpl(W &w)
         {
-            cv::Mat tpl = this->templateImage();
-            cv::Mat target = this->targetImage();
-            
-            const VecOfSDI &sdi = _sdiPyramid[this->level()];
-            
-            Sampler<SAMPLE_BILINEAR> s;
-            
-            ParamType b = W::Traits::zeroParam(w.numParameters());
-            ScalarType sumErrors = 0;
-            int sumConstraints = 0;
+            const TemplatePixels &pixels = this->templatePixels();
             
-            int idx = 0;
-            for (int y = 1; y < tpl.rows - 1; ++y) {
-                
-                const float *tplRow = tpl.ptr<float>(y);
-                
-                for (int x = 1; x < tpl.cols - 1; ++x, ++idx) {
-                    const float templateIntensity = tplRow[x];
-
-                    PointType ptpl;
-                    ptpl << ScalarType(x), ScalarType(y);
-                    
-                    // 1. Warp target pixel back to template using w
-                    PointType ptgt = w(ptpl);
-                    
-                    if (!this->isInImage(ptgt, target.size(), 1))
-                        continue;
-                    
-                    const float targetIntensity = s.sample<float>(target, ptgt);
-                    
-                    // 2. Compute the error. Roles reverse compared to forward additive / compositional
-                    const float err = targetIntensity - templateIntensity;
-                    sumErrors += ScalarType(err * err);
-                    sumConstraints += 1;
-                    
-                    // 3. Update b using SDI lookup
-                    b += sdi[idx].t() * err;
-                }
+            if (_sparsePyramid[this->level()].size() > 0) {
+                return detail::inverseCompositionalSparseStep(w,
+                                                              this->targetImage(),
+                                                              _sparsePyramid[this->level()],
+                                                              _invHessians[this->level()],
+                                                              this->loss(),
+                                                              _chunks);
             }
             
-            // 4. Solve Ax = b
-            ParamType delta = _invHessians[this->level()] * b;
-            
-            SingleStepResult<W> step;
-            step.delta = delta;
-            step.sumErrors = sumErrors;
-            step.numConstraints = sumConstraints;
-            
-            return step;
+            return detail::inverseCompositionalStep(w,
+                                                    this->templateImage(),
+                                                    this->targetImage(),
+                                                    _sdiPyramid[this->level()],
+                                                    _invHessians[this->level()],
+                                                    this->loss(),
+                                                    _chunks,
+                                                    pixels.masked() ? &pixels : 0);
         }
         
         
@@ -203,14 +861,46 @@ namespace imagealign {
         }
         
     private:
-        friend class AlignBase< AlignInverseCompositional<W>, W >;
         
-        typedef std::vector< typename W::Traits::PixelSDIType > VecOfSDI;
+        /** Reference template levels, steepest descent images and inverse Hessians of shared template data. */
+        void usePreparedTemplate(const PreparedTemplate<W> &tmpl)
+        {
+            CV_Assert(!tmpl.empty());
+            CV_Assert(_selection.selectsAll());
+            
+            _preparedImages.resize(tmpl.numLevels());
+            _sdiPyramid.resize(tmpl.numLevels());
+            _invHessians.resize(tmpl.numLevels());
+            for (int i = 0; i < tmpl.numLevels(); ++i) {
+                _preparedImages[i] = tmpl.templateImage(i);
+                _sdiPyramid[i] = tmpl.sdi(i);
+                _invHessians[i] = tmpl.invHessian(i);
+            }
+            
+            this->adoptTemplateLevels(_preparedImages);
+            
+            _preparedStorage = tmpl.storage();
+            _usePrepared = true;
+        }
+        
+        friend class AlignBase< AlignInverseCompositional<W, L>, W, L >;
+        
         typedef std::vector< typename W::Traits::HessianType > VecOfHessian;
     
-        std::vector<VecOfSDI> _sdiPyramid;
+        std::vector< JacobianTable<W> > _jacobianPyramid;
+        std::vector<SDIPlanes> _sdiPyramid;
+        std::vector< detail::SparseTemplate<ScalarType> > _sparsePyramid;
         VecOfHessian _invHessians;
         
+        PixelSelection _selection;
+        std::vector<float> _scores;
+        std::vector<int> _indices;
+        
+        std::vector< RowChunkSums<W> > _chunks;
+        
+        std::vector<cv::Mat> _preparedImages;
+        cv::Mat _preparedStorage;
+        bool _usePrepared;
     };
     
     
@@ -0,0 +1,140 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_JACOBIAN_TABLE_H
+#define IMAGE_ALIGN_JACOBIAN_TABLE_H
+
+#include <imagealign/config.h>
+#include <vector>
+#include <algorithm>
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+namespace imagealign {
+    
+    /**
+        Per-pixel Jacobians of a warp evaluated at identity.
+        
+        Compositional algorithms evaluate the Jacobian at W(x, 0) only, which makes it a 
+        function of the template pixel position alone. This table stores the Jacobian for 
+        every inner pixel of a template level, i.e. x in [1, width - 1) and y in [1, height - 1), 
+        in row-major order.
+        
+        Tables are recomputed only when the template dimensions change, so that replacing 
+        a template of the same size does not evaluate any Jacobian.
+     */
+    template<class W>
+    class JacobianTable {
+    public:
+        typedef typename W::Traits::JacobianType JacobianType;
+        typedef typename W::Traits::PointType PointType;
+        typedef typename W::Traits::ScalarType ScalarType;
+        
+        inline JacobianTable()
+            : _width(0), _height(0), _params(0)
+        {}
+        
+        /**
+            Fill the table for a template level.
+            
+            \param w0 Identity warp scaled to the pyramid level.
+            \param width Width of template level.
+            \param height Height of template level.
+         */
+        inline void create(const W &w0, int width, int height) {
+            if (width == _width && height == _height && w0.numParameters() == _params)
+                return;
+            
+            _width = width;
+            _height = height;
+            _params = w0.numParameters();
+            
+            const int inner = std::max<int>(width - 2, 0) * std::max<int>(height - 2, 0);
+            _jacobians.resize(inner);
+            
+            int idx = 0;
+            for (int y = 1; y < height - 1; ++y) {
+                for (int x = 1; x < width - 1; ++x, ++idx) {
+                    // Note: Jacobians are computed with pixel positions corresponding
+                    // to the finest pyramid level.
+                    _jacobians[idx] = w0.jacobian(PointType(ScalarType(x), ScalarType(y)));
+                }
+            }
+        }
+        
+        /** Width of template level. */
+        inline int width() const {
+            return _width;
+        }
+        
+        /** Height of template level. */
+        inline int height() const {
+            return _height;
+        }
+        
+        /** Jacobians of row y starting at pixel (1, y). */
+        inline const JacobianType *row(int y) const {
+            return _jacobians.empty() ? 0 : &_jacobians[size_t(y - 1) * size_t(_width - 2)];
+        }
+        
+        /** Jacobian of inner pixel (x, y). */
+        inline const JacobianType &jacobian(int x, int y) const {
+            return row(y)[x - 1];
+        }
+        
+    private:
+        std::vector<JacobianType> _jacobians;
+        int _width, _height, _params;
+    };
+    
+    namespace detail {
+        
+        /**
+            Evaluates the Jacobian of a warp on the fly.
+            
+            Offers the same access as JacobianTable where a table is not worth its memory.
+         */
+        template<class W>
+        class WarpJacobians {
+        public:
+            typedef typename W::Traits::JacobianType JacobianType;
+            typedef typename W::Traits::PointType PointType;
+            typedef typename W::Traits::ScalarType ScalarType;
+            
+            inline explicit WarpJacobians(const W &w0)
+                : _w0(w0)
+            {}
+            
+            /** Jacobian of pixel (x, y). */
+            inline JacobianType jacobian(int x, int y) const {
+                return _w0.jacobian(PointType(ScalarType(x), ScalarType(y)));
+            }
+            
+        private:
+            const W &_w0;
+        };
+    }
+
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,140 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_LOSS_H
+#define IMAGE_ALIGN_LOSS_H
+
+#include <imagealign/config.h>
+#include <algorithm>
+#include <cmath>
+
+namespace imagealign {
+    
+    /**
+        Sum of squared differences.
+     
+        Loss functions are passed as template parameter to alignment algorithms. They
+        offer the following interface
+     
+            enum { IsWeighted = 0 or 1 };
+            float rho(float e) const;
+            float weight(float e) const;
+            void weights(const float *e, float *w, int n) const;
+     
+        where rho is the loss of an intensity error e and weight the corresponding weight 
+        rho'(e) / (2 * e) used in iteratively reweighted least squares. All losses are scaled 
+        such that rho(e) is close to e * e for small errors. When IsWeighted is zero all weights 
+        are one and algorithms use their unweighted code path.
+     */
+    struct LossSquared {
+        enum {
+            IsWeighted = 0
+        };
+        
+        inline float rho(float e) const {
+            return e * e;
+        }
+        
+        inline float weight(float) const {
+            return 1.f;
+        }
+        
+        inline void weights(const float *, float *w, int n) const {
+            std::fill(w, w + n, 1.f);
+        }
+    };
+    
+    /**
+        Huber loss.
+     
+        Quadratic for errors up to k, linear beyond. Reduces the influence of outliers 
+        such as occlusions while retaining convexity.
+     */
+    struct LossHuber {
+        enum {
+            IsWeighted = 1
+        };
+        
+        /** Threshold in intensity units. */
+        float k;
+        
+        inline explicit LossHuber(float threshold = 10.f)
+            : k(threshold)
+        {}
+        
+        inline float rho(float e) const {
+            const float a = std::fabs(e);
+            const float m = std::min<float>(a, k);
+            return m * (2.f * a - m);
+        }
+        
+        inline float weight(float e) const {
+            return k / std::max<float>(std::fabs(e), k);
+        }
+        
+        /** Branch-free batch weights. */
+        inline void weights(const float *e, float *w, int n) const {
+            for (int i = 0; i < n; ++i) {
+                w[i] = k / std::max<float>(std::fabs(e[i]), k);
+            }
+        }
+    };
+    
+    /**
+        Tukey's biweight loss.
+     
+        Errors beyond c are ignored entirely. Handles gross outliers such as specular
+        highlights, but requires a good initial estimate.
+     */
+    struct LossTukey {
+        enum {
+            IsWeighted = 1
+        };
+        
+        /** Threshold in intensity units. */
+        float c;
+        
+        inline explicit LossTukey(float threshold = 30.f)
+            : c(threshold)
+        {}
+        
+        inline float rho(float e) const {
+            const float u = std::min<float>(e * e / (c * c), 1.f);
+            const float v = 1.f - u;
+            return (c * c / 3.f) * (1.f - v * v * v);
+        }
+        
+        inline float weight(float e) const {
+            const float v = 1.f - std::min<float>(e * e / (c * c), 1.f);
+            return v * v;
+        }
+        
+        /** Branch-free batch weights. */
+        inline void weights(const float *e, float *w, int n) const {
+            const float ic2 = 1.f / (c * c);
+            for (int i = 0; i < n; ++i) {
+                const float v = 1.f - std::min<float>(e[i] * e[i] * ic2, 1.f);
+                w[i] = v * v;
+            }
+        }
+    };
+
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,320 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_MULTI_HYPOTHESIS_H
+#define IMAGE_ALIGN_MULTI_HYPOTHESIS_H
+
+#include <imagealign/align_context.h>
+#include <imagealign/prepared_template.h>
+#include <imagealign/image_pyramid.h>
+#include <imagealign/termination.h>
+#include <imagealign/loss.h>
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+namespace imagealign {
+    
+    /**
+        Alignment from many initial warps with pruning at coarse levels.
+        
+        Lucas-Kanade methods converge to the local minimum closest to the initial warp. When
+        the initial guess is far off, a set of hypotheses, e.g. a grid of translations and
+        rotations around the guess, is more robust. Aligning each hypothesis on all levels is
+        wasteful, since most of them end up in poor minima that are already apparent on coarse
+        levels.
+        
+        MultiHypothesisAligner aligns all hypotheses concurrently on the coarsest levels only,
+        see setCoarseLevels. Hypotheses are ranked by their error on the finest of these levels.
+        The best ones, see setMaxSurvivors, are refined on the remaining finer levels. Hypotheses
+        that converged to the same warp as a better one are pruned, see setMinSeparation.
+        
+        All hypotheses share one PreparedTemplate and one target ImagePyramid. Each hypothesis
+        uses its own AlignContext, which are kept across calls.
+        
+        \tparam W Type of warp motion to use during alignment.
+        \tparam L Loss applied to intensity errors. See LossSquared.
+     */
+    template<class W, class L = LossSquared>
+    class MultiHypothesisAligner {
+    public:
+        
+        typedef MultiHypothesisAligner<W, L> SelfType;
+        typedef typename W::Traits::ScalarType ScalarType;
+        
+        MultiHypothesisAligner()
+            : _coarseLevels(1), _maxSurvivors(3), _minSeparation(1), _best(-1)
+        {}
+        
+        /**
+            Set parameters of the loss function, e.g. thresholds of robust losses.
+         */
+        SelfType &setLoss(const L &loss) {
+            _loss = loss;
+            return *this;
+        }
+        
+        /** Access the loss function. */
+        const L &loss() const {
+            return _loss;
+        }
+        
+        /**
+            Reject hopeless hypotheses and optionally stop at a coarse level.
+            
+            Same as AlignBase::setCascade. Rejected hypotheses never survive.
+         */
+        SelfType &setCascade(const CascadeCriteria &cascade) {
+            _cascade = cascade;
+            return *this;
+        }
+        
+        /** Access the cascade criteria. */
+        const CascadeCriteria &cascade() const {
+            return _cascade;
+        }
+        
+        /**
+            Set the number of coarsest levels all hypotheses are aligned on. Defaults to 1.
+         */
+        SelfType &setCoarseLevels(int levels) {
+            _coarseLevels = std::max<int>(1, levels);
+            return *this;
+        }
+        
+        /** Number of coarsest levels all hypotheses are aligned on. */
+        int coarseLevels() const {
+            return _coarseLevels;
+        }
+        
+        /**
+            Set the maximum number of hypotheses refined on the finer levels. Defaults to 3.
+         */
+        SelfType &setMaxSurvivors(int survivors) {
+            _maxSurvivors = std::max<int>(1, survivors);
+            return *this;
+        }
+        
+        /** Maximum number of hypotheses refined on the finer levels. */
+        int maxSurvivors() const {
+            return _maxSurvivors;
+        }
+        
+        /**
+            Set the minimum distance between surviving hypotheses.
+            
+            Hypotheses whose template corners are closer than the given distance in pixels of
+            the finest level to those of a better survivor are pruned. Defaults to 1.
+         */
+        SelfType &setMinSeparation(double pixels) {
+            _minSeparation = pixels;
+            return *this;
+        }
+        
+        /** Minimum distance between surviving hypotheses. */
+        double minSeparation() const {
+            return _minSeparation;
+        }
+        
+        /**
+            Align all hypotheses and refine the best.
+            
+            Iterations per level are the same as for a single AlignContext::align with the
+            given arguments.
+            
+            \param tmpl Shared template data. Only read.
+            \param target Target image pyramid. Only read.
+            \param hypotheses Initial warps. Receive the results, which for pruned hypotheses
+                   are the results of the coarse levels.
+            \param maxIterations Maximum number of iterations in all levels per hypothesis. Split
+                   evenly among levels, at least one iteration per level.
+            \param eps Minimum length of incremental parameter vector to continue on current level.
+            \return Index of the best hypothesis or -1 when all were rejected.
+         */
+        int align(const PreparedTemplate<W> &tmpl, const ImagePyramid &target, std::vector<W> &hypotheses, int maxIterations, ScalarType eps)
+        {
+            CV_Assert(!tmpl.empty());
+            CV_Assert(target.numLevels() > 0);
+            CV_Assert(target[0].channels() == 1);
+            
+            const int n = (int)hypotheses.size();
+            
+            _errors.assign(n, std::numeric_limits<ScalarType>::max());
+            _survivorIndices.clear();
+            _best = -1;
+            
+            if (n == 0)
+                return _best;
+            
+            if ((int)_contexts.size() < n)
+                _contexts.resize(n);
+            
+            const int levels = std::min<int>(tmpl.numLevels(), target.numLevels());
+            const int split = std::max<int>(0, levels - _coarseLevels);
+            const int iterationsPerLevel = std::max<int>(1, maxIterations / levels);
+            
+            // 1. Align all hypotheses on the coarse levels. Contexts split iterations among
+            //    all levels from the coarsest one, although the cascade stops early.
+            CascadeCriteria coarse = _cascade;
+            coarse.finestLevel = std::max<int>(split, _cascade.finestLevel);
+            
+            _indices.resize(n);
+            for (int i = 0; i < n; ++i) {
+                _indices[i] = i;
+                _contexts[i].setLoss(_loss).setCascade(coarse).setCoarsestLevel(-1);
+            }
+            
+            runStage(tmpl, target, hypotheses, iterationsPerLevel * levels, eps);
+            
+            // 2. Keep the best hypotheses that are sufficiently apart
+            std::stable_sort(_indices.begin(), _indices.end(), ByError(_errors));
+            
+            const cv::Size size = tmpl.templateImage(0).size();
+            
+            for (int i = 0; i < n && (int)_survivorIndices.size() < _maxSurvivors; ++i) {
+                const int h = _indices[i];
+                if (_errors[h] == std::numeric_limits<ScalarType>::max())
+                    break;
+                
+                bool separate = true;
+                for (size_t k = 0; k < _survivorIndices.size() && separate; ++k) {
+                    separate = cornerDisplacement(hypotheses[h], hypotheses[_survivorIndices[k]], size) >= _minSeparation;
+                }
+                
+                if (separate)
+                    _survivorIndices.push_back(h);
+            }
+            
+            // 3. Refine survivors on the finer levels
+            if (split > 0 && _cascade.finestLevel < split && !_survivorIndices.empty()) {
+                _indices = _survivorIndices;
+                for (size_t i = 0; i < _indices.size(); ++i) {
+                    _contexts[_indices[i]].setCascade(_cascade).setCoarsestLevel(split - 1);
+                }
+                
+                runStage(tmpl, target, hypotheses, iterationsPerLevel * split, eps);
+                std::stable_sort(_survivorIndices.begin(), _survivorIndices.end(), ByError(_errors));
+            }
+            
+            if (!_survivorIndices.empty() && _errors[_survivorIndices[0]] < std::numeric_limits<ScalarType>::max())
+                _best = _survivorIndices[0];
+            
+            return _best;
+        }
+        
+        /** Index of the best hypothesis of the last alignment or -1. */
+        int best() const {
+            return _best;
+        }
+        
+        /** Indices of the hypotheses refined in the last alignment, best first. */
+        const std::vector<int> &survivors() const {
+            return _survivorIndices;
+        }
+        
+        /**
+            Errors of the last alignment per hypothesis.
+            
+            Errors of survivors refer to the finest level aligned, those of pruned hypotheses
+            to the finest coarse level. Rejected hypotheses report the maximum value.
+         */
+        const std::vector<ScalarType> &errors() const {
+            return _errors;
+        }
+        
+        /** Access the context of a hypothesis, e.g. for statistics of the last alignment. */
+        const AlignContext<W, L> &context(int hypothesis) const {
+            return _contexts[hypothesis];
+        }
+    
+    private:
+        
+        /** Orders hypotheses by increasing error. */
+        struct ByError {
+            explicit ByError(const std::vector<ScalarType> &errors)
+                : _errors(errors)
+            {}
+            
+            bool operator()(int a, int b) const {
+                return _errors[a] < _errors[b];
+            }
+            
+            const std::vector<ScalarType> &_errors;
+        };
+        
+        /** Align the hypotheses listed in _indices concurrently. */
+        void runStage(const PreparedTemplate<W> &tmpl, const ImagePyramid &target, std::vector<W> &hypotheses, int maxIterations, ScalarType eps)
+        {
+            StageBody body(*this, tmpl, target, hypotheses, maxIterations, eps);
+            cv::parallel_for_(cv::Range(0, (int)_indices.size()), body);
+        }
+        
+        class StageBody : public cv::ParallelLoopBody {
+        public:
+            StageBody(SelfType &mh,
+                      const PreparedTemplate<W> &tmpl,
+                      const ImagePyramid &target,
+                      std::vector<W> &hypotheses,
+                      int maxIterations,
+                      ScalarType eps)
+                : _mh(mh), _tmpl(tmpl), _target(target), _hypotheses(hypotheses), _maxIterations(maxIterations), _eps(eps)
+            {}
+            
+            void operator()(const cv::Range &r) const {
+                for (int i = r.start; i < r.end; ++i) {
+                    const int h = _mh._indices[i];
+                    AlignContext<W, L> &ctx = _mh._contexts[h];
+                    
+                    ctx.align(_tmpl, _target, _hypotheses[h], _maxIterations, _eps);
+                    _mh._errors[h] = ctx.rejected() ? std::numeric_limits<ScalarType>::max() : ctx.lastError();
+                }
+            }
+        
+        private:
+            SelfType &_mh;
+            const PreparedTemplate<W> &_tmpl;
+            const ImagePyramid &_target;
+            std::vector<W> &_hypotheses;
+            int _maxIterations;
+            ScalarType _eps;
+        };
+        
+        int _coarseLevels;
+        int _maxSurvivors;
+        double _minSeparation;
+        int _best;
+        L _loss;
+        CascadeCriteria _cascade;
+        
+        std::vector< AlignContext<W, L> > _contexts;
+        std::vector<int> _indices;
+        std::vector<int> _survivorIndices;
+        std::vector<ScalarType> _errors;
+    };
+    
+}
+
+#endif
\ No newline at end of file
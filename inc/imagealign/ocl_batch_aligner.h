@@ -0,0 +1,618 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_OCL_BATCH_ALIGNER_H
+#define IMAGE_ALIGN_OCL_BATCH_ALIGNER_H
+
+#include <imagealign/batch_aligner.h>
+
+#include <limits>
+#include <vector>
+
+namespace imagealign {
+    
+    namespace detail {
+        
+        /**
+            Host side of batched inverse compositional alignment on OpenCL devices.
+            
+            Prepares templates using BatchAligner and packs the data read by the kernel of 
+            OclBatchAligner:
+                - layout: one row of 6 ints per track level holding template offset, template
+                  stride, width, height, SDI offset and SDI stride. Offsets and strides count
+                  floats of the arena.
+                - invHessians: one row per track level holding the row-major inverse Hessian.
+                - levelIndices: one int per launched track referring to a row of layout.
+                - matrices: one row per launched track holding the row-major 3x3 warp matrix.
+                - results: one row per launched track receiving the parameter delta, the sum of
+                  squared errors and the number of constraints.
+            
+            All buffers are allocated by prepare. Alignment runs the levels of all tracks in 
+            lockstep, see align, and does not depend on a device.
+            
+            \tparam W Type of warp motion to use during alignment.
+         */
+        template<class W>
+        class OclBatchHost {
+        public:
+            
+            typedef typename W::Traits::ScalarType ScalarType;
+            typedef typename W::Traits::ParamType ParamType;
+            
+            OclBatchHost()
+                : _numParameters(0)
+            {}
+            
+            /**
+                Prepare templates and pack the level layout and inverse Hessians.
+                
+                See BatchAligner::prepare.
+             */
+            void prepare(const std::vector<cv::Mat> &templates, const W &w, int pyramidLevels)
+            {
+                _batch.prepare(templates, w, pyramidLevels);
+                
+                const int nParams = w.numParameters();
+                const int n = _batch.numTracks();
+                const int numLevels = (int)_batch._levels.size();
+                CV_Assert(_batch._arenaCapacity < size_t(std::numeric_limits<int>::max()));
+                
+                _numParameters = nParams;
+                
+                // 1. Level layout and inverse Hessians
+                _layout.create(std::max<int>(numLevels, 1), 6);
+                _invHessians.create(std::max<int>(numLevels, 1), nParams * nParams);
+                _layout.setTo(cv::Scalar::all(0));
+                _invHessians.setTo(cv::Scalar::all(0));
+                
+                for (int i = 0; i < numLevels; ++i) {
+                    const typename BatchAligner<W>::TrackLevel &l = _batch._levels[i];
+                    _layout(i, 0) = (int)l.tplOffset;
+                    _layout(i, 1) = l.tplStride;
+                    _layout(i, 2) = l.width;
+                    _layout(i, 3) = l.height;
+                    _layout(i, 4) = (int)l.sdiOffset;
+                    _layout(i, 5) = SDIPlanes::alignedRowStride(l.width - 2);
+                    
+                    for (int r = 0; r < nParams; ++r) {
+                        for (int c = 0; c < nParams; ++c) {
+                            _invHessians(i, r * nParams + c) = float(W::Traits::at(_batch._invHessians[i], r, c));
+                        }
+                    }
+                }
+                
+                // 2. Per launch buffers, sized for all tracks
+                _levelIndices.create(1, std::max<int>(n, 1));
+                _matrices.create(std::max<int>(n, 1), 9);
+                _results.create(std::max<int>(n, 1), nParams + 2);
+                
+                _active.reserve(n);
+                _tracks.reserve(n);
+            }
+            
+            /**
+                Align all tracks in lockstep.
+                
+                Levels are processed from coarse to fine. Every iteration of a level packs level
+                indices and warp matrices of all tracks still iterating on that level and invokes
+                launch(level, count), which fills the first count rows of results. Termination,
+                the cascade and warp updates follow detail::AlignLoop, so results match 
+                BatchAligner::align up to the precision of launch.
+                
+                \param warps One warp per track. Holds the initial estimates and receives results.
+                \param targetLevels Number of levels of the target pyramid.
+                \param maxIterations Maximum number of iterations in all levels per track.
+                \param eps Minimum length of incremental parameter vector to continue on current level.
+                \param status Optional. See BatchAligner::align.
+                \param errors Optional. See BatchAligner::align.
+                \param launch Computes steps of packed tracks.
+             */
+            template<class Launch>
+            void align(std::vector<W> &warps,
+                       int targetLevels,
+                       int maxIterations,
+                       ScalarType eps,
+                       std::vector<uchar> *status,
+                       std::vector<ScalarType> *errors,
+                       Launch &launch)
+            {
+                CV_Assert(warps.size() == _batch._tracks.size());
+                
+                const int n = numTracks();
+                const CascadeCriteria &cascade = _batch.cascade();
+                
+                if (status) status->resize(n);
+                if (errors) errors->resize(n);
+                
+                // 1. One alignment loop per track. Same strategy as BatchAligner::alignTrack
+                _tracks.clear();
+                int maxLevels = 0;
+                
+                for (int t = 0; t < n; ++t) {
+                    const int levels = std::min<int>(_batch._tracks[t].numLevels, targetLevels);
+                    const int finest = std::max<int>(0, std::min<int>(cascade.finestLevel, levels - 1));
+                    
+                    _tracks.push_back(TrackState(warps[t], levels, finest, EpsilonTermination<W>(maxIterations, eps)));
+                    maxLevels = std::max<int>(maxLevels, levels);
+                }
+                
+                for (int lev = maxLevels - 1; lev >= 0; --lev) {
+                    
+                    // 2. Enter level
+                    for (int t = 0; t < n; ++t) {
+                        TrackState &s = _tracks[t];
+                        s.atLevel = s.levels > 0 && s.loop.level() == lev + 1 && s.loop.nextLevel();
+                    }
+                    
+                    // 3. One launch per iteration for all tracks iterating on this level
+                    for (;;) {
+                        _active.clear();
+                        for (int t = 0; t < n; ++t) {
+                            if (_tracks[t].atLevel && _tracks[t].loop.iterating())
+                                _active.push_back(t);
+                        }
+                        
+                        if (_active.empty())
+                            break;
+                        
+                        const int m = (int)_active.size();
+                        pack(lev);
+                        launch(lev, m);
+                        
+                        for (int a = 0; a < m; ++a) {
+                            const int t = _active[a];
+                            const typename BatchAligner<W>::TrackLevel &l = _batch._levels[_batch._tracks[t].firstLevel + lev];
+                            _tracks[t].loop.update(unpack(a), InverseCompositionalUpdate<W>(), cv::Size(l.width, l.height));
+                        }
+                    }
+                    
+                    // 4. Leave level
+                    for (int t = 0; t < n; ++t) {
+                        if (_tracks[t].atLevel)
+                            _tracks[t].loop.endLevel(cascade);
+                    }
+                }
+                
+                for (int t = 0; t < n; ++t) {
+                    TrackState &s = _tracks[t];
+                    
+                    ScalarType e = std::numeric_limits<ScalarType>::max();
+                    if (s.levels > 0) {
+                        warps[t] = s.loop.warp();
+                        if (!s.loop.rejected())
+                            e = s.loop.error();
+                    }
+                    
+                    if (status) (*status)[t] = e < std::numeric_limits<ScalarType>::max() ? 1 : 0;
+                    if (errors) (*errors)[t] = e;
+                }
+            }
+            
+            /** Access the host aligner holding the prepared templates. */
+            BatchAligner<W> &batch() {
+                return _batch;
+            }
+            
+            /** Access the host aligner holding the prepared templates. */
+            const BatchAligner<W> &batch() const {
+                return _batch;
+            }
+            
+            /** Arena holding template pyramids and steepest descent images of all tracks. */
+            const float *arena() const {
+                return _batch._arena;
+            }
+            
+            /** Number of floats in arena. */
+            size_t arenaSize() const {
+                return _batch._arenaCapacity;
+            }
+            
+            /** Number of prepared tracks. */
+            int numTracks() const {
+                return _batch.numTracks();
+            }
+            
+            /** Number of warp parameters. */
+            int numParameters() const {
+                return _numParameters;
+            }
+            
+            /** Level layout, see class description. */
+            const cv::Mat_<int> &layout() const {
+                return _layout;
+            }
+            
+            /** Inverse Hessians, see class description. */
+            const cv::Mat_<float> &invHessians() const {
+                return _invHessians;
+            }
+            
+            /** Level indices of the current launch, see class description. */
+            const cv::Mat_<int> &levelIndices() const {
+                return _levelIndices;
+            }
+            
+            /** Warp matrices of the current launch, see class description. */
+            const cv::Mat_<float> &matrices() const {
+                return _matrices;
+            }
+            
+            /** Results of the current launch, see class description. */
+            cv::Mat_<float> &results() {
+                return _results;
+            }
+            
+        private:
+            
+            typedef AlignLoop<W, EpsilonTermination<W> > LoopType;
+            
+            /** Alignment state of a track. */
+            struct TrackState {
+                TrackState(const W &w, int levels_, int finest, const EpsilonTermination<W> &strategy)
+                    : loop(w, std::max<int>(levels_ - 1, 0), finest, strategy), levels(levels_), atLevel(false)
+                {}
+                
+                LoopType loop;
+                int levels;
+                bool atLevel;
+            };
+            
+            /** Pack level indices and warp matrices of active tracks. */
+            void pack(int lev) {
+                for (int a = 0; a < (int)_active.size(); ++a) {
+                    const int t = _active[a];
+                    _levelIndices(0, a) = _batch._tracks[t].firstLevel + lev;
+                    
+                    const cv::Matx<ScalarType, 3, 3> h = _tracks[t].loop.warp().matrix();
+                    for (int i = 0; i < 9; ++i)
+                        _matrices(a, i) = float(h.val[i]);
+                }
+            }
+            
+            /** Read the step of the a-th active track from results. */
+            SingleStepResult<W> unpack(int a) const {
+                const float *r = _results.ptr<float>(a);
+                
+                SingleStepResult<W> s;
+                s.delta = W::Traits::zeroParam(_numParameters);
+                for (int k = 0; k < _numParameters; ++k)
+                    W::Traits::at(s.delta, k, 0) = ScalarType(r[k]);
+                
+                s.sumErrors = ScalarType(r[_numParameters]);
+                s.numConstraints = (int)r[_numParameters + 1];
+                return s;
+            }
+            
+            BatchAligner<W> _batch;
+            int _numParameters;
+            
+            cv::Mat_<int> _layout;
+            cv::Mat_<float> _invHessians;
+            cv::Mat_<int> _levelIndices;
+            cv::Mat_<float> _matrices;
+            cv::Mat_<float> _results;
+            
+            std::vector<int> _active;
+            std::vector<TrackState> _tracks;
+        };
+    }
+}
+
+#if defined(IA_USE_OPENCL)
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/ocl.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+namespace imagealign {
+    
+    namespace detail {
+        
+        /**
+            OpenCL program performing one inverse compositional step for many tracks.
+            
+            Each work-group handles a single track. Work-items warp template pixels, sample the
+            target bilinearly and accumulate SDI^T * error, the sum of squared errors and the
+            number of constraints. The group reduces its partial sums in local memory and
+            solves for the parameter delta using the precomputed inverse Hessian.
+            
+            Compiled with NPARAMS, PERSPECTIVE and WGS (work-group size, a power of two) defined.
+         */
+        inline const char *oclInverseCompositionalSource() {
+            return
+            "#define NSUMS (NPARAMS + 2)\n"
+            "__kernel void ia_ic_batch_step(__global const uchar *tgtPtr, int tgtStep, int tgtOffset, int tgtRows, int tgtCols,\n"
+            "                               __global const float *arena,\n"
+            "                               __global const int *levels,\n"
+            "                               __global const float *invHessians,\n"
+            "                               __global const int *active,\n"
+            "                               __global const float *warps,\n"
+            "                               __global float *results)\n"
+            "{\n"
+            "    __local float partial[NSUMS * WGS];\n"
+            "    const int g = get_group_id(0);\n"
+            "    const int lid = get_local_id(0);\n"
+            "    const int l = active[g];\n"
+            "    __global const int *desc = levels + l * 6;\n"
+            "    const int tplOffset = desc[0], tplStride = desc[1], width = desc[2], height = desc[3];\n"
+            "    const int sdiOffset = desc[4], sdiStride = desc[5];\n"
+            "    __global const float *m = warps + g * 9;\n"
+            "    const int iw = width - 2, ih = height - 2;\n"
+            "    const int plane = ih * sdiStride;\n"
+            "    float acc[NSUMS];\n"
+            "    for (int k = 0; k < NSUMS; ++k) acc[k] = 0.f;\n"
+            "    for (int i = lid; i < iw * ih; i += WGS) {\n"
+            "        const int sy = i / iw, sx = i - sy * iw;\n"
+            "        const float x = (float)(sx + 1), y = (float)(sy + 1);\n"
+            "        float px = m[0] * x + m[1] * y + m[2];\n"
+            "        float py = m[3] * x + m[4] * y + m[5];\n"
+            "#if PERSPECTIVE\n"
+            "        const float pz = m[6] * x + m[7] * y + m[8];\n"
+            "        px /= pz; py /= pz;\n"
+            "#endif\n"
+            "        if (!(px >= 1.5f && py >= 1.5f && px < tgtCols - 0.5f && py < tgtRows - 0.5f)) continue;\n"
+            "        const int ix = (int)floor(px), iy = (int)floor(py);\n"
+            "        const int ix1 = ix + 1 < tgtCols ? ix + 1 : tgtCols - 2;\n"
+            "        const int iy1 = iy + 1 < tgtRows ? iy + 1 : tgtRows - 2;\n"
+            "        const float a = px - (float)ix, b = py - (float)iy;\n"
+            "        __global const float *r0 = (__global const float *)(tgtPtr + tgtOffset + iy * tgtStep);\n"
+            "        __global const float *r1 = (__global const float *)(tgtPtr + tgtOffset + iy1 * tgtStep);\n"
+            "        const float v = (r0[ix] * (1.f - a) + r0[ix1] * a) * (1.f - b) + (r1[ix] * (1.f - a) + r1[ix1] * a) * b;\n"
+            "        const float err = v - arena[tplOffset + (sy + 1) * tplStride + sx + 1];\n"
+            "        __global const float *s = arena + sdiOffset + sy * sdiStride + sx;\n"
+            "        for (int k = 0; k < NPARAMS; ++k) acc[k] += s[k * plane] * err;\n"
+            "        acc[NPARAMS] += err * err;\n"
+            "        acc[NPARAMS + 1] += 1.f;\n"
+            "    }\n"
+            "    for (int k = 0; k < NSUMS; ++k) partial[k * WGS + lid] = acc[k];\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    for (int n = WGS / 2; n > 0; n >>= 1) {\n"
+            "        if (lid < n)\n"
+            "            for (int k = 0; k < NSUMS; ++k) partial[k * WGS + lid] += partial[k * WGS + lid + n];\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    }\n"
+            "    if (lid == 0) {\n"
+            "        __global const float *h = invHessians + l * NPARAMS * NPARAMS;\n"
+            "        __global float *out = results + g * NSUMS;\n"
+            "        for (int r = 0; r < NPARAMS; ++r) {\n"
+            "            float d = 0.f;\n"
+            "            for (int c = 0; c < NPARAMS; ++c) d += h[r * NPARAMS + c] * partial[c * WGS];\n"
+            "            out[r] = d;\n"
+            "        }\n"
+            "        out[NPARAMS] = partial[NPARAMS * WGS];\n"
+            "        out[NPARAMS + 1] = partial[(NPARAMS + 1) * WGS];\n"
+            "    }\n"
+            "}\n";
+        }
+    }
+    
+    /**
+        Batched inverse compositional alignment on OpenCL devices.
+        
+        Same strategy and results, up to single precision rounding, as BatchAligner. Templates
+        are prepared on the host by BatchAligner and uploaded once: template pyramids, steepest
+        descent images and inverse Hessians of all tracks stay resident on the device. The
+        target pyramid is uploaded once per frame using setTarget.
+        
+        Every iteration of a pyramid level is a single kernel launch covering all tracks still
+        iterating on that level. Per launch only the current warp matrices are uploaded and
+        the parameter deltas, sum of squared errors and number of constraints per track are
+        read back. Termination, the cascade and warp updates run on the host.
+        
+        Available when compiled with IA_USE_OPENCL, see IMAGEALIGN_USE_OPENCL, against
+        OpenCV 3.x. Limited to planar warps and the squared loss.
+        
+        \tparam W Type of warp motion to use during alignment.
+     */
+    template<class W>
+    class OclBatchAligner {
+    public:
+        
+        typedef typename W::Traits::ScalarType ScalarType;
+        typedef typename W::Traits::ParamType ParamType;
+        typedef typename W::Traits::HessianType HessianType;
+        
+        OclBatchAligner()
+            : _numParameters(0)
+        {}
+        
+        /**
+            Test whether an OpenCL device is available and enabled.
+         */
+        static bool available() {
+            return cv::ocl::haveOpenCL() && cv::ocl::useOpenCL();
+        }
+        
+        /**
+            Prepare templates for alignment and upload them to the device.
+            
+            See BatchAligner::prepare.
+         */
+        void prepare(const std::vector<cv::Mat> &templates, const W &w, int pyramidLevels)
+        {
+            CV_Assert(available());
+            
+            _host.prepare(templates, w, pyramidLevels);
+            
+            const int nParams = w.numParameters();
+            const int n = std::max<int>(_host.numTracks(), 1);
+            
+            // 1. Compile kernel for the number of parameters
+            if (nParams != _numParameters || _kernel.empty()) {
+                const cv::String opts = cv::format("-D NPARAMS=%d -D PERSPECTIVE=%d -D WGS=%d",
+                                                   nParams,
+                                                   int(W::Traits::WarpMode) == WARP_PERSPECTIVE ? 1 : 0,
+                                                   int(WorkGroupSize));
+                cv::String msg;
+                _kernel.create("ia_ic_batch_step", cv::ocl::ProgramSource(detail::oclInverseCompositionalSource()), opts, &msg);
+                if (_kernel.empty())
+                    CV_Error(cv::Error::OpenCLApiCallError, msg);
+                _numParameters = nParams;
+            }
+            
+            // 2. Upload arena, level layout and inverse Hessians
+            cv::Mat(1, (int)_host.arenaSize(), CV_32FC1, const_cast<float*>(_host.arena())).copyTo(_arena);
+            _host.layout().copyTo(_layout);
+            _host.invHessians().copyTo(_invHessians);
+            
+            // 3. Per launch buffers, sized for all tracks
+            _levelIndicesDevice.create(1, n, CV_32SC1);
+            _matricesDevice.create(n, 9, CV_32FC1);
+            _resultsDevice.create(n, nParams + 2, CV_32FC1);
+        }
+        
+        /**
+            Upload the target pyramid to the device.
+            
+            The target stays resident until the next call, so subsequent calls to align
+            with different initial warps do not transfer images.
+         */
+        void setTarget(const ImagePyramid &target)
+        {
+            CV_Assert(target.numLevels() > 0);
+            CV_Assert(target[0].channels() == 1);
+            
+            _target.resize(target.numLevels());
+            
+            for (int i = 0; i < target.numLevels(); ++i) {
+                target[i].convertTo(_level, CV_32F);
+                _level.copyTo(_target[i]);
+            }
+        }
+        
+        /**
+            Align all tracks with the current target.
+            
+            See BatchAligner::align.
+         */
+        void align(std::vector<W> &warps,
+                   int maxIterations,
+                   ScalarType eps,
+                   std::vector<uchar> *status = 0,
+                   std::vector<ScalarType> *errors = 0)
+        {
+            CV_Assert(!_target.empty());
+            
+            Launch launch(*this);
+            _host.align(warps, (int)_target.size(), maxIterations, eps, status, errors, launch);
+        }
+        
+        /**
+            Reject hopeless tracks at coarse levels and optionally stop at a coarse level.
+            
+            See BatchAligner::setCascade.
+         */
+        void setCascade(const CascadeCriteria &cascade) {
+            _host.batch().setCascade(cascade);
+        }
+        
+        /** Access the cascade criteria. */
+        const CascadeCriteria &cascade() const {
+            return _host.batch().cascade();
+        }
+        
+        /**
+            Number of tracks prepared.
+         */
+        int numTracks() const {
+            return _host.numTracks();
+        }
+        
+        /**
+            Number of pyramid levels prepared for a track.
+         */
+        int numLevels(int track) const {
+            return _host.batch().numLevels(track);
+        }
+    
+    private:
+        
+        enum {
+            /** Number of work-items cooperating on a single track. Power of two. */
+            WorkGroupSize = 128
+        };
+        
+        /** Launches steps on the device, see detail::OclBatchHost::align. */
+        class Launch {
+        public:
+            explicit Launch(OclBatchAligner &a)
+                : _a(a)
+            {}
+            
+            void operator()(int lev, int m) const {
+                _a.step(lev, m);
+            }
+            
+        private:
+            OclBatchAligner &_a;
+        };
+        
+        /**
+            Launch a single step for the first m packed tracks on the given level.
+            
+            Uploads level indices and warp matrices of packed tracks and downloads the results.
+            Device buffers were allocated by prepare.
+         */
+        void step(int lev, int m)
+        {
+            cv::UMat levelIndices = _levelIndicesDevice.colRange(0, m);
+            cv::UMat matrices = _matricesDevice.rowRange(0, m);
+            _host.levelIndices().colRange(0, m).copyTo(levelIndices);
+            _host.matrices().rowRange(0, m).copyTo(matrices);
+            
+            _kernel.args(cv::ocl::KernelArg::ReadOnly(_target[lev]),
+                         cv::ocl::KernelArg::PtrReadOnly(_arena),
+                         cv::ocl::KernelArg::PtrReadOnly(_layout),
+                         cv::ocl::KernelArg::PtrReadOnly(_invHessians),
+                         cv::ocl::KernelArg::PtrReadOnly(_levelIndicesDevice),
+                         cv::ocl::KernelArg::PtrReadOnly(_matricesDevice),
+                         cv::ocl::KernelArg::PtrWriteOnly(_resultsDevice));
+            
+            size_t global[1] = { size_t(m) * size_t(WorkGroupSize) };
+            size_t local[1] = { size_t(WorkGroupSize) };
+            
+            if (!_kernel.run(1, global, local, true))
+                CV_Error(cv::Error::OpenCLApiCallError, "Failed to run inverse compositional kernel");
+            
+            cv::Mat results = _host.results().rowRange(0, m);
+            _resultsDevice.rowRange(0, m).copyTo(results);
+        }
+        
+        detail::OclBatchHost<W> _host;
+        int _numParameters;
+        cv::ocl::Kernel _kernel;
+        
+        // Resident on device
+        cv::UMat _arena, _layout, _invHessians;
+        std::vector<cv::UMat> _target;
+        cv::Mat _level;
+        
+        // Per launch, allocated by prepare
+        cv::UMat _levelIndicesDevice, _matricesDevice, _resultsDevice;
+    };
+    
+}
+
+#endif
+
+#endif
\ No newline at end of file
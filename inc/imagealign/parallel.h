@@ -0,0 +1,132 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_PARALLEL_H
+#define IMAGE_ALIGN_PARALLEL_H
+
+#include <imagealign/config.h>
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+#include <algorithm>
+
+/**
+    Minimum number of pixels of an image before work on it is split among threads.
+    Smaller images are processed by the calling thread. Define before including any
+    Image Alignment header to override.
+ */
+#ifndef IA_PARALLEL_MIN_PIXELS
+#define IA_PARALLEL_MIN_PIXELS (256 * 256)
+#endif
+
+/**
+    Approximate number of pixels per unit of parallel work.
+ */
+#ifndef IA_PARALLEL_CHUNK_PIXELS
+#define IA_PARALLEL_CHUNK_PIXELS (64 * 256)
+#endif
+
+namespace imagealign {
+    
+    /**
+        Partition of image rows into chunks.
+        
+        The partition depends on the image dimensions only, never on the number of threads.
+        Algorithms compute partial results per chunk and reduce them in chunk order, which
+        makes results reproducible bit by bit regardless of the number of threads used.
+     */
+    struct RowChunks {
+        int begin;
+        int end;
+        int rowsPerChunk;
+        int count;
+        
+        /**
+            Partition rows [begin, end) of an image with the given number of columns.
+         */
+        inline RowChunks(int rowBegin, int rowEnd, int cols)
+            : begin(rowBegin), end(std::max<int>(rowBegin, rowEnd))
+        {
+            const int rows = end - begin;
+            cols = std::max<int>(cols, 1);
+            
+            if (int64(rows) * int64(cols) < int64(IA_PARALLEL_MIN_PIXELS)) {
+                rowsPerChunk = std::max<int>(rows, 1);
+            } else {
+                rowsPerChunk = std::max<int>(1, IA_PARALLEL_CHUNK_PIXELS / cols);
+            }
+            
+            count = std::max<int>(1, (rows + rowsPerChunk - 1) / rowsPerChunk);
+        }
+        
+        /** First row of chunk c. */
+        inline int chunkBegin(int c) const {
+            return begin + c * rowsPerChunk;
+        }
+        
+        /** One past last row of chunk c. */
+        inline int chunkEnd(int c) const {
+            return std::min<int>(end, begin + (c + 1) * rowsPerChunk);
+        }
+    };
+    
+    namespace detail {
+        
+        template<class Kernel>
+        class RowChunksBody : public cv::ParallelLoopBody {
+        public:
+            RowChunksBody(const RowChunks &chunks, const Kernel &kernel)
+                : _chunks(chunks), _kernel(kernel)
+            {}
+            
+            void operator()(const cv::Range &r) const {
+                for (int c = r.start; c < r.end; ++c) {
+                    _kernel(c, _chunks.chunkBegin(c), _chunks.chunkEnd(c));
+                }
+            }
+        
+        private:
+            const RowChunks &_chunks;
+            const Kernel &_kernel;
+        };
+    }
+    
+    /**
+        Invoke kernel(chunk, rowBegin, rowEnd) for every chunk.
+        
+        Chunks are distributed among threads using cv::parallel_for_. A single chunk is
+        processed by the calling thread.
+     */
+    template<class Kernel>
+    inline void parallelForRows(const RowChunks &chunks, const Kernel &kernel)
+    {
+        if (chunks.count == 1) {
+            kernel(0, chunks.begin, chunks.end);
+        } else {
+            cv::parallel_for_(cv::Range(0, chunks.count), detail::RowChunksBody<Kernel>(chunks, kernel));
+        }
+    }
+
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,290 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_PIXEL_SELECTION_H
+#define IMAGE_ALIGN_PIXEL_SELECTION_H
+
+#include <imagealign/config.h>
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+#include <vector>
+#include <algorithm>
+
+namespace imagealign {
+    
+    /** Rank pixels by squared magnitude of the template gradient. */
+    const int PIXEL_SCORE_GRADIENT = 0;
+    /** Rank pixels by squared norm of their steepest descent image. */
+    const int PIXEL_SCORE_SDI = 1;
+    
+    /**
+        Selection of template pixels used during alignment.
+        
+        Flat template regions contribute little to the least squares system. Restricting
+        alignment to the pixels with the highest scores reduces the work per iteration
+        almost proportionally, usually with little impact on accuracy for textured templates.
+        
+        The selection is applied to every pyramid level individually.
+     */
+    struct PixelSelection {
+        /** Number of pixels to keep per level. Takes precedence over fraction when positive. */
+        int count;
+        
+        /** Fraction of pixels in (0, 1] to keep per level. */
+        float fraction;
+        
+        /** Score used to rank pixels. One of PIXEL_SCORE_GRADIENT, PIXEL_SCORE_SDI. */
+        int score;
+        
+        inline PixelSelection()
+            : count(0), fraction(1.f), score(PIXEL_SCORE_GRADIENT)
+        {}
+        
+        /** Use all pixels. */
+        inline static PixelSelection all() {
+            return PixelSelection();
+        }
+        
+        /** Test if all pixels are kept. */
+        inline bool selectsAll() const {
+            return count <= 0 && fraction >= 1.f;
+        }
+        
+        /** Keep the k best pixels per level. */
+        inline static PixelSelection topCount(int k, int score = PIXEL_SCORE_GRADIENT) {
+            PixelSelection s;
+            s.count = std::max<int>(k, 1);
+            s.score = score;
+            return s;
+        }
+        
+        /** Keep the given fraction of best pixels per level. */
+        inline static PixelSelection topFraction(float f, int score = PIXEL_SCORE_GRADIENT) {
+            PixelSelection s;
+            s.fraction = std::min<float>(std::max<float>(f, 0.f), 1.f);
+            s.score = score;
+            return s;
+        }
+        
+        /**
+            Number of pixels to keep.
+            
+            \param available Number of pixels on level.
+            \param minimum Lower bound, typically the number of warp parameters.
+         */
+        inline int numPixels(int available, int minimum) const {
+            int n = available;
+            if (count > 0) {
+                n = count;
+            } else if (fraction < 1.f) {
+                n = (int)(fraction * float(available) + 0.5f);
+            }
+            return std::min<int>(available, std::max<int>(n, minimum));
+        }
+    };
+    
+    /**
+        Run of consecutive template pixels within a row.
+     */
+    struct PixelSpan {
+        int y;
+        int xBegin;
+        int xEnd;
+    };
+    
+    /**
+        Template pixels of one pyramid level that take part in alignment.
+        
+        Pixels are stored as spans of consecutive pixels, sorted by row. Border pixels are
+        never part of a span, since gradients are not defined there. Unmasked templates use 
+        a single span per row covering all inner pixels. Masked templates skip background 
+        pixels entirely, so that alignment loops iterating spans do no work on them.
+     */
+    class TemplatePixels {
+    public:
+        
+        inline TemplatePixels()
+            : _numPixels(0), _masked(false)
+        {}
+        
+        /**
+            Use all inner pixels.
+            
+            \param size Size of template.
+         */
+        inline void create(cv::Size size) {
+            _spans.clear();
+            _rowOffsets.assign(std::max<int>(size.height, 0) + 1, 0);
+            _numPixels = 0;
+            _masked = false;
+            
+            for (int y = 1; y < size.height - 1; ++y) {
+                _rowOffsets[y] = (int)_spans.size();
+                if (size.width > 2) {
+                    PixelSpan s = {y, 1, size.width - 1};
+                    _spans.push_back(s);
+                    _numPixels += size.width - 2;
+                }
+            }
+            finishRows(size.height);
+        }
+        
+        /**
+            Use inner pixels of non-zero mask.
+            
+            \param mask Single channel 8 bit mask of template size.
+         */
+        inline void create(const cv::Mat &mask) {
+            CV_Assert(mask.type() == CV_8UC1);
+            
+            _spans.clear();
+            _rowOffsets.assign(mask.rows + 1, 0);
+            _numPixels = 0;
+            _masked = true;
+            
+            for (int y = 1; y < mask.rows - 1; ++y) {
+                _rowOffsets[y] = (int)_spans.size();
+                
+                const uchar *m = mask.ptr<uchar>(y);
+                int x = 1;
+                while (x < mask.cols - 1) {
+                    while (x < mask.cols - 1 && !m[x]) ++x;
+                    const int begin = x;
+                    while (x < mask.cols - 1 && m[x]) ++x;
+                    
+                    if (x > begin) {
+                        PixelSpan s = {y, begin, x};
+                        _spans.push_back(s);
+                        _numPixels += x - begin;
+                    }
+                }
+            }
+            finishRows(mask.rows);
+        }
+        
+        /** Total number of pixels. */
+        inline int numPixels() const {
+            return _numPixels;
+        }
+        
+        /** Test if pixels stem from a mask. */
+        inline bool masked() const {
+            return _masked;
+        }
+        
+        /** Index of the first span of row y. */
+        inline int rowBegin(int y) const {
+            return _rowOffsets[y];
+        }
+        
+        /** One past the index of the last span of row y. */
+        inline int rowEnd(int y) const {
+            return _rowOffsets[y + 1];
+        }
+        
+        /** Access the i-th span. */
+        inline const PixelSpan &span(int i) const {
+            return _spans[i];
+        }
+        
+        /** Test if the pixel at x, y is part of a span. */
+        inline bool contains(int x, int y) const {
+            if (y < 0 || y + 1 >= (int)_rowOffsets.size())
+                return false;
+            
+            for (int i = rowBegin(y); i < rowEnd(y); ++i) {
+                if (x >= _spans[i].xBegin && x < _spans[i].xEnd)
+                    return true;
+            }
+            return false;
+        }
+    
+    private:
+        
+        /** Close row offsets after the last row containing spans. */
+        inline void finishRows(int rows) {
+            const int n = (int)_spans.size();
+            for (int y = std::max<int>(rows - 1, 0); y <= rows; ++y) {
+                _rowOffsets[y] = n;
+            }
+            
+            // Row 0 has no spans
+            if (rows > 0)
+                _rowOffsets[0] = 0;
+        }
+        
+        std::vector<PixelSpan> _spans;
+        std::vector<int> _rowOffsets;
+        int _numPixels;
+        bool _masked;
+    };
+    
+    namespace detail {
+        
+        /** Orders pixel indices by descending score, ties by ascending index. */
+        class ScoreGreater {
+        public:
+            inline explicit ScoreGreater(const std::vector<float> &scores)
+                : _scores(scores)
+            {}
+            
+            inline bool operator()(int a, int b) const {
+                return _scores[a] > _scores[b] || (_scores[a] == _scores[b] && a < b);
+            }
+            
+        private:
+            const std::vector<float> &_scores;
+        };
+        
+        /**
+            Select indices of the k highest scores.
+            
+            The selection is deterministic. Selected indices are returned in ascending order,
+            which preserves the memory order of pixels.
+            
+            \param scores One score per pixel.
+            \param k Number of indices to select.
+            \param indices Receives selected indices.
+         */
+        inline void selectTopScores(const std::vector<float> &scores, int k, std::vector<int> &indices)
+        {
+            const int n = (int)scores.size();
+            k = std::max<int>(0, std::min<int>(k, n));
+            
+            indices.resize(n);
+            for (int i = 0; i < n; ++i)
+                indices[i] = i;
+            
+            if (k < n) {
+                std::nth_element(indices.begin(), indices.begin() + k, indices.end(), ScoreGreater(scores));
+            }
+            
+            indices.resize(k);
+            std::sort(indices.begin(), indices.end());
+        }
+    }
+
+}
+
+#endif
\ No newline at end of file
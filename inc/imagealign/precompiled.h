@@ -0,0 +1,72 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef IMAGE_ALIGN_PRECOMPILED_H
+#define IMAGE_ALIGN_PRECOMPILED_H
+
+#include <imagealign/warp.h>
+#include <imagealign/forward_additive.h>
+#include <imagealign/forward_compositional.h>
+#include <imagealign/inverse_compositional.h>
+#include <imagealign/efficient_second_order.h>
+
+/**
+    Invoke X(Aligner, Warp) for all warps precompiled for one aligner.
+ */
+#define IA_PRECOMPILED_WARPS(X, A) \
+    X(A, WarpTranslationF) \
+    X(A, WarpTranslationD) \
+    X(A, WarpEuclideanF) \
+    X(A, WarpEuclideanD) \
+    X(A, WarpSimilarityF) \
+    X(A, WarpSimilarityD) \
+    X(A, WarpAffineF) \
+    X(A, WarpAffineD) \
+    X(A, WarpPerspectiveF) \
+    X(A, WarpPerspectiveD)
+
+/**
+    Invoke X(Aligner, Warp) for all aligners and warps provided by ialign.
+ 
+    Only the default squared loss is precompiled. All other combinations are instantiated
+    by the including translation unit as usual.
+ */
+#define IA_PRECOMPILED_ALIGNERS(X) \
+    IA_PRECOMPILED_WARPS(X, AlignForwardAdditive) \
+    IA_PRECOMPILED_WARPS(X, AlignForwardCompositional) \
+    IA_PRECOMPILED_WARPS(X, AlignInverseCompositional) \
+    IA_PRECOMPILED_WARPS(X, AlignESM)
+
+#define IA_EXTERN_ALIGNER(A, W) \
+    extern template class A<W>; \
+    extern template class AlignBase< A<W>, W, LossSquared >;
+
+// Instantiations provided by ialign are compiled with its definitions. Macros changing
+// aligner code, such as IA_NO_STATS, are set for ialign and its consumers alike through
+// the CMake options, see align_stats.h.
+#if defined(IA_PRECOMPILED)
+namespace imagealign {
+    
+    // Suppress implicit instantiation in including translation units, ialign provides them.
+    IA_PRECOMPILED_ALIGNERS(IA_EXTERN_ALIGNER)
+}
+#endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,434 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef IMAGE_ALIGN_PREPARED_TEMPLATE_H
+#define IMAGE_ALIGN_PREPARED_TEMPLATE_H
+
+#include <imagealign/inverse_compositional.h>
+#include <imagealign/image_pyramid.h>
+#include <imagealign/sdi.h>
+#include <opencv2/core/core.hpp>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace imagealign {
+    
+    /**
+        Template data of inverse compositional alignment, prepared once and shared.
+        
+        Holds the template pyramid, steepest descent images and inverse Hessians of all
+        levels, i.e everything AlignInverseCompositional::prepareImpl computes. Once created
+        the data is never modified. Copies share the same memory, so a single prepared 
+        template can be used by many aligners and threads at once, see 
+        AlignInverseCompositional::prepare.
+        
+        All data lives in a single blob that doubles as binary file format. Saved templates
+        are either loaded into memory or wrapped without copying, e.g. from a memory mapped 
+        file. The format uses native byte order and is specific to the warp type and scalar 
+        precision. Layout:
+            - Header, see FileHeader.
+            - One FileLevel per pyramid level.
+            - Inverse Hessians of all levels as row-major doubles.
+            - Float data starting at a multiple of SDIPlanes::Alignment. Per level the template
+              image followed by its steepest descent images, rows padded to SDIPlanes::rowStride.
+        
+        Pixel selection is not supported, all inner template pixels are used.
+        
+        \tparam W Type of warp motion to use during alignment.
+     */
+    template<class W>
+    class PreparedTemplate {
+    public:
+        
+        typedef typename W::Traits::ScalarType ScalarType;
+        typedef typename W::Traits::HessianType HessianType;
+        
+        enum {
+            /** Version of the binary format. */
+            FormatVersion = 1
+        };
+        
+        inline PreparedTemplate()
+            : _blob(0), _blobBytes(0), _dataOffset(0)
+        {}
+        
+        /**
+            Prepare template data.
+            
+            Allocates new memory, copies of this object keep referring to the previous data.
+            
+            \param tmpl Single channel template image of at least 3x3 pixels.
+            \param w Warp used to determine the number of parameters.
+            \param pyramidLevels Maximum number of pyramid levels to generate.
+         */
+        inline void create(cv::InputArray tmpl, const W &w, int pyramidLevels)
+        {
+            CV_Assert(tmpl.channels() == 1);
+            CV_Assert(tmpl.size().width >= 3 && tmpl.size().height >= 3);
+            
+            const int nParams = w.numParameters();
+            const int levels = std::max<int>(1, std::min<int>(pyramidLevels, ImagePyramid::maxLevelsForImageSize(tmpl.size())));
+            
+            ImagePyramid pyr;
+            pyr.create(tmpl, levels);
+            
+            // 1. Layout of blob
+            std::vector<FileLevel> fl(levels);
+            int64 floats = 0;
+            for (int i = 0; i < levels; ++i) {
+                FileLevel &l = fl[i];
+                l.width = pyr[i].cols;
+                l.height = pyr[i].rows;
+                l.tplStride = SDIPlanes::alignedRowStride(l.width);
+                l.reserved = 0;
+                l.tplOffset = floats;
+                floats += int64(l.tplStride) * int64(l.height);
+                l.sdiOffset = floats;
+                floats += int64(SDIPlanes::requiredSize(nParams, l.width - 2, l.height - 2));
+            }
+            
+            FileHeader h;
+            std::memcpy(h.magic, "IAPT", 4);
+            h.version = FormatVersion;
+            h.warpMode = W::Traits::WarpMode;
+            h.scalarBytes = (int)sizeof(ScalarType);
+            h.numParameters = nParams;
+            h.numLevels = levels;
+            h.dataOffset = (int64)cv::alignSize(sizeof(FileHeader) + levels * (sizeof(FileLevel) + sizeof(double) * nParams * nParams), SDIPlanes::Alignment);
+            h.totalBytes = h.dataOffset + floats * int64(sizeof(float));
+            
+            // 2. Allocate fresh memory, shared data is immutable
+            _data = cv::Mat();
+            detail::createBytes(_data, size_t(h.totalBytes) + SDIPlanes::Alignment);
+            _data.setTo(cv::Scalar::all(0));
+            uchar *blob = cv::alignPtr(_data.ptr(), SDIPlanes::Alignment);
+            
+            std::memcpy(blob, &h, sizeof(FileHeader));
+            std::memcpy(blob + sizeof(FileHeader), &fl[0], levels * sizeof(FileLevel));
+            double *invHessians = reinterpret_cast<double*>(blob + sizeof(FileHeader) + levels * sizeof(FileLevel));
+            float *data = reinterpret_cast<float*>(blob + h.dataOffset);
+            
+            // 3. Fill template images, steepest descent images and inverse Hessians
+            _warp = w;
+            _warp.setIdentity();
+            
+            W w0(_warp);
+            
+            for (int i = 0; i < levels; ++i) {
+                const FileLevel &l = fl[i];
+                
+                cv::Mat tpl(l.height, l.width, CV_32FC1, data + l.tplOffset, size_t(l.tplStride) * sizeof(float));
+                pyr[i].copyTo(tpl);
+                
+                SDIPlanes sdi;
+                sdi.wrap(data + l.sdiOffset, nParams, l.width - 2, l.height - 2);
+                
+                HessianType hessian = W::Traits::zeroHessian(nParams);
+                detail::inverseCompositionalSDI(w0, tpl, sdi, hessian);
+                
+                HessianType invHessian = hessian.inv();
+                for (int r = 0; r < nParams; ++r) {
+                    for (int c = 0; c < nParams; ++c) {
+                        invHessians[(i * nParams + r) * nParams + c] = double(W::Traits::at(invHessian, r, c));
+                    }
+                }
+                
+                w0 = w0.scaled(-1);
+            }
+            
+            parse(blob, size_t(h.totalBytes));
+        }
+        
+        /**
+            Use serialized template data without copying.
+            
+            No memory is owned afterwards. The caller guarantees that data is aligned to 
+            SDIPlanes::Alignment bytes, e.g. by memory mapping the file, and outlives this 
+            object and all its copies.
+            
+            \param data Serialized template data, see write.
+            \param bytes Number of bytes available at data.
+            \return false when data is malformed or was written for a different warp.
+         */
+        inline bool wrap(const void *data, size_t bytes)
+        {
+            _data = cv::Mat();
+            
+            if (!isAligned(data) || !parse(static_cast<const uchar*>(data), bytes)) {
+                clear();
+                return false;
+            }
+            
+            return true;
+        }
+        
+        /**
+            Read serialized template data into memory owned by this object.
+            
+            \param data Serialized template data, see write.
+            \param bytes Number of bytes available at data.
+            \return false when data is malformed or was written for a different warp.
+         */
+        inline bool read(const void *data, size_t bytes)
+        {
+            _data = cv::Mat();
+            detail::createBytes(_data, size_t(bytes) + SDIPlanes::Alignment);
+            uchar *blob = cv::alignPtr(_data.ptr(), SDIPlanes::Alignment);
+            std::memcpy(blob, data, bytes);
+            
+            if (!parse(blob, bytes)) {
+                clear();
+                return false;
+            }
+            
+            return true;
+        }
+        
+        /**
+            Load template data from a file written by save.
+            
+            \return false when the file cannot be read, is malformed or was written for a 
+                    different warp.
+         */
+        inline bool load(const std::string &path)
+        {
+            std::ifstream f(path.c_str(), std::ios::binary);
+            if (!f)
+                return false;
+            
+            f.seekg(0, std::ios::end);
+            const std::streamoff bytes = f.tellg();
+            f.seekg(0, std::ios::beg);
+            
+            if (bytes < std::streamoff(sizeof(FileHeader)))
+                return false;
+            
+            _data = cv::Mat();
+            detail::createBytes(_data, size_t(bytes) + SDIPlanes::Alignment);
+            uchar *blob = cv::alignPtr(_data.ptr(), SDIPlanes::Alignment);
+            
+            if (!f.read(reinterpret_cast<char*>(blob), bytes) || !parse(blob, size_t(bytes))) {
+                clear();
+                return false;
+            }
+            
+            return true;
+        }
+        
+        /**
+            Serialize template data.
+            
+            \param buf Receives sizeInBytes() bytes.
+         */
+        inline void write(std::vector<uchar> &buf) const
+        {
+            buf.assign(_blob, _blob + _blobBytes);
+        }
+        
+        /**
+            Save template data to a file.
+            
+            \return false when the file cannot be written.
+         */
+        inline bool save(const std::string &path) const
+        {
+            std::ofstream f(path.c_str(), std::ios::binary);
+            if (!f)
+                return false;
+            
+            f.write(reinterpret_cast<const char*>(_blob), std::streamsize(_blobBytes));
+            return bool(f);
+        }
+        
+        /** Release data. */
+        inline void clear()
+        {
+            _data = cv::Mat();
+            _blob = 0;
+            _blobBytes = 0;
+            _levels.clear();
+            _invHessians.clear();
+        }
+        
+        /** Test if no template data is available. */
+        inline bool empty() const {
+            return _blob == 0;
+        }
+        
+        /** Size of the serialized template data in bytes. */
+        inline size_t sizeInBytes() const {
+            return _blobBytes;
+        }
+        
+        /** Number of pyramid levels prepared. */
+        inline int numLevels() const {
+            return (int)_levels.size();
+        }
+        
+        /** Number of warp parameters. */
+        inline int numParameters() const {
+            return _warp.numParameters();
+        }
+        
+        /** Memory holding the data. Empty for wrapped data. Copies keep the data alive. */
+        inline const cv::Mat &storage() const {
+            return _data;
+        }
+        
+        /** Identity warp of the prepared type. */
+        inline const W &warp() const {
+            return _warp;
+        }
+        
+        /** Floating point template image of the given level. Refers to shared memory. */
+        inline cv::Mat templateImage(int level) const {
+            const FileLevel &l = _levels[level];
+            return cv::Mat(l.height, l.width, CV_32FC1, const_cast<float*>(data()) + l.tplOffset, size_t(l.tplStride) * sizeof(float));
+        }
+        
+        /** Steepest descent images of the given level. Refers to shared memory. */
+        inline SDIPlanes sdi(int level) const {
+            const FileLevel &l = _levels[level];
+            SDIPlanes planes;
+            planes.wrap(const_cast<float*>(data()) + l.sdiOffset, numParameters(), l.width - 2, l.height - 2);
+            return planes;
+        }
+        
+        /** Inverse Hessian of the given level. */
+        inline const HessianType &invHessian(int level) const {
+            return _invHessians[level];
+        }
+        
+    private:
+        
+        enum {
+            /** Upper bound on the number of levels accepted when parsing. */
+            MaxLevels = 32
+        };
+        
+        /** Leading block of serialized template data. */
+        struct FileHeader {
+            char magic[4];
+            int version;
+            int warpMode;
+            int scalarBytes;
+            int numParameters;
+            int numLevels;
+            int64 dataOffset;
+            int64 totalBytes;
+        };
+        
+        /** Layout of one pyramid level. Offsets count floats from the start of the float data. */
+        struct FileLevel {
+            int width;
+            int height;
+            int tplStride;
+            int reserved;
+            int64 tplOffset;
+            int64 sdiOffset;
+        };
+        
+        inline static bool isAligned(const void *p) {
+            return reinterpret_cast<size_t>(p) % SDIPlanes::Alignment == 0;
+        }
+        
+        inline const float *data() const {
+            return reinterpret_cast<const float*>(_blob + _dataOffset);
+        }
+        
+        /**
+            Validate serialized data and extract level table and inverse Hessians.
+         */
+        inline bool parse(const uchar *blob, size_t bytes)
+        {
+            if (bytes < sizeof(FileHeader))
+                return false;
+            
+            FileHeader h;
+            std::memcpy(&h, blob, sizeof(FileHeader));
+            
+            const int nParams = _warp.numParameters();
+            
+            if (std::memcmp(h.magic, "IAPT", 4) != 0 ||
+                h.version != FormatVersion ||
+                h.warpMode != W::Traits::WarpMode ||
+                h.scalarBytes != (int)sizeof(ScalarType) ||
+                h.numParameters != nParams ||
+                h.numLevels < 1 || h.numLevels > MaxLevels ||
+                h.totalBytes < 0 || size_t(h.totalBytes) > bytes ||
+                h.dataOffset % SDIPlanes::Alignment != 0 ||
+                h.dataOffset < int64(sizeof(FileHeader) + h.numLevels * (sizeof(FileLevel) + sizeof(double) * nParams * nParams)) ||
+                h.dataOffset > h.totalBytes)
+            {
+                return false;
+            }
+            
+            const int64 floats = (h.totalBytes - h.dataOffset) / int64(sizeof(float));
+            
+            std::vector<FileLevel> levels(h.numLevels);
+            std::memcpy(&levels[0], blob + sizeof(FileHeader), h.numLevels * sizeof(FileLevel));
+            
+            for (int i = 0; i < h.numLevels; ++i) {
+                const FileLevel &l = levels[i];
+                if (l.width < 3 || l.height < 3 || l.tplStride != SDIPlanes::alignedRowStride(l.width) ||
+                    l.tplOffset < 0 || l.tplOffset + int64(l.tplStride) * l.height > floats ||
+                    l.sdiOffset < 0 || l.sdiOffset + int64(SDIPlanes::requiredSize(nParams, l.width - 2, l.height - 2)) > floats)
+                {
+                    return false;
+                }
+            }
+            
+            const uchar *hessians = blob + sizeof(FileHeader) + h.numLevels * sizeof(FileLevel);
+            
+            _invHessians.resize(h.numLevels);
+            for (int i = 0; i < h.numLevels; ++i) {
+                HessianType invHessian = W::Traits::zeroHessian(nParams);
+                for (int r = 0; r < nParams; ++r) {
+                    for (int c = 0; c < nParams; ++c) {
+                        double v;
+                        std::memcpy(&v, hessians + sizeof(double) * ((i * nParams + r) * nParams + c), sizeof(double));
+                        W::Traits::at(invHessian, r, c) = ScalarType(v);
+                    }
+                }
+                _invHessians[i] = invHessian;
+            }
+            
+            _levels.swap(levels);
+            _blob = blob;
+            _blobBytes = size_t(h.totalBytes);
+            _dataOffset = size_t(h.dataOffset);
+            
+            return true;
+        }
+        
+        cv::Mat _data;
+        const uchar *_blob;
+        size_t _blobBytes;
+        size_t _dataOffset;
+        std::vector<FileLevel> _levels;
+        std::vector<HessianType> _invHessians;
+        W _warp;
+    };
+
+}
+
+#endif
\ No newline at end of file
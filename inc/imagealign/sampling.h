@@ -20,12 +20,265 @@
 #ifndef IMAGE_ALIGN_SAMPLING_H
 #define IMAGE_ALIGN_SAMPLING_H
 
+#include <imagealign/config.h>
+#include <imagealign/simd_dispatch.h>
 #include <opencv2/core/core.hpp>
 #include <opencv2/core/core_c.h>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#if defined(IA_USE_AVX2)
+    #include <immintrin.h>
+#elif defined(IA_USE_SSE2)
+    #include <emmintrin.h>
+#elif defined(IA_USE_NEON)
+    #include <arm_neon.h>
+#endif
+
 namespace imagealign {
     
+    namespace detail {
+        
+        /**
+            Bilinear interpolation kernel for coordinates strictly inside the image.
+         
+            Requires 0 <= x < cols - 1 and 0 <= y < rows - 1 for all coordinates, so 
+            that truncation equals floor and all four neighbors are valid pixels.
+         */
+        template<class ChannelType, class Scalar>
+        inline void bilinearInterior(const cv::Mat &img, const Scalar *xs, const Scalar *ys, int n, ChannelType *dst)
+        {
+            for (int i = 0; i < n; ++i) {
+                const int ix = static_cast<int>(xs[i]);
+                const int iy = static_cast<int>(ys[i]);
+                
+                const Scalar a = xs[i] - (Scalar)ix;
+                const Scalar b = ys[i] - (Scalar)iy;
+                
+                const ChannelType *ptrY0 = img.ptr<ChannelType>(iy) + ix;
+                const ChannelType *ptrY1 = img.ptr<ChannelType>(iy + 1) + ix;
+                
+                dst[i] = cv::saturate_cast<ChannelType>((ptrY0[0] * (Scalar(1) - a) + ptrY0[1] * a) * (Scalar(1) - b) +
+                                                        (ptrY1[0] * (Scalar(1) - a) + ptrY1[1] * a) * b);
+            }
+        }
+        
+        /**
+            Bilinear interpolation kernel for single precision images and coordinates.
+         
+            Same requirements as the generic kernel. The vectorized part is performed by the
+            SIMD kernels, see simd_dispatch.h.
+         */
+        inline void bilinearInterior(const cv::Mat &img, const float *xs, const float *ys, int n, float *dst)
+        {
+            int i = 0;
+            
+            if (img.step % sizeof(float) == 0) {
+                i = bilinearInteriorSIMD(img.ptr<float>(0), static_cast<int>(img.step / sizeof(float)), xs, ys, n, dst);
+            }
+            
+            // Remaining coordinates
+            bilinearInterior<float, float>(img, xs + i, ys + i, n - i, dst + i);
+        }
+        
+        enum {
+            /** Fractional bits of fixed point interpolation weights per axis. */
+            FixedPointBits = 8,
+            FixedPointOne = 1 << FixedPointBits
+        };
+        
+        /**
+            Fixed point bilinear interpolation of the four neighbors with weights in [0, FixedPointOne].
+         
+            Weights per axis take 8 bits, so that the products of the two weights sum to 2^16 and 
+            interpolating 16 bit pixels fits an unsigned 32 bit accumulator. Conversion to 
+            floating point happens once per sample.
+         */
+        template<class ChannelType>
+        inline float interpolateFixedPoint(ChannelType f0, ChannelType f1, ChannelType f2, ChannelType f3, unsigned int wx, unsigned int wy)
+        {
+            const unsigned int top = unsigned(f0) * (FixedPointOne - wx) + unsigned(f1) * wx;
+            const unsigned int bottom = unsigned(f2) * (FixedPointOne - wx) + unsigned(f3) * wx;
+            return float(top * (FixedPointOne - wy) + bottom * wy) * (1.f / float(FixedPointOne * FixedPointOne));
+        }
+        
+        /** Round fractional image coordinate in [0, 1] to a fixed point weight. */
+        template<class Scalar>
+        inline unsigned int fixedPointWeight(Scalar a)
+        {
+            return unsigned(a * Scalar(FixedPointOne) + Scalar(0.5));
+        }
+        
+        /**
+            Fixed point bilinear interpolation kernel of 8 or 16 bit images for coordinates strictly 
+            inside the image. Same requirements as bilinearInterior.
+         */
+        template<class ChannelType, class Scalar>
+        inline void bilinearInteriorFixedPoint(const cv::Mat &img, const Scalar *xs, const Scalar *ys, int n, float *dst)
+        {
+            for (int i = 0; i < n; ++i) {
+                const int ix = static_cast<int>(xs[i]);
+                const int iy = static_cast<int>(ys[i]);
+                
+                const ChannelType *ptrY0 = img.ptr<ChannelType>(iy) + ix;
+                const ChannelType *ptrY1 = img.ptr<ChannelType>(iy + 1) + ix;
+                
+                dst[i] = interpolateFixedPoint(ptrY0[0], ptrY0[1], ptrY1[0], ptrY1[1],
+                                               fixedPointWeight(xs[i] - (Scalar)ix),
+                                               fixedPointWeight(ys[i] - (Scalar)iy));
+            }
+        }
+        
+        /**
+            Fixed point bilinear interpolation of 8 or 16 bit images at a single coordinate with 
+            reflected borders.
+         */
+        template<class ChannelType, class Scalar>
+        inline float bilinearFixedPoint(const cv::Mat &img, Scalar x, Scalar y)
+        {
+            const int ix = static_cast<int>(std::floor(x));
+            const int iy = static_cast<int>(std::floor(y));
+            
+            const int x0 = cv::borderInterpolate(ix, img.cols, cv::BORDER_REFLECT_101);
+            const int x1 = cv::borderInterpolate(ix + 1, img.cols, cv::BORDER_REFLECT_101);
+            const int y0 = cv::borderInterpolate(iy, img.rows, cv::BORDER_REFLECT_101);
+            const int y1 = cv::borderInterpolate(iy + 1, img.rows, cv::BORDER_REFLECT_101);
+            
+            const ChannelType *ptrY0 = img.ptr<ChannelType>(y0);
+            const ChannelType *ptrY1 = img.ptr<ChannelType>(y1);
+            
+            return interpolateFixedPoint(ptrY0[x0], ptrY0[x1], ptrY1[x0], ptrY1[x1],
+                                         fixedPointWeight(x - (Scalar)ix),
+                                         fixedPointWeight(y - (Scalar)iy));
+        }
+        
+        /**
+            Locate the four neighbors and interpolation weights for bilinear sampling 
+            of interleaved multi-channel images.
+         
+            Borders are reflected when the four neighbors are not all inside the image.
+            Returned columns are offsets into the rows, i.e. already multiplied by the
+            number of channels.
+         */
+        template<class ChannelType, int Channels, class Scalar>
+        inline void interleavedNeighbors(const cv::Mat &img, Scalar x, Scalar y,
+                                         const ChannelType *&ptrY0, const ChannelType *&ptrY1,
+                                         int &x0, int &x1, Scalar &a, Scalar &b)
+        {
+            const int ix = static_cast<int>(std::floor(x));
+            const int iy = static_cast<int>(std::floor(y));
+            
+            int y0 = iy, y1 = iy + 1;
+            x0 = ix;
+            x1 = ix + 1;
+            
+            if (ix < 0 || iy < 0 || x1 >= img.cols || y1 >= img.rows) {
+                x0 = cv::borderInterpolate(x0, img.cols, cv::BORDER_REFLECT_101);
+                x1 = cv::borderInterpolate(x1, img.cols, cv::BORDER_REFLECT_101);
+                y0 = cv::borderInterpolate(y0, img.rows, cv::BORDER_REFLECT_101);
+                y1 = cv::borderInterpolate(y1, img.rows, cv::BORDER_REFLECT_101);
+            }
+            
+            a = x - (Scalar)ix;
+            b = y - (Scalar)iy;
+            
+            x0 *= Channels;
+            x1 *= Channels;
+            ptrY0 = img.ptr<ChannelType>(y0);
+            ptrY1 = img.ptr<ChannelType>(y1);
+        }
+        
+        /**
+            Bilinear interpolation of interleaved multi-channel images.
+         */
+        template<class ChannelType, int Channels, class Scalar>
+        struct BilinearInterleaved {
+            
+            static inline void run(const cv::Mat &img, const Scalar *xs, const Scalar *ys, int n, ChannelType *dst)
+            {
+                for (int i = 0; i < n; ++i, dst += Channels) {
+                    const ChannelType *ptrY0, *ptrY1;
+                    int x0, x1;
+                    Scalar a, b;
+                    interleavedNeighbors<ChannelType, Channels>(img, xs[i], ys[i], ptrY0, ptrY1, x0, x1, a, b);
+                    
+                    for (int c = 0; c < Channels; ++c) {
+                        dst[c] = cv::saturate_cast<ChannelType>((ptrY0[x0 + c] * (Scalar(1) - a) + ptrY0[x1 + c] * a) * (Scalar(1) - b) +
+                                                                (ptrY1[x0 + c] * (Scalar(1) - a) + ptrY1[x1 + c] * a) * b);
+                    }
+                }
+            }
+        };
+        
+        /**
+            Bilinear interpolation of interleaved 8 bit images in fixed point.
+         
+            Avoids conversions to floating point, e.g. when rendering aligned color images. 
+            Results are rounded and differ by at most one from floating point interpolation.
+         */
+        template<int Channels, class Scalar>
+        struct BilinearInterleaved<uchar, Channels, Scalar> {
+            
+            static inline void run(const cv::Mat &img, const Scalar *xs, const Scalar *ys, int n, uchar *dst)
+            {
+                for (int i = 0; i < n; ++i, dst += Channels) {
+                    const uchar *ptrY0, *ptrY1;
+                    int x0, x1;
+                    Scalar a, b;
+                    interleavedNeighbors<uchar, Channels>(img, xs[i], ys[i], ptrY0, ptrY1, x0, x1, a, b);
+                    
+                    const unsigned int wx = fixedPointWeight(a);
+                    const unsigned int wy = fixedPointWeight(b);
+                    
+                    for (int c = 0; c < Channels; ++c) {
+                        const unsigned int top = unsigned(ptrY0[x0 + c]) * (FixedPointOne - wx) + unsigned(ptrY0[x1 + c]) * wx;
+                        const unsigned int bottom = unsigned(ptrY1[x0 + c]) * (FixedPointOne - wx) + unsigned(ptrY1[x1 + c]) * wx;
+                        dst[c] = uchar((top * (FixedPointOne - wy) + bottom * wy + (1u << (2 * FixedPointBits - 1))) >> (2 * FixedPointBits));
+                    }
+                }
+            }
+        };
+        
+#if defined(IA_USE_SSE2) || defined(IA_USE_NEON)
+        /**
+            Bilinear interpolation of four channel single precision images.
+         
+            Each pixel occupies exactly one SIMD register, so all channels are 
+            interpolated at once.
+         */
+        template<>
+        struct BilinearInterleaved<float, 4, float> {
+            
+            static inline void run(const cv::Mat &img, const float *xs, const float *ys, int n, float *dst)
+            {
+                for (int i = 0; i < n; ++i, dst += 4) {
+                    const float *ptrY0, *ptrY1;
+                    int x0, x1;
+                    float a, b;
+                    interleavedNeighbors<float, 4>(img, xs[i], ys[i], ptrY0, ptrY1, x0, x1, a, b);
+                    
+    #if defined(IA_USE_SSE2)
+                    const __m128 va = _mm_set1_ps(a);
+                    const __m128 vb = _mm_set1_ps(b);
+                    const __m128 ia = _mm_set1_ps(1.f - a);
+                    const __m128 ib = _mm_set1_ps(1.f - b);
+                    const __m128 top = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(ptrY0 + x0), ia), _mm_mul_ps(_mm_loadu_ps(ptrY0 + x1), va));
+                    const __m128 bottom = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(ptrY1 + x0), ia), _mm_mul_ps(_mm_loadu_ps(ptrY1 + x1), va));
+                    _mm_storeu_ps(dst, _mm_add_ps(_mm_mul_ps(top, ib), _mm_mul_ps(bottom, vb)));
+    #else
+                    const float32x4_t va = vdupq_n_f32(a);
+                    const float32x4_t vb = vdupq_n_f32(b);
+                    const float32x4_t ia = vdupq_n_f32(1.f - a);
+                    const float32x4_t ib = vdupq_n_f32(1.f - b);
+                    const float32x4_t top = vaddq_f32(vmulq_f32(vld1q_f32(ptrY0 + x0), ia), vmulq_f32(vld1q_f32(ptrY0 + x1), va));
+                    const float32x4_t bottom = vaddq_f32(vmulq_f32(vld1q_f32(ptrY1 + x0), ia), vmulq_f32(vld1q_f32(ptrY1 + x1), va));
+                    vst1q_f32(dst, vaddq_f32(vmulq_f32(top, ib), vmulq_f32(bottom, vb)));
+    #endif
+                }
+            }
+        };
+#endif
+    }
+    
     /**
         Generic interface for sampling methods
      
@@ -50,6 +303,18 @@ namespace imagealign {
          */
         template<class ChannelType>
         inline ChannelType sample(const cv::Mat &img, const cv::Point2f &p) const;
+        
+        /**
+            Be able to sample image at a batch of locations.
+         
+            \param img Image to sample. Assumed to be single channel.
+            \param x Array of x coordinates.
+            \param y Array of y coordinates.
+            \param n Number of coordinates.
+            \param dst Array receiving n sampled values.
+         */
+        template<class ChannelType>
+        inline void sample(const cv::Mat &img, const float *x, const float *y, int n, ChannelType *dst) const;
     };
     
     
@@ -107,6 +372,115 @@ namespace imagealign {
         {
             return sample<ChannelType>(img, p(0), p(1));
         }
+        
+        /**
+            Bilinear sampling at a batch of image coordinates.
+         
+            Runs of coordinates that lie in the image interior are passed to the
+            unchecked kernel. Remaining coordinates are sampled individually with border
+            handling.
+         */
+        template<class ChannelType, class Scalar>
+        inline void sample(const cv::Mat &img, const Scalar *x, const Scalar *y, int n, ChannelType *dst) const
+        {
+            const Scalar maxX = Scalar(img.cols - 1);
+            const Scalar maxY = Scalar(img.rows - 1);
+            
+            int i = 0;
+            while (i < n) {
+                int j = i;
+                while (j < n && x[j] >= Scalar(0) && x[j] < maxX && y[j] >= Scalar(0) && y[j] < maxY)
+                    ++j;
+                
+                if (j > i) {
+                    sampleUnchecked<ChannelType>(img, x + i, y + i, j - i, dst + i);
+                    i = j;
+                } else {
+                    dst[i] = sample<ChannelType>(img, x[i], y[i]);
+                    ++i;
+                }
+            }
+        }
+        
+        /**
+            Bilinear sampling of 8 bit, 16 bit or single precision images at a batch of image 
+            coordinates, returning single precision values.
+         
+            Integer images are interpolated in fixed point and converted to floating point 
+            per sample. Hence, the image data stays in its compact representation, see 
+            ImagePyramid::create. Single precision images are sampled as by sample<float>.
+         */
+        template<class Scalar>
+        inline void sampleToFloat(const cv::Mat &img, const Scalar *x, const Scalar *y, int n, float *dst) const
+        {
+            switch (img.depth()) {
+                case CV_8U:
+                    sampleFixedPoint<uchar>(img, x, y, n, dst);
+                    break;
+                case CV_16U:
+                    sampleFixedPoint<ushort>(img, x, y, n, dst);
+                    break;
+                default:
+                    sample<float>(img, x, y, n, dst);
+                    break;
+            }
+        }
+        
+        /**
+            Bilinear sampling at a batch of interior image coordinates.
+         
+            Skips border handling entirely. The caller has to ensure 0 <= x < cols - 1 and 
+            0 <= y < rows - 1 for all coordinates. Single precision images sampled at single 
+            precision coordinates use SIMD instructions where available.
+         */
+        template<class ChannelType, class Scalar>
+        inline void sampleUnchecked(const cv::Mat &img, const Scalar *x, const Scalar *y, int n, ChannelType *dst) const
+        {
+            detail::bilinearInterior(img, x, y, n, dst);
+        }
+        
+        /**
+            Bilinear sampling of interleaved multi-channel images at a batch of image coordinates.
+         
+            Writes Channels values per coordinate to dst. Four channel single precision images
+            sampled at single precision coordinates interpolate all channels at once using SIMD 
+            instructions where available.
+         
+            \tparam Channels Number of interleaved channels of img.
+         */
+        template<class ChannelType, int Channels, class Scalar>
+        inline void sampleInterleaved(const cv::Mat &img, const Scalar *x, const Scalar *y, int n, ChannelType *dst) const
+        {
+            CV_Assert(img.channels() == Channels);
+            detail::BilinearInterleaved<ChannelType, Channels, Scalar>::run(img, x, y, n, dst);
+        }
+        
+    private:
+        
+        /**
+            Fixed point sampling of 8 or 16 bit images. Same run detection as sample.
+         */
+        template<class ChannelType, class Scalar>
+        inline void sampleFixedPoint(const cv::Mat &img, const Scalar *x, const Scalar *y, int n, float *dst) const
+        {
+            const Scalar maxX = Scalar(img.cols - 1);
+            const Scalar maxY = Scalar(img.rows - 1);
+            
+            int i = 0;
+            while (i < n) {
+                int j = i;
+                while (j < n && x[j] >= Scalar(0) && x[j] < maxX && y[j] >= Scalar(0) && y[j] < maxY)
+                    ++j;
+                
+                if (j > i) {
+                    detail::bilinearInteriorFixedPoint<ChannelType>(img, x + i, y + i, j - i, dst + i);
+                    i = j;
+                } else {
+                    dst[i] = detail::bilinearFixedPoint<ChannelType>(img, x[i], y[i]);
+                    ++i;
+                }
+            }
+        }
     };
     
     /**
@@ -142,6 +516,62 @@ namespace imagealign {
         {
             return sample<ChannelType>(img, p(0), p(1));
         }
+        
+        /**
+            Nearest sampling at a batch of image coordinates.
+         */
+        template<class ChannelType, class Scalar>
+        inline void sample(const cv::Mat &img, const Scalar *x, const Scalar *y, int n, ChannelType *dst) const
+        {
+            for (int i = 0; i < n; ++i) {
+                dst[i] = sample<ChannelType>(img, x[i], y[i]);
+            }
+        }
+        
+        /**
+            Nearest sampling of interleaved multi-channel images at a batch of image coordinates.
+         
+            Writes Channels values per coordinate to dst.
+         
+            \tparam Channels Number of interleaved channels of img.
+         */
+        template<class ChannelType, int Channels, class Scalar>
+        inline void sampleInterleaved(const cv::Mat &img, const Scalar *x, const Scalar *y, int n, ChannelType *dst) const
+        {
+            CV_Assert(img.channels() == Channels);
+            
+            for (int i = 0; i < n; ++i, dst += Channels) {
+                const int x0 = cv::borderInterpolate(static_cast<int>(std::floor(x[i])), img.cols, cv::BORDER_REFLECT_101);
+                const int y0 = cv::borderInterpolate(static_cast<int>(std::floor(y[i])), img.rows, cv::BORDER_REFLECT_101);
+                
+                const ChannelType *p = img.ptr<ChannelType>(y0) + x0 * Channels;
+                for (int c = 0; c < Channels; ++c) {
+                    dst[c] = p[c];
+                }
+            }
+        }
+        
+        /**
+            Nearest sampling of 8 bit, 16 bit or single precision images at a batch of image
+            coordinates, returning single precision values.
+         */
+        template<class Scalar>
+        inline void sampleToFloat(const cv::Mat &img, const Scalar *x, const Scalar *y, int n, float *dst) const
+        {
+            switch (img.depth()) {
+                case CV_8U:
+                    for (int i = 0; i < n; ++i)
+                        dst[i] = float(sample<uchar>(img, x[i], y[i]));
+                    break;
+                case CV_16U:
+                    for (int i = 0; i < n; ++i)
+                        dst[i] = float(sample<ushort>(img, x[i], y[i]));
+                    break;
+                default:
+                    sample<float>(img, x, y, n, dst);
+                    break;
+            }
+        }
     };
 }
 
@@ -0,0 +1,205 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_SDI_H
+#define IMAGE_ALIGN_SDI_H
+
+#include <imagealign/config.h>
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+#include <imagealign/simd_dispatch.h>
+#include <algorithm>
+
+namespace imagealign {
+    
+    namespace detail {
+        
+        /**
+            Allocate a continuous 8 bit buffer of at least the given number of bytes.
+         
+            Buffers are shaped into rows of 4 kB, so that sizes beyond the int range of
+            single row matrices are supported.
+         */
+        inline void createBytes(cv::Mat &m, size_t bytes) {
+            const size_t rowBytes = 4096;
+            m.create(int((bytes + rowBytes - 1) / rowBytes), int(rowBytes), CV_8UC1);
+        }
+    }
+    
+    /**
+        Steepest descent images in structure-of-arrays layout.
+        
+        Stores one single precision plane per warp parameter. Each plane holds one value
+        per pixel in row-major order. Rows start at cache line boundaries, so that entire
+        rows can be combined with vector instructions, e.g. when accumulating SDI^T * error
+        or the Hessian.
+     */
+    class SDIPlanes {
+    public:
+        
+        inline SDIPlanes()
+            : _base(0), _params(0), _width(0), _height(0), _stride(0)
+        {}
+        
+        /**
+            Copy planes.
+         
+            Owned planes are copied deeply, so that copies never write to each other's planes.
+            Wrapped memory is referenced, see wrap.
+         */
+        inline SDIPlanes(const SDIPlanes &other)
+            : _base(0), _params(0), _width(0), _height(0), _stride(0)
+        {
+            *this = other;
+        }
+        
+        inline SDIPlanes &operator=(const SDIPlanes &other) {
+            if (this == &other)
+                return *this;
+            
+            if (other._data.empty()) {
+                wrap(other._base, other._params, other._width, other._height);
+            } else {
+                create(other._params, other._width, other._height);
+                std::copy(other._base, other._base + requiredSize(_params, _width, _height), _base);
+            }
+            
+            return *this;
+        }
+        
+        /**
+            Allocate planes.
+            
+            Existing memory is reused when the dimensions do not change.
+            
+            \param params Number of planes, i.e the number of warp parameters.
+            \param width Number of values per row.
+            \param height Number of rows.
+         */
+        inline void create(int params, int width, int height) {
+            
+            params = std::max<int>(params, 0);
+            width = std::max<int>(width, 0);
+            height = std::max<int>(height, 0);
+            
+            if (_base && !_data.empty() && params == _params && width == _width && height == _height)
+                return;
+            
+            _params = params;
+            _width = width;
+            _height = height;
+            _stride = alignedRowStride(width);
+            
+            const size_t bytes = requiredSize(params, width, height) * sizeof(float);
+            detail::createBytes(_data, bytes + CacheLineBytes);
+            _data.setTo(cv::Scalar::all(0));
+            _base = cv::alignPtr(reinterpret_cast<float*>(_data.ptr()), CacheLineBytes);
+        }
+        
+        /**
+            Use external memory for planes.
+         
+            No memory is owned afterwards. The caller guarantees that data is aligned to
+            Alignment bytes, holds at least requiredSize(params, width, height) floats and
+            outlives this object.
+         */
+        inline void wrap(float *data, int params, int width, int height) {
+            _data.release();
+            _base = data;
+            _params = std::max<int>(params, 0);
+            _width = std::max<int>(width, 0);
+            _height = std::max<int>(height, 0);
+            _stride = alignedRowStride(_width);
+        }
+        
+        /** Row stride in number of floats used for the given row width. */
+        inline static int alignedRowStride(int width) {
+            return (int)cv::alignSize(std::max<int>(width, 1), CacheLineFloats);
+        }
+        
+        /** Number of floats required to store planes of the given dimensions. */
+        inline static size_t requiredSize(int params, int width, int height) {
+            return size_t(std::max<int>(params, 0)) * size_t(std::max<int>(height, 0)) * size_t(alignedRowStride(width));
+        }
+        
+        /** Number of planes. */
+        inline int numParameters() const {
+            return _params;
+        }
+        
+        /** Number of values per row. */
+        inline int width() const {
+            return _width;
+        }
+        
+        /** Number of rows. */
+        inline int height() const {
+            return _height;
+        }
+        
+        /** Distance between consecutive rows in number of floats. */
+        inline int rowStride() const {
+            return _stride;
+        }
+        
+        /** Access row y of plane p. */
+        inline float *ptr(int p, int y) {
+            return _base + (size_t(p) * size_t(_height) + size_t(y)) * size_t(_stride);
+        }
+        
+        /** Access row y of plane p. */
+        inline const float *ptr(int p, int y) const {
+            return _base + (size_t(p) * size_t(_height) + size_t(y)) * size_t(_stride);
+        }
+        
+        /**
+            Dot product of plane p with plane q summed over all rows.
+         */
+        inline double dot(int p, int q) const {
+            double sum = 0;
+            for (int y = 0; y < _height; ++y) {
+                sum += detail::dotProduct(ptr(p, y), ptr(q, y), _width);
+            }
+            return sum;
+        }
+    
+        enum {
+            /** Alignment of rows in bytes. */
+            Alignment = 64
+        };
+        
+    private:
+        enum {
+            CacheLineBytes = Alignment,
+            CacheLineFloats = CacheLineBytes / sizeof(float)
+        };
+        
+        cv::Mat _data;
+        float *_base;
+        int _params, _width, _height, _stride;
+    };
+
+}
+
+#endif
\ No newline at end of file
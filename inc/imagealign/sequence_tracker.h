@@ -0,0 +1,384 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef IMAGE_ALIGN_SEQUENCE_TRACKER_H
+#define IMAGE_ALIGN_SEQUENCE_TRACKER_H
+
+#include <imagealign/align_base.h>
+#include <imagealign/image_pyramid.h>
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+namespace imagealign {
+    
+    /**
+        Motion models used to predict warps of the next frame.
+     */
+    enum EMotionModel {
+        /** The warp of the previous frame is used as is. */
+        MOTION_STATIC,
+        /** Parameters change by the same amount as between the previous two frames. */
+        MOTION_CONSTANT_VELOCITY,
+        /** Parameter velocities are filtered by an alpha-beta filter. */
+        MOTION_ALPHA_BETA
+    };
+    
+    /**
+        Tracking of templates through a sequence of frames.
+     
+        Each track owns an aligner that is prepared once and aligned against every new frame.
+        Between frames the tracker keeps a velocity of the warp parameters per track and seeds
+        alignment with the warp predicted by the motion model, see EMotionModel.
+     
+        The number of pyramid levels aligned per track adapts to the quality of the prediction.
+        The tracker remembers by how many pixels the template corners moved away from the
+        predicted warp during alignment. Levels are chosen such that the expected displacement
+        shrinks below the convergence radius on the coarsest level used. Tracks moving smoothly
+        are aligned on one or two levels only. Without any history all levels are used.
+     
+        Sudden motion is not visible in the history before it happens. When an alignment on
+        fewer levels is rejected, ends with an error well above the error of the previous frame,
+        leaves too few template pixels inside the frame or ends without constraints, the track 
+        is aligned again from the prediction on all levels, see setFallback.
+     
+        Tracks rejected by their aligner, see AlignBase::setCascade and 
+        AlignBase::setMinValidFraction, are marked lost and no longer aligned.
+     
+        \tparam A Aligner type, e.g. AlignInverseCompositional<W>.
+     */
+    template<class A>
+    class SequenceTracker {
+    public:
+        typedef typename A::WarpType W;
+        typedef typename W::Traits::ParamType ParamType;
+        typedef typename W::Traits::ScalarType ScalarType;
+        
+        SequenceTracker()
+            : _model(MOTION_CONSTANT_VELOCITY), _alpha(1), _beta(0.5), _radius(2), _fallbackErrorRatio(4), _fallbackValidFraction(0.5), _fallbackMinError(1)
+        {}
+        
+        /**
+            Set the motion model.
+         
+            The alpha-beta filter corrects the prediction p by the alignment residual r as
+            p + alpha * r and the velocity v as v + beta * r. Alpha equal to one keeps the
+            aligned warp, smaller values smooth it.
+         
+            \param model Motion model
+            \param alpha Position gain of the alpha-beta filter.
+            \param beta Velocity gain of the alpha-beta filter.
+         */
+        SequenceTracker &setMotionModel(EMotionModel model, double alpha = 1, double beta = 0.5) {
+            _model = model;
+            _alpha = alpha;
+            _beta = beta;
+            return *this;
+        }
+        
+        /** Access the motion model. */
+        EMotionModel motionModel() const {
+            return _model;
+        }
+        
+        /**
+            Set the displacement in pixels a single pyramid level reliably recovers.
+         
+            Each additional level doubles the displacement recovered. Larger values use
+            fewer levels.
+         */
+        SequenceTracker &setConvergenceRadius(double pixels) {
+            _radius = std::max<double>(pixels, 1e-3);
+            return *this;
+        }
+        
+        /**
+            Set when tracks aligned on fewer than all levels are aligned again on all levels.
+         
+            Rejections by the aligner and alignments ending without constraints always fall back.
+         
+            \param errorRatio Fall back when the error exceeds the error of the previous frame by this factor. Zero disables the test.
+            \param validFraction Fall back when fewer than this fraction of template pixels warp into the frame. Zero disables the test.
+            \param minError Errors of previous frames below this value are raised to it, so that near perfect matches do not fall back on noise.
+         */
+        SequenceTracker &setFallback(double errorRatio, double validFraction, double minError = 1) {
+            _fallbackErrorRatio = errorRatio;
+            _fallbackValidFraction = validFraction;
+            _fallbackMinError = minError;
+            return *this;
+        }
+        
+        /**
+            Add a track.
+         
+            \param tmpl Single channel template image.
+            \param target Pyramid of the frame the template is located in.
+            \param w Warp of the template in target.
+            \param pyramidLevels Maximum number of pyramid levels.
+            \return Index of the new track.
+         */
+        int addTrack(cv::InputArray tmpl, const ImagePyramid &target, const W &w, int pyramidLevels)
+        {
+            _aligners.push_back(A());
+            _aligners.back().prepare(tmpl, target, w, pyramidLevels);
+            
+            Track t;
+            t.warp = w;
+            t.velocity = W::Traits::zeroParam(w.numParameters());
+            t.templateSize = tmpl.size();
+            t.displacement = 0;
+            t.error = 0;
+            t.frames = 0;
+            t.levels = _aligners.back().numLevels();
+            t.lost = false;
+            _tracks.push_back(t);
+            
+            return (int)_tracks.size() - 1;
+        }
+        
+        /**
+            Remove all tracks.
+         */
+        void clear() {
+            _aligners.clear();
+            _tracks.clear();
+        }
+        
+        /**
+            Align all tracks not lost with the next frame.
+         
+            Tracks are processed in parallel. The target pyramid is shared by all tracks and
+            must hold as many levels as the tracks were prepared with. Aligners requiring target
+            gradients receive gradients computed once per frame when the pyramid lacks them.
+         
+            \param target Pyramid of the next frame.
+            \param maxIterations Maximum number of iterations in all levels used per track.
+            \param eps Minimum length of incremental parameter vector to continue on current level.
+         */
+        void track(const ImagePyramid &target, int maxIterations, ScalarType eps)
+        {
+            CV_Assert(target.numLevels() > 0);
+            CV_Assert(target[0].channels() == 1);
+            
+            const ImagePyramid &frame = framePyramid(target);
+            
+            TrackBody body(*this, frame, maxIterations, eps);
+            cv::parallel_for_(cv::Range(0, numTracks()), body);
+        }
+        
+        /** Number of tracks. */
+        int numTracks() const {
+            return (int)_tracks.size();
+        }
+        
+        /** Warp of a track after the most recent frame. */
+        const W &warp(int track) const {
+            return _tracks[track].warp;
+        }
+        
+        /** Parameter velocity of a track per frame. */
+        const ParamType &velocity(int track) const {
+            return _tracks[track].velocity;
+        }
+        
+        /** Test if a track was lost. */
+        bool lost(int track) const {
+            return _tracks[track].lost;
+        }
+        
+        /** Number of pyramid levels aligned for a track in the most recent frame, including fallbacks. */
+        int levelsUsed(int track) const {
+            return _tracks[track].levels;
+        }
+        
+        /** 
+            Access the aligner of a track, e.g. to configure losses or cascades. Warps set by 
+            the aligner are overridden by the tracker.
+         */
+        A &aligner(int track) {
+            return _aligners[track];
+        }
+        
+    private:
+        
+        struct Track {
+            W warp;
+            ParamType velocity;
+            cv::Size templateSize;
+            /** Smoothed displacement between predicted and aligned warp in pixels. */
+            double displacement;
+            /** Error of the most recent alignment. */
+            double error;
+            int frames;
+            int levels;
+            bool lost;
+        };
+        
+        /** Number of levels required to recover the given displacement. */
+        int levelsForDisplacement(double d, int maxLevels) const {
+            int levels = 1;
+            double recovered = _radius;
+            while (levels < maxLevels && d > recovered) {
+                ++levels;
+                recovered *= 2;
+            }
+            return levels;
+        }
+        
+        /** 
+            Share the target with all aligners. Gradients are added once here, so that 
+            aligners do not compute them per track.
+         */
+        const ImagePyramid &framePyramid(const ImagePyramid &target) {
+            if (!A::RequiresTargetGradients || target.hasGradients())
+                return target;
+            
+            const int levels = target.numLevels();
+            _frameImages.resize(levels);
+            _frameGradients.resize(levels);
+            for (int i = 0; i < levels; ++i) {
+                _frameImages[i] = target[i];
+                ImagePyramid::computeGradientImage(_frameImages[i], _frameGradients[i]);
+            }
+            _frame.assign(_frameImages, _frameGradients, levels);
+            
+            return _frame;
+        }
+        
+        /** Test if an alignment on fewer than all levels needs to be repeated on all levels. */
+        bool needsFallback(const Track &t, const A &a, const W &w, const ImagePyramid &target) const {
+            if (a.rejected())
+                return true;
+            
+            if (_fallbackErrorRatio > 0 && double(a.lastError()) > _fallbackErrorRatio * std::max<double>(t.error, _fallbackMinError))
+                return true;
+            
+            if (detail::tooFewValidPixels(w, t.templateSize, target[0].size(), _fallbackValidFraction))
+                return true;
+            
+            return a.lastReason() == TERMINATION_NO_CONSTRAINTS;
+        }
+        
+        /** Predict, align and update a single track. */
+        void trackOne(int idx, const ImagePyramid &target, int maxIterations, ScalarType eps)
+        {
+            Track &t = _tracks[idx];
+            if (t.lost)
+                return;
+            
+            A &a = _aligners[idx];
+            a.updateTarget(target);
+            
+            // 1. Predict warp from motion history
+            W predicted = t.warp;
+            if (_model != MOTION_STATIC && t.frames > 0) {
+                ParamType p = t.warp.parameters() + t.velocity;
+                predicted.setParameters(p);
+            }
+            
+            // 2. Choose levels from the expected displacement
+            t.levels = (t.frames > 0) ? levelsForDisplacement(t.displacement, a.numLevels()) : a.numLevels();
+            a.setCoarsestLevel(t.levels - 1);
+            
+            // 3. Align starting from prediction
+            W w = predicted;
+            a.align(w, maxIterations, eps);
+            
+            if (t.levels < a.numLevels() && needsFallback(t, a, w, target)) {
+                t.levels = a.numLevels();
+                a.setCoarsestLevel(t.levels - 1);
+                w = predicted;
+                a.align(w, maxIterations, eps);
+            }
+            
+            if (a.rejected()) {
+                t.warp = w;
+                t.lost = true;
+                return;
+            }
+            
+            // 4. Update motion state
+            const ParamType residual = w.parameters() - predicted.parameters();
+            
+            if (_model == MOTION_CONSTANT_VELOCITY) {
+                t.velocity = w.parameters() - t.warp.parameters();
+                t.warp = w;
+            } else if (_model == MOTION_ALPHA_BETA) {
+                t.velocity = t.velocity + residual * ScalarType(_beta);
+                ParamType p = predicted.parameters() + residual * ScalarType(_alpha);
+                t.warp.setParameters(p);
+            } else {
+                t.warp = w;
+            }
+            
+            // Sudden motion raises the expected displacement at once, smooth motion lowers it gradually.
+            const double d = cornerDisplacement(w, predicted, t.templateSize);
+            t.displacement = std::max<double>(d, 0.5 * t.displacement);
+            t.error = double(a.lastError());
+            ++t.frames;
+        }
+        
+        class TrackBody : public cv::ParallelLoopBody {
+        public:
+            TrackBody(SequenceTracker &st, const ImagePyramid &target, int maxIterations, ScalarType eps)
+                : _st(st), _target(target), _maxIterations(maxIterations), _eps(eps)
+            {}
+            
+            void operator()(const cv::Range &r) const {
+                for (int t = r.start; t < r.end; ++t) {
+                    _st.trackOne(t, _target, _maxIterations, _eps);
+                }
+            }
+            
+        private:
+            SequenceTracker &_st;
+            const ImagePyramid &_target;
+            int _maxIterations;
+            ScalarType _eps;
+        };
+        
+        // Aligners are never relocated once prepared.
+        std::deque<A> _aligners;
+        std::vector<Track> _tracks;
+        
+        EMotionModel _model;
+        double _alpha;
+        double _beta;
+        double _radius;
+        double _fallbackErrorRatio;
+        double _fallbackValidFraction;
+        double _fallbackMinError;
+        
+        // Target with gradients computed once per frame, see framePyramid.
+        ImagePyramid _frame;
+        std::vector<cv::Mat> _frameImages;
+        std::vector<cv::Mat> _frameGradients;
+    };
+
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,100 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef IMAGE_ALIGN_SIMD_DISPATCH_H
+#define IMAGE_ALIGN_SIMD_DISPATCH_H
+
+#include <imagealign/config.h>
+#include <imagealign/simd_kernels.h>
+
+namespace imagealign {
+    
+    namespace detail {
+        
+#if defined(IA_USE_DISPATCH)
+        /**
+            Kernels of the best instruction set supported by the running CPU.
+         
+            Selected once on first use. Provided by ialign.
+         */
+        const SIMDKernels &simdKernels();
+#endif
+        
+        /**
+            Dot product of two single precision arrays.
+         
+            Uses the kernels selected at runtime when IA_USE_DISPATCH is defined and the
+            kernels of the current translation unit otherwise.
+         */
+        inline float dotProduct(const float *a, const float *b, int n)
+        {
+#if defined(IA_USE_DISPATCH)
+            return simdKernels().dotProduct(a, b, n);
+#else
+            return native::dotProduct(a, b, n);
+#endif
+        }
+        
+        /**
+            Element-wise product of two single precision arrays.
+         */
+        inline void multiply(const float *a, const float *b, float *dst, int n)
+        {
+#if defined(IA_USE_DISPATCH)
+            simdKernels().multiply(a, b, dst, n);
+#else
+            native::multiply(a, b, dst, n);
+#endif
+        }
+        
+        /**
+            Vectorized part of bilinear interpolation of single precision images.
+         
+            \return Number of coordinates processed.
+         */
+        inline int bilinearInteriorSIMD(const float *base, int stride, const float *xs, const float *ys, int n, float *dst)
+        {
+#if defined(IA_USE_DISPATCH)
+            return simdKernels().bilinearInterior(base, stride, xs, ys, n, dst);
+#else
+            return native::bilinearInterior(base, stride, xs, ys, n, dst);
+#endif
+        }
+    }
+    
+    /**
+        Name of the instruction set used by SIMD kernels.
+     
+        When IA_USE_DISPATCH is defined, kernels compiled for AVX2 and AVX-512 are part of 
+        ialign next to the baseline kernels and the best instruction set supported by the 
+        running CPU is chosen. 
+        Otherwise kernels are compiled with the flags of the including translation unit.
+     */
+    inline const char *simdInstructionSet()
+    {
+#if defined(IA_USE_DISPATCH)
+        return detail::simdKernels().name;
+#else
+        return detail::native::instructionSet();
+#endif
+    }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,331 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef IMAGE_ALIGN_SIMD_KERNELS_H
+#define IMAGE_ALIGN_SIMD_KERNELS_H
+
+#include <imagealign/config.h>
+
+#if defined(IA_USE_AVX2) || defined(IA_USE_AVX512)
+    #include <immintrin.h>
+#elif defined(IA_USE_SSE2)
+    #include <emmintrin.h>
+#elif defined(IA_USE_NEON)
+    #include <arm_neon.h>
+#endif
+
+/**
+    Namespace receiving the kernels of this translation unit.
+ 
+    Each kernel source of the ialign library defines its own namespace and is compiled for
+    a specific instruction set, see simd_dispatch.h. Kernels only operate on plain arrays, 
+    so that no inline function shared with other translation units is compiled with 
+    extended instruction sets. With IA_USE_DISPATCH, kernels of namespace native use the
+    baseline instruction set, see config.h.
+ */
+#ifndef IA_KERNEL_NAMESPACE
+#define IA_KERNEL_NAMESPACE native
+#endif
+
+namespace imagealign {
+    
+    namespace detail {
+        
+        /**
+            Table of SIMD kernels compiled for one instruction set.
+         */
+        struct SIMDKernels {
+            /** Name of instruction set. */
+            const char *name;
+            
+            /** Dot product of two arrays. */
+            float (*dotProduct)(const float *a, const float *b, int n);
+            
+            /** Element-wise product of two arrays. */
+            void (*multiply)(const float *a, const float *b, float *dst, int n);
+            
+            /** Vectorized part of bilinear interpolation. Returns number of coordinates processed. */
+            int (*bilinearInterior)(const float *base, int stride, const float *xs, const float *ys, int n, float *dst);
+        };
+        
+        /** Kernels compiled for AVX2. Provided by ialign. */
+        const SIMDKernels *simdKernelsAVX2();
+        
+        /** Kernels compiled for AVX-512. Provided by ialign. */
+        const SIMDKernels *simdKernelsAVX512();
+        
+        namespace IA_KERNEL_NAMESPACE {
+            
+            /**
+                Name of the instruction set the kernels below are compiled for.
+             */
+            inline const char *instructionSet()
+            {
+#if defined(IA_USE_AVX512)
+                return "avx512";
+#elif defined(IA_USE_AVX2)
+                return "avx2";
+#elif defined(IA_USE_SSE2)
+                return "sse2";
+#elif defined(IA_USE_NEON)
+                return "neon";
+#else
+                return "scalar";
+#endif
+            }
+            
+            /**
+                Dot product of two single precision arrays.
+                
+                Processes 16 (AVX-512), 8 (AVX2) or 4 (SSE2, NEON) elements at once. The order of 
+                summation depends only on n, hence results are reproducible for a given 
+                instruction set.
+             */
+            inline float dotProduct(const float *a, const float *b, int n)
+            {
+                int i = 0;
+                float sum = 0.f;
+                
+#if defined(IA_USE_AVX512)
+                __m512 acc16 = _mm512_setzero_ps();
+                for (; i + 16 <= n; i += 16) {
+                    acc16 = _mm512_add_ps(acc16, _mm512_mul_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+                }
+                float lanes16[16];
+                _mm512_storeu_ps(lanes16, acc16);
+                for (int k = 0; k < 16; k += 4) {
+                    sum += (lanes16[k] + lanes16[k + 1]) + (lanes16[k + 2] + lanes16[k + 3]);
+                }
+#endif
+                
+#if defined(IA_USE_AVX2)
+                __m256 acc = _mm256_setzero_ps();
+                for (; i + 8 <= n; i += 8) {
+                    acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+                }
+                float lanes[8];
+                _mm256_storeu_ps(lanes, acc);
+                sum += ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+#elif defined(IA_USE_SSE2)
+                __m128 acc = _mm_setzero_ps();
+                for (; i + 4 <= n; i += 4) {
+                    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+                }
+                float lanes[4];
+                _mm_storeu_ps(lanes, acc);
+                sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(IA_USE_NEON)
+                float32x4_t acc = vdupq_n_f32(0.f);
+                for (; i + 4 <= n; i += 4) {
+                    acc = vaddq_f32(acc, vmulq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
+                }
+                float lanes[4];
+                vst1q_f32(lanes, acc);
+                sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+                
+                for (; i < n; ++i) {
+                    sum += a[i] * b[i];
+                }
+                
+                return sum;
+            }
+            
+            /**
+                Element-wise product of two single precision arrays.
+                
+                \param a First array.
+                \param b Second array.
+                \param dst Receives a[i] * b[i]. May alias a or b.
+                \param n Number of elements.
+             */
+            inline void multiply(const float *a, const float *b, float *dst, int n)
+            {
+                int i = 0;
+                
+#if defined(IA_USE_AVX512)
+                for (; i + 16 <= n; i += 16) {
+                    _mm512_storeu_ps(dst + i, _mm512_mul_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+                }
+#endif
+                
+#if defined(IA_USE_AVX2)
+                for (; i + 8 <= n; i += 8) {
+                    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+                }
+#elif defined(IA_USE_SSE2)
+                for (; i + 4 <= n; i += 4) {
+                    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+                }
+#elif defined(IA_USE_NEON)
+                for (; i + 4 <= n; i += 4) {
+                    vst1q_f32(dst + i, vmulq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
+                }
+#endif
+                
+                for (; i < n; ++i) {
+                    dst[i] = a[i] * b[i];
+                }
+            }
+            
+            /**
+                Bilinear interpolation of single precision images for coordinates strictly inside the image.
+             
+                Requires 0 <= x < cols - 1 and 0 <= y < rows - 1 for all coordinates. Processes 16 
+                (AVX-512), 8 (AVX2) or 4 (SSE2, NEON) coordinates at once. AVX2 and AVX-512 use 
+                hardware gathers, SSE2 and NEON fetch the neighbors of each lane individually and 
+                interpolate vectorized. Remaining coordinates are left to the caller.
+             
+                \param base First pixel of image.
+                \param stride Distance between rows in number of floats.
+                \param xs Array of x coordinates.
+                \param ys Array of y coordinates.
+                \param n Number of coordinates.
+                \param dst Array receiving sampled values.
+                \return Number of coordinates processed.
+             */
+            inline int bilinearInterior(const float *base, int stride, const float *xs, const float *ys, int n, float *dst)
+            {
+                int i = 0;
+                
+#if defined(IA_USE_AVX512)
+                {
+                    const __m512i vstride = _mm512_set1_epi32(stride);
+                    const __m512i one = _mm512_set1_epi32(1);
+                    const __m512 fone = _mm512_set1_ps(1.f);
+                    
+                    for (; i + 16 <= n; i += 16) {
+                        const __m512 x = _mm512_loadu_ps(xs + i);
+                        const __m512 y = _mm512_loadu_ps(ys + i);
+                        const __m512i ix = _mm512_cvttps_epi32(x);
+                        const __m512i iy = _mm512_cvttps_epi32(y);
+                        const __m512 a = _mm512_sub_ps(x, _mm512_cvtepi32_ps(ix));
+                        const __m512 b = _mm512_sub_ps(y, _mm512_cvtepi32_ps(iy));
+                        
+                        const __m512i o0 = _mm512_add_epi32(_mm512_mullo_epi32(iy, vstride), ix);
+                        const __m512i o2 = _mm512_add_epi32(o0, vstride);
+                        
+                        const __m512 f0 = _mm512_i32gather_ps(o0, base, 4);
+                        const __m512 f1 = _mm512_i32gather_ps(_mm512_add_epi32(o0, one), base, 4);
+                        const __m512 f2 = _mm512_i32gather_ps(o2, base, 4);
+                        const __m512 f3 = _mm512_i32gather_ps(_mm512_add_epi32(o2, one), base, 4);
+                        
+                        const __m512 ia = _mm512_sub_ps(fone, a);
+                        const __m512 ib = _mm512_sub_ps(fone, b);
+                        const __m512 top = _mm512_add_ps(_mm512_mul_ps(f0, ia), _mm512_mul_ps(f1, a));
+                        const __m512 bottom = _mm512_add_ps(_mm512_mul_ps(f2, ia), _mm512_mul_ps(f3, a));
+                        
+                        _mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_mul_ps(top, ib), _mm512_mul_ps(bottom, b)));
+                    }
+                }
+#endif
+                
+#if defined(IA_USE_AVX2)
+                const __m256i vstride = _mm256_set1_epi32(stride);
+                const __m256i one = _mm256_set1_epi32(1);
+                const __m256 fone = _mm256_set1_ps(1.f);
+                
+                for (; i + 8 <= n; i += 8) {
+                    const __m256 x = _mm256_loadu_ps(xs + i);
+                    const __m256 y = _mm256_loadu_ps(ys + i);
+                    const __m256i ix = _mm256_cvttps_epi32(x);
+                    const __m256i iy = _mm256_cvttps_epi32(y);
+                    const __m256 a = _mm256_sub_ps(x, _mm256_cvtepi32_ps(ix));
+                    const __m256 b = _mm256_sub_ps(y, _mm256_cvtepi32_ps(iy));
+                    
+                    const __m256i o0 = _mm256_add_epi32(_mm256_mullo_epi32(iy, vstride), ix);
+                    const __m256i o2 = _mm256_add_epi32(o0, vstride);
+                    
+                    const __m256 f0 = _mm256_i32gather_ps(base, o0, 4);
+                    const __m256 f1 = _mm256_i32gather_ps(base, _mm256_add_epi32(o0, one), 4);
+                    const __m256 f2 = _mm256_i32gather_ps(base, o2, 4);
+                    const __m256 f3 = _mm256_i32gather_ps(base, _mm256_add_epi32(o2, one), 4);
+                    
+                    const __m256 ia = _mm256_sub_ps(fone, a);
+                    const __m256 ib = _mm256_sub_ps(fone, b);
+                    const __m256 top = _mm256_add_ps(_mm256_mul_ps(f0, ia), _mm256_mul_ps(f1, a));
+                    const __m256 bottom = _mm256_add_ps(_mm256_mul_ps(f2, ia), _mm256_mul_ps(f3, a));
+                    
+                    _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_mul_ps(top, ib), _mm256_mul_ps(bottom, b)));
+                }
+#elif defined(IA_USE_SSE2) || defined(IA_USE_NEON)
+                int ix[4], iy[4];
+                float f0[4], f1[4], f2[4], f3[4];
+                
+    #if defined(IA_USE_SSE2)
+                const __m128 fone = _mm_set1_ps(1.f);
+    #else
+                const float32x4_t fone = vdupq_n_f32(1.f);
+    #endif
+                
+                for (; i + 4 <= n; i += 4) {
+    #if defined(IA_USE_SSE2)
+                    const __m128 x = _mm_loadu_ps(xs + i);
+                    const __m128 y = _mm_loadu_ps(ys + i);
+                    const __m128i vix = _mm_cvttps_epi32(x);
+                    const __m128i viy = _mm_cvttps_epi32(y);
+                    const __m128 a = _mm_sub_ps(x, _mm_cvtepi32_ps(vix));
+                    const __m128 b = _mm_sub_ps(y, _mm_cvtepi32_ps(viy));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(ix), vix);
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(iy), viy);
+    #else
+                    const float32x4_t x = vld1q_f32(xs + i);
+                    const float32x4_t y = vld1q_f32(ys + i);
+                    const int32x4_t vix = vcvtq_s32_f32(x);
+                    const int32x4_t viy = vcvtq_s32_f32(y);
+                    const float32x4_t a = vsubq_f32(x, vcvtq_f32_s32(vix));
+                    const float32x4_t b = vsubq_f32(y, vcvtq_f32_s32(viy));
+                    vst1q_s32(ix, vix);
+                    vst1q_s32(iy, viy);
+    #endif
+                    
+                    // No gather instructions available, fetch neighbors per lane.
+                    for (int k = 0; k < 4; ++k) {
+                        const float *ptrY0 = base + iy[k] * stride + ix[k];
+                        const float *ptrY1 = ptrY0 + stride;
+                        f0[k] = ptrY0[0];
+                        f1[k] = ptrY0[1];
+                        f2[k] = ptrY1[0];
+                        f3[k] = ptrY1[1];
+                    }
+                    
+    #if defined(IA_USE_SSE2)
+                    const __m128 ia = _mm_sub_ps(fone, a);
+                    const __m128 ib = _mm_sub_ps(fone, b);
+                    const __m128 top = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(f0), ia), _mm_mul_ps(_mm_loadu_ps(f1), a));
+                    const __m128 bottom = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(f2), ia), _mm_mul_ps(_mm_loadu_ps(f3), a));
+                    _mm_storeu_ps(dst + i, _mm_add_ps(_mm_mul_ps(top, ib), _mm_mul_ps(bottom, b)));
+    #else
+                    const float32x4_t ia = vsubq_f32(fone, a);
+                    const float32x4_t ib = vsubq_f32(fone, b);
+                    const float32x4_t top = vaddq_f32(vmulq_f32(vld1q_f32(f0), ia), vmulq_f32(vld1q_f32(f1), a));
+                    const float32x4_t bottom = vaddq_f32(vmulq_f32(vld1q_f32(f2), ia), vmulq_f32(vld1q_f32(f3), a));
+                    vst1q_f32(dst + i, vaddq_f32(vmulq_f32(top, ib), vmulq_f32(bottom, b)));
+    #endif
+                }
+#endif
+                
+                return i;
+            }
+        }
+    }
+}
+
+#endif
\ No newline at end of file
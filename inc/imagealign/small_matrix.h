@@ -0,0 +1,325 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_SMALL_MATRIX_H
+#define IMAGE_ALIGN_SMALL_MATRIX_H
+
+#include <imagealign/config.h>
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+#include <algorithm>
+#include <cmath>
+
+namespace imagealign {
+    
+    /**
+        Matrix of run time known size with inline storage.
+        
+        Warps whose number of parameters is known at run time only cannot use cv::Matx, while
+        cv::Mat allocates on every Jacobian, gradient times Jacobian and SDI times error in the
+        innermost loops. SmallMatrix stores up to MaxRows x MaxCols elements inline and never
+        touches the heap. Copies and arithmetic only visit the rows x cols elements in use.
+        
+        Supports the operations alignment algorithms perform on warp traits types, see
+        WarpTraitsForBoundedParameterCount. Dimensions are checked in debug builds only.
+        
+        \tparam Scalar Element type.
+        \tparam MaxRows Maximum number of rows.
+        \tparam MaxCols Maximum number of columns.
+     */
+    template<class Scalar, int MaxRows, int MaxCols>
+    class SmallMatrix {
+    public:
+        typedef Scalar value_type;
+        
+        enum {
+            MaxRowsAtCompileTime = MaxRows,
+            MaxColsAtCompileTime = MaxCols
+        };
+        
+        /** Empty matrix. */
+        inline SmallMatrix()
+            : _rows(0), _cols(0)
+        {}
+        
+        /** Matrix of given size initialized to zero. */
+        inline SmallMatrix(int rows, int cols) {
+            create(rows, cols);
+            setTo(Scalar(0));
+        }
+        
+        inline SmallMatrix(const SmallMatrix &other) {
+            copyFrom(other);
+        }
+        
+        inline SmallMatrix &operator=(const SmallMatrix &other) {
+            copyFrom(other);
+            return *this;
+        }
+        
+        /** Matrix of given size initialized to zero. */
+        inline static SmallMatrix zeros(int rows, int cols) {
+            return SmallMatrix(rows, cols);
+        }
+        
+        /** Matrix of given size with ones on the diagonal. */
+        inline static SmallMatrix eye(int rows, int cols) {
+            SmallMatrix m(rows, cols);
+            for (int i = 0; i < std::min<int>(rows, cols); ++i)
+                m(i, i) = Scalar(1);
+            return m;
+        }
+        
+        /** Change size. Contents are undefined afterwards. */
+        inline void create(int rows, int cols) {
+            CV_DbgAssert(rows >= 0 && rows <= MaxRows && cols >= 0 && cols <= MaxCols);
+            _rows = rows;
+            _cols = cols;
+        }
+        
+        /** Set all elements in use to s. */
+        inline void setTo(Scalar s) {
+            for (int i = 0; i < _rows; ++i)
+                for (int j = 0; j < _cols; ++j)
+                    (*this)(i, j) = s;
+        }
+        
+        inline int rows() const {
+            return _rows;
+        }
+        
+        inline int cols() const {
+            return _cols;
+        }
+        
+        inline bool empty() const {
+            return _rows == 0 || _cols == 0;
+        }
+        
+        inline Scalar &operator()(int i, int j) {
+            return _val[i * MaxCols + j];
+        }
+        
+        inline Scalar operator()(int i, int j) const {
+            return _val[i * MaxCols + j];
+        }
+        
+        /** Transposed matrix. */
+        inline SmallMatrix<Scalar, MaxCols, MaxRows> t() const {
+            SmallMatrix<Scalar, MaxCols, MaxRows> r;
+            r.create(_cols, _rows);
+            for (int i = 0; i < _rows; ++i)
+                for (int j = 0; j < _cols; ++j)
+                    r(j, i) = (*this)(i, j);
+            return r;
+        }
+        
+        /**
+            Inverse of a square matrix.
+            
+            Gauss-Jordan elimination with partial pivoting in double precision. Returns a zero
+            matrix when singular, same as cv::Matx::inv.
+         */
+        inline SmallMatrix inv() const {
+            CV_DbgAssert(_rows == _cols);
+            
+            const int n = _rows;
+            double a[MaxRows][MaxRows], r[MaxRows][MaxRows];
+            
+            for (int i = 0; i < n; ++i) {
+                for (int j = 0; j < n; ++j) {
+                    a[i][j] = double((*this)(i, j));
+                    r[i][j] = (i == j) ? 1.0 : 0.0;
+                }
+            }
+            
+            for (int c = 0; c < n; ++c) {
+                int p = c;
+                for (int i = c + 1; i < n; ++i) {
+                    if (std::abs(a[i][c]) > std::abs(a[p][c]))
+                        p = i;
+                }
+                
+                if (!(std::abs(a[p][c]) > 0))
+                    return zeros(n, n);
+                
+                if (p != c) {
+                    for (int j = 0; j < n; ++j) {
+                        std::swap(a[p][j], a[c][j]);
+                        std::swap(r[p][j], r[c][j]);
+                    }
+                }
+                
+                const double s = 1.0 / a[c][c];
+                for (int j = 0; j < n; ++j) {
+                    a[c][j] *= s;
+                    r[c][j] *= s;
+                }
+                
+                for (int i = 0; i < n; ++i) {
+                    if (i == c)
+                        continue;
+                    const double f = a[i][c];
+                    for (int j = 0; j < n; ++j) {
+                        a[i][j] -= f * a[c][j];
+                        r[i][j] -= f * r[c][j];
+                    }
+                }
+            }
+            
+            SmallMatrix m;
+            m.create(n, n);
+            for (int i = 0; i < n; ++i)
+                for (int j = 0; j < n; ++j)
+                    m(i, j) = Scalar(r[i][j]);
+            return m;
+        }
+        
+        inline SmallMatrix &operator+=(const SmallMatrix &other) {
+            CV_DbgAssert(_rows == other._rows && _cols == other._cols);
+            for (int i = 0; i < _rows; ++i)
+                for (int j = 0; j < _cols; ++j)
+                    (*this)(i, j) += other(i, j);
+            return *this;
+        }
+        
+        inline SmallMatrix &operator-=(const SmallMatrix &other) {
+            CV_DbgAssert(_rows == other._rows && _cols == other._cols);
+            for (int i = 0; i < _rows; ++i)
+                for (int j = 0; j < _cols; ++j)
+                    (*this)(i, j) -= other(i, j);
+            return *this;
+        }
+        
+        inline SmallMatrix &operator*=(Scalar s) {
+            for (int i = 0; i < _rows; ++i)
+                for (int j = 0; j < _cols; ++j)
+                    (*this)(i, j) *= s;
+            return *this;
+        }
+    
+    private:
+        
+        inline void copyFrom(const SmallMatrix &other) {
+            _rows = other._rows;
+            _cols = other._cols;
+            for (int i = 0; i < _rows; ++i)
+                for (int j = 0; j < _cols; ++j)
+                    (*this)(i, j) = other(i, j);
+        }
+        
+        Scalar _val[MaxRows * MaxCols];
+        int _rows, _cols;
+    };
+    
+    template<class Scalar, int MaxRows, int MaxCols>
+    inline SmallMatrix<Scalar, MaxRows, MaxCols> operator+(SmallMatrix<Scalar, MaxRows, MaxCols> a, const SmallMatrix<Scalar, MaxRows, MaxCols> &b) {
+        return a += b;
+    }
+    
+    template<class Scalar, int MaxRows, int MaxCols>
+    inline SmallMatrix<Scalar, MaxRows, MaxCols> operator-(SmallMatrix<Scalar, MaxRows, MaxCols> a, const SmallMatrix<Scalar, MaxRows, MaxCols> &b) {
+        return a -= b;
+    }
+    
+    template<class Scalar, int MaxRows, int MaxCols>
+    inline SmallMatrix<Scalar, MaxRows, MaxCols> operator-(SmallMatrix<Scalar, MaxRows, MaxCols> a) {
+        return a *= Scalar(-1);
+    }
+    
+    // Scalar products for the same argument types cv::Matx accepts.
+    
+    template<class Scalar, int MaxRows, int MaxCols>
+    inline SmallMatrix<Scalar, MaxRows, MaxCols> operator*(SmallMatrix<Scalar, MaxRows, MaxCols> a, float s) {
+        return a *= Scalar(s);
+    }
+    
+    template<class Scalar, int MaxRows, int MaxCols>
+    inline SmallMatrix<Scalar, MaxRows, MaxCols> operator*(SmallMatrix<Scalar, MaxRows, MaxCols> a, double s) {
+        return a *= Scalar(s);
+    }
+    
+    template<class Scalar, int MaxRows, int MaxCols>
+    inline SmallMatrix<Scalar, MaxRows, MaxCols> operator*(SmallMatrix<Scalar, MaxRows, MaxCols> a, int s) {
+        return a *= Scalar(s);
+    }
+    
+    template<class Scalar, int MaxRows, int MaxCols>
+    inline SmallMatrix<Scalar, MaxRows, MaxCols> operator*(float s, SmallMatrix<Scalar, MaxRows, MaxCols> a) {
+        return a *= Scalar(s);
+    }
+    
+    template<class Scalar, int MaxRows, int MaxCols>
+    inline SmallMatrix<Scalar, MaxRows, MaxCols> operator*(double s, SmallMatrix<Scalar, MaxRows, MaxCols> a) {
+        return a *= Scalar(s);
+    }
+    
+    template<class Scalar, int MaxRows, int MaxCols>
+    inline SmallMatrix<Scalar, MaxRows, MaxCols> operator*(int s, SmallMatrix<Scalar, MaxRows, MaxCols> a) {
+        return a *= Scalar(s);
+    }
+    
+    /** Matrix product. The number of columns of a must equal the number of rows of b. */
+    template<class Scalar, int R1, int C1, int R2, int C2>
+    inline SmallMatrix<Scalar, R1, C2> operator*(const SmallMatrix<Scalar, R1, C1> &a, const SmallMatrix<Scalar, R2, C2> &b) {
+        CV_DbgAssert(a.cols() == b.rows());
+        
+        SmallMatrix<Scalar, R1, C2> r;
+        r.create(a.rows(), b.cols());
+        
+        for (int i = 0; i < a.rows(); ++i) {
+            for (int j = 0; j < b.cols(); ++j) {
+                Scalar v(0);
+                for (int k = 0; k < a.cols(); ++k)
+                    v += a(i, k) * b(k, j);
+                r(i, j) = v;
+            }
+        }
+        return r;
+    }
+    
+    /**
+        Euclidean norm of a parameter vector.
+        
+        Accepts the parameter types of all warp traits: cv::Matx and cv::Mat are forwarded to 
+        cv::norm, SmallMatrix is handled below.
+     */
+    template<class M>
+    inline double parameterNorm(const M &m) {
+        return cv::norm(m);
+    }
+    
+    /** Same as above for SmallMatrix. */
+    template<class Scalar, int MaxRows, int MaxCols>
+    inline double parameterNorm(const SmallMatrix<Scalar, MaxRows, MaxCols> &m) {
+        double sum = 0;
+        for (int i = 0; i < m.rows(); ++i)
+            for (int j = 0; j < m.cols(); ++j)
+                sum += double(m(i, j)) * double(m(i, j));
+        return std::sqrt(sum);
+    }
+    
+}
+
+#endif
\ No newline at end of file
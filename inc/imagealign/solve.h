@@ -0,0 +1,229 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef IMAGE_ALIGN_SOLVE_H
+#define IMAGE_ALIGN_SOLVE_H
+
+#include <imagealign/config.h>
+#include <imagealign/small_matrix.h>
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+namespace imagealign {
+    
+    /**
+        Add the outer product of a steepest descent row to the upper triangle of a Hessian.
+     
+        Hessians are symmetric, so accumulating the upper triangle only saves almost half of
+        the multiply-adds. The lower triangle is left untouched. See solveSymmetric.
+     
+        \param h Hessian receiving weight * sd^T * sd in its upper triangle.
+        \param sd Steepest descent row of a pixel.
+        \param weight Weight of pixel.
+     */
+    template<class Scalar, int N>
+    inline void accumulateUpper(cv::Matx<Scalar, N, N> &h, const cv::Matx<Scalar, 1, N> &sd, Scalar weight) {
+        for (int p = 0; p < N; ++p) {
+            const Scalar sp = sd(0, p) * weight;
+            for (int q = p; q < N; ++q) {
+                h(p, q) += sp * sd(0, q);
+            }
+        }
+    }
+    
+    /** Same as above for warps with run time known number of parameters. */
+    template<class Scalar>
+    inline void accumulateUpper(cv::Mat &h, const cv::Mat &sd, Scalar weight) {
+        const int n = sd.cols;
+        for (int p = 0; p < n; ++p) {
+            const Scalar sp = sd.at<Scalar>(0, p) * weight;
+            for (int q = p; q < n; ++q) {
+                h.at<Scalar>(p, q) += sp * sd.at<Scalar>(0, q);
+            }
+        }
+    }
+    
+    /** Same as above for warps with a bounded number of parameters. */
+    template<class Scalar, int MaxN>
+    inline void accumulateUpper(SmallMatrix<Scalar, MaxN, MaxN> &h, const SmallMatrix<Scalar, 1, MaxN> &sd, Scalar weight) {
+        const int n = sd.cols();
+        for (int p = 0; p < n; ++p) {
+            const Scalar sp = sd(0, p) * weight;
+            for (int q = p; q < n; ++q) {
+                h(p, q) += sp * sd(0, q);
+            }
+        }
+    }
+    
+    /** Copy the upper triangle of a square matrix to its lower triangle. */
+    template<class Scalar, int N>
+    inline void symmetrizeUpper(cv::Matx<Scalar, N, N> &h) {
+        for (int r = 0; r < N; ++r) {
+            for (int c = r + 1; c < N; ++c) {
+                h(c, r) = h(r, c);
+            }
+        }
+    }
+    
+    /** Same as above for SmallMatrix. */
+    template<class Scalar, int MaxN>
+    inline void symmetrizeUpper(SmallMatrix<Scalar, MaxN, MaxN> &h) {
+        for (int r = 0; r < h.rows(); ++r) {
+            for (int c = r + 1; c < h.cols(); ++c) {
+                h(c, r) = h(r, c);
+            }
+        }
+    }
+    
+    namespace detail {
+        
+        /**
+            Solve h * x = b by LDL^T decomposition of the upper triangle of h in double precision.
+         
+            \return false when h is not positive definite, x is undefined then.
+         */
+        template<int MaxN, class M, class V>
+        inline bool solveLDLT(const M &h, const V &b, int n, double *x) {
+            double l[MaxN][MaxN];
+            double d[MaxN];
+            
+            for (int j = 0; j < n; ++j) {
+                double dj = double(h(j, j));
+                for (int k = 0; k < j; ++k) {
+                    dj -= l[j][k] * l[j][k] * d[k];
+                }
+                
+                if (!(dj > 0))
+                    return false;
+                
+                d[j] = dj;
+                for (int i = j + 1; i < n; ++i) {
+                    double v = double(h(j, i));
+                    for (int k = 0; k < j; ++k) {
+                        v -= l[i][k] * l[j][k] * d[k];
+                    }
+                    l[i][j] = v / dj;
+                }
+            }
+            
+            // L * z = b, D * y = z, L^T * x = y
+            for (int i = 0; i < n; ++i) {
+                double v = double(b(i, 0));
+                for (int k = 0; k < i; ++k) {
+                    v -= l[i][k] * x[k];
+                }
+                x[i] = v;
+            }
+            
+            for (int i = 0; i < n; ++i) {
+                x[i] /= d[i];
+            }
+            
+            for (int i = n - 1; i >= 0; --i) {
+                double v = x[i];
+                for (int k = i + 1; k < n; ++k) {
+                    v -= l[k][i] * x[k];
+                }
+                x[i] = v;
+            }
+            
+            return true;
+        }
+    }
+    
+    /**
+        Solve h * x = b for symmetric positive definite h.
+     
+        Uses an LDL^T decomposition computed in double precision, reading the upper triangle
+        of h only. This is cheaper than the general inverse and together with accumulateUpper
+        avoids filling the lower triangle. Matrices that are not positive definite, e.g. of
+        textureless templates, fall back to Matx::inv and behave like the general inverse.
+     
+        \param h Symmetric matrix of which only the upper triangle is read.
+        \param b Right hand side.
+     */
+    template<class Scalar, int N>
+    inline cv::Matx<Scalar, N, 1> solveSymmetric(const cv::Matx<Scalar, N, N> &h, const cv::Matx<Scalar, N, 1> &b) {
+        double x[N];
+        if (!detail::solveLDLT<N>(h, b, N, x)) {
+            cv::Matx<Scalar, N, N> full = h;
+            symmetrizeUpper(full);
+            return full.inv() * b;
+        }
+        
+        cv::Matx<Scalar, N, 1> r;
+        for (int i = 0; i < N; ++i) {
+            r(i, 0) = Scalar(x[i]);
+        }
+        return r;
+    }
+    
+    /** 
+        Same as above for two parameters, e.g. translations, using the closed form inverse.
+     */
+    template<class Scalar>
+    inline cv::Matx<Scalar, 2, 1> solveSymmetric(const cv::Matx<Scalar, 2, 2> &h, const cv::Matx<Scalar, 2, 1> &b) {
+        const double a = h(0, 0), c = h(0, 1), d = h(1, 1);
+        const double det = a * d - c * c;
+        if (!(a > 0.0 && det > 0.0)) {
+            cv::Matx<Scalar, 2, 2> full = h;
+            symmetrizeUpper(full);
+            return full.inv() * b;
+        }
+        
+        const double b0 = b(0, 0), b1 = b(1, 0);
+        return cv::Matx<Scalar, 2, 1>(Scalar((d * b0 - c * b1) / det),
+                                      Scalar((a * b1 - c * b0) / det));
+    }
+    
+    /** Same as above for warps with a bounded number of parameters. */
+    template<class Scalar, int MaxN>
+    inline SmallMatrix<Scalar, MaxN, 1> solveSymmetric(const SmallMatrix<Scalar, MaxN, MaxN> &h, const SmallMatrix<Scalar, MaxN, 1> &b) {
+        const int n = h.rows();
+        
+        double x[MaxN];
+        if (!detail::solveLDLT<MaxN>(h, b, n, x)) {
+            SmallMatrix<Scalar, MaxN, MaxN> full = h;
+            symmetrizeUpper(full);
+            return full.inv() * b;
+        }
+        
+        SmallMatrix<Scalar, MaxN, 1> r;
+        r.create(n, 1);
+        for (int i = 0; i < n; ++i) {
+            r(i, 0) = Scalar(x[i]);
+        }
+        return r;
+    }
+    
+    /** Same as above for matrices of run time known size using the general inverse. */
+    inline cv::Mat solveSymmetric(const cv::Mat &h, const cv::Mat &b) {
+        cv::Mat full = h.clone();
+        cv::completeSymm(full);
+        return full.inv() * b;
+    }
+    
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,274 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_STREAMING_PYRAMID_H
+#define IMAGE_ALIGN_STREAMING_PYRAMID_H
+
+#include <imagealign/config.h>
+#include <imagealign/image_pyramid.h>
+#include <vector>
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+namespace imagealign {
+    
+    /**
+        Image pyramid for video streams.
+        
+        In contrast to ImagePyramid this pyramid is meant to be fed with one frame after
+        another.
+            - All level buffers are allocated once for a given frame size and reused.
+            - 8 bit frames are ingested directly. Coarser levels are computed on 8 bit images
+              and converted to floating point per level. Hence, the full resolution float
+              image is only computed when level 0 is accessed. Note that 8 bit levels are
+              rounded, which differs slightly from pyramids computed in floating point.
+            - 8 bit levels can be exported as is, see setExportDepth.
+            - Levels are computed lazily on first access.
+            - Each frame increments a generation counter. Consumers remember the generation
+              of the data they use and can test for stale data, see AlignBase::isTargetStale.
+        
+        Lazy evaluation is not thread-safe. Materialize all required levels, e.g. using
+        toPyramid, before sharing the data among threads.
+     */
+    class StreamingPyramid {
+    public:
+        
+        inline StreamingPyramid()
+            : _levels(0), _gradients(false), _generation(0), _exportDepth(CV_32F)
+        {}
+        
+        /**
+            Create and allocate pyramid.
+            
+            \param frameSize Size of frames to be pushed.
+            \param levels Number of levels.
+            \param gradients When true, interleaved gradient images are provided as well. See
+                   ImagePyramid::createGradients.
+         */
+        inline StreamingPyramid(cv::Size frameSize, int levels, bool gradients = false)
+            : _levels(0), _gradients(false), _generation(0), _exportDepth(CV_32F)
+        {
+            configure(frameSize, levels, gradients);
+        }
+        
+        /**
+            Allocate level buffers.
+            
+            \param frameSize Size of frames to be pushed.
+            \param levels Number of levels.
+            \param gradients When true, interleaved gradient images are provided as well.
+         */
+        inline void configure(cv::Size frameSize, int levels, bool gradients = false) {
+            _frameSize = frameSize;
+            _levels = std::max<int>(levels, 1);
+            _gradients = gradients;
+            
+            _pyr8.resize(_levels);
+            _pyr32.resize(_levels);
+            _grads.resize(gradients ? _levels : 0);
+            
+            cv::Size s = frameSize;
+            for (int i = 0; i < _levels; ++i) {
+                // Level 0 of 8 bit input is the frame itself.
+                if (i > 0) {
+                    _pyr8[i].create(s, CV_8UC1);
+                }
+                _pyr32[i].create(s, CV_32FC1);
+                if (gradients) {
+                    _grads[i].create(s, CV_32FC4);
+                }
+                
+                // Same as cv::pyrDown
+                s = cv::Size((s.width + 1) / 2, (s.height + 1) / 2);
+            }
+            
+            invalidate();
+        }
+        
+        /**
+            Ingest a new frame.
+            
+            The frame is referenced, not copied. It must not be modified until the next frame
+            is pushed. Pushing a frame of different size reconfigures the pyramid.
+            
+            \param frame Single channel 8 bit or floating point image.
+         */
+        inline void push(cv::InputArray frame) {
+            cv::Mat f = frame.getMat();
+            
+            CV_Assert(f.channels() == 1);
+            CV_Assert(f.depth() == CV_8U || f.depth() == CV_32F);
+            
+            if (f.size() != _frameSize || _levels == 0) {
+                configure(f.size(), std::max<int>(_levels, 1), _gradients);
+            }
+            
+            _frame = f;
+            invalidate();
+            ++_generation;
+        }
+        
+        /**
+            Set the depth of levels exported by toPyramid.
+         
+            When CV_8U and frames are 8 bit, levels are exported without conversion to 
+            floating point. Aligners sample those in fixed point, see Sampler::sampleToFloat.
+            Floating point frames are always exported as floating point.
+         
+            \param depth CV_32F or CV_8U.
+         */
+        inline void setExportDepth(int depth) {
+            CV_Assert(depth == CV_32F || depth == CV_8U);
+            _exportDepth = depth;
+        }
+        
+        /**
+            Number of frames pushed so far.
+         */
+        inline uint64 generation() const {
+            return _generation;
+        }
+        
+        /**
+            Number of levels in the pyramid.
+         */
+        inline int numLevels() const {
+            return _levels;
+        }
+        
+        /**
+            Test if gradient images are provided.
+         */
+        inline bool hasGradients() const {
+            return _gradients;
+        }
+        
+        /**
+            Return the floating point image of the i-th level. Computed on first access.
+         */
+        inline cv::Mat operator[](int level) const {
+            CV_Assert(!_frame.empty() && level >= 0 && level < _levels);
+            
+            // Floating point frames are used as is.
+            if (level == 0 && _frame.depth() == CV_32F) {
+                return _frame;
+            }
+            
+            if (!_valid32[level]) {
+                if (_frame.depth() == CV_32F) {
+                    ImagePyramid::pyrDown((*this)[level - 1], _pyr32[level], _tiles.tiles);
+                } else {
+                    level8(level).convertTo(_pyr32[level], CV_32F);
+                }
+                _valid32[level] = 1;
+            }
+            
+            return _pyr32[level];
+        }
+        
+        /**
+            Return the interleaved intensity and gradient image of the i-th level. Computed on first access.
+            
+            Requires hasGradients() to be true.
+         */
+        inline cv::Mat gradientImage(int level) const {
+            CV_Assert(_gradients);
+            
+            if (!_validGrad[level]) {
+                // 8 bit levels give the same gradients without materializing floating point levels.
+                ImagePyramid::computeGradientImage(_frame.depth() == CV_8U ? level8(level) : (*this)[level], _grads[level]);
+                _validGrad[level] = 1;
+            }
+            
+            return _grads[level];
+        }
+        
+        /**
+            Materialize levels and export them as ImagePyramid.
+            
+            Only headers are exported, pixels are shared. Gradients are exported when
+            hasGradients() is true. Once all exported levels are materialized, concurrent 
+            calls do not modify the pyramid.
+            
+            \param dst Pyramid receiving the first levels.
+            \param levels Number of levels to export.
+         */
+        inline void toPyramid(ImagePyramid &dst, int levels) const {
+            levels = std::max<int>(1, std::min<int>(levels, _levels));
+            
+            const bool export8 = _exportDepth == CV_8U && _frame.depth() == CV_8U;
+            
+            std::vector<cv::Mat> imgs(levels);
+            for (int i = 0; i < levels; ++i) {
+                imgs[i] = export8 ? level8(i) : (*this)[i];
+                if (_gradients) {
+                    gradientImage(i);
+                }
+            }
+            
+            dst.assign(imgs, _grads, levels);
+        }
+    
+    private:
+        
+        /** Mark all levels as outdated. */
+        inline void invalidate() {
+            _valid8.assign(_levels, 0);
+            _valid32.assign(_levels, 0);
+            _validGrad.assign(_levels, 0);
+        }
+        
+        /** Return 8 bit image of the i-th level. Requires 8 bit frames. */
+        inline const cv::Mat &level8(int level) const {
+            if (level == 0) {
+                return _frame;
+            }
+            
+            if (!_valid8[level]) {
+                ImagePyramid::pyrDown(level8(level - 1), _pyr8[level], _tiles.tiles);
+                _valid8[level] = 1;
+            }
+            
+            return _pyr8[level];
+        }
+        
+        cv::Size _frameSize;
+        int _levels;
+        bool _gradients;
+        uint64 _generation;
+        int _exportDepth;
+        
+        cv::Mat _frame;
+        mutable std::vector<cv::Mat> _pyr8;
+        mutable std::vector<cv::Mat> _pyr32;
+        mutable std::vector<cv::Mat> _grads;
+        mutable std::vector<uchar> _valid8;
+        mutable std::vector<uchar> _valid32;
+        mutable std::vector<uchar> _validGrad;
+        mutable detail::TileBuffers _tiles;
+    };
+
+}
+
+#endif
\ No newline at end of file
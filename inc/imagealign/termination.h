@@ -0,0 +1,232 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_TERMINATION_H
+#define IMAGE_ALIGN_TERMINATION_H
+
+#include <imagealign/config.h>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+namespace imagealign {
+    
+    /**
+        Information about a single alignment iteration passed to termination policies.
+     */
+    struct TerminationStep {
+        /** Pyramid level of iteration. Level 0 is the finest level. */
+        int level;
+        
+        /** Iteration index on level. */
+        int iteration;
+        
+        /** 
+            Maximum displacement of the template corners caused by the step. Measured in 
+            pixels of the finest pyramid level.
+         */
+        double displacement;
+        
+        /** Error before the previous step. Not finite on the first iteration of a level. */
+        double previousError;
+        
+        /** Error before this step. */
+        double error;
+        
+        TerminationStep()
+            : level(0), iteration(0), displacement(0), previousError(std::numeric_limits<double>::max()), error(0)
+        {}
+    };
+    
+    /**
+        Early rejection and early acceptance across pyramid levels.
+     
+        Tested after every pyramid level, see AlignBase::setCascade. Alignments whose mean
+        error exceeds maxError, or whose last iteration had fewer than minConstraints 
+        constraints, are rejected before any work on finer levels is done. Alignment ends
+        at finestLevel, which allows cheap low precision estimates. Defaults disable the
+        cascade.
+     */
+    struct CascadeCriteria {
+        /** Maximum mean error after a level. */
+        double maxError;
+        
+        /** Minimum number of constraints on a level. */
+        int minConstraints;
+        
+        /** Finest pyramid level to align. Level 0 is the finest level of the pyramid. */
+        int finestLevel;
+        
+        inline CascadeCriteria()
+            : maxError(std::numeric_limits<double>::max()), minConstraints(0), finestLevel(0)
+        {}
+        
+        /**
+            Create criteria.
+         
+            \param maxError_ Maximum mean error after a level.
+            \param minConstraints_ Minimum number of constraints on a level.
+            \param finestLevel_ Finest pyramid level to align.
+         */
+        inline CascadeCriteria(double maxError_, int minConstraints_, int finestLevel_ = 0)
+            : maxError(maxError_), minConstraints(minConstraints_), finestLevel(finestLevel_)
+        {}
+        
+        /** Test if a level with the given mean error and number of constraints is rejected. */
+        inline bool rejects(double error, int numConstraints) const {
+            return numConstraints < minConstraints || error > maxError;
+        }
+    };
+    
+    /**
+        Configurable termination policy for AlignBase::align.
+     
+        Termination policies control the number of iterations per level and decide when
+        alignment has converged. Any class offering the following methods can be used as
+        a policy
+     
+            void beginAlignment(int numLevels);
+            int levelIterations(int level);
+            bool converged(const TerminationStep &s);
+            bool skipFinerLevels(int level, int iterations, int accepted, double displacement);
+     
+        This implementation supports
+            - an iteration schedule per level and rolling unused iterations down to the 
+              next finer level.
+            - a minimum displacement of the template corners in pixels of the finest level.
+              Unlike the norm of the parameter delta this treats translation, rotation and 
+              scale alike.
+            - a minimum relative error change.
+            - skipping finer levels once a level has moved the template corners less than
+              a (subpixel) threshold.
+     */
+    class TerminationCriteria {
+    public:
+        
+        /**
+            Create criteria.
+         
+            \param maxIterations Total number of iterations, split evenly among levels unless a
+                   schedule is given.
+         */
+        inline explicit TerminationCriteria(int maxIterations = 100)
+            : _maxIterations(std::max<int>(maxIterations, 0)),
+              _rollover(true),
+              _minDisplacement(0),
+              _minRelativeErrorChange(0),
+              _skipFinerLevelsBelow(0),
+              _numLevels(0),
+              _carry(0)
+        {}
+        
+        /**
+            Set number of iterations per level.
+         
+            \param schedule Iterations per level, element 0 refers to the finest level. Levels
+                   not in schedule use the last entry.
+         */
+        inline TerminationCriteria &setLevelIterations(const std::vector<int> &schedule) {
+            _schedule = schedule;
+            return *this;
+        }
+        
+        /** Enable passing of unused iterations to the next finer level. Enabled by default. */
+        inline TerminationCriteria &setRollover(bool enable) {
+            _rollover = enable;
+            return *this;
+        }
+        
+        /** Stop iterating a level when template corners move less than the given number of pixels. */
+        inline TerminationCriteria &setMinDisplacement(double pixels) {
+            _minDisplacement = pixels;
+            return *this;
+        }
+        
+        /** Stop iterating a level when the error decreases by less than the given fraction. */
+        inline TerminationCriteria &setMinRelativeErrorChange(double fraction) {
+            _minRelativeErrorChange = fraction;
+            return *this;
+        }
+        
+        /** 
+            Skip finer levels when all steps of a level moved the template corners by less than 
+            the given number of pixels in total. Zero disables skipping.
+         */
+        inline TerminationCriteria &setSkipFinerLevelsBelow(double pixels) {
+            _skipFinerLevelsBelow = pixels;
+            return *this;
+        }
+        
+        inline void beginAlignment(int numLevels) {
+            _numLevels = std::max<int>(numLevels, 1);
+            _carry = 0;
+        }
+        
+        inline int levelIterations(int level) {
+            int n;
+            if (_schedule.empty()) {
+                n = _maxIterations / _numLevels;
+            } else {
+                n = _schedule[std::min<int>(level, (int)_schedule.size() - 1)];
+            }
+            return std::max<int>(n, 0) + _carry;
+        }
+        
+        inline bool converged(const TerminationStep &s) {
+            if (s.displacement < _minDisplacement)
+                return true;
+            
+            if (_minRelativeErrorChange > 0 && s.previousError < std::numeric_limits<double>::max()) {
+                const double change = (s.previousError - s.error) / std::max<double>(s.previousError, std::numeric_limits<double>::min());
+                if (change < _minRelativeErrorChange)
+                    return true;
+            }
+            
+            return false;
+        }
+        
+        /**
+            Decide after a level whether to skip finer levels.
+         
+            \param level Pyramid level finished.
+            \param iterations Iterations performed on level, including a final rejected step.
+            \param accepted Steps accepted on level.
+            \param displacement Total displacement of template corners on level.
+         */
+        inline bool skipFinerLevels(int level, int iterations, int accepted, double displacement) {
+            _carry = _rollover ? std::max<int>(0, levelIterations(level) - iterations) : 0;
+            
+            return _skipFinerLevelsBelow > 0 && accepted > 0 && displacement < _skipFinerLevelsBelow;
+        }
+        
+    private:
+        std::vector<int> _schedule;
+        int _maxIterations;
+        bool _rollover;
+        double _minDisplacement;
+        double _minRelativeErrorChange;
+        double _skipFinerLevelsBelow;
+        
+        int _numLevels;
+        int _carry;
+    };
+
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,267 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef IMAGE_ALIGN_TILED_ALIGNER_H
+#define IMAGE_ALIGN_TILED_ALIGNER_H
+
+#include <imagealign/align_base.h>
+#include <imagealign/image_pyramid.h>
+#include <imagealign/tiled_pyramid.h>
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+namespace imagealign {
+    
+    /**
+        Alignment of templates with targets too large to be held in memory.
+        
+        Before every alignment the bounds of the template warped by the current estimate are 
+        extended by a margin, see setMargin. Regions of these bounds are copied from all levels
+        of a TiledPyramid and aligned against, so that only tiles covered by the warped template
+        are decoded. Peak memory thus scales with the template footprint instead of the target 
+        size. Warps are shifted into region coordinates and back transparently.
+        
+        Regions keep a fixed size centered on the warped template, so that region buffers and
+        target dependent data of the aligner, such as target gradients, are reused between calls.
+        The size only grows when the warped template outgrows it.
+        
+        Template pixels warped beyond the margin count as outside of the target. The margin
+        should cover the displacement expected, which at the coarsest level of n levels amounts
+        to the convergence radius times 2^(n-1).
+        
+        Usage
+            
+            RawFileTileProvider raw("scan.raw", cv::Size(40000, 30000), CV_8UC1);
+            TiledPyramid target(raw, 4);
+            
+            TiledAligner< AlignInverseCompositional<W> > a;
+            a.prepare(tmpl, target, w, 4);
+            a.align(w, 30, 0.003);
+        
+        \tparam A Aligner of planar warps, e.g. AlignInverseCompositional<WarpEuclidean>.
+     */
+    template<class A>
+    class TiledAligner {
+    public:
+        typedef typename A::WarpType W;
+        typedef typename W::Traits::ScalarType ScalarType;
+        
+        TiledAligner()
+            : _target(0), _levels(0), _margin(32), _regionSize(0, 0)
+        {}
+        
+        /**
+            Set margin in finest level pixels around the warped template bounds.
+         */
+        TiledAligner &setMargin(int pixels) {
+            _margin = std::max<int>(pixels, 0);
+            return *this;
+        }
+        
+        /** Margin in finest level pixels. */
+        int margin() const {
+            return _margin;
+        }
+        
+        /**
+            Prepare for alignment.
+            
+            \param tmpl Single channel template image.
+            \param target Pyramid of target image. Must outlive subsequent calls to align.
+            \param w Initial warp, which must map the template into the target.
+            \param pyramidLevels Maximum number of pyramid levels.
+            \param mask Optional single channel 8 bit mask of template size, see AlignBase::prepare.
+         */
+        void prepare(cv::InputArray tmpl, TiledPyramid &target, const W &w, int pyramidLevels, cv::InputArray mask = cv::noArray())
+        {
+            CV_Assert(target.numLevels() > 0);
+            
+            _target = &target;
+            _templateSize = tmpl.size();
+            _levels = std::max<int>(1, std::min<int>(pyramidLevels, 
+                                                     std::min<int>(target.numLevels(), ImagePyramid::maxLevelsForImageSize(_templateSize))));
+            
+            _regionSize = cv::Size(0, 0);
+            _region = extractRegion(w);
+            CV_Assert(_region.area() > 0);
+            
+            _aligner.prepare(tmpl, _regionPyramid, shifted(w, -1), _levels, mask);
+            _levels = _aligner.numLevels();
+        }
+        
+        /**
+            Align template and target.
+            
+            Copies the region around the warped template from the target pyramid and aligns
+            against it, see AlignBase::align.
+            
+            \param w Current state of warp estimation. Will be modified to hold result.
+            \param maxIterations Maximum number of iterations in all levels.
+            \param eps Minimum length of incremental parameter vector to continue on current level.
+            \return false when the warped template misses the target or the aligner rejected the
+                    alignment, see AlignBase::rejected.
+         */
+        bool align(W &w, int maxIterations, ScalarType eps)
+        {
+            CV_Assert(_target != 0);
+            
+            _region = extractRegion(w);
+            if (_region.area() == 0)
+                return false;
+            
+            _aligner.updateTarget(_regionPyramid);
+            
+            W ws = shifted(w, -1);
+            _aligner.align(ws, maxIterations, eps);
+            w = shifted(ws, 1);
+            
+            return !_aligner.rejected();
+        }
+        
+        /** Region of the finest level used by the most recent call. */
+        cv::Rect region() const {
+            return _region;
+        }
+        
+        /** 
+            Access the aligner, e.g. to configure losses or query errors. Targets set by the
+            aligner are overridden by this class.
+         */
+        A &aligner() {
+            return _aligner;
+        }
+        
+        /** Access the aligner. */
+        const A &aligner() const {
+            return _aligner;
+        }
+    
+    private:
+        
+        /** 
+            Copy regions of all levels around the warped template.
+            
+            The region origin and size are multiples of 2^(levels - 1), which keeps the origins of
+            all levels integral and consistent with scaling warps between levels. The size is kept
+            between calls unless the warped template bounds plus margin exceed it. Regions are
+            shifted rather than shrunk at the target borders.
+            
+            \return Region of the finest level. Empty when the template misses the target.
+         */
+        cv::Rect extractRegion(const W &w)
+        {
+            typedef typename W::Traits::PointType PointType;
+            
+            const ScalarType cx[] = {ScalarType(0), ScalarType(_templateSize.width - 1)};
+            const ScalarType cy[] = {ScalarType(0), ScalarType(_templateSize.height - 1)};
+            
+            ScalarType minX = std::numeric_limits<ScalarType>::max(), maxX = -minX;
+            ScalarType minY = minX, maxY = maxX;
+            for (int i = 0; i < 4; ++i) {
+                const PointType p = w(PointType(cx[i & 1], cy[i >> 1]));
+                minX = std::min<ScalarType>(minX, p(0));
+                maxX = std::max<ScalarType>(maxX, p(0));
+                minY = std::min<ScalarType>(minY, p(1));
+                maxY = std::max<ScalarType>(maxY, p(1));
+            }
+            
+            const cv::Size s = _target->size(0);
+            const int step = 1 << (_levels - 1);
+            
+            const int bx0 = cvFloor(double(minX)) - _margin;
+            const int by0 = cvFloor(double(minY)) - _margin;
+            const int bx1 = cvCeil(double(maxX)) + 2 + _margin;
+            const int by1 = cvCeil(double(maxY)) + 2 + _margin;
+            
+            if (std::min<int>(s.width, bx1) <= std::max<int>(0, bx0) || 
+                std::min<int>(s.height, by1) <= std::max<int>(0, by0))
+                return cv::Rect();
+            
+            // Two extra steps absorb centering and rounding the origin down.
+            _regionSize.width = std::max<int>(_regionSize.width, ((bx1 - bx0 + step - 1) / step + 2) * step);
+            _regionSize.height = std::max<int>(_regionSize.height, ((by1 - by0 + step - 1) / step + 2) * step);
+            
+            const int rw = std::min<int>(_regionSize.width, s.width);
+            const int rh = std::min<int>(_regionSize.height, s.height);
+            
+            int x0 = std::min<int>((bx0 + bx1 - rw) / 2, ((s.width - rw) / step) * step);
+            int y0 = std::min<int>((by0 + by1 - rh) / 2, ((s.height - rh) / step) * step);
+            x0 = (std::max<int>(x0, 0) / step) * step;
+            y0 = (std::max<int>(y0, 0) / step) * step;
+            
+            _regionLevels.resize(_levels);
+            for (int i = 0; i < _levels; ++i) {
+                const cv::Size ls = _target->size(i);
+                const int d = (1 << i) - 1;
+                const int lx0 = x0 >> i, ly0 = y0 >> i;
+                const int lx1 = std::min<int>(ls.width, (x0 + rw + d) >> i);
+                const int ly1 = std::min<int>(ls.height, (y0 + rh + d) >> i);
+                
+                _target->region(i, cv::Rect(lx0, ly0, lx1 - lx0, ly1 - ly0), _regionLevels[i]);
+            }
+            
+            // Gradients are computed into buffers of fixed size instead of by the aligner.
+            if (A::RequiresTargetGradients) {
+                _regionGradients.resize(_levels);
+                for (int i = 0; i < _levels; ++i) {
+                    ImagePyramid::computeGradientImage(_regionLevels[i], _regionGradients[i]);
+                }
+            }
+            
+            _regionPyramid.assign(_regionLevels, _regionGradients, _levels);
+            
+            return cv::Rect(x0, y0, rw, rh);
+        }
+        
+        /** Shift a warp by the region origin, sign -1 into and sign 1 out of region coordinates. */
+        W shifted(const W &w, int sign) const
+        {
+            typename W::MType t = W::MType::eye();
+            t(0, 2) = ScalarType(sign * _region.x);
+            t(1, 2) = ScalarType(sign * _region.y);
+            
+            W r(w);
+            r.setMatrix(t * w.matrix());
+            return r;
+        }
+        
+        A _aligner;
+        TiledPyramid *_target;
+        cv::Size _templateSize;
+        int _levels;
+        int _margin;
+        cv::Rect _region;
+        cv::Size _regionSize;
+        std::vector<cv::Mat> _regionLevels;
+        std::vector<cv::Mat> _regionGradients;
+        ImagePyramid _regionPyramid;
+    };
+    
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,449 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef IMAGE_ALIGN_TILED_PYRAMID_H
+#define IMAGE_ALIGN_TILED_PYRAMID_H
+
+#include <imagealign/config.h>
+#include <imagealign/image_pyramid.h>
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+#include <fstream>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+namespace imagealign {
+    
+    /**
+        Source of pixels of an image too large to be held in memory.
+        
+        Implementations decode rectangular regions of the full resolution image on demand, 
+        e.g. from tiled image files. See TiledPyramid.
+     */
+    class TileProvider {
+    public:
+        virtual ~TileProvider() {}
+        
+        /** Size of the full resolution image. */
+        virtual cv::Size imageSize() const = 0;
+        
+        /**
+            Decode a region of the full resolution image.
+            
+            \param region Region inside the image bounds.
+            \param dst Receives single channel pixels of region. One of CV_8U, CV_16U or CV_32F.
+         */
+        virtual void readRegion(const cv::Rect &region, cv::Mat &dst) = 0;
+    };
+    
+    /**
+        Tile provider of an image in memory.
+        
+        The image is not copied. Memory mapped files are supported by wrapping the mapped
+        pixels into a cv::Mat header, so that only pages of regions read are loaded.
+     */
+    class MatTileProvider : public TileProvider {
+    public:
+        
+        inline explicit MatTileProvider(const cv::Mat &img)
+            : _img(img)
+        {
+            CV_Assert(img.channels() == 1);
+        }
+        
+        inline cv::Size imageSize() const {
+            return _img.size();
+        }
+        
+        inline void readRegion(const cv::Rect &region, cv::Mat &dst) {
+            _img(region).copyTo(dst);
+        }
+    
+    private:
+        cv::Mat _img;
+    };
+    
+    /**
+        Tile provider of a raw file of row major pixels.
+        
+        Each region is read row by row, seeking to the first pixel of a region row. Pixels
+        are expected in native byte order.
+     */
+    class RawFileTileProvider : public TileProvider {
+    public:
+        
+        /**
+            Open raw file.
+            
+            \param path Path of file.
+            \param size Size of image.
+            \param type Single channel pixel type. One of CV_8UC1, CV_16UC1 or CV_32FC1.
+            \param offset Bytes to skip at the beginning of the file, e.g. of headers.
+         */
+        inline RawFileTileProvider(const std::string &path, cv::Size size, int type, size_t offset = 0)
+            : _file(path.c_str(), std::ios::in | std::ios::binary), _size(size), _type(type), _offset(offset)
+        {
+            CV_Assert(type == CV_8UC1 || type == CV_16UC1 || type == CV_32FC1);
+        }
+        
+        /** Test if file was opened. */
+        inline bool isOpen() const {
+            return _file.is_open();
+        }
+        
+        inline cv::Size imageSize() const {
+            return _size;
+        }
+        
+        inline void readRegion(const cv::Rect &region, cv::Mat &dst) {
+            CV_Assert(isOpen());
+            
+            dst.create(region.size(), _type);
+            
+            const size_t elemSize = CV_ELEM_SIZE(_type);
+            const std::streamsize rowBytes = std::streamsize(region.width * elemSize);
+            
+            for (int y = 0; y < region.height; ++y) {
+                const size_t pos = _offset + (size_t(region.y + y) * size_t(_size.width) + size_t(region.x)) * elemSize;
+                _file.seekg(std::streamoff(pos));
+                _file.read(reinterpret_cast<char*>(dst.ptr(y)), rowBytes);
+                CV_Assert(_file.gcount() == rowBytes);
+            }
+        }
+    
+    private:
+        std::ifstream _file;
+        cv::Size _size;
+        int _type;
+        size_t _offset;
+    };
+    
+    /** Identifies a tile by pyramid level and tile coordinates. */
+    struct TileKey {
+        int level;
+        int x;
+        int y;
+        
+        inline TileKey(int level, int x, int y)
+            : level(level), x(x), y(y)
+        {}
+        
+        inline bool operator<(const TileKey &o) const {
+            if (level != o.level) return level < o.level;
+            if (y != o.y) return y < o.y;
+            return x < o.x;
+        }
+    };
+    
+    /**
+        Least recently used cache of decoded tiles.
+        
+        Tiles are evicted, least recently used first, once the cached pixel data exceeds 
+        the capacity. The most recent tile is always kept.
+     */
+    class TileCache {
+    public:
+        
+        inline explicit TileCache(size_t capacityBytes = size_t(64) << 20)
+            : _bytes(0), _capacity(capacityBytes)
+        {}
+        
+        /** Set capacity in bytes of pixel data. Evicts tiles as required. */
+        inline void setCapacity(size_t bytes) {
+            _capacity = bytes;
+            evict();
+        }
+        
+        /** Capacity in bytes of pixel data. */
+        inline size_t capacity() const {
+            return _capacity;
+        }
+        
+        /** Bytes of pixel data of cached tiles. */
+        inline size_t bytes() const {
+            return _bytes;
+        }
+        
+        /** Number of cached tiles. */
+        inline size_t size() const {
+            return _tiles.size();
+        }
+        
+        /**
+            Look up a tile and mark it most recently used.
+            
+            \return false when the tile is not cached.
+         */
+        inline bool find(const TileKey &key, cv::Mat &tile) {
+            Index::iterator i = _index.find(key);
+            if (i == _index.end())
+                return false;
+            
+            _tiles.splice(_tiles.begin(), _tiles, i->second);
+            tile = i->second->second;
+            return true;
+        }
+        
+        /** Insert a tile as most recently used, replacing a cached tile of same key. */
+        inline void insert(const TileKey &key, const cv::Mat &tile) {
+            Index::iterator i = _index.find(key);
+            if (i != _index.end()) {
+                _bytes -= tileBytes(i->second->second);
+                _tiles.erase(i->second);
+                _index.erase(i);
+            }
+            
+            _tiles.push_front(Entry(key, tile));
+            _index.insert(std::make_pair(key, _tiles.begin()));
+            _bytes += tileBytes(tile);
+            
+            evict();
+        }
+        
+        /** Remove all tiles. */
+        inline void clear() {
+            _tiles.clear();
+            _index.clear();
+            _bytes = 0;
+        }
+    
+    private:
+        typedef std::pair<TileKey, cv::Mat> Entry;
+        typedef std::list<Entry> List;
+        typedef std::map<TileKey, List::iterator> Index;
+        
+        inline static size_t tileBytes(const cv::Mat &tile) {
+            return tile.total() * tile.elemSize();
+        }
+        
+        inline void evict() {
+            while (_bytes > _capacity && _tiles.size() > 1) {
+                _bytes -= tileBytes(_tiles.back().second);
+                _index.erase(_tiles.back().first);
+                _tiles.pop_back();
+            }
+        }
+        
+        List _tiles;
+        Index _index;
+        size_t _bytes;
+        size_t _capacity;
+    };
+    
+    /**
+        Image pyramid of images too large to be held in memory.
+        
+        In contrast to ImagePyramid, levels are never materialized. Each level is divided
+        into square tiles, which are computed on first access and kept in a TileCache. Tiles
+        halve in size per level down to MinTileSize, so that tiles of all levels cover 
+        similar regions of the finest level.
+            - Tiles of the finest level are decoded from a TileProvider and converted to
+              floating point.
+            - Tiles of coarser levels are computed from the region of the next finer level 
+              covered by the tile and its filter support. Results are identical to pyramids
+              computed by ImagePyramid.
+        
+        Consumers request regions of levels, see region. Only tiles covered by requested 
+        regions are decoded, so that memory is bounded by the cache capacity rather than the
+        image size. 
+        
+        Caching is not thread-safe. Copy regions required before sharing them among threads.
+     */
+    class TiledPyramid {
+    public:
+        
+        enum {
+            /** Minimum width and height of tiles of coarse levels. */
+            MinTileSize = 16
+        };
+        
+        inline TiledPyramid()
+            : _provider(0), _tileSize(0), _decoded(0)
+        {}
+        
+        /**
+            Create pyramid.
+            
+            \param provider Source of finest level pixels. Must outlive the pyramid.
+            \param levels Maximum number of levels.
+            \param tileSize Width and height of tiles of the finest level in pixels.
+            \param cacheBytes Capacity of tile cache in bytes.
+         */
+        inline TiledPyramid(TileProvider &provider, int levels, int tileSize = 256, size_t cacheBytes = size_t(64) << 20)
+            : _provider(0), _tileSize(0), _decoded(0)
+        {
+            create(provider, levels, tileSize, cacheBytes);
+        }
+        
+        /** Same as constructor above. Clears the cache. */
+        inline void create(TileProvider &provider, int levels, int tileSize = 256, size_t cacheBytes = size_t(64) << 20) {
+            CV_Assert(tileSize > 0);
+            
+            _provider = &provider;
+            _tileSize = tileSize;
+            _decoded = 0;
+            _cache.clear();
+            _cache.setCapacity(cacheBytes);
+            
+            cv::Size s = provider.imageSize();
+            levels = std::max<int>(1, std::min<int>(levels, ImagePyramid::maxLevelsForImageSize(s)));
+            
+            _sizes.resize(levels);
+            _buffers.resize(levels);
+            for (int i = 0; i < levels; ++i) {
+                _sizes[i] = s;
+                s = cv::Size((s.width + 1) / 2, (s.height + 1) / 2);
+            }
+        }
+        
+        /** Number of levels. */
+        inline int numLevels() const {
+            return (int)_sizes.size();
+        }
+        
+        /** Size of pyramid level. */
+        inline cv::Size size(int level) const {
+            return _sizes[level];
+        }
+        
+        /** Width and height of tiles of a level. */
+        inline int tileSize(int level = 0) const {
+            return std::max<int>(_tileSize >> level, std::min<int>(_tileSize, MinTileSize));
+        }
+        
+        /** Access the tile cache, e.g. to change its capacity. */
+        inline TileCache &cache() {
+            return _cache;
+        }
+        
+        /** Access the tile cache. */
+        inline const TileCache &cache() const {
+            return _cache;
+        }
+        
+        /** Number of tiles computed since create, including tiles computed again after eviction. */
+        inline size_t numTilesDecoded() const {
+            return _decoded;
+        }
+        
+        /**
+            Access a tile.
+            
+            \param level Pyramid level.
+            \param tx Tile column.
+            \param ty Tile row.
+            \return Floating point pixels of tile, which are smaller than tileSize at the right
+                    and bottom borders.
+         */
+        inline cv::Mat tile(int level, int tx, int ty) {
+            const TileKey key(level, tx, ty);
+            
+            cv::Mat t;
+            if (_cache.find(key, t))
+                return t;
+            
+            const int ts = tileSize(level);
+            const cv::Size s = _sizes[level];
+            const cv::Rect r(tx * ts, ty * ts, std::min<int>(ts, s.width - tx * ts), std::min<int>(ts, s.height - ty * ts));
+            
+            if (level == 0) {
+                _provider->readRegion(r, _raw);
+                CV_Assert(_raw.size() == r.size() && _raw.channels() == 1);
+                _raw.convertTo(t, CV_32F);
+            } else {
+                // Output pixel x depends on pixels 2x - 2 ... 2x + 2 of the finer level, 
+                // see ImagePyramid::pyrDown. Even offsets keep the sampling phase.
+                const cv::Size ps = _sizes[level - 1];
+                const int x0 = std::max<int>(0, 2 * r.x - 2);
+                const int y0 = std::max<int>(0, 2 * r.y - 2);
+                const int x1 = std::min<int>(ps.width, 2 * (r.x + r.width) + 1);
+                const int y1 = std::min<int>(ps.height, 2 * (r.y + r.height) + 1);
+                
+                cv::Mat &src = _buffers[level - 1];
+                region(level - 1, cv::Rect(x0, y0, x1 - x0, y1 - y0), src);
+                
+                cv::pyrDown(src, _down);
+                _down(cv::Rect(r.x - x0 / 2, r.y - y0 / 2, r.width, r.height)).copyTo(t);
+            }
+            
+            ++_decoded;
+            _cache.insert(key, t);
+            
+            return t;
+        }
+        
+        /**
+            Copy a region of a pyramid level.
+            
+            Computes all tiles covered by the region that are not cached.
+            
+            \param level Pyramid level.
+            \param r Region inside the bounds of the level.
+            \param dst Receives floating point pixels of region. 
+         */
+        inline void region(int level, const cv::Rect &r, cv::Mat &dst) {
+            CV_Assert(_provider != 0);
+            CV_Assert(r.x >= 0 && r.y >= 0 && r.width > 0 && r.height > 0 &&
+                      r.x + r.width <= _sizes[level].width && r.y + r.height <= _sizes[level].height);
+            
+            dst.create(r.size(), CV_32FC1);
+            
+            const int ts = tileSize(level);
+            const int tx0 = r.x / ts, tx1 = (r.x + r.width - 1) / ts;
+            const int ty0 = r.y / ts, ty1 = (r.y + r.height - 1) / ts;
+            
+            for (int ty = ty0; ty <= ty1; ++ty) {
+                for (int tx = tx0; tx <= tx1; ++tx) {
+                    const cv::Mat t = tile(level, tx, ty);
+                    
+                    const cv::Rect bounds(tx * ts, ty * ts, t.cols, t.rows);
+                    const cv::Rect common = bounds & r;
+                    
+                    cv::Mat d = dst(common - r.tl());
+                    t(common - bounds.tl()).copyTo(d);
+                }
+            }
+        }
+    
+    private:
+        TileProvider *_provider;
+        int _tileSize;
+        size_t _decoded;
+        TileCache _cache;
+        std::vector<cv::Size> _sizes;
+        
+        /** Regions of finer levels, one per level to allow recursion. */
+        std::vector<cv::Mat> _buffers;
+        cv::Mat _raw;
+        cv::Mat _down;
+    };
+    
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,245 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef IMAGE_ALIGN_TRANSLATION_SEARCH_H
+#define IMAGE_ALIGN_TRANSLATION_SEARCH_H
+
+#include <imagealign/config.h>
+#include <imagealign/warp.h>
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+namespace imagealign {
+    
+    /** Scores of integer translation search. */
+    enum ESearchScore {
+        /** Sum of squared differences. */
+        SEARCH_SSD,
+        
+        /** Normalized cross correlation. Invariant to gain and bias of target intensities. */
+        SEARCH_NCC
+    };
+    
+    /**
+        Exhaustive search of integer translations of a template.
+        
+        Gradient based alignment converges only when the initial estimate is within a 
+        few pixels of the solution at the coarsest pyramid level. Applied to the coarsest 
+        level beforehand, this search tests all integer offsets within a radius of the 
+        current estimate and moves the warp to the best one, so that large motions 
+        converge in few iterations.
+        
+        Sums of target intensities and squared intensities over candidate windows are 
+        computed by separable running box sums, the cross term with the template directly.
+        Buffers are kept between invocations. Template masks are ignored.
+        
+        Usage
+            
+            TranslationSearch s;
+            s.setRadius(4);
+            s.apply(templateLevel, targetLevel, w);
+     */
+    class TranslationSearch {
+    public:
+        
+        inline TranslationSearch()
+            : _radius(0), _score(SEARCH_NCC)
+        {}
+        
+        /** Set search radius in pixels. Zero disables the search. */
+        inline TranslationSearch &setRadius(int radius) {
+            _radius = std::max<int>(radius, 0);
+            return *this;
+        }
+        
+        /** Set score to compare candidates with, see ESearchScore. */
+        inline TranslationSearch &setScore(int score) {
+            _score = score;
+            return *this;
+        }
+        
+        /** Search radius in pixels. */
+        inline int radius() const {
+            return _radius;
+        }
+        
+        /** Score to compare candidates with. */
+        inline int score() const {
+            return _score;
+        }
+        
+        /**
+            Move a translational warp to the best integer offset.
+            
+            Candidates are template sized windows of the target at integer positions around
+            the rounded translation. Windows not fully inside the target are skipped. The 
+            warp is left untouched when the rounded translation already scores best.
+            
+            \param tpl Floating point template image.
+            \param target Single channel target image of the same pyramid level.
+            \param w Translational warp. Will be modified to hold result.
+            \return true when the warp was moved.
+         */
+        template<class W>
+        bool apply(const cv::Mat &tpl, const cv::Mat &target, W &w)
+        {
+            typedef typename W::Traits::ParamType ParamType;
+            typedef typename W::Traits::ScalarType ScalarType;
+            
+            CV_Assert(IsTranslationWarp<W>::value);
+            CV_Assert(tpl.type() == CV_32FC1 && target.channels() == 1);
+            
+            if (_radius == 0 || tpl.empty())
+                return false;
+            
+            ParamType p = w.parameters();
+            const int bx = cvRound(double(W::Traits::at(p, 0, 0)));
+            const int by = cvRound(double(W::Traits::at(p, 1, 0)));
+            
+            // 1. Region of the target covered by all candidate windows
+            const cv::Rect all(bx - _radius, by - _radius, tpl.cols + 2 * _radius, tpl.rows + 2 * _radius);
+            const cv::Rect roi = all & cv::Rect(0, 0, target.cols, target.rows);
+            if (roi.width < tpl.cols || roi.height < tpl.rows)
+                return false;
+            
+            target(roi).convertTo(_target, CV_32F);
+            
+            const int nx = roi.width - tpl.cols + 1;
+            const int ny = roi.height - tpl.rows + 1;
+            
+            // 2. Template statistics
+            const double n = double(tpl.cols) * double(tpl.rows);
+            double sumT = 0, sumTT = 0;
+            for (int y = 0; y < tpl.rows; ++y) {
+                const float *t = tpl.ptr<float>(y);
+                for (int x = 0; x < tpl.cols; ++x) {
+                    sumT += t[x];
+                    sumTT += double(t[x]) * double(t[x]);
+                }
+            }
+            const double varT = sumTT - sumT * sumT / n;
+            
+            // 3. Vertical box sums of the first candidate row, updated incrementally below
+            _columns.assign(roi.width, 0.0);
+            _columnsSq.assign(roi.width, 0.0);
+            for (int y = 0; y < tpl.rows; ++y) {
+                addRow(y, 1.0);
+            }
+            
+            const int ox0 = bx - roi.x;
+            const int oy0 = by - roi.y;
+            
+            int bestX = ox0, bestY = oy0;
+            double bestCost = std::numeric_limits<double>::max();
+            
+            for (int oy = 0; oy < ny; ++oy) {
+                if (oy > 0) {
+                    addRow(oy - 1, -1.0);
+                    addRow(oy + tpl.rows - 1, 1.0);
+                }
+                
+                // 4. Horizontal running sums give box sums of all candidates in this row
+                double box = 0, boxSq = 0;
+                for (int x = 0; x < tpl.cols; ++x) {
+                    box += _columns[x];
+                    boxSq += _columnsSq[x];
+                }
+                
+                for (int ox = 0; ox < nx; ++ox) {
+                    if (ox > 0) {
+                        box += _columns[ox + tpl.cols - 1] - _columns[ox - 1];
+                        boxSq += _columnsSq[ox + tpl.cols - 1] - _columnsSq[ox - 1];
+                    }
+                    
+                    const double cross = crossCorrelation(tpl, ox, oy);
+                    
+                    double cost;
+                    if (_score == SEARCH_SSD) {
+                        cost = sumTT - 2.0 * cross + boxSq;
+                    } else {
+                        const double varI = boxSq - box * box / n;
+                        const double denom = varT * varI;
+                        if (!(denom > 0.0))
+                            continue;
+                        cost = -(cross - sumT * box / n) / std::sqrt(denom);
+                    }
+                    
+                    // Prefer the current estimate on ties
+                    const bool current = (ox == ox0 && oy == oy0);
+                    if (cost < bestCost || (current && cost <= bestCost)) {
+                        bestCost = cost;
+                        bestX = ox;
+                        bestY = oy;
+                    }
+                }
+            }
+            
+            if (bestX == ox0 && bestY == oy0)
+                return false;
+            
+            W::Traits::at(p, 0, 0) = ScalarType(roi.x + bestX);
+            W::Traits::at(p, 1, 0) = ScalarType(roi.y + bestY);
+            w.setParameters(p);
+            
+            return true;
+        }
+    
+    private:
+        
+        /** Add a row of the target region to the vertical box sums. */
+        inline void addRow(int y, double sign) {
+            const float *r = _target.ptr<float>(y);
+            for (int x = 0; x < _target.cols; ++x) {
+                _columns[x] += sign * r[x];
+                _columnsSq[x] += sign * double(r[x]) * double(r[x]);
+            }
+        }
+        
+        /** Sum of products of template and the candidate window at (ox, oy) of the target region. */
+        inline double crossCorrelation(const cv::Mat &tpl, int ox, int oy) const {
+            double sum = 0;
+            for (int y = 0; y < tpl.rows; ++y) {
+                const float *t = tpl.ptr<float>(y);
+                const float *r = _target.ptr<float>(oy + y) + ox;
+                
+                for (int x = 0; x < tpl.cols; ++x) {
+                    sum += double(t[x]) * double(r[x]);
+                }
+            }
+            return sum;
+        }
+        
+        int _radius;
+        int _score;
+        cv::Mat _target;
+        std::vector<double> _columns;
+        std::vector<double> _columnsSq;
+    };
+    
+}
+
+#endif
\ No newline at end of file
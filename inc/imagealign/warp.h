@@ -21,6 +21,7 @@
 #define IMAGE_ALIGN_WARP_H
 
 #include <imagealign/config.h>
+#include <imagealign/small_matrix.h>
 
 IA_DISABLE_PRAGMA_WARN(4190)
 IA_DISABLE_PRAGMA_WARN(4244)
@@ -28,6 +29,9 @@ IA_DISABLE_PRAGMA_WARN(4244)
 IA_DISABLE_PRAGMA_WARN_END
 IA_DISABLE_PRAGMA_WARN_END
 
+#include <algorithm>
+#include <cmath>
+
 namespace imagealign {
     
     /** 
@@ -104,6 +108,10 @@ namespace imagealign {
         
         /** Helper function to allocate a new GradientType object initialized to zero. */
         static GradientType initGradient(Scalar x, Scalar y);
+        
+        /** Helper function to access element (i, j) of any of the matrix types above. */
+        template<class M>
+        static Scalar &at(M &m, int i, int j);
     };
     
     /** 
@@ -151,11 +159,27 @@ namespace imagealign {
         static GradientType initGradient(Scalar x, Scalar y) {
             return GradientType(x, y);
         }
+        
+        /** Helper function to access element (i, j) of a matrix. */
+        template<int Rows, int Cols>
+        static Scalar &at(cv::Matx<Scalar, Rows, Cols> &m, int i, int j) {
+            return m(i, j);
+        }
+        
+        /** Helper function to access element (i, j) of a matrix. */
+        template<int Rows, int Cols>
+        static Scalar at(const cv::Matx<Scalar, Rows, Cols> &m, int i, int j) {
+            return m(i, j);
+        }
 
     };
     
     /**
         Default warp traits implementation for run time known parameter sizes.
+        
+        Matrices are cv::Mat, which allocate on the heap for every Jacobian and steepest descent
+        row. Prefer WarpTraitsForBoundedParameterCount when an upper bound on the number of
+        parameters is known.
      */
     template<int W, class Scalar>
     struct WarpTraitsForRunTimeKnownParameterCount {
@@ -203,6 +227,84 @@ namespace imagealign {
             return g;
         }
         
+        /** Helper function to access element (i, j) of a matrix. */
+        static Scalar &at(cv::Mat &m, int i, int j) {
+            return m.at<Scalar>(i, j);
+        }
+        
+        /** Helper function to access element (i, j) of a matrix. */
+        static Scalar at(const cv::Mat &m, int i, int j) {
+            return m.at<Scalar>(i, j);
+        }
+        
+    };
+    
+    /**
+        Warp traits implementation for run time known parameter sizes up to a maximum.
+        
+        Matrices are SmallMatrix with inline storage for MaxN parameters, so alignment does
+        not allocate per pixel. Jacobian tables hold their entries contiguously.
+     */
+    template<int W, int MaxN, class Scalar>
+    struct WarpTraitsForBoundedParameterCount {
+        enum {
+            WarpMode = W,
+            ParametersAtCompileTime = -1,
+            MaxParametersAtCompileTime = MaxN
+        };
+        
+        /** Precision of floating point type */
+        typedef Scalar ScalarType;
+        
+        /** Type to hold a 2 dimensional point */
+        typedef cv::Matx<Scalar, 2, 1> PointType;
+        
+        /** Type to hold parameters of warp. */
+        typedef SmallMatrix<Scalar, MaxN, 1> ParamType;
+        
+        /** Type to hold a gradient in x and y direction. Matrix of size 1x2. */
+        typedef SmallMatrix<Scalar, 1, 2> GradientType;
+        
+        /** Type to hold Jacobian of warp. */
+        typedef SmallMatrix<Scalar, 2, MaxN> JacobianType;
+        
+        /** Type to hold Hessian matrix. */
+        typedef SmallMatrix<Scalar, MaxN, MaxN> HessianType;
+        
+        /** Type to hold the steepest descent image for a single pixel */
+        typedef SmallMatrix<Scalar, 1, MaxN> PixelSDIType;
+        
+        /** Helper function to allocate a new ParamType object initialized to zero. */
+        static ParamType zeroParam(int nParams) {
+            return ParamType::zeros(nParams, 1);
+        }
+        
+        /** Helper function to allocate a new HessianType object initialized to zero. */
+        static HessianType zeroHessian(int nParams) {
+            return HessianType::zeros(nParams, nParams);
+        }
+        
+        /** Helper function to initialize a new gradient. */
+        static GradientType initGradient(Scalar x, Scalar y) {
+            GradientType g;
+            g.create(1, 2);
+            g(0, 0) = x;
+            g(0, 1) = y;
+            return g;
+        }
+        
+        /** Helper function to access element (i, j) of a matrix. */
+        template<int Rows, int Cols>
+        static Scalar &at(SmallMatrix<Scalar, Rows, Cols> &m, int i, int j) {
+            return m(i, j);
+        }
+        
+        /** Helper function to access element (i, j) of a matrix. */
+        template<int Rows, int Cols>
+        static Scalar at(const SmallMatrix<Scalar, Rows, Cols> &m, int i, int j) {
+            return m(i, j);
+        }
+        
     };
     
     /**
@@ -223,6 +325,18 @@ namespace imagealign {
     template<class Scalar>
     struct WarpTraits<WARP_SIMILARITY, Scalar> : WarpTraitsForCompileTimeKnownParameterCount<WARP_SIMILARITY, 4, Scalar> {};
     
+    /**
+        Warp traits for affine motion.
+     */
+    template<class Scalar>
+    struct WarpTraits<WARP_AFFINE, Scalar> : WarpTraitsForCompileTimeKnownParameterCount<WARP_AFFINE, 6, Scalar> {};
+    
+    /**
+        Warp traits for perspective motion.
+     */
+    template<class Scalar>
+    struct WarpTraits<WARP_PERSPECTIVE, Scalar> : WarpTraitsForCompileTimeKnownParameterCount<WARP_PERSPECTIVE, 8, Scalar> {};
+    
     /**
         Interface declaration for warps.
      
@@ -348,10 +462,236 @@ namespace imagealign {
             
         }
         
+        /**
+            Prepare incremental warping of consecutive pixels in a row.
+            
+            Planar warps are linear in homogeneous coordinates. Warping pixel (x + i, y)
+            thus amounts to start + i * step, followed by the projective division for
+            perspective motions.
+            
+            \param x Column of the first pixel in row.
+            \param y Row of pixels.
+            \param start Receives the homogeneous coordinates of the warped first pixel.
+            \param step Receives the homogeneous increment per pixel in x direction.
+         */
+        inline void scanline(Scalar x, Scalar y, cv::Matx<Scalar, 3, 1> &start, cv::Matx<Scalar, 3, 1> &step) const {
+            start = _m * cv::Matx<Scalar, 3, 1>(x, y, Scalar(1));
+            step = _m.col(0);
+        }
+    
     protected:
         MType _m;
     };
     
+    /**
+        Compile time test whether a warp derives from PlanarWarp.
+     */
+    template<class W>
+    struct IsPlanarWarp {
+    private:
+        template<int WarpMode, class Scalar>
+        static char test(const PlanarWarp<WarpMode, Scalar> *);
+        static long test(...);
+    public:
+        enum {
+            value = sizeof(test(static_cast<const W*>(0))) == sizeof(char)
+        };
+    };
+    
+    /**
+        Compile time test whether a warp is a pure translation.
+        
+        The Jacobian of such warps is the identity everywhere, which allows algorithms to use
+        image gradients directly as steepest descent images.
+     */
+    template<class W>
+    struct IsTranslationWarp {
+        enum {
+            value = int(W::Traits::WarpMode) == int(WARP_TRANSLATION) && int(W::Traits::ParametersAtCompileTime) == 2
+        };
+    };
+    
+    /**
+        Evaluate a warp for consecutive pixels of an image row.
+        
+        Alignment algorithms visit template pixels row by row. This generic version
+        simply invokes the warp for each pixel. Planar warps are evaluated incrementally,
+        see specialization below.
+        
+        Usage
+            
+            WarpScanline<W> ws(w);
+            for (int y = 0; y < rows; ++y) {
+                ws.start(0, y);
+                for (int x = 0; x < cols; ++x, ws.next()) {
+                    PointType p = ws.point();
+                }
+            }
+     */
+    template<class W, bool Planar = IsPlanarWarp<W>::value>
+    class WarpScanline {
+    public:
+        typedef typename W::Traits::PointType PointType;
+        typedef typename W::Traits::ScalarType ScalarType;
+        
+        enum {
+            /** Whether span computes exact ranges of valid pixels. */
+            ExactSpans = 0
+        };
+        
+        inline explicit WarpScanline(const W &w)
+            : _w(w), _x0(0), _x(0), _y(0)
+        {}
+        
+        /** Position on pixel (x, y). */
+        inline void start(int x, int y) {
+            _x0 = ScalarType(x);
+            _x = _x0;
+            _y = ScalarType(y);
+        }
+        
+        /** Position on the i-th pixel counted from the pixel passed to start. */
+        inline void seek(int i) {
+            _x = _x0 + ScalarType(i);
+        }
+        
+        /** Warped coordinates of current pixel. */
+        inline PointType point() const {
+            return _w(PointType(_x, _y));
+        }
+        
+        /** Advance to next pixel in row. */
+        inline void next() {
+            _x += ScalarType(1);
+        }
+        
+        /**
+            Range of pixels in row whose warped coordinates might fall into a rectangle.
+         
+            Generic warps cannot be bounded, so all n pixels are reported.
+         */
+        inline void span(int n, ScalarType /*lo*/, ScalarType /*hiX*/, ScalarType /*hiY*/, int &first, int &last) const {
+            first = 0;
+            last = std::max<int>(n, 0);
+        }
+    
+    private:
+        const W &_w;
+        ScalarType _x0, _x, _y;
+    };
+    
+    /**
+        Incremental row evaluation for planar warps.
+        
+        The warp matrix is applied once per row. Subsequent pixels are computed from
+        the row start and a constant step vector. The step is scaled by the pixel offset
+        rather than accumulated, so single precision warps do not drift on long rows.
+     */
+    template<class W>
+    class WarpScanline<W, true> {
+    public:
+        typedef typename W::Traits::PointType PointType;
+        typedef typename W::Traits::ScalarType ScalarType;
+        
+        inline explicit WarpScanline(const W &w)
+            : _w(w), _i(0)
+        {}
+        
+        /** Position on pixel (x, y). */
+        inline void start(int x, int y) {
+            _w.scanline(ScalarType(x), ScalarType(y), _start, _step);
+            _i = ScalarType(0);
+        }
+        
+        /** Position on the i-th pixel counted from the pixel passed to start. */
+        inline void seek(int i) {
+            _i = ScalarType(i);
+        }
+        
+        /** Warped coordinates of current pixel. */
+        inline PointType point() const {
+            const ScalarType hx = _start(0) + _i * _step(0);
+            const ScalarType hy = _start(1) + _i * _step(1);
+            
+            if (W::Traits::WarpMode < WARP_PERSPECTIVE) {
+                return PointType(hx, hy);
+            } else {
+                const ScalarType iw = ScalarType(1) / (_start(2) + _i * _step(2));
+                return PointType(hx * iw, hy * iw);
+            }
+        }
+        
+        /** Advance to next pixel in row. */
+        inline void next() {
+            _i += ScalarType(1);
+        }
+        
+        /**
+            Range of pixels in row whose warped coordinates fall into a rectangle.
+            
+            Warped coordinates are linear in the pixel offset, for perspective warps after
+            multiplying by the (positive) homogeneous coordinate. Each rectangle border thus 
+            bounds the offset from one side, and the valid pixels form a single range which 
+            is computed from the row start and step alone.
+            
+            Pixels exactly at the bounds may be misclassified by rounding. Callers requiring
+            exact results verify the pixels at both ends of the range.
+            
+            \param n Number of pixels in row, counted from the pixel passed to start.
+            \param lo Lower bound of x and y coordinates (inclusive).
+            \param hiX Upper bound of x coordinates (exclusive).
+            \param hiY Upper bound of y coordinates (exclusive).
+            \param first Receives first pixel offset in range.
+            \param last Receives pixel offset past range. Equals first when no pixel is in range.
+         */
+        inline void span(int n, ScalarType lo, ScalarType hiX, ScalarType hiY, int &first, int &last) const {
+            // Valid offsets i satisfy a <= i <= b
+            double a = 0, b = double(n - 1);
+            
+            const double sw = (W::Traits::WarpMode < WARP_PERSPECTIVE) ? 1.0 : double(_start(2));
+            const double dw = (W::Traits::WarpMode < WARP_PERSPECTIVE) ? 0.0 : double(_step(2));
+            
+            // Positive homogeneous coordinate, i.e points in front of the camera
+            clipLinear(sw, dw, a, b);
+            
+            // lo * w <= x < hiX * w
+            clipLinear(double(_start(0)) - double(lo) * sw, double(_step(0)) - double(lo) * dw, a, b);
+            clipLinear(double(hiX) * sw - double(_start(0)), double(hiX) * dw - double(_step(0)), a, b);
+            
+            // lo * w <= y < hiY * w
+            clipLinear(double(_start(1)) - double(lo) * sw, double(_step(1)) - double(lo) * dw, a, b);
+            clipLinear(double(hiY) * sw - double(_start(1)), double(hiY) * dw - double(_step(1)), a, b);
+            
+            a = std::min<double>(a, double(std::max<int>(n, 0)));
+            b = std::max<double>(b, -1.0);
+            
+            first = (int)std::ceil(a);
+            last = std::max<int>(first, (int)std::floor(b) + 1);
+        }
+        
+        enum {
+            /** Whether span computes exact ranges of valid pixels. */
+            ExactSpans = 1
+        };
+    
+    private:
+        
+        /** Intersect range [a, b] with the offsets i satisfying c0 + i * c1 >= 0. */
+        static inline void clipLinear(double c0, double c1, double &a, double &b) {
+            if (c1 > 0) {
+                a = std::max<double>(a, -c0 / c1);
+            } else if (c1 < 0) {
+                b = std::min<double>(b, -c0 / c1);
+            } else if (c0 < 0) {
+                b = -1.0;
+            }
+        }
+        
+        const W &_w;
+        cv::Matx<ScalarType, 3, 1> _start, _step;
+        ScalarType _i;
+    };
+    
     /** 
         Warp implementation for pure translational motion.
      
@@ -705,6 +1045,260 @@ namespace imagealign {
         
     };
     
+    /**
+        Warp implementation for affine motion.
+     
+        An affine transform consists of a linear transformation and a translation. It preserves 
+        parallel lines and straight lines.
+     
+        The warp is parametrized with 6 parameters (tx, ty, a, b, c, d). In matrix notation
+     
+            (1 + a)     c     tx
+               b     (1 + d)  ty
+     
+        The identity transform corresponds to all parameters being zero.
+     */
+    template<class Scalar>
+    class Warp<WARP_AFFINE, Scalar> : public PlanarWarp<WARP_AFFINE, Scalar> {
+    private:
+        using PlanarWarp<WARP_AFFINE, Scalar>::_m;
+    public:
+        
+        using PlanarWarp<WARP_AFFINE, Scalar>::matrix;
+        using PlanarWarp<WARP_AFFINE, Scalar>::setMatrix;
+        
+        typedef WarpTraits<WARP_AFFINE, Scalar> Traits;
+        typedef typename Traits::PointType PointType;
+        typedef typename Traits::ParamType ParamType;
+        typedef typename Traits::JacobianType JacobianType;
+        
+        /** Get warp parameters */
+        ParamType parameters() const {
+            ParamType p;
+            p(0, 0) = _m(0, 2);
+            p(1, 0) = _m(1, 2);
+            p(2, 0) = _m(0, 0) - Scalar(1);
+            p(3, 0) = _m(1, 0);
+            p(4, 0) = _m(0, 1);
+            p(5, 0) = _m(1, 1) - Scalar(1);
+            return p;
+        }
+        
+        /** Set warp parameters */
+        void setParameters(const ParamType &p) {
+            _m(0, 2) = p(0, 0);
+            _m(1, 2) = p(1, 0);
+            
+            _m(0, 0) = Scalar(1) + p(2, 0);
+            _m(1, 0) = p(3, 0);
+            _m(0, 1) = p(4, 0);
+            _m(1, 1) = Scalar(1) + p(5, 0);
+        }
+        
+        /** Scale the parameters of the warp. */
+        Warp<WARP_AFFINE, Scalar> scaled(int numLevels) const
+        {
+            ParamType p = this->parameters();
+            Scalar s = std::pow(Scalar(2), numLevels);
+            p(0, 0) *= s;
+            p(1, 0) *= s;
+            
+            Warp<WARP_AFFINE, Scalar> w;
+            w.setParameters(p);
+            
+            return w;
+        }
+        
+        /**
+            Compute the jacobian of the warp.
+         
+            The Jacobian matrix contains the partial derivatives of the warp parameters
+            with respect to x and y coordinates, evaluated at the current value of parameters.
+            In this case:
+         
+                    tx   ty   a   b   c   d
+                x   1    0    x   0   y   0
+                y   0    1    0   x   0   y
+         
+         */
+        JacobianType jacobian(const PointType &p) const {
+            JacobianType j = JacobianType::zeros();
+            j(0, 0) = Scalar(1);
+            j(1, 1) = Scalar(1);
+            
+            j(0, 2) = p(0);
+            j(1, 3) = p(0);
+            
+            j(0, 4) = p(1);
+            j(1, 5) = p(1);
+            
+            return j;
+        }
+        
+        /** Forward additive step. */
+        void updateForwardAdditive(const ParamType &delta) {
+            setParameters(parameters() + delta);
+        }
+        
+        /** Forward compositional step. */
+        void updateForwardCompositional(const ParamType &delta) {
+            Warp<WARP_AFFINE, Scalar> wDelta;
+            wDelta.setParameters(delta);
+            setMatrix(matrix() * wDelta.matrix());
+        }
+        
+        /** Inverse compositional step. */
+        void updateInverseCompositional(const ParamType &delta) {
+            Warp<WARP_AFFINE, Scalar> wDelta;
+            wDelta.setParameters(delta);
+            setMatrix(matrix() * wDelta.invMatrix());
+        }
+    };
+    
+    /**
+        Warp implementation for perspective motion.
+     
+        A perspective transform (homography) relates two images of a planar scene. It preserves 
+        straight lines only.
+     
+        The warp is parametrized with 8 parameters (tx, ty, a, b, c, d, e, f). In matrix notation
+     
+            (1 + a)     c     tx
+               b     (1 + d)  ty
+               e        f      1
+     
+        Points are warped in homogeneous coordinates followed by division through the third 
+        coordinate. The matrix is kept normalized such that its lower right element equals one.
+     */
+    template<class Scalar>
+    class Warp<WARP_PERSPECTIVE, Scalar> : public PlanarWarp<WARP_PERSPECTIVE, Scalar> {
+    private:
+        using PlanarWarp<WARP_PERSPECTIVE, Scalar>::_m;
+    public:
+        
+        using PlanarWarp<WARP_PERSPECTIVE, Scalar>::matrix;
+        
+        typedef WarpTraits<WARP_PERSPECTIVE, Scalar> Traits;
+        typedef typename Traits::PointType PointType;
+        typedef typename Traits::ParamType ParamType;
+        typedef typename Traits::JacobianType JacobianType;
+        typedef typename PlanarWarp<WARP_PERSPECTIVE, Scalar>::MType MType;
+        
+        /** Set warp matrix. The matrix is normalized such that its lower right element equals one. */
+        void setMatrix(const MType &m) {
+            _m = m * (Scalar(1) / m(2, 2));
+        }
+        
+        /** Get warp parameters */
+        ParamType parameters() const {
+            ParamType p;
+            p(0, 0) = _m(0, 2);
+            p(1, 0) = _m(1, 2);
+            p(2, 0) = _m(0, 0) - Scalar(1);
+            p(3, 0) = _m(1, 0);
+            p(4, 0) = _m(0, 1);
+            p(5, 0) = _m(1, 1) - Scalar(1);
+            p(6, 0) = _m(2, 0);
+            p(7, 0) = _m(2, 1);
+            return p;
+        }
+        
+        /** Set warp parameters */
+        void setParameters(const ParamType &p) {
+            _m(0, 2) = p(0, 0);
+            _m(1, 2) = p(1, 0);
+            
+            _m(0, 0) = Scalar(1) + p(2, 0);
+            _m(1, 0) = p(3, 0);
+            _m(0, 1) = p(4, 0);
+            _m(1, 1) = Scalar(1) + p(5, 0);
+            
+            _m(2, 0) = p(6, 0);
+            _m(2, 1) = p(7, 0);
+            _m(2, 2) = Scalar(1);
+        }
+        
+        /** 
+            Scale the parameters of the warp. 
+         
+            Corresponds to S * H * S^-1 with S = diag(s, s, 1).
+         */
+        Warp<WARP_PERSPECTIVE, Scalar> scaled(int numLevels) const
+        {
+            ParamType p = this->parameters();
+            Scalar s = std::pow(Scalar(2), numLevels);
+            p(0, 0) *= s;
+            p(1, 0) *= s;
+            p(6, 0) /= s;
+            p(7, 0) /= s;
+            
+            Warp<WARP_PERSPECTIVE, Scalar> w;
+            w.setParameters(p);
+            
+            return w;
+        }
+        
+        /**
+            Compute the jacobian of the warp.
+         
+            The Jacobian matrix contains the partial derivatives of the warp parameters
+            with respect to x and y coordinates, evaluated at the current value of parameters.
+            In this case:
+         
+                    tx    ty    a     b     c     d     e         f
+                x   1/w   0     x/w   0     y/w   0    -x*x'/w   -y*x'/w
+                y   0     1/w   0     x/w   0     y/w  -x*y'/w   -y*y'/w
+         
+            with (x', y') being the warped point and w = e*x + f*y + 1. At identity the Jacobian 
+            simplifies to w = 1, x' = x and y' = y.
+         */
+        JacobianType jacobian(const PointType &p) const {
+            const Scalar x = p(0);
+            const Scalar y = p(1);
+            
+            const Scalar iw = Scalar(1) / (_m(2, 0) * x + _m(2, 1) * y + _m(2, 2));
+            const Scalar wx = (_m(0, 0) * x + _m(0, 1) * y + _m(0, 2)) * iw;
+            const Scalar wy = (_m(1, 0) * x + _m(1, 1) * y + _m(1, 2)) * iw;
+            
+            JacobianType j = JacobianType::zeros();
+            j(0, 0) = iw;
+            j(1, 1) = iw;
+            
+            j(0, 2) = x * iw;
+            j(1, 3) = x * iw;
+            
+            j(0, 4) = y * iw;
+            j(1, 5) = y * iw;
+            
+            j(0, 6) = -x * wx * iw;
+            j(1, 6) = -x * wy * iw;
+            
+            j(0, 7) = -y * wx * iw;
+            j(1, 7) = -y * wy * iw;
+            
+            return j;
+        }
+        
+        /** Forward additive step. */
+        void updateForwardAdditive(const ParamType &delta) {
+            setParameters(parameters() + delta);
+        }
+        
+        /** Forward compositional step. */
+        void updateForwardCompositional(const ParamType &delta) {
+            Warp<WARP_PERSPECTIVE, Scalar> wDelta;
+            wDelta.setParameters(delta);
+            setMatrix(matrix() * wDelta.matrix());
+        }
+        
+        /** Inverse compositional step. */
+        void updateInverseCompositional(const ParamType &delta) {
+            Warp<WARP_PERSPECTIVE, Scalar> wDelta;
+            wDelta.setParameters(delta);
+            setMatrix(matrix() * wDelta.invMatrix());
+        }
+    };
+    
     typedef Warp<WARP_TRANSLATION, float> WarpTranslationF;
     typedef Warp<WARP_TRANSLATION, double> WarpTranslationD;
     
@@ -714,6 +1308,12 @@ namespace imagealign {
     typedef Warp<WARP_SIMILARITY, float> WarpSimilarityF;
     typedef Warp<WARP_SIMILARITY, double> WarpSimilarityD;
     
+    typedef Warp<WARP_AFFINE, float> WarpAffineF;
+    typedef Warp<WARP_AFFINE, double> WarpAffineD;
+    
+    typedef Warp<WARP_PERSPECTIVE, float> WarpPerspectiveF;
+    typedef Warp<WARP_PERSPECTIVE, double> WarpPerspectiveD;
+    
 }
 
 #endif
\ No newline at end of file
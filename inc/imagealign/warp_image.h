@@ -22,9 +22,101 @@
 
 #include <imagealign/sampling.h>
 #include <imagealign/warp.h>
+#include <imagealign/parallel.h>
 #include <opencv2/core/core.hpp>
+#include <algorithm>
 
 namespace imagealign {
+    
+    namespace detail {
+        
+        /** Sample a block of coordinates in the pixel type of the source. */
+        template<class ChannelType, class S, class Scalar>
+        inline void sampleBlock(const S &s, const cv::Mat &src, const Scalar *xs, const Scalar *ys, int n, ChannelType *dst)
+        {
+            s.template sample<ChannelType>(src, xs, ys, n, dst);
+        }
+        
+        /** Sample a block of coordinates of 8 bit, 16 bit or floating point sources to floating point. */
+        template<class S, class Scalar>
+        inline void sampleBlock(const S &s, const cv::Mat &src, const Scalar *xs, const Scalar *ys, int n, float *dst)
+        {
+            s.sampleToFloat(src, xs, ys, n, dst);
+        }
+        
+        
+        /**
+            Warps chunks of destination rows.
+         
+            Source coordinates are advanced incrementally along each row and sampled in 
+            blocks, so that no heap memory is required.
+         
+            \tparam Channels Number of interleaved channels of source and destination.
+         */
+        template<class ChannelType, int Channels, int SampleMethod, class W>
+        class WarpImageRows {
+        public:
+            typedef typename W::Traits::ScalarType ScalarType;
+            typedef typename W::Traits::PointType PointType;
+            
+            WarpImageRows(const cv::Mat &src, cv::Mat &dst, const W &w, const Sampler<SampleMethod> &s)
+                : _src(src), _dst(dst), _w(w), _s(s)
+            {}
+            
+            void operator()(int /*chunk*/, int rowBegin, int rowEnd) const {
+                const int BlockSize = 64;
+                ScalarType xs[BlockSize], ys[BlockSize];
+                
+                WarpScanline<W> ws(_w);
+                
+                for (int y = rowBegin; y < rowEnd; ++y) {
+                    ChannelType *r = _dst.ptr<ChannelType>(y);
+                    ws.start(0, y);
+                    
+                    for (int x0 = 0; x0 < _dst.cols; x0 += BlockSize) {
+                        const int n = std::min<int>(BlockSize, _dst.cols - x0);
+                        
+                        for (int i = 0; i < n; ++i, ws.next()) {
+                            PointType wp = ws.point();
+                            xs[i] = wp(0);
+                            ys[i] = wp(1);
+                        }
+                        
+                        sample(xs, ys, n, r + x0 * Channels);
+                    }
+                }
+            }
+            
+        private:
+            
+            template<int C>
+            struct Tag {};
+            
+            inline void sample(const ScalarType *xs, const ScalarType *ys, int n, ChannelType *dst) const {
+                sample(xs, ys, n, dst, Tag<Channels>());
+            }
+            
+            inline void sample(const ScalarType *xs, const ScalarType *ys, int n, ChannelType *dst, Tag<1>) const {
+                sampleBlock(_s, _src, xs, ys, n, dst);
+            }
+            
+            template<int C>
+            inline void sample(const ScalarType *xs, const ScalarType *ys, int n, ChannelType *dst, Tag<C>) const {
+                _s.template sampleInterleaved<ChannelType, C>(_src, xs, ys, n, dst);
+            }
+            
+            const cv::Mat &_src;
+            cv::Mat &_dst;
+            const W &_w;
+            const Sampler<SampleMethod> &_s;
+        };
+        
+        template<class ChannelType, int Channels, int SampleMethod, class W>
+        inline void warpImageRows(const cv::Mat &src, cv::Mat &dst, const W &w, const Sampler<SampleMethod> &s)
+        {
+            parallelForRows(RowChunks(0, dst.rows, dst.cols), WarpImageRows<ChannelType, Channels, SampleMethod, W>(src, dst, w, s));
+        }
+    }
 
     /**
         Warp an image using bilinear interpolation.
@@ -33,9 +125,16 @@ namespace imagealign {
         of the warp is such that for given pixel in the destination image, the warp reports the corresponding
         pixel in the source image.
      
-        This method will call create on the destination image.
+        This method will call create on the destination image. The destination has pixel type
+        ChannelType and as many channels as the source. When ChannelType is float, 8 and 16 bit 
+        single channel sources are interpolated by Sampler::sampleToFloat.
      
-        \param src_ Source image
+        Images of up to four interleaved channels, e.g. BGR images, are warped in a single pass
+        and interpolate all channels of a pixel at once. Source coordinates are computed
+        incrementally per row, see WarpScanline. Large images are processed in parallel
+        chunks of rows, see RowChunks.
+     
+        \param src_ Source image with one to four channels.
         \param dst_ Destination image
         \param dstSize Size of destination image
         \param s Sampler to use.
@@ -44,29 +143,35 @@ namespace imagealign {
     template<class ChannelType, int SampleMethod, int WarpType, class Scalar>
     void warpImage(cv::InputArray src_, cv::OutputArray dst_, cv::Size dstSize, const Warp<WarpType, Scalar> &w, const Sampler<SampleMethod> &s = Sampler<SampleMethod>())
     {
-        CV_Assert(src_.channels() == 1);
-        
-        typedef typename Warp<WarpType, Scalar>::Traits::PointType PointType;
+        const int channels = src_.channels();
         
-        dst_.create(dstSize, src_.type());
+        CV_Assert(channels >= 1 && channels <= 4);
+        CV_Assert(channels == 1 || src_.depth() == cv::DataType<ChannelType>::depth);
         
         cv::Mat src = src_.getMat();
+        
+        dst_.create(dstSize, CV_MAKETYPE(cv::DataType<ChannelType>::depth, channels));
         cv::Mat dst = dst_.getMat();
         
-        for (int y = 0; y < dstSize.height; ++y) {
-            ChannelType *r = dst.ptr<ChannelType>(y);
-            
-            for (int x = 0; x < dstSize.width; ++x) {
-                PointType wp = w(PointType(Scalar(x), Scalar(y)));
-                r[x] = s.template sample<ChannelType>(src, wp);
-            }
+        if (dstSize.width <= 0 || dstSize.height <= 0)
+            return;
+        
+        switch (channels) {
+            case 1:
+                detail::warpImageRows<ChannelType, 1>(src, dst, w, s);
+                break;
+            case 2:
+                detail::warpImageRows<ChannelType, 2>(src, dst, w, s);
+                break;
+            case 3:
+                detail::warpImageRows<ChannelType, 3>(src, dst, w, s);
+                break;
+            default:
+                detail::warpImageRows<ChannelType, 4>(src, dst, w, s);
+                break;
         }
     }
     
-    
-    
-    
-    
 }
 
 #endif
\ No newline at end of file
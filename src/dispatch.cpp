@@ -0,0 +1,69 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <imagealign/simd_dispatch.h>
+
+IA_DISABLE_PRAGMA_WARN(4190)
+IA_DISABLE_PRAGMA_WARN(4244)
+#include <opencv2/core/core.hpp>
+IA_DISABLE_PRAGMA_WARN_END
+IA_DISABLE_PRAGMA_WARN_END
+
+#if defined(IA_USE_DISPATCH)
+
+namespace imagealign {
+    
+    namespace detail {
+        
+        /** Kernels compiled with the baseline flags of ialign. */
+        static const SIMDKernels *simdKernelsNative()
+        {
+            static const SIMDKernels kernels = {
+                native::instructionSet(),
+                &native::dotProduct,
+                &native::multiply,
+                &native::bilinearInterior
+            };
+            return &kernels;
+        }
+        
+        /** Select kernels of the best instruction set supported by the CPU and operating system. */
+        static const SIMDKernels *selectSIMDKernels()
+        {
+#if defined(CV_CPU_AVX_512F)
+            if (cv::checkHardwareSupport(CV_CPU_AVX_512F))
+                return simdKernelsAVX512();
+#endif
+#if defined(CV_CPU_AVX2)
+            if (cv::checkHardwareSupport(CV_CPU_AVX2))
+                return simdKernelsAVX2();
+#endif
+            return simdKernelsNative();
+        }
+        
+        const SIMDKernels &simdKernels()
+        {
+            static const SIMDKernels *kernels = selectSIMDKernels();
+            return *kernels;
+        }
+    }
+}
+
+#endif
\ No newline at end of file
@@ -16,3 +16,19 @@
  You should have received a copy of the GNU General Public License
  along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
 */
+
+
+#include <imagealign/imagealign.h>
+
+#if defined(IA_PRECOMPILED)
+
+#define IA_INSTANTIATE_ALIGNER(A, W) \
+    template class A<W>; \
+    template class AlignBase< A<W>, W, LossSquared >;
+
+namespace imagealign {
+    
+    IA_PRECOMPILED_ALIGNERS(IA_INSTANTIATE_ALIGNER)
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,40 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// Compiled with AVX2 enabled. Must not include headers other than simd_kernels.h.
+#define IA_KERNEL_NAMESPACE avx2
+#include <imagealign/simd_kernels.h>
+
+namespace imagealign {
+    
+    namespace detail {
+        
+        const SIMDKernels *simdKernelsAVX2()
+        {
+            static const SIMDKernels kernels = {
+                avx2::instructionSet(),
+                &avx2::dotProduct,
+                &avx2::multiply,
+                &avx2::bilinearInterior
+            };
+            return &kernels;
+        }
+    }
+}
\ No newline at end of file
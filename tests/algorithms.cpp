@@ -22,9 +22,20 @@
 #include <imagealign/forward_additive.h>
 #include <imagealign/forward_compositional.h>
 #include <imagealign/inverse_compositional.h>
+#include <imagealign/efficient_second_order.h>
+#include <imagealign/batch_aligner.h>
+#include <imagealign/ocl_batch_aligner.h>
+#include <imagealign/prepared_template.h>
+#include <imagealign/align_context.h>
+#include <imagealign/sequence_tracker.h>
+#include <imagealign/multi_hypothesis.h>
+#include <imagealign/tiled_aligner.h>
+#include <imagealign/solve.h>
 #include <imagealign/warp_image.h>
 #include <iostream>
 
+#include "allocation_counter.h"
+
 template< class A, class W >
 W testAlgorithm(cv::Mat tpl, cv::Mat target, W w, int levels, const typename W::Traits::ParamType &expected, double tolerance = 0.01)
 {
@@ -69,6 +80,9 @@ TEST_CASE("algorithm-translation")
         
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 1, expected);
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, expected);
+        
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 1, expected);
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 2, expected);
     }
     
     // Double precision floating point
@@ -88,6 +102,9 @@ TEST_CASE("algorithm-translation")
         
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 1, expected);
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, expected);
+        
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 1, expected);
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 2, expected);
     }
 }
 
@@ -122,6 +139,9 @@ TEST_CASE("algorithm-euclidean")
         
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 1, expected);
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, expected);
+        
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 1, expected);
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 2, expected);
     }
     
     // Double precision floating point
@@ -145,6 +165,9 @@ TEST_CASE("algorithm-euclidean")
         
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 1, expected);
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, expected);
+        
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 1, expected);
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 2, expected);
     }
 }
 
@@ -180,6 +203,9 @@ TEST_CASE("algorithm-similarity")
         
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 1, expected, 0.02);
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, expected, 0.02);
+        
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 1, expected, 0.02);
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 2, expected, 0.02);
     }
     
     // Double precision floating point
@@ -204,7 +230,90 @@ TEST_CASE("algorithm-similarity")
         
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 1, expected, 0.02);
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, expected, 0.02);
+        
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 1, expected, 0.02);
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 2, expected, 0.02);
+    }
+}
+
+TEST_CASE("algorithm-affine")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    cv::Mat tmpl;
+    
+    typedef ia::WarpAffineD W;
+    
+    W::Traits::ParamType expected;
+    expected << 30, 25, 0.05, 0.08, -0.06, -0.04;
+    
+    W w;
+    w.setParameters(expected);
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    
+    W::Traits::ParamType noise;
+    noise << 0.8, -0.7, 0.01, -0.01, 0.01, 0.01;
+    w.setParameters(expected + noise);
+    
+    testAlgorithm< ia::AlignForwardAdditive<W> >(tmpl, target, w, 1, expected, 0.02);
+    testAlgorithm< ia::AlignForwardAdditive<W> >(tmpl, target, w, 2, expected, 0.02);
+    
+    testAlgorithm< ia::AlignForwardCompositional<W> >(tmpl, target, w, 1, expected, 0.02);
+    testAlgorithm< ia::AlignForwardCompositional<W> >(tmpl, target, w, 2, expected, 0.02);
+    
+    testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 1, expected, 0.02);
+    testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, expected, 0.02);
+    
+    testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 1, expected, 0.02);
+    testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 2, expected, 0.02);
+}
+
+TEST_CASE("algorithm-perspective")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    cv::Mat tmpl;
+    
+    typedef ia::WarpPerspectiveD W;
+    
+    W::Traits::ParamType expected;
+    expected << 30, 25, 0.05, 0.03, -0.04, -0.02, 0.001, -0.0005;
+    
+    W w;
+    w.setParameters(expected);
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    
+    W::Traits::ParamType noise;
+    noise << 0.8, -0.7, 0.01, -0.01, 0.01, 0.01, 0, 0;
+    w.setParameters(expected + noise);
+    
+    testAlgorithm< ia::AlignForwardAdditive<W> >(tmpl, target, w, 1, expected, 0.02);
+    testAlgorithm< ia::AlignForwardCompositional<W> >(tmpl, target, w, 1, expected, 0.02);
+    testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 1, expected, 0.02);
+    testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, expected, 0.02);
+    
+    testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 1, expected, 0.02);
+    testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 2, expected, 0.02);
+    
+    // Single precision inverse compositional
+    typedef ia::WarpPerspectiveF WF;
+    WF wf;
+    WF::Traits::ParamType expectedF, noiseF;
+    for (int i = 0; i < 8; ++i) {
+        expectedF(i, 0) = float(expected(i, 0));
+        noiseF(i, 0) = float(noise(i, 0));
     }
+    wf.setParameters(expectedF + noiseF);
+    testAlgorithm< ia::AlignInverseCompositional<WF> >(tmpl, target, wf, 1, expectedF, 0.02);
+    testAlgorithm< ia::AlignESM<WF> >(tmpl, target, wf, 1, expectedF, 0.02);
 }
 
 // Test dummy dynamic warp;
@@ -280,6 +389,69 @@ namespace imagealign {
 	private:
 		cv::Mat_<Scalar> _m;
 	};
+	
+	const int WARP_TRANSLATION_BOUNDED = 254;
+	
+	template<class Scalar>
+	struct WarpTraits<WARP_TRANSLATION_BOUNDED, Scalar> : WarpTraitsForBoundedParameterCount<WARP_TRANSLATION_BOUNDED, 8, Scalar> {};
+	
+	template<class Scalar>
+	class Warp<WARP_TRANSLATION_BOUNDED, Scalar> {
+	public:
+		typedef WarpTraits<WARP_TRANSLATION_BOUNDED, Scalar> Traits;
+		
+		Warp() {
+			setIdentity();
+		}
+		
+		int numParameters() const {
+			return 2;
+		}
+		
+		void setIdentity() {
+			_p = Traits::zeroParam(2);
+		}
+		
+		Warp<WARP_TRANSLATION_BOUNDED, Scalar> scaled(int numLevels) const
+		{
+			Warp<WARP_TRANSLATION_BOUNDED, Scalar> ws(*this);
+			ws._p *= std::pow(Scalar(2), numLevels);
+			return ws;
+		}
+		
+		typename Traits::PointType operator()(const typename Traits::PointType &p) const {
+			return typename Traits::PointType(p(0) + _p(0, 0), p(1) + _p(1, 0));
+		}
+		
+		typename Traits::JacobianType jacobian(const typename Traits::PointType &p) const {
+			return Traits::JacobianType::eye(2, 2);
+		}
+		
+		void updateInverseCompositional(const typename Traits::ParamType &delta) {
+			_p -= delta;
+		}
+		
+		void updateForwardAdditive(const typename Traits::ParamType &delta) {
+			_p += delta;
+		}
+		
+		void updateForwardCompositional(const typename Traits::ParamType &delta) {
+			_p += delta;
+		}
+		
+		// Helper functions
+		
+		void setParameters(const typename Traits::ParamType &p) {
+			_p = p;
+		}
+		
+		typename Traits::ParamType parameters() const {
+			return _p;
+		}
+	
+	private:
+		typename Traits::ParamType _p;
+	};
 }
 
 TEST_CASE("algorithm-dynamic-warp")
@@ -313,6 +485,9 @@ TEST_CASE("algorithm-dynamic-warp")
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 1, expected);
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, expected);
         
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 1, expected);
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 2, expected);
+        
         testAlgorithm< ia::AlignForwardCompositional<W> >(tmpl, target, w, 1, expected);
         testAlgorithm< ia::AlignForwardCompositional<W> >(tmpl, target, w, 2, expected);
     }
@@ -338,8 +513,2151 @@ TEST_CASE("algorithm-dynamic-warp")
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 1, expected);
         testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, expected);
         
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 1, expected);
+        testAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 2, expected);
+        
         testAlgorithm< ia::AlignForwardCompositional<W> >(tmpl, target, w, 1, expected);
         testAlgorithm< ia::AlignForwardCompositional<W> >(tmpl, target, w, 2, expected);
     }
 
 }
+
+
+template< class A, class W >
+void testBoundedAlgorithm(cv::Mat tpl, cv::Mat target, W w, int levels, const typename W::Traits::ParamType &expected)
+{
+    A a;
+    a.prepare(tpl, target, w, levels);
+    
+    W warmup = w;
+    a.align(warmup, 100, 0);
+    
+    // Bounded parameter storage is inline, so a warmed up aligner must not touch the heap.
+    const int before = allocations();
+    a.align(w, 100, 0);
+    const int after = allocations();
+    
+    REQUIRE(after == before);
+    REQUIRE(ia::parameterNorm(w.parameters() - expected) == Catch::Detail::Approx(0).epsilon(0.01));
+}
+
+TEST_CASE("algorithm-bounded-warp")
+{
+    namespace ia = imagealign;
+    
+    // Small matrix operations match cv::Matx
+    {
+        typedef ia::SmallMatrix<double, 8, 8> M;
+        typedef ia::SmallMatrix<double, 8, 1> V;
+        
+        cv::Matx33d hx(4, 1, 0.5,
+                       1, 3, 0.2,
+                       0.5, 0.2, 2);
+        cv::Matx31d bx(1, -2, 0.5);
+        
+        M h(3, 3);
+        V b(3, 1);
+        for (int i = 0; i < 3; ++i) {
+            b(i, 0) = bx(i, 0);
+            for (int j = 0; j < 3; ++j)
+                h(i, j) = hx(i, j);
+        }
+        
+        const V x = ia::solveSymmetric(h, b);
+        const V y = h.inv() * b;
+        const cv::Matx31d expected = hx.inv() * bx;
+        
+        REQUIRE(x.rows() == 3);
+        REQUIRE(x.cols() == 1);
+        for (int i = 0; i < 3; ++i) {
+            REQUIRE(x(i, 0) == Catch::Detail::Approx(expected(i, 0)));
+            REQUIRE(y(i, 0) == Catch::Detail::Approx(expected(i, 0)));
+        }
+        
+        const M hth = h.t() * h;
+        REQUIRE(hth(0, 1) == Catch::Detail::Approx((hx.t() * hx)(0, 1)));
+        REQUIRE(ia::parameterNorm(b * 2.0 - b - b) == 0);
+        REQUIRE(ia::parameterNorm(M(3, 3).inv()) == 0);  // Singular
+    }
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    cv::Mat tmpl = target(cv::Rect(20, 20, 10, 10));
+    
+    typedef ia::Warp<ia::WARP_TRANSLATION_BOUNDED, float> W;
+    
+    W::Traits::ParamType expected = W::Traits::zeroParam(2);
+    expected(0, 0) = 20;
+    expected(1, 0) = 20;
+    
+    W::Traits::ParamType noisy = W::Traits::zeroParam(2);
+    noisy(0, 0) = 19;
+    noisy(1, 0) = 19;
+    
+    W w;
+    w.setParameters(noisy);
+    
+    testBoundedAlgorithm< ia::AlignForwardAdditive<W> >(tmpl, target, w, 1, expected);
+    testBoundedAlgorithm< ia::AlignForwardAdditive<W> >(tmpl, target, w, 2, expected);
+    
+    testBoundedAlgorithm< ia::AlignForwardCompositional<W> >(tmpl, target, w, 1, expected);
+    testBoundedAlgorithm< ia::AlignForwardCompositional<W> >(tmpl, target, w, 2, expected);
+    
+    testBoundedAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 1, expected);
+    testBoundedAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, expected);
+    
+    testBoundedAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 1, expected);
+    testBoundedAlgorithm< ia::AlignESM<W> >(tmpl, target, w, 2, expected);
+}
+
+TEST_CASE("sdi-planes")
+{
+    ia::SDIPlanes sdi;
+    sdi.create(3, 37, 5);
+    
+    REQUIRE(sdi.numParameters() == 3);
+    REQUIRE(sdi.width() == 37);
+    REQUIRE(sdi.height() == 5);
+    REQUIRE(sdi.rowStride() >= 37);
+    
+    cv::RNG rng(42);
+    for (int p = 0; p < 3; ++p) {
+        for (int y = 0; y < 5; ++y) {
+            // Rows start at cache line boundaries
+            REQUIRE(((size_t)sdi.ptr(p, y) % 64) == 0);
+            for (int x = 0; x < 37; ++x) {
+                sdi.ptr(p, y)[x] = rng.uniform(-1.f, 1.f);
+            }
+        }
+    }
+    
+    for (int p = 0; p < 3; ++p) {
+        for (int q = 0; q < 3; ++q) {
+            double expected = 0;
+            for (int y = 0; y < 5; ++y) {
+                for (int x = 0; x < 37; ++x) {
+                    expected += double(sdi.ptr(p, y)[x]) * double(sdi.ptr(q, y)[x]);
+                }
+            }
+            REQUIRE(sdi.dot(p, q) == Approx(expected).epsilon(1e-4));
+        }
+    }
+    
+    // Same dimensions reuse memory
+    const float *first = sdi.ptr(0, 0);
+    sdi.create(3, 37, 5);
+    REQUIRE(sdi.ptr(0, 0) == first);
+    
+    // Byte buffers are not limited to the int range of single rows
+    cv::Mat buf;
+    ia::detail::createBytes(buf, 10000);
+    REQUIRE(buf.isContinuous());
+    REQUIRE(buf.total() * buf.elemSize() >= size_t(10000));
+    REQUIRE(buf.rows > 1);
+}
+
+TEST_CASE("batch-aligner")
+{
+    namespace ia = imagealign;
+    typedef ia::WarpTranslationF W;
+    
+    cv::Mat target(120, 120, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    ia::ImagePyramid targetPyramid;
+    targetPyramid.create(target, 3);
+    
+    // Templates of varying size, including one that is too small to be tracked.
+    std::vector<cv::Rect> rects;
+    rects.push_back(cv::Rect(20, 20, 20, 20));
+    rects.push_back(cv::Rect(50, 30, 31, 25));
+    rects.push_back(cv::Rect(70, 70, 12, 16));
+    rects.push_back(cv::Rect(10, 80, 2, 2));
+    
+    std::vector<cv::Mat> templates;
+    std::vector<W> warps(rects.size());
+    for (size_t i = 0; i < rects.size(); ++i) {
+        templates.push_back(target(rects[i]));
+        warps[i].setParameters(W::Traits::ParamType(float(rects[i].x) - 1.5f, float(rects[i].y) + 1.2f));
+    }
+    std::vector<W> initial = warps;
+    
+    ia::BatchAligner<W> ba;
+    ba.prepare(templates, W(), 3);
+    REQUIRE(ba.numTracks() == 4);
+    REQUIRE(ba.numLevels(3) == 0);
+    
+    std::vector<uchar> status;
+    std::vector<float> errors;
+    ba.align(targetPyramid, warps, 30, 0.001f, &status, &errors);
+    
+    REQUIRE(status.size() == 4);
+    REQUIRE(status[3] == 0);
+    
+    for (size_t i = 0; i < 3; ++i) {
+        REQUIRE(status[i] == 1);
+        
+        // Results match individually prepared aligners
+        W w = initial[i];
+        ia::AlignInverseCompositional<W> ic;
+        ic.prepare(templates[i], targetPyramid, w, 3);
+        ic.align(w, 30, 0.001f);
+        
+        REQUIRE(ba.numLevels((int)i) == ic.numLevels());
+        REQUIRE(cv::norm(w.parameters() - warps[i].parameters(), cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(1e-6));
+        REQUIRE(errors[i] == Catch::Detail::Approx(ic.lastError()));
+        
+        W::Traits::ParamType expected((float)rects[i].x, (float)rects[i].y);
+        REQUIRE(cv::norm(warps[i].parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.01));
+    }
+    
+    // Preparing again with same layout reuses the arena
+    ba.prepare(templates, W(), 3);
+    warps = initial;
+    std::vector<uchar> status2;
+    ba.align(targetPyramid, warps, 30, 0.001f, &status2);
+    REQUIRE(status2 == status);
+}
+
+/** Host emulation of the OpenCL kernel of OclBatchAligner reading the packed buffers. */
+template<class W>
+struct EmulatedOclLaunch {
+    EmulatedOclLaunch(imagealign::detail::OclBatchHost<W> &host_, const imagealign::ImagePyramid &target_)
+        : host(host_), target(target_)
+    {}
+    
+    void operator()(int lev, int m) const {
+        const int nParams = host.numParameters();
+        const float *arena = host.arena();
+        
+        cv::Mat tgt;
+        target[lev].convertTo(tgt, CV_32F);
+        
+        for (int g = 0; g < m; ++g) {
+            const int l = host.levelIndices()(0, g);
+            const int *desc = host.layout()[l];
+            const int tplOffset = desc[0], tplStride = desc[1], width = desc[2], height = desc[3];
+            const int sdiOffset = desc[4], sdiStride = desc[5];
+            const float *mx = host.matrices()[g];
+            const int iw = width - 2, ih = height - 2;
+            const int plane = ih * sdiStride;
+            
+            std::vector<float> acc(nParams + 2, 0.f);
+            for (int sy = 0; sy < ih; ++sy) {
+                for (int sx = 0; sx < iw; ++sx) {
+                    const float x = float(sx + 1), y = float(sy + 1);
+                    float px = mx[0] * x + mx[1] * y + mx[2];
+                    float py = mx[3] * x + mx[4] * y + mx[5];
+                    if (int(W::Traits::WarpMode) == imagealign::WARP_PERSPECTIVE) {
+                        const float pz = mx[6] * x + mx[7] * y + mx[8];
+                        px /= pz;
+                        py /= pz;
+                    }
+                    if (!(px >= 1.5f && py >= 1.5f && px < tgt.cols - 0.5f && py < tgt.rows - 0.5f))
+                        continue;
+                    
+                    const int ix = (int)std::floor(px), iy = (int)std::floor(py);
+                    const int ix1 = ix + 1 < tgt.cols ? ix + 1 : tgt.cols - 2;
+                    const int iy1 = iy + 1 < tgt.rows ? iy + 1 : tgt.rows - 2;
+                    const float a = px - (float)ix, b = py - (float)iy;
+                    const float *r0 = tgt.ptr<float>(iy);
+                    const float *r1 = tgt.ptr<float>(iy1);
+                    const float v = (r0[ix] * (1.f - a) + r0[ix1] * a) * (1.f - b) + (r1[ix] * (1.f - a) + r1[ix1] * a) * b;
+                    const float err = v - arena[tplOffset + (sy + 1) * tplStride + sx + 1];
+                    
+                    const float *sd = arena + sdiOffset + sy * sdiStride + sx;
+                    for (int k = 0; k < nParams; ++k)
+                        acc[k] += sd[k * plane] * err;
+                    acc[nParams] += err * err;
+                    acc[nParams + 1] += 1.f;
+                }
+            }
+            
+            const float *h = host.invHessians()[l];
+            float *out = host.results()[g];
+            for (int r = 0; r < nParams; ++r) {
+                float d = 0.f;
+                for (int c = 0; c < nParams; ++c)
+                    d += h[r * nParams + c] * acc[c];
+                out[r] = d;
+            }
+            out[nParams] = acc[nParams];
+            out[nParams + 1] = acc[nParams + 1];
+        }
+    }
+    
+    imagealign::detail::OclBatchHost<W> &host;
+    const imagealign::ImagePyramid &target;
+};
+
+TEST_CASE("ocl-batch-host")
+{
+    namespace ia = imagealign;
+    typedef ia::WarpSimilarityF W;
+    
+    // Own generator, leaves the sequence of later tests untouched
+    cv::RNG rng(11);
+    cv::Mat target(120, 120, CV_8UC1);
+    for (int y = 0; y < target.rows; ++y)
+        for (int x = 0; x < target.cols; ++x)
+            target.at<uchar>(y, x) = (uchar)rng.uniform(0, 255);
+    cv::blur(target, target, cv::Size(5,5));
+    
+    ia::ImagePyramid targetPyramid;
+    targetPyramid.create(target, 3);
+    
+    std::vector<cv::Rect> rects;
+    rects.push_back(cv::Rect(20, 20, 20, 20));
+    rects.push_back(cv::Rect(50, 30, 31, 25));
+    rects.push_back(cv::Rect(70, 70, 12, 16));
+    rects.push_back(cv::Rect(10, 80, 2, 2));
+    
+    std::vector<cv::Mat> templates;
+    std::vector<W> warps(rects.size());
+    for (size_t i = 0; i < rects.size(); ++i) {
+        templates.push_back(target(rects[i]));
+        warps[i].setParameters(W::Traits::ParamType(float(rects[i].x) - 1.5f, float(rects[i].y) + 1.2f, 0.f, 0.f));
+    }
+    std::vector<W> cpuWarps = warps;
+    
+    ia::BatchAligner<W> ba;
+    ba.prepare(templates, W(), 3);
+    std::vector<uchar> cpuStatus;
+    ba.align(targetPyramid, cpuWarps, 30, 0.001f, &cpuStatus);
+    
+    ia::detail::OclBatchHost<W> host;
+    host.prepare(templates, W(), 3);
+    REQUIRE(host.numTracks() == 4);
+    REQUIRE(host.numParameters() == 4);
+    
+    // One layout row per track level, referring to template and steepest descent images in the arena
+    int levels = 0;
+    for (int t = 0; t < host.numTracks(); ++t)
+        levels += host.batch().numLevels(t);
+    REQUIRE(host.layout().rows == levels);
+    REQUIRE(host.invHessians().rows == levels);
+    REQUIRE(host.invHessians().cols == 16);
+    
+    REQUIRE(host.layout()(0, 2) == 20);
+    REQUIRE(host.layout()(0, 3) == 20);
+    REQUIRE(host.layout()(0, 5) == ia::SDIPlanes::alignedRowStride(18));
+    REQUIRE(size_t(host.layout()(levels - 1, 4)) < host.arenaSize());
+    
+    cv::Mat tpl(20, 20, CV_32FC1, const_cast<float*>(host.arena()) + host.layout()(0, 0), size_t(host.layout()(0, 1)) * sizeof(float));
+    cv::Mat expected;
+    templates[0].convertTo(expected, CV_32F);
+    REQUIRE(cv::norm(tpl, expected, cv::NORM_L1) == 0);
+    
+    // Per launch buffers hold all tracks
+    REQUIRE(host.levelIndices().cols == 4);
+    REQUIRE(host.matrices().rows == 4);
+    REQUIRE(host.matrices().cols == 9);
+    REQUIRE(host.results().rows == 4);
+    REQUIRE(host.results().cols == 6);
+    
+    // Lockstep alignment on the packed buffers matches the host implementation
+    EmulatedOclLaunch<W> launch(host, targetPyramid);
+    std::vector<uchar> status;
+    std::vector<float> errors;
+    host.align(warps, targetPyramid.numLevels(), 30, 0.001f, &status, &errors, launch);
+    
+    REQUIRE(status == cpuStatus);
+    REQUIRE(status[3] == 0);
+    for (size_t i = 0; i < 3; ++i) {
+        REQUIRE(status[i] == 1);
+        REQUIRE(cv::norm(warps[i].parameters() - cpuWarps[i].parameters(), cv::NORM_L1) < 0.01);
+    }
+}
+
+#if defined(IA_USE_OPENCL)
+TEST_CASE("ocl-batch-aligner")
+{
+    namespace ia = imagealign;
+    typedef ia::WarpSimilarityF W;
+    
+    if (!ia::OclBatchAligner<W>::available())
+        return;
+    
+    cv::Mat target(120, 120, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    ia::ImagePyramid targetPyramid;
+    targetPyramid.create(target, 3);
+    
+    std::vector<cv::Rect> rects;
+    rects.push_back(cv::Rect(20, 20, 20, 20));
+    rects.push_back(cv::Rect(50, 30, 31, 25));
+    rects.push_back(cv::Rect(70, 70, 12, 16));
+    rects.push_back(cv::Rect(10, 80, 2, 2));
+    
+    std::vector<cv::Mat> templates;
+    std::vector<W> warps(rects.size());
+    for (size_t i = 0; i < rects.size(); ++i) {
+        templates.push_back(target(rects[i]));
+        warps[i].setParameters(W::Traits::ParamType(float(rects[i].x) - 1.5f, float(rects[i].y) + 1.2f, 0.f, 0.f));
+    }
+    std::vector<W> cpuWarps = warps;
+    
+    ia::BatchAligner<W> ba;
+    ba.prepare(templates, W(), 3);
+    std::vector<uchar> cpuStatus;
+    ba.align(targetPyramid, cpuWarps, 30, 0.001f, &cpuStatus);
+    
+    ia::OclBatchAligner<W> oba;
+    oba.prepare(templates, W(), 3);
+    oba.setTarget(targetPyramid);
+    REQUIRE(oba.numTracks() == 4);
+    
+    std::vector<uchar> status;
+    oba.align(warps, 30, 0.001f, &status);
+    
+    // Results match the host implementation up to single precision rounding.
+    REQUIRE(status == cpuStatus);
+    for (size_t i = 0; i < 3; ++i) {
+        REQUIRE(cv::norm(warps[i].parameters() - cpuWarps[i].parameters(), cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.01));
+    }
+}
+#endif
+
+TEST_CASE("algorithm-update")
+{
+    namespace ia = imagealign;
+    typedef ia::WarpTranslationF W;
+    
+    cv::Mat frame0(100, 100, CV_8UC1), frame1(100, 100, CV_8UC1);
+    cv::randu(frame0, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(frame0, frame0, cv::Size(5,5));
+    cv::randu(frame1, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(frame1, frame1, cv::Size(5,5));
+    
+    // Pyramids reuse buffers of equal size
+    ia::ImagePyramid pyr;
+    pyr.create(frame0, 3, true);
+    const uchar *data = pyr[1].data;
+    const uchar *gradData = pyr.gradientImage(1).data;
+    pyr.create(frame1, 3, true);
+    REQUIRE(pyr[1].data == data);
+    REQUIRE(pyr.gradientImage(1).data == gradData);
+    
+    W::Traits::ParamType expected(20, 20);
+    
+    W w0;
+    w0.setParameters(W::Traits::ParamType(18, 18));
+    
+    // Updating the target matches preparing from scratch
+    {
+        ia::AlignForwardAdditive<W> a, b;
+        a.prepare(frame1(cv::Rect(20, 20, 30, 30)), frame0, w0, 2);
+        a.updateTarget(frame1);
+        b.prepare(frame1(cv::Rect(20, 20, 30, 30)), frame1, w0, 2);
+        
+        W wa = w0, wb = w0;
+        a.align(wa, 50, 0.001f);
+        b.align(wb, 50, 0.001f);
+        
+        REQUIRE(cv::norm(wa.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.01));
+        REQUIRE(cv::norm(wa.parameters() - wb.parameters(), cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(1e-6));
+    }
+    
+    // Updating the template matches preparing from scratch
+    {
+        ia::AlignInverseCompositional<W> a, b;
+        a.prepare(frame0(cv::Rect(20, 20, 30, 30)), frame1, w0, 2);
+        a.updateTemplate(frame1(cv::Rect(20, 20, 30, 30)), w0);
+        b.prepare(frame1(cv::Rect(20, 20, 30, 30)), frame1, w0, 2);
+        
+        W wa = w0, wb = w0;
+        a.align(wa, 50, 0.001f);
+        b.align(wb, 50, 0.001f);
+        
+        REQUIRE(cv::norm(wa.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.01));
+        REQUIRE(cv::norm(wa.parameters() - wb.parameters(), cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(1e-6));
+    }
+    
+    // Updating the template of a copy leaves the original untouched
+    {
+        ia::AlignInverseCompositional<W> a;
+        a.prepare(frame1(cv::Rect(20, 20, 30, 30)), frame1, w0, 2);
+        
+        W before = w0;
+        a.align(before, 50, 0.001f);
+        
+        ia::AlignInverseCompositional<W> b(a);
+        b.updateTemplate(frame0(cv::Rect(20, 20, 30, 30)), w0);
+        
+        W after = w0;
+        a.align(after, 50, 0.001f);
+        
+        REQUIRE(cv::norm(after.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.01));
+        REQUIRE(cv::norm(after.parameters() - before.parameters(), cv::NORM_L1) == 0);
+    }
+    
+    // Shared pyramids are never written to
+    {
+        ia::ImagePyramid shared;
+        shared.create(frame0, 2);
+        cv::Mat before = shared[0].clone();
+        
+        ia::AlignInverseCompositional<W> a;
+        a.prepare(frame1(cv::Rect(20, 20, 30, 30)), shared, w0, 2);
+        a.updateTarget(frame1);
+        
+        REQUIRE(cv::norm(shared[0], before, cv::NORM_L1) == 0);
+        
+        W wa = w0;
+        a.align(wa, 50, 0.001f);
+        REQUIRE(cv::norm(wa.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.01));
+    }
+    
+    // Gradients of shared pyramids lacking them are computed into reused buffers
+    {
+        ia::ImagePyramid shared0, shared1;
+        shared0.create(frame0, 2);
+        shared1.create(frame1, 2);
+        
+        ia::AlignForwardAdditive<W> a;
+        a.prepare(frame1(cv::Rect(20, 20, 30, 30)), shared0, w0, 2);
+        
+        // The first pass sizes buffers, including statistics, the second must not allocate.
+        W wa = w0;
+        int before = 0;
+        for (int pass = 0; pass < 2; ++pass) {
+            before = allocations();
+            for (int k = 0; k < 3; ++k) {
+                a.updateTarget(k % 2 ? shared0 : shared1);
+                wa = w0;
+                a.align(wa, 50, 0.001f);
+            }
+        }
+        const int after = allocations();
+        REQUIRE(after == before);
+        REQUIRE(!shared0.hasGradients());
+        REQUIRE(cv::norm(wa.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.01));
+    }
+    
+    // Levels limited by a short target return with the next target
+    {
+        ia::ImagePyramid single, full;
+        single.create(frame1, 1);
+        full.create(frame1, 3);
+        
+        ia::AlignInverseCompositional<W> a;
+        a.prepare(frame1(cv::Rect(20, 20, 40, 40)), frame0, w0, 3);
+        REQUIRE(a.numLevels() == 3);
+        
+        a.updateTarget(single);
+        REQUIRE(a.numLevels() == 1);
+        a.updateTarget(frame1);
+        REQUIRE(a.numLevels() == 3);
+        
+        a.updateTarget(single);
+        a.updateTarget(full);
+        REQUIRE(a.numLevels() == 3);
+        
+        // Template data covers all levels after updating the template on a short target
+        a.updateTarget(single);
+        a.updateTemplate(frame1(cv::Rect(20, 20, 40, 40)), w0);
+        REQUIRE(a.numLevels() == 1);
+        a.updateTarget(full);
+        REQUIRE(a.numLevels() == 3);
+        
+        W wa = w0;
+        a.align(wa, 50, 0.001f);
+        REQUIRE(cv::norm(wa.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.01));
+    }
+}
+
+TEST_CASE("streaming-pyramid")
+{
+    namespace ia = imagealign;
+    typedef ia::WarpTranslationF W;
+    
+    cv::Mat frame0(100, 100, CV_8UC1), frame1(100, 100, CV_8UC1);
+    cv::randu(frame0, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(frame0, frame0, cv::Size(5,5));
+    cv::randu(frame1, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(frame1, frame1, cv::Size(5,5));
+    
+    ia::StreamingPyramid stream(frame0.size(), 3, true);
+    REQUIRE(stream.generation() == 0);
+    
+    stream.push(frame0);
+    REQUIRE(stream.generation() == 1);
+    
+    const uchar *data = stream[2].data;
+    
+    // Levels from 8 bit input stay close to floating point pyramids
+    ia::ImagePyramid reference;
+    reference.create(frame0, 3, true);
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(stream[i].size() == reference[i].size());
+        REQUIRE(stream[i].type() == CV_32FC1);
+        REQUIRE(cv::norm(stream[i], reference[i], cv::NORM_INF) <= double(i));
+    }
+    
+    cv::Mat grad;
+    ia::ImagePyramid::computeGradientImage(stream[1], grad);
+    REQUIRE(cv::norm(stream.gradientImage(1), grad, cv::NORM_INF) == 0);
+    
+    // Aligners detect stale targets
+    W w0;
+    w0.setParameters(W::Traits::ParamType(18, 18));
+    
+    ia::AlignForwardAdditive<W> a;
+    a.prepare(frame1(cv::Rect(20, 20, 30, 30)), frame0, w0, 2);
+    a.updateTarget(stream);
+    REQUIRE(!a.isTargetStale(stream));
+    
+    stream.push(frame1);
+    REQUIRE(stream.generation() == 2);
+    REQUIRE(a.isTargetStale(stream));
+    
+    a.updateTarget(stream);
+    REQUIRE(!a.isTargetStale(stream));
+    
+    // Buffers are reused among frames
+    REQUIRE(stream[2].data == data);
+    
+    W w = w0;
+    a.align(w, 50, 0.001f);
+    
+    W::Traits::ParamType expected(20, 20);
+    REQUIRE(cv::norm(w.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.01));
+    
+    // Levels limited by a short stream return with a deeper one
+    ia::StreamingPyramid shallow(frame0.size(), 1);
+    shallow.push(frame1);
+    
+    ia::AlignInverseCompositional<W> b;
+    b.prepare(frame1(cv::Rect(20, 20, 40, 40)), frame0, w0, 3);
+    REQUIRE(b.numLevels() == 3);
+    b.updateTarget(shallow);
+    REQUIRE(b.numLevels() == 1);
+    b.updateTarget(stream);
+    REQUIRE(b.numLevels() == 3);
+}
+
+TEST_CASE("parallel-rows")
+{
+    namespace ia = imagealign;
+    
+    // Chunks cover all rows and depend on image size only
+    {
+        ia::RowChunks small(1, 29, 30);
+        REQUIRE(small.count == 1);
+        REQUIRE(small.chunkBegin(0) == 1);
+        REQUIRE(small.chunkEnd(0) == 29);
+        
+        ia::RowChunks large(1, 599, 600);
+        REQUIRE(large.count > 1);
+        REQUIRE(large.chunkBegin(0) == 1);
+        REQUIRE(large.chunkEnd(large.count - 1) == 599);
+        for (int c = 1; c < large.count; ++c) {
+            REQUIRE(large.chunkBegin(c) == large.chunkEnd(c - 1));
+        }
+    }
+    
+    cv::Mat target(600, 600, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    // Tiled pyramid levels are identical to cv::pyrDown
+    {
+        ia::ImagePyramid pyr;
+        pyr.create(target, 3);
+        
+        cv::Mat l0, l1, l2;
+        target.convertTo(l0, CV_32F);
+        cv::pyrDown(l0, l1);
+        cv::pyrDown(l1, l2);
+        
+        REQUIRE(cv::norm(pyr[0], l0, cv::NORM_INF) == 0);
+        REQUIRE(cv::norm(pyr[1], l1, cv::NORM_INF) == 0);
+        REQUIRE(cv::norm(pyr[2], l2, cv::NORM_INF) == 0);
+    }
+    
+    // Large templates are aligned in chunks
+    {
+        typedef ia::WarpTranslationF W;
+        
+        cv::Mat tmpl = target(cv::Rect(100, 100, 300, 300));
+        
+        W::Traits::ParamType expected(100, 100);
+        
+        W w;
+        w.setParameters(W::Traits::ParamType(98, 98.5f));
+        
+        testAlgorithm< ia::AlignForwardAdditive<W> >(tmpl, target, w, 2, expected);
+        testAlgorithm< ia::AlignForwardCompositional<W> >(tmpl, target, w, 2, expected);
+        testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, expected);
+    }
+}
+
+TEST_CASE("algorithm-pixel-selection")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(200, 200, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    cv::Mat tmpl;
+    
+    typedef ia::WarpSimilarityD W;
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(50, 40, 0.1, 1.05));
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(60, 60), w);
+    W::Traits::ParamType expected = w.parameters();
+    
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(51, 39.5, 0.12, 1.04));
+    
+    // Selection count and fraction
+    REQUIRE(ia::PixelSelection::all().numPixels(100, 4) == 100);
+    REQUIRE(ia::PixelSelection::topCount(10).numPixels(100, 4) == 10);
+    REQUIRE(ia::PixelSelection::topCount(2).numPixels(100, 4) == 4);
+    REQUIRE(ia::PixelSelection::topCount(200).numPixels(100, 4) == 100);
+    REQUIRE(ia::PixelSelection::topFraction(0.15f).numPixels(100, 4) == 15);
+    
+    // Top scores are selected in memory order
+    std::vector<float> scores;
+    scores.push_back(1.f); scores.push_back(5.f); scores.push_back(3.f); scores.push_back(5.f); scores.push_back(0.f);
+    std::vector<int> indices;
+    ia::detail::selectTopScores(scores, 3, indices);
+    REQUIRE(indices.size() == 3);
+    REQUIRE(indices[0] == 1);
+    REQUIRE(indices[1] == 2);
+    REQUIRE(indices[2] == 3);
+    
+    const int modes[] = {ia::PIXEL_SCORE_GRADIENT, ia::PIXEL_SCORE_SDI};
+    for (int m = 0; m < 2; ++m) {
+        W ws = w;
+        
+        ia::AlignInverseCompositional<W> a;
+        a.setPixelSelection(ia::PixelSelection::topFraction(0.15f, modes[m]));
+        a.prepare(tmpl, target, ws, 2);
+        
+        REQUIRE(a.numSelectedPixels(0) == (int)(0.15f * 58 * 58 + 0.5f));
+        REQUIRE(a.numSelectedPixels(1) == (int)(0.15f * 28 * 28 + 0.5f));
+        
+        a.align(ws, 100, 0.0);
+        REQUIRE(cv::norm(ws.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.02));
+    }
+    
+    // Switching back to all pixels
+    {
+        W ws = w;
+        
+        ia::AlignInverseCompositional<W> a;
+        a.setPixelSelection(ia::PixelSelection::topCount(300));
+        a.prepare(tmpl, target, ws, 1);
+        REQUIRE(a.numSelectedPixels(0) == 300);
+        
+        a.setPixelSelection(ia::PixelSelection::all());
+        a.updateTemplate(tmpl, ws);
+        REQUIRE(a.numSelectedPixels(0) == 58 * 58);
+        
+        a.align(ws, 100, 0.0);
+        REQUIRE(cv::norm(ws.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.02));
+    }
+}
+
+/** Records budgets and iterations of levels passed through a termination policy. */
+struct RecordingCriteria : imagealign::TerminationCriteria {
+    explicit RecordingCriteria(int maxIterations)
+        : imagealign::TerminationCriteria(maxIterations)
+    {}
+    
+    int levelIterations(int level) {
+        budgets.push_back(imagealign::TerminationCriteria::levelIterations(level));
+        return budgets.back();
+    }
+    
+    bool skipFinerLevels(int level, int iterations, int accepted, double displacement) {
+        performed.push_back(iterations);
+        acceptedSteps.push_back(accepted);
+        return imagealign::TerminationCriteria::skipFinerLevels(level, iterations, accepted, displacement);
+    }
+    
+    std::vector<int> budgets;
+    std::vector<int> performed;
+    std::vector<int> acceptedSteps;
+};
+
+TEST_CASE("termination-policy")
+{
+    namespace ia = imagealign;
+    
+    // Schedule with rollover of unused iterations
+    {
+        std::vector<int> schedule;
+        schedule.push_back(5);
+        schedule.push_back(10);
+        
+        ia::TerminationCriteria c;
+        c.setLevelIterations(schedule);
+        c.beginAlignment(3);
+        
+        REQUIRE(c.levelIterations(2) == 10);
+        REQUIRE(!c.skipFinerLevels(2, 4, 4, 1.0));
+        REQUIRE(c.levelIterations(1) == 16);
+        REQUIRE(!c.skipFinerLevels(1, 16, 16, 1.0));
+        REQUIRE(c.levelIterations(0) == 5);
+        
+        // A final rejected step consumes an iteration as well
+        c.beginAlignment(3);
+        REQUIRE(!c.skipFinerLevels(2, 5, 4, 1.0));
+        REQUIRE(c.levelIterations(1) == 15);
+        
+        c.setRollover(false);
+        c.beginAlignment(3);
+        REQUIRE(!c.skipFinerLevels(2, 0, 0, 1.0));
+        REQUIRE(c.levelIterations(1) == 10);
+    }
+    
+    // Iteration counts are compared below, so the target must not depend on tests run before.
+    cv::RNG rng(5);
+    cv::Mat target(100, 100, CV_8UC1);
+    for (int y = 0; y < target.rows; ++y)
+        for (int x = 0; x < target.cols; ++x)
+            target.at<uchar>(y, x) = (uchar)rng.uniform(0, 255);
+    cv::blur(target, target, cv::Size(5,5));
+    
+    cv::Mat tmpl;
+    
+    typedef ia::WarpSimilarityD W;
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(30, 30, 0.1, 1.05));
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    W::Traits::ParamType expected = w.parameters();
+    
+    W w0;
+    w0.setParametersInCanonicalRepresentation(W::Traits::ParamType(31, 29, 0.12, 1.04));
+    
+    // Displacement based convergence needs fewer iterations than running until the error rises
+    {
+        ia::AlignInverseCompositional<W> a;
+        a.prepare(tmpl, target, w0, 2);
+        
+        W wa = w0;
+        std::vector<W> stepsA;
+        a.align(wa, 100, 0.0, &stepsA);
+        
+        W wb = w0;
+        std::vector<W> stepsB;
+        ia::TerminationCriteria c(100);
+        c.setMinDisplacement(0.01);
+        a.align(wb, c, &stepsB);
+        
+        REQUIRE(cv::norm(wb.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.02));
+        REQUIRE(stepsB.size() < stepsA.size());
+        
+        W wc = w0;
+        ia::TerminationCriteria e(100);
+        e.setMinRelativeErrorChange(0.01);
+        a.align(wc, e);
+        REQUIRE(cv::norm(wc.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.02));
+    }
+    
+    // Rollover carries iterations not performed, counting rejected steps as performed
+    {
+        ia::AlignInverseCompositional<W> a;
+        a.prepare(tmpl, target, w0, 2);
+        
+        W wr = w0;
+        RecordingCriteria c(100);
+        a.align(wr, c);
+        
+        REQUIRE(c.budgets.size() == 2);
+        REQUIRE(c.performed.size() == 2);
+        REQUIRE(c.performed[0] == c.acceptedSteps[0] + 1);
+        REQUIRE(c.budgets[1] == 50 + c.budgets[0] - c.performed[0]);
+    }
+    
+    // Finer levels are skipped when a coarse level barely moves the template
+    {
+        ia::AlignForwardCompositional<W> a;
+        a.prepare(tmpl, target, w0, 3);
+        
+        W wa = w;
+        std::vector<W> stepsA;
+        ia::TerminationCriteria all(30);
+        a.align(wa, all, &stepsA);
+        
+        W ws = w;
+        std::vector<W> steps;
+        ia::TerminationCriteria c(30);
+        c.setSkipFinerLevelsBelow(2.0);
+        a.align(ws, c, &steps);
+        
+        REQUIRE(steps.size() > 0);
+        REQUIRE(steps.size() < stepsA.size());
+        REQUIRE(cv::norm(steps.back().parameters() - ws.parameters()) == Catch::Detail::Approx(0));
+        REQUIRE(std::abs(ws.parameters()(0) - expected(0)) < 2.0);
+        REQUIRE(std::abs(ws.parameters()(1) - expected(1)) < 2.0);
+    }
+}
+
+template<class W>
+void testValidRowSpans(const W &w, cv::Size tplSize, cv::Size targetSize)
+{
+    ia::WarpScanline<W> ws(w);
+    ia::WarpedRow<typename W::Traits::ScalarType> row;
+    
+    int total = 0;
+    for (int y = 1; y < tplSize.height - 1; ++y) {
+        ia::warpRowPositions(ws, y, 1, tplSize.width - 1, targetSize, row);
+        
+        // Compare against testing every pixel
+        int n = 0;
+        for (int x = 1; x < tplSize.width - 1; ++x) {
+            typename W::Traits::PointType p = w(typename W::Traits::PointType(typename W::Traits::ScalarType(x), typename W::Traits::ScalarType(y)));
+            if (ia::isInImage(p, targetSize, 1)) {
+                REQUIRE(n < row.size);
+                REQUIRE(row.cols[n] == x);
+                ++n;
+            }
+        }
+        REQUIRE(n == row.size);
+        total += n;
+    }
+    
+    REQUIRE(ia::countValidPixels(w, tplSize, targetSize) == total);
+}
+
+TEST_CASE("valid-row-spans")
+{
+    namespace ia = imagealign;
+    
+    cv::RNG rng(42);
+    
+    for (int i = 0; i < 50; ++i) {
+        ia::WarpAffineF wa;
+        ia::WarpAffineF::Traits::ParamType pa;
+        pa << rng.uniform(-60.f, 100.f), rng.uniform(-60.f, 100.f), rng.uniform(-0.5f, 0.5f), rng.uniform(-0.5f, 0.5f), rng.uniform(-0.5f, 0.5f), rng.uniform(-0.5f, 0.5f);
+        wa.setParameters(pa);
+        testValidRowSpans(wa, cv::Size(60, 40), cv::Size(100, 80));
+        
+        ia::WarpPerspectiveD wp;
+        ia::WarpPerspectiveD::Traits::ParamType pp;
+        pp << rng.uniform(-60., 100.), rng.uniform(-60., 100.), rng.uniform(-0.3, 0.3), rng.uniform(-0.3, 0.3), rng.uniform(-0.3, 0.3), rng.uniform(-0.3, 0.3), rng.uniform(-0.01, 0.01), rng.uniform(-0.01, 0.01);
+        wp.setParameters(pp);
+        testValidRowSpans(wp, cv::Size(60, 40), cv::Size(100, 80));
+    }
+    
+    // Integer translations put pixels exactly onto the bounds
+    for (int tx = -70; tx < 110; tx += 7) {
+        ia::WarpTranslationF wt;
+        wt.setParameters(ia::WarpTranslationF::Traits::ParamType(float(tx) + 0.5f, float(-tx) * 0.5f));
+        testValidRowSpans(wt, cv::Size(60, 40), cv::Size(100, 80));
+    }
+    
+    // Early rejection of templates mostly outside of the target
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    cv::Mat tmpl = target(cv::Rect(40, 40, 30, 30)).clone();
+    
+    typedef ia::WarpTranslationF W;
+    
+    ia::AlignInverseCompositional<W> a;
+    W w;
+    a.prepare(tmpl, target, w, 2);
+    a.setMinValidFraction(0.5);
+    
+    w.setParameters(W::Traits::ParamType(85.f, 40.f));
+    a.align(w, 20, 0.f);
+    REQUIRE(a.rejected());
+    
+    w.setParameters(W::Traits::ParamType(41.f, 39.f));
+    a.align(w, 20, 0.f);
+    REQUIRE(!a.rejected());
+    REQUIRE(w.parameters()(0) == Catch::Detail::Approx(40.f).epsilon(0.01));
+    REQUIRE(w.parameters()(1) == Catch::Detail::Approx(40.f).epsilon(0.01));
+    
+    ia::TerminationCriteria c(20);
+    w.setParameters(W::Traits::ParamType(-20.f, 40.f));
+    a.align(w, c);
+    REQUIRE(a.rejected());
+    
+    // Only pixels warped inside the target are constraints
+    ia::AlignESM<W> esm;
+    w.setParameters(W::Traits::ParamType(80.f, 40.f));
+    const int valid = ia::countValidPixels(w, tmpl.size(), target.size());
+    REQUIRE(valid < 28 * 28);
+    esm.prepare(tmpl, target, w, 1);
+    esm.align(w, 1, 0.f);
+#if !defined(IA_NO_STATS)
+    REQUIRE(esm.stats().trajectory.size() == 1);
+    REQUIRE(esm.stats().trajectory[0].numConstraints == valid);
+#endif
+}
+
+TEST_CASE("algorithm-robust-loss")
+{
+    namespace ia = imagealign;
+    
+    // Loss functions
+    {
+        ia::LossHuber huber(2.f);
+        REQUIRE(huber.rho(1.f) == Catch::Detail::Approx(1.f));
+        REQUIRE(huber.rho(-4.f) == Catch::Detail::Approx(12.f));
+        REQUIRE(huber.weight(1.f) == Catch::Detail::Approx(1.f));
+        REQUIRE(huber.weight(-4.f) == Catch::Detail::Approx(0.5f));
+        
+        ia::LossTukey tukey(3.f);
+        REQUIRE(tukey.rho(0.f) == Catch::Detail::Approx(0.f));
+        REQUIRE(tukey.rho(5.f) == Catch::Detail::Approx(3.f));
+        REQUIRE(tukey.weight(0.f) == Catch::Detail::Approx(1.f));
+        REQUIRE(tukey.weight(3.f) == Catch::Detail::Approx(0.f));
+        REQUIRE(tukey.weight(-5.f) == Catch::Detail::Approx(0.f));
+        
+        const float e[5] = {0.f, 1.f, -2.5f, 4.f, -10.f};
+        float wh[5], wt[5];
+        huber.weights(e, wh, 5);
+        tukey.weights(e, wt, 5);
+        for (int i = 0; i < 5; ++i) {
+            REQUIRE(wh[i] == Catch::Detail::Approx(huber.weight(e[i])));
+            REQUIRE(wt[i] == Catch::Detail::Approx(tukey.weight(e[i])));
+        }
+    }
+    
+    // Occluded template
+    {
+        cv::Mat target(100, 100, CV_8UC1);
+        cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+        cv::blur(target, target, cv::Size(5,5));
+        
+        cv::Mat tmpl = target(cv::Rect(30, 30, 40, 40)).clone();
+        tmpl(cv::Rect(4, 4, 12, 12)).setTo(cv::Scalar::all(255));
+        
+        typedef ia::WarpTranslationF W;
+        typedef ia::LossHuber H;
+        typedef ia::LossTukey T;
+        
+        W::Traits::ParamType expected(30, 30);
+        
+        W w;
+        w.setParameters(W::Traits::ParamType(28, 29));
+        
+        testAlgorithm< ia::AlignForwardAdditive<W, H> >(tmpl, target, w, 1, expected, 0.05);
+        testAlgorithm< ia::AlignForwardCompositional<W, H> >(tmpl, target, w, 1, expected, 0.05);
+        testAlgorithm< ia::AlignInverseCompositional<W, H> >(tmpl, target, w, 1, expected, 0.05);
+        testAlgorithm< ia::AlignESM<W, H> >(tmpl, target, w, 1, expected, 0.05);
+        
+        testAlgorithm< ia::AlignForwardAdditive<W, T> >(tmpl, target, w, 1, expected, 0.05);
+        testAlgorithm< ia::AlignForwardCompositional<W, T> >(tmpl, target, w, 1, expected, 0.05);
+        testAlgorithm< ia::AlignInverseCompositional<W, T> >(tmpl, target, w, 1, expected, 0.05);
+        testAlgorithm< ia::AlignESM<W, T> >(tmpl, target, w, 1, expected, 0.05);
+        
+        // Robust losses improve on squared loss
+        W ws = w;
+        ia::AlignInverseCompositional<W> squared;
+        squared.prepare(tmpl, target, ws, 1);
+        squared.align(ws, 100, 0.f);
+        
+        W wr = w;
+        ia::AlignInverseCompositional<W, T> robust;
+        robust.prepare(tmpl, target, wr, 1);
+        robust.align(wr, 100, 0.f);
+        
+        REQUIRE(cv::norm(wr.parameters() - expected) <= cv::norm(ws.parameters() - expected));
+        
+        // Weighted Hessian on selected pixels
+        W wp = w;
+        ia::AlignInverseCompositional<W, T> sparse;
+        sparse.setPixelSelection(ia::PixelSelection::topFraction(0.5f));
+        sparse.prepare(tmpl, target, wp, 1);
+        sparse.align(wp, 100, 0.f);
+        
+        REQUIRE(cv::norm(wp.parameters() - expected, cv::NORM_L1) < 0.1);
+    }
+}
+
+TEST_CASE("align-stats")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+#if !defined(IA_NO_STATS)
+    cv::Mat tmpl = target(cv::Rect(40, 40, 30, 30)).clone();
+    
+    typedef ia::WarpTranslationF W;
+    
+    ia::AlignForwardCompositional<W> a;
+    W w;
+    w.setParameters(W::Traits::ParamType(38.f, 41.f));
+    a.prepare(tmpl, target, w, 2);
+    
+    REQUIRE(a.stats().prepareSeconds >= a.stats().pyramidSeconds);
+    REQUIRE(a.stats().pyramidSeconds >= 0);
+    
+    std::vector<W> steps;
+    a.align(w, 40, 0.001f, &steps);
+    
+    const ia::AlignStats &s = a.stats();
+    REQUIRE(s.levels.size() == 2);
+    REQUIRE(s.totalIterations() == (int)s.trajectory.size());
+    REQUIRE(s.alignSeconds >= 0);
+    REQUIRE(s.reason != ia::TERMINATION_NONE);
+    REQUIRE(s.reason == s.levels[0].reason);
+    REQUIRE(a.lastReason() == a.stats().reason);
+    
+    // Trajectory runs from coarse to fine and decreases per level
+    int accepted = 0;
+    for (size_t i = 0; i < s.trajectory.size(); ++i) {
+        const ia::AlignIterationStats &it = s.trajectory[i];
+        accepted += it.accepted ? 1 : 0;
+        REQUIRE(it.numConstraints > 0);
+        if (i > 0) {
+            REQUIRE(it.level <= s.trajectory[i - 1].level);
+            if (it.accepted && it.level == s.trajectory[i - 1].level)
+                REQUIRE(it.error <= s.trajectory[i - 1].error);
+        }
+    }
+    REQUIRE(accepted == (int)steps.size());
+    REQUIRE(s.levels[0].accepted + s.levels[1].accepted == accepted);
+    REQUIRE(s.levels[0].numConstraints == 28 * 28);
+    
+    // Budget exhausted
+    w.setParameters(W::Traits::ParamType(38.f, 41.f));
+    a.align(w, 2, 0.f);
+    REQUIRE(a.stats().totalIterations() == 2);
+    REQUIRE(a.stats().levels[1].reason == ia::TERMINATION_MAX_ITERATIONS);
+    REQUIRE(a.stats().levels[0].reason == ia::TERMINATION_MAX_ITERATIONS);
+    
+    // Rejection
+    a.setMinValidFraction(0.5);
+    w.setParameters(W::Traits::ParamType(85.f, 40.f));
+    a.align(w, 20, 0.f);
+    REQUIRE(a.stats().reason == ia::TERMINATION_REJECTED);
+    REQUIRE(a.lastReason() == a.stats().reason);
+    REQUIRE(a.stats().totalIterations() == 0);
+    
+    // Termination policies
+    a.setMinValidFraction(0);
+    ia::TerminationCriteria c(40);
+    c.setMinDisplacement(0.01);
+    w.setParameters(W::Traits::ParamType(38.f, 41.f));
+    a.align(w, c);
+    REQUIRE(a.stats().levels[0].reason == ia::TERMINATION_CONVERGED);
+    
+    c.setSkipFinerLevelsBelow(100.0);
+    w.setParameters(W::Traits::ParamType(38.f, 41.f));
+    a.align(w, c);
+    REQUIRE(a.stats().reason == ia::TERMINATION_SKIPPED_FINER_LEVELS);
+    REQUIRE(a.lastReason() == a.stats().reason);
+    REQUIRE(a.stats().levels[0].iterations == 0);
+#endif
+}
+
+template< class A, class W >
+void testIntegerTarget(cv::Mat tpl, cv::Mat target, W w, int levels, int depth, const typename W::Traits::ParamType &expected)
+{
+    typedef typename W::Traits::ScalarType S;
+    
+    A a;
+    a.setTargetDepth(depth);
+    a.prepare(tpl, target, w, levels);
+    a.align(w, 100, S(0));
+    
+    REQUIRE(cv::norm(w.parameters() - expected, cv::NORM_L1) < 0.05);
+}
+
+TEST_CASE("algorithm-integer-target")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    cv::Mat tmpl = target(cv::Rect(20, 20, 30, 30));
+    
+    typedef ia::WarpTranslationF W;
+    
+    W::Traits::ParamType expected(20, 20);
+    
+    W w;
+    w.setParameters(W::Traits::ParamType(18, 18));
+    
+    const int depths[2] = {CV_8U, CV_16U};
+    for (int i = 0; i < 2; ++i) {
+        testIntegerTarget< ia::AlignForwardAdditive<W> >(tmpl, target, w, 2, depths[i], expected);
+        testIntegerTarget< ia::AlignForwardCompositional<W> >(tmpl, target, w, 2, depths[i], expected);
+        testIntegerTarget< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, depths[i], expected);
+        testIntegerTarget< ia::AlignESM<W> >(tmpl, target, w, 2, depths[i], expected);
+    }
+    
+    // 8 bit levels exported by streaming pyramids
+    ia::StreamingPyramid sp(target.size(), 2);
+    sp.setExportDepth(CV_8U);
+    sp.push(target);
+    
+    ia::ImagePyramid pyr;
+    sp.toPyramid(pyr, 2);
+    REQUIRE(pyr.depth() == CV_8U);
+    
+    W wi = w;
+    ia::AlignInverseCompositional<W> ic;
+    ic.prepare(tmpl, pyr, wi, 2);
+    ic.align(wi, 100, 0.f);
+    
+    REQUIRE(cv::norm(wi.parameters() - expected, cv::NORM_L1) < 0.05);
+}
+
+/** Exposes template levels, so that tests can check where they live. */
+template<class W>
+struct TemplateLevelsIC : imagealign::AlignInverseCompositional<W> {
+    cv::Mat templateLevel(int level) {
+        return this->templateImagePyramid()[level];
+    }
+};
+
+TEST_CASE("prepared-template")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    cv::Mat tmpl = target(cv::Rect(20, 20, 30, 30));
+    
+    typedef ia::WarpSimilarityF W;
+    
+    W w;
+    w.setParameters(W::Traits::ParamType(0.05f, 0.f, 18.f, 18.f));
+    
+    ia::PreparedTemplate<W> prepared;
+    prepared.create(tmpl, w, 2);
+    
+    REQUIRE(!prepared.empty());
+    REQUIRE(prepared.numLevels() == 2);
+    REQUIRE(prepared.numParameters() == 4);
+    
+    // Same results as preparing the aligner itself
+    W wa = w;
+    ia::AlignInverseCompositional<W> a;
+    a.prepare(tmpl, target, wa, 2);
+    a.align(wa, 100, 0.f);
+    
+    W wb = w;
+    ia::AlignInverseCompositional<W> b;
+    b.prepare(prepared, target);
+    b.align(wb, 100, 0.f);
+    
+    REQUIRE(cv::norm(wa.parameters() - wb.parameters()) == 0);
+    REQUIRE(a.lastError() == b.lastError());
+    
+    // Template levels are adopted without building a pyramid
+    TemplateLevelsIC<W> e;
+    e.prepare(prepared, target);
+    for (int i = 0; i < prepared.numLevels(); ++i) {
+        REQUIRE(e.templateLevel(i).data == prepared.templateImage(i).data);
+    }
+    
+    // Prepared templates store all pixels, selections are refused
+    ia::AlignInverseCompositional<W> selective;
+    selective.setPixelSelection(ia::PixelSelection::topFraction(0.5f));
+    REQUIRE_THROWS(selective.prepare(prepared, target));
+    
+    // Failing to prepare from shared data leaves the aligner ready for other templates
+    {
+        cv::Mat other = target(cv::Rect(40, 40, 30, 30));
+        cv::Mat color(target.size(), CV_8UC3, cv::Scalar::all(0));
+        
+        ia::AlignInverseCompositional<W> failed, fresh;
+        REQUIRE_THROWS(failed.prepare(prepared, color));
+        
+        W wf = w, wr = w;
+        failed.prepare(other, target, wf, 2);
+        fresh.prepare(other, target, wr, 2);
+        failed.align(wf, 100, 0.f);
+        fresh.align(wr, 100, 0.f);
+        
+        REQUIRE(cv::norm(wf.parameters() - wr.parameters()) == 0);
+        REQUIRE(failed.lastError() == fresh.lastError());
+    }
+    
+    // Serialization round trips
+    std::vector<uchar> buf;
+    prepared.write(buf);
+    REQUIRE(buf.size() == prepared.sizeInBytes());
+    
+    ia::PreparedTemplate<W> copied;
+    REQUIRE(copied.read(&buf[0], buf.size()));
+    
+    // Zero copy from aligned memory
+    cv::Mat mem(1, (int)buf.size() + ia::SDIPlanes::Alignment, CV_8UC1);
+    uchar *aligned = cv::alignPtr(mem.ptr(), ia::SDIPlanes::Alignment);
+    std::copy(buf.begin(), buf.end(), aligned);
+    
+    ia::PreparedTemplate<W> wrapped;
+    REQUIRE(wrapped.wrap(aligned, buf.size()));
+    REQUIRE(wrapped.templateImage(0).data >= aligned);
+    REQUIRE(wrapped.templateImage(0).data < aligned + buf.size());
+    REQUIRE(wrapped.storage().empty());
+    
+    REQUIRE(prepared.save("prepared_template.bin"));
+    ia::PreparedTemplate<W> loaded;
+    REQUIRE(loaded.load("prepared_template.bin"));
+    std::remove("prepared_template.bin");
+    
+    ia::PreparedTemplate<W> *others[3] = {&copied, &wrapped, &loaded};
+    for (int i = 0; i < 3; ++i) {
+        W wc = w;
+        ia::AlignInverseCompositional<W> c;
+        c.prepare(*others[i], target);
+        c.align(wc, 100, 0.f);
+        REQUIRE(cv::norm(wa.parameters() - wc.parameters()) == 0);
+    }
+    
+    // Malformed data and other warps are refused
+    ia::PreparedTemplate<ia::WarpAffineF> affine;
+    REQUIRE(!affine.read(&buf[0], buf.size()));
+    REQUIRE(affine.empty());
+    REQUIRE(!copied.read(&buf[0], buf.size() / 2));
+    REQUIRE(!loaded.load("does_not_exist.bin"));
+    REQUIRE(!wrapped.wrap(aligned + 4, buf.size() - 4));
+    
+    // Updating the template computes template data again
+    W wd = w;
+    b.updateTemplate(tmpl, wd);
+    b.align(wd, 100, 0.f);
+    REQUIRE(cv::norm(wa.parameters() - wd.parameters()) == 0);
+    
+    // Adopted levels are never written to
+    cv::Mat level0 = prepared.templateImage(0).clone();
+    e.updateTemplate(target(cv::Rect(40, 40, 30, 30)), w);
+    REQUIRE(e.templateLevel(0).data != prepared.templateImage(0).data);
+    REQUIRE(cv::norm(prepared.templateImage(0), level0, cv::NORM_L1) == 0);
+}
+
+template<class W>
+class ContextBody : public cv::ParallelLoopBody {
+public:
+    ContextBody(const imagealign::PreparedTemplate<W> &tmpl, const imagealign::ImagePyramid &target, std::vector<W> &warps)
+        : _tmpl(tmpl), _target(target), _warps(warps)
+    {}
+    
+    void operator()(const cv::Range &r) const {
+        imagealign::AlignContext<W> ctx;
+        for (int i = r.start; i < r.end; ++i) {
+            ctx.align(_tmpl, _target, _warps[i], 100, 0.f);
+        }
+    }
+    
+private:
+    const imagealign::PreparedTemplate<W> &_tmpl;
+    const imagealign::ImagePyramid &_target;
+    std::vector<W> &_warps;
+};
+
+TEST_CASE("align-context")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    cv::Mat tmpl = target(cv::Rect(20, 20, 30, 30));
+    
+    typedef ia::WarpTranslationF W;
+    
+    ia::PreparedTemplate<W> prepared;
+    prepared.create(tmpl, W(), 2);
+    
+    ia::ImagePyramid pyr;
+    pyr.create(target, 2);
+    
+    // Several initial warps aligned concurrently against the same template data
+    std::vector<W> warps(16);
+    for (size_t i = 0; i < warps.size(); ++i) {
+        warps[i].setParameters(W::Traits::ParamType(17.f + 0.4f * float(i % 4), 17.f + 0.4f * float(i / 4)));
+    }
+    std::vector<W> initial = warps;
+    
+    cv::parallel_for_(cv::Range(0, (int)warps.size()), ContextBody<W>(prepared, pyr, warps));
+    
+    for (size_t i = 0; i < warps.size(); ++i) {
+        W wa = initial[i];
+        ia::AlignInverseCompositional<W> a;
+        a.prepare(tmpl, pyr, wa, 2);
+        a.align(wa, 100, 0.f);
+        
+        REQUIRE(cv::norm(warps[i].parameters() - wa.parameters()) == 0);
+        REQUIRE(cv::norm(warps[i].parameters() - W::Traits::ParamType(20, 20), cv::NORM_L1) < 0.01);
+    }
+    
+    // Results and statistics of the last alignment
+    ia::AlignContext<W, ia::LossHuber> ctx;
+    W w = initial[0];
+    ctx.align(prepared, pyr, w, 100, 0.f);
+    
+    REQUIRE(ctx.numLevels() == 2);
+    REQUIRE(ctx.level() == 0);
+    REQUIRE(ctx.lastError() < 1.f);
+#if !defined(IA_NO_STATS)
+    REQUIRE(ctx.stats().levels.size() == 2);
+    REQUIRE(ctx.stats().totalIterations() > 0);
+#endif
+    
+    // Rejection of templates mostly outside of the target
+    ctx.setMinValidFraction(0.5);
+    w.setParameters(W::Traits::ParamType(85.f, 40.f));
+    ctx.align(prepared, pyr, w, 100, 0.f);
+    REQUIRE(ctx.rejected());
+    
+    // Translation search recovers from initial estimates outside the basin
+    ctx.setTranslationSearch(6);
+    w.setParameters(W::Traits::ParamType(30.f, 11.f));
+    ctx.align(prepared, pyr, w, 100, 0.f);
+    REQUIRE(!ctx.rejected());
+    REQUIRE(cv::norm(w.parameters() - W::Traits::ParamType(20, 20), cv::NORM_L1) < 0.01);
+    
+    W wa(w);
+    wa.setParameters(W::Traits::ParamType(30.f, 11.f));
+    ia::AlignInverseCompositional<W> a;
+    a.prepare(tmpl, pyr, wa, 2);
+    a.setMinValidFraction(0.5).setTranslationSearch(6);
+    a.align(wa, 100, 0.f);
+    REQUIRE(cv::norm(w.parameters() - wa.parameters()) == 0);
+}
+
+TEST_CASE("align-cascade")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    cv::Mat tmpl = target(cv::Rect(20, 20, 30, 30));
+    
+    cv::Mat unrelated(30, 30, CV_8UC1);
+    cv::randu(unrelated, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(unrelated, unrelated, cv::Size(5,5));
+    
+    typedef ia::WarpTranslationF W;
+    
+    W::Traits::ParamType expected(20, 20);
+    
+    W w0;
+    w0.setParameters(W::Traits::ParamType(18, 18));
+    
+    const ia::CascadeCriteria cascade(50., 100);
+    
+    // Hopeless alignments are rejected on the coarsest level
+    {
+        W w = w0;
+        ia::AlignInverseCompositional<W> a;
+        a.setCascade(cascade);
+        a.prepare(unrelated, target, w, 3);
+        a.align(w, 100, 0.f);
+        
+        REQUIRE(a.rejected());
+#if !defined(IA_NO_STATS)
+        REQUIRE(a.stats().reason == ia::TERMINATION_CASCADE_REJECTED);
+        REQUIRE(a.numLevels() > 1);
+        REQUIRE(a.stats().levels[0].iterations == 0);
+        REQUIRE(a.stats().levels[a.numLevels() - 1].iterations > 0);
+#endif
+        
+        W wp = w0;
+        ia::TerminationCriteria policy(100);
+        a.align(wp, policy);
+        REQUIRE(a.rejected());
+    }
+    
+    // Good alignments pass
+    {
+        W w = w0;
+        ia::AlignInverseCompositional<W> a;
+        a.setCascade(cascade);
+        a.prepare(tmpl, target, w, 3);
+        a.align(w, 100, 0.f);
+        
+        REQUIRE(!a.rejected());
+        REQUIRE(cv::norm(w.parameters() - expected, cv::NORM_L1) < 0.01);
+    }
+    
+    // Stopping at a coarse level still reports the warp at full resolution
+    {
+        W w = w0;
+        ia::AlignForwardCompositional<W> a;
+        a.setCascade(ia::CascadeCriteria(std::numeric_limits<double>::max(), 0, 1));
+        a.prepare(tmpl, target, w, 3);
+        a.align(w, 100, 0.f);
+        
+        REQUIRE(!a.rejected());
+        REQUIRE(cv::norm(w.parameters() - expected, cv::NORM_L1) < 1.);
+#if !defined(IA_NO_STATS)
+        REQUIRE(a.stats().reason == ia::TERMINATION_SKIPPED_FINER_LEVELS);
+        REQUIRE(a.stats().levels[0].iterations == 0);
+#endif
+        
+        W wp = w0;
+        ia::TerminationCriteria policy(100);
+        a.align(wp, policy);
+        REQUIRE(cv::norm(wp.parameters() - expected, cv::NORM_L1) < 1.);
+    }
+    
+    // Batches reject tracks individually
+    {
+        std::vector<cv::Mat> templates;
+        templates.push_back(tmpl);
+        templates.push_back(unrelated);
+        
+        ia::BatchAligner<W> ba;
+        ba.setCascade(cascade);
+        ba.prepare(templates, W(), 3);
+        
+        ia::ImagePyramid pyr;
+        pyr.create(target, 3);
+        
+        std::vector<W> warps(2, w0);
+        std::vector<uchar> status;
+        ba.align(pyr, warps, 100, 0.f, &status);
+        
+        REQUIRE(status[0] == 1);
+        REQUIRE(status[1] == 0);
+        REQUIRE(cv::norm(warps[0].parameters() - expected, cv::NORM_L1) < 0.01);
+        
+        ia::PreparedTemplate<W> prepared;
+        prepared.create(unrelated, W(), 3);
+        
+        W w = w0;
+        ia::AlignContext<W> ctx;
+        ctx.setCascade(cascade);
+        ctx.align(prepared, pyr, w, 100, 0.f);
+        REQUIRE(ctx.rejected());
+    }
+}
+
+TEST_CASE("sequence-tracker")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat scene(240, 240, CV_8UC1);
+    cv::randu(scene, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(scene, scene, cv::Size(5,5));
+    
+    // Content moves by (3, 2) pixels per frame
+    const int vx = 3, vy = 2;
+    const int frames = 8;
+    std::vector<ia::ImagePyramid> pyrs(frames);
+    for (int k = 0; k < frames; ++k) {
+        pyrs[k].create(scene(cv::Rect(100 - k * vx, 100 - k * vy, 120, 120)), 4);
+    }
+    
+    typedef ia::WarpTranslationF W;
+    typedef ia::AlignInverseCompositional<W> A;
+    
+    cv::Mat tmpl = pyrs[0][0](cv::Rect(40, 40, 40, 40));
+    
+    W w0;
+    w0.setParameters(W::Traits::ParamType(40, 40));
+    
+    ia::SequenceTracker<A> ct;
+    ia::SequenceTracker<A> st;
+    st.setMotionModel(ia::MOTION_STATIC);
+    ia::SequenceTracker<A> ab;
+    ab.setMotionModel(ia::MOTION_ALPHA_BETA, 1, 0.5);
+    
+    REQUIRE(ct.addTrack(tmpl, pyrs[0], w0, 4) == 0);
+    REQUIRE(st.addTrack(tmpl, pyrs[0], w0, 4) == 0);
+    REQUIRE(ab.addTrack(tmpl, pyrs[0], w0, 4) == 0);
+    
+    for (int k = 1; k < frames; ++k) {
+        ct.track(pyrs[k], 100, 0.f);
+        st.track(pyrs[k], 100, 0.f);
+        ab.track(pyrs[k], 100, 0.f);
+        
+        W::Traits::ParamType expected(float(40 + k * vx), float(40 + k * vy));
+        
+        REQUIRE(!ct.lost(0));
+        REQUIRE(cv::norm(ct.warp(0).parameters() - expected, cv::NORM_L1) < 0.05);
+        REQUIRE(cv::norm(st.warp(0).parameters() - expected, cv::NORM_L1) < 0.05);
+        REQUIRE(cv::norm(ab.warp(0).parameters() - expected, cv::NORM_L1) < 0.05);
+    }
+    
+    W::Traits::ParamType velocity(vx, vy);
+    REQUIRE(cv::norm(ct.velocity(0) - velocity, cv::NORM_L1) < 0.05);
+    REQUIRE(cv::norm(ab.velocity(0) - velocity, cv::NORM_L1) < 0.2);
+    
+    // Good predictions require a single level, motion without prediction requires more.
+    REQUIRE(ct.levelsUsed(0) == 1);
+    REQUIRE(ab.levelsUsed(0) == 1);
+    REQUIRE(st.levelsUsed(0) > 1);
+    REQUIRE(cv::norm(st.velocity(0), cv::NORM_L1) == 0);
+}
+
+TEST_CASE("sequence-tracker-jump")
+{
+    namespace ia = imagealign;
+    
+    cv::RNG rng(23);
+    cv::Mat scene(240, 240, CV_8UC1);
+    for (int y = 0; y < scene.rows; ++y)
+        for (int x = 0; x < scene.cols; ++x)
+            scene.at<uchar>(y, x) = (uchar)rng.uniform(0, 255);
+    cv::blur(scene, scene, cv::Size(5,5));
+    
+    // Content moves by (3, 2) pixels per frame and jumps by (6, 5) pixels at frame 5
+    const int vx = 3, vy = 2;
+    const int jx = 6, jy = 5;
+    const int jumpFrame = 5;
+    const int frames = 8;
+    std::vector<ia::ImagePyramid> pyrs(frames);
+    std::vector<cv::Point> offsets(frames);
+    for (int k = 0; k < frames; ++k) {
+        offsets[k] = cv::Point(k * vx, k * vy) + (k >= jumpFrame ? cv::Point(jx, jy) : cv::Point());
+        pyrs[k].create(scene(cv::Rect(100 - offsets[k].x, 100 - offsets[k].y, 120, 120)), 4);
+    }
+    
+    typedef ia::WarpTranslationF W;
+    
+    cv::Mat tmpl = pyrs[0][0](cv::Rect(40, 40, 40, 40));
+    
+    W w0;
+    w0.setParameters(W::Traits::ParamType(40, 40));
+    
+    ia::SequenceTracker< ia::AlignInverseCompositional<W> > ic;
+    ia::SequenceTracker< ia::AlignForwardAdditive<W> > fa;
+    
+    REQUIRE(ic.addTrack(tmpl, pyrs[0], w0, 4) == 0);
+    REQUIRE(fa.addTrack(tmpl, pyrs[0], w0, 4) == 0);
+    REQUIRE(!pyrs[0].hasGradients());
+    
+    for (int k = 1; k < frames; ++k) {
+        ic.track(pyrs[k], 100, 0.f);
+        fa.track(pyrs[k], 100, 0.f);
+        
+        W::Traits::ParamType expected(float(40 + offsets[k].x), float(40 + offsets[k].y));
+        
+        REQUIRE(!ic.lost(0));
+        REQUIRE(!fa.lost(0));
+        REQUIRE(cv::norm(ic.warp(0).parameters() - expected, cv::NORM_L1) < 0.05);
+        REQUIRE(cv::norm(fa.warp(0).parameters() - expected, cv::NORM_L1) < 0.05);
+        
+        // Smooth motion needs a single level, the jump falls back to all levels.
+        if (k > 2 && k < jumpFrame) {
+            REQUIRE(ic.levelsUsed(0) == 1);
+            REQUIRE(fa.levelsUsed(0) == 1);
+        } else if (k == jumpFrame) {
+            REQUIRE(ic.levelsUsed(0) == ic.aligner(0).numLevels());
+            REQUIRE(fa.levelsUsed(0) == fa.aligner(0).numLevels());
+        }
+    }
+    
+    // Frames shared with the tracker are left untouched.
+    REQUIRE(!pyrs[frames - 1].hasGradients());
+    
+    // Alignments ending without constraints fall back even when all thresholds are disabled
+    ia::SequenceTracker< ia::AlignInverseCompositional<W> > nc;
+    nc.setFallback(0, 0);
+    REQUIRE(nc.addTrack(tmpl, pyrs[0], w0, 4) == 0);
+    for (int k = 1; k < jumpFrame; ++k) {
+        nc.track(pyrs[k], 100, 0.f);
+    }
+    REQUIRE(nc.levelsUsed(0) == 1);
+    
+    ia::ImagePyramid corner;
+    corner.create(pyrs[0][0](cv::Rect(0, 0, 40, 40)), 4);
+    nc.track(corner, 100, 0.f);
+    REQUIRE(nc.aligner(0).lastReason() == ia::TERMINATION_NO_CONSTRAINTS);
+    REQUIRE(nc.levelsUsed(0) == nc.aligner(0).numLevels());
+    REQUIRE(!nc.lost(0));
+}
+
+TEST_CASE("multi-hypothesis")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(140, 140, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    cv::Mat tmpl = target(cv::Rect(50, 46, 24, 24));
+    
+    typedef ia::WarpTranslationF W;
+    
+    ia::PreparedTemplate<W> prepared;
+    prepared.create(tmpl, W(), 3);
+    
+    ia::ImagePyramid pyr;
+    pyr.create(target, 3);
+    
+    // Grid of translations around a poor guess
+    std::vector<W> hypotheses;
+    for (int y = -2; y <= 2; ++y) {
+        for (int x = -2; x <= 2; ++x) {
+            W w;
+            w.setParameters(W::Traits::ParamType(60.f + 4.f * float(x), 37.f + 4.f * float(y)));
+            hypotheses.push_back(w);
+        }
+    }
+    std::vector<W> initial = hypotheses;
+    
+    ia::MultiHypothesisAligner<W> mh;
+    mh.setMaxSurvivors(3);
+    
+    const int best = mh.align(prepared, pyr, hypotheses, 30, 0.001f);
+    
+    REQUIRE(best >= 0);
+    REQUIRE(best == mh.best());
+    REQUIRE(mh.survivors().size() > 0);
+    REQUIRE(mh.survivors().size() <= 3);
+    REQUIRE(mh.survivors()[0] == best);
+    REQUIRE(mh.errors().size() == hypotheses.size());
+    REQUIRE(cv::norm(hypotheses[best].parameters() - W::Traits::ParamType(50, 46), cv::NORM_L1) < 0.01);
+    
+    // Survivors are distinct
+    for (size_t i = 0; i < mh.survivors().size(); ++i) {
+        for (size_t j = i + 1; j < mh.survivors().size(); ++j) {
+            REQUIRE(ia::cornerDisplacement(hypotheses[mh.survivors()[i]], hypotheses[mh.survivors()[j]], tmpl.size()) >= mh.minSeparation());
+        }
+    }
+    
+    // The best survivor matches a full alignment from its initial warp
+    ia::AlignContext<W> ctx;
+    W w = initial[best];
+    ctx.align(prepared, pyr, w, 30, 0.001f);
+    REQUIRE(cv::norm(w.parameters() - hypotheses[best].parameters()) == 0);
+    REQUIRE(mh.errors()[best] == ctx.lastError());
+    
+    // Aligning all levels for every hypothesis finds the same optimum
+    hypotheses = initial;
+    mh.setCoarseLevels(3);
+    const int bestAll = mh.align(prepared, pyr, hypotheses, 30, 0.001f);
+    REQUIRE(bestAll >= 0);
+    REQUIRE(cv::norm(hypotheses[bestAll].parameters() - W::Traits::ParamType(50, 46), cv::NORM_L1) < 0.01);
+    
+    // Budgets smaller than the number of levels still refine every level
+    hypotheses = initial;
+    mh.setCoarseLevels(1);
+    const int bestSmall = mh.align(prepared, pyr, hypotheses, 2, 0.001f);
+    REQUIRE(bestSmall >= 0);
+    REQUIRE(cv::norm(hypotheses[bestSmall].parameters() - initial[bestSmall].parameters()) > 0);
+}
+
+TEST_CASE("solve-symmetric")
+{
+    namespace ia = imagealign;
+    
+    typedef cv::Matx<float, 6, 6> H;
+    typedef cv::Matx<float, 6, 1> P;
+    typedef cv::Matx<float, 1, 6> S;
+    
+    cv::RNG rng(7);
+    
+    // Accumulated upper triangle matches the full outer product
+    H h = H::zeros();
+    H full = H::zeros();
+    for (int i = 0; i < 50; ++i) {
+        S sd;
+        for (int k = 0; k < 6; ++k)
+            sd(0, k) = rng.uniform(-1.f, 1.f);
+        
+        ia::accumulateUpper(h, sd, 0.5f);
+        full += (sd.t() * sd) * 0.5f;
+    }
+    
+    for (int r = 0; r < 6; ++r) {
+        for (int c = 0; c < 6; ++c) {
+            if (c >= r) {
+                REQUIRE(h(r, c) == Catch::Detail::Approx(full(r, c)).epsilon(1e-4));
+            } else {
+                REQUIRE(h(r, c) == 0.f);
+            }
+        }
+    }
+    
+    P b;
+    for (int k = 0; k < 6; ++k)
+        b(k) = rng.uniform(-1.f, 1.f);
+    
+    // Same solution as the general inverse, reading the upper triangle only
+    const P x = ia::solveSymmetric(h, b);
+    const P xinv = full.inv() * b;
+    REQUIRE(cv::norm(x - xinv, cv::NORM_L1) < 1e-3);
+    
+    H symm = h;
+    ia::symmetrizeUpper(symm);
+    REQUIRE(cv::norm(symm * x - b, cv::NORM_L1) < 1e-3);
+    
+    // Singular matrices behave like the general inverse
+    const P zero = ia::solveSymmetric(H::zeros(), b);
+    REQUIRE(cv::norm(zero - H::zeros().inv() * b, cv::NORM_L1) == 0);
+    
+    // Closed form solution of two parameters
+    cv::Matx<double, 2, 2> h2(4, 1, 1, 3);
+    cv::Matx<double, 2, 1> b2(1, 2);
+    REQUIRE(cv::norm(ia::solveSymmetric(h2, b2) - h2.inv() * b2, cv::NORM_L1) < 1e-12);
+    
+    h2(1, 0) = 0;
+    REQUIRE(cv::norm(ia::solveSymmetric(h2, b2) - cv::Matx<double, 2, 1>(1. / 11., 7. / 11.), cv::NORM_L1) < 1e-12);
+}
+
+TEST_CASE("algorithm-gradient-reuse")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    cv::Mat tmpl;
+    
+    typedef ia::WarpAffineD W;
+    
+    W::Traits::ParamType expected;
+    expected << 30, 25, 0.05, 0.08, -0.06, -0.04;
+    
+    W w;
+    w.setParameters(expected);
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    
+    W::Traits::ParamType noise;
+    noise << 0.8, -0.7, 0.01, -0.01, 0.01, 0.01;
+    w.setParameters(expected + noise);
+    
+    for (int levels = 1; levels <= 2; ++levels) {
+        W wr = w;
+        ia::AlignForwardCompositional<W> a;
+        a.setGradientReuseThreshold(0.5);
+        REQUIRE(a.gradientReuseThreshold() == 0.5);
+        a.prepare(tmpl, target, wr, levels);
+        a.align(wr, 100, 0.);
+        
+        REQUIRE(cv::norm(wr.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.02));
+    }
+}
+
+TEST_CASE("algorithm-masked-template")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    // Circular object on background that does not move with the template
+    cv::Mat tmpl = target(cv::Rect(30, 25, 40, 40)).clone();
+    cv::Mat background(40, 40, CV_8UC1);
+    cv::randu(background, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    cv::Mat mask(40, 40, CV_8UC1);
+    for (int y = 0; y < 40; ++y) {
+        for (int x = 0; x < 40; ++x) {
+            const bool inside = (x - 20) * (x - 20) + (y - 20) * (y - 20) < 16 * 16;
+            mask.at<uchar>(y, x) = inside ? 255 : 0;
+            if (!inside)
+                tmpl.at<uchar>(y, x) = background.at<uchar>(y, x);
+        }
+    }
+    
+    ia::TemplatePixels pixels;
+    pixels.create(mask);
+    REQUIRE(pixels.masked());
+    REQUIRE(pixels.numPixels() == cv::countNonZero(mask(cv::Rect(1, 1, 38, 38))));
+    REQUIRE(pixels.contains(20, 20));
+    REQUIRE(!pixels.contains(2, 2));
+    
+    ia::TemplatePixels all;
+    all.create(cv::Size(40, 40));
+    REQUIRE(!all.masked());
+    REQUIRE(all.numPixels() == 38 * 38);
+    
+    std::vector<cv::Mat> masks;
+    ia::ImagePyramid::createMasks(mask, 3, masks);
+    REQUIRE(masks.size() == 3);
+    REQUIRE(masks[1].size() == cv::Size(20, 20));
+    REQUIRE(masks[1].at<uchar>(10, 10) == 255);
+    REQUIRE(masks[1].at<uchar>(0, 0) == 0);
+    
+    typedef ia::WarpTranslationF W;
+    
+    W::Traits::ParamType expected(30, 25);
+    
+    W w0;
+    w0.setParameters(W::Traits::ParamType(28.5f, 26.5f));
+    
+    {
+        W w = w0;
+        ia::AlignForwardAdditive<W> a;
+        a.prepare(tmpl, target, w, 2, mask);
+        a.align(w, 100, 0.f);
+        REQUIRE(cv::norm(w.parameters() - expected, cv::NORM_L1) < 0.01);
+    }
+    
+    {
+        W w = w0;
+        ia::AlignForwardCompositional<W> a;
+        a.prepare(tmpl, target, w, 2, mask);
+        a.align(w, 100, 0.f);
+        REQUIRE(cv::norm(w.parameters() - expected, cv::NORM_L1) < 0.01);
+    }
+    
+    {
+        W w = w0;
+        ia::AlignESM<W> a;
+        a.prepare(tmpl, target, w, 2, mask);
+        a.align(w, 100, 0.f);
+        REQUIRE(cv::norm(w.parameters() - expected, cv::NORM_L1) < 0.01);
+    }
+    
+    {
+        W w = w0;
+        ia::AlignInverseCompositional<W> a;
+        a.prepare(tmpl, target, w, 2, mask);
+        a.align(w, 100, 0.f);
+        REQUIRE(cv::norm(w.parameters() - expected, cv::NORM_L1) < 0.01);
+#if !defined(IA_NO_STATS)
+        REQUIRE(a.stats().levels[0].numConstraints <= pixels.numPixels());
+#endif
+        
+        // Selection picks masked pixels only
+        a.setPixelSelection(ia::PixelSelection::topFraction(0.5f));
+        a.updateTemplate(tmpl, w0, mask);
+        REQUIRE(a.numSelectedPixels(0) == (int)(0.5f * pixels.numPixels() + 0.5f));
+        
+        w = w0;
+        a.align(w, 100, 0.f);
+        REQUIRE(cv::norm(w.parameters() - expected, cv::NORM_L1) < 0.01);
+    }
+    
+    {
+        // Contexts mask shared template data
+        ia::PreparedTemplate<W> prepared;
+        prepared.create(tmpl, w0, 2);
+        ia::ImagePyramid pyr;
+        pyr.create(target, 2);
+        
+        ia::AlignContext<W> ctx;
+        ctx.setMask(prepared, mask);
+        REQUIRE(ctx.masked());
+        
+        W w = w0;
+        ctx.align(prepared, pyr, w, 100, 0.f);
+        REQUIRE(cv::norm(w.parameters() - expected, cv::NORM_L1) < 0.01);
+#if !defined(IA_NO_STATS)
+        REQUIRE(ctx.stats().levels[0].numConstraints <= pixels.numPixels());
+#endif
+        
+        W wa = w0;
+        ia::AlignInverseCompositional<W> a;
+        a.prepare(tmpl, pyr, wa, 2, mask);
+        a.align(wa, 100, 0.f);
+        REQUIRE(cv::norm(w.parameters() - wa.parameters(), cv::NORM_L1) < 0.001);
+        
+        ctx.setMask(prepared, cv::noArray());
+        REQUIRE(!ctx.masked());
+    }
+    
+    {
+        // The rectangular template is biased by the background
+        W w = w0;
+        ia::AlignInverseCompositional<W> a;
+        a.prepare(tmpl, target, w, 2);
+        a.align(w, 100, 0.f);
+        REQUIRE(cv::norm(w.parameters() - expected, cv::NORM_L1) > 0.01);
+    }
+}
+
+TEST_CASE("translation-search")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(120, 120, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    cv::Mat tmpl = target(cv::Rect(40, 30, 32, 32));
+    cv::Mat tmplF;
+    tmpl.convertTo(tmplF, CV_32F);
+    
+    typedef ia::WarpTranslationF W;
+    
+    // Integer offsets are found by both scores, NCC under gain and bias changes
+    {
+        cv::Mat brighter;
+        target.convertTo(brighter, CV_8U, 0.5, 40);
+        
+        ia::TranslationSearch s;
+        s.setRadius(4);
+        
+        W w;
+        w.setParameters(W::Traits::ParamType(43.3f, 27.8f));
+        REQUIRE(s.setScore(ia::SEARCH_SSD).apply(tmplF, target, w));
+        REQUIRE(w.parameters()(0) == 40.f);
+        REQUIRE(w.parameters()(1) == 30.f);
+        
+        // Left untouched at the best offset
+        REQUIRE(!s.apply(tmplF, target, w));
+        
+        w.setParameters(W::Traits::ParamType(36.6f, 33.1f));
+        REQUIRE(s.setScore(ia::SEARCH_NCC).apply(tmplF, brighter, w));
+        REQUIRE(w.parameters()(0) == 40.f);
+        REQUIRE(w.parameters()(1) == 30.f);
+    }
+    
+    // Steepest descent images of translations are the template gradients
+    {
+        W w0;
+        ia::SDIPlanes sdi;
+        sdi.create(2, tmplF.cols - 2, tmplF.rows - 2);
+        W::Traits::HessianType h = W::Traits::zeroHessian(2);
+        ia::detail::inverseCompositionalSDI(w0, tmplF, sdi, h);
+        
+        for (int y = 1; y < tmplF.rows - 1; ++y) {
+            for (int x = 1; x < tmplF.cols - 1; ++x) {
+                const W::Traits::GradientType g = ia::gradient<float, ia::SAMPLE_NEAREST, W::Traits>(tmplF, W::Traits::PointType(float(x), float(y)));
+                REQUIRE(sdi.ptr(0, y - 1)[x - 1] == g(0));
+                REQUIRE(sdi.ptr(1, y - 1)[x - 1] == g(1));
+            }
+        }
+        REQUIRE(h(0, 0) > 0.f);
+    }
+    
+    // Large motions converge once searched on the coarsest level
+    {
+        W w;
+        w.setParameters(W::Traits::ParamType(52.f, 19.f));
+        
+        ia::AlignInverseCompositional<W> a;
+        a.setTranslationSearch(6);
+        REQUIRE(a.translationSearch().radius() == 6);
+        a.prepare(tmpl, target, w, 3);
+        a.align(w, 30, 0.001f);
+        
+        REQUIRE(cv::norm(w.parameters() - W::Traits::ParamType(40.f, 30.f), cv::NORM_L1) < 0.05);
+    }
+}
+
+TEST_CASE("tiled-alignment")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(300, 340, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    // Tiled levels are identical to levels of image pyramids
+    ia::MatTileProvider provider(target);
+    ia::TiledPyramid tiled(provider, 3, 48);
+    
+    ia::ImagePyramid pyr;
+    pyr.create(target, 3);
+    
+    REQUIRE(tiled.numLevels() == 3);
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(tiled.size(i) == pyr[i].size());
+        
+        cv::Mat full;
+        tiled.region(i, cv::Rect(cv::Point(0, 0), tiled.size(i)), full);
+        REQUIRE(cv::norm(full, pyr[i], cv::NORM_INF) == 0);
+        
+        cv::Mat part;
+        const cv::Rect r(7 >> i, 45 >> i, 100 >> i, 60 >> i);
+        tiled.region(i, r, part);
+        REQUIRE(cv::norm(part, pyr[i](r), cv::NORM_INF) == 0);
+    }
+    
+    // Cached tiles are not computed again, least recently used tiles are evicted
+    const size_t decoded = tiled.numTilesDecoded();
+    tiled.tile(1, 0, 0);
+    REQUIRE(tiled.numTilesDecoded() == decoded);
+    
+    const size_t cached = tiled.cache().size();
+    tiled.cache().setCapacity(4 * 48 * 48 * sizeof(float));
+    REQUIRE(tiled.cache().size() < cached);
+    REQUIRE(tiled.cache().bytes() <= tiled.cache().capacity());
+    
+    tiled.tile(1, 0, 0);
+    REQUIRE(tiled.numTilesDecoded() == decoded);
+    tiled.tile(0, 0, 0);
+    REQUIRE(tiled.numTilesDecoded() == decoded + 1);
+    
+    // Raw files are read by region
+    {
+        std::ofstream out("tiled_target.raw", std::ios::out | std::ios::binary);
+        out.write("head", 4);
+        for (int y = 0; y < target.rows; ++y)
+            out.write(reinterpret_cast<const char*>(target.ptr(y)), target.cols);
+    }
+    
+    {
+        ia::RawFileTileProvider raw("tiled_target.raw", target.size(), CV_8UC1, 4);
+        REQUIRE(raw.isOpen());
+        
+        cv::Mat r;
+        raw.readRegion(cv::Rect(13, 200, 81, 17), r);
+        REQUIRE(cv::norm(r, target(cv::Rect(13, 200, 81, 17)), cv::NORM_INF) == 0);
+    }
+    std::remove("tiled_target.raw");
+    
+    // Alignment decodes tiles around the template only
+    {
+        typedef ia::WarpEuclideanD W;
+        
+        W::Traits::ParamType expected(250, 190, 0.1);
+        
+        W w;
+        w.setParameters(expected);
+        cv::Mat tmpl;
+        ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+        
+        w.setParameters(expected + W::Traits::ParamType(4, -3, 0.02));
+        
+        // Decoded tiles do not depend on the size of the target
+        cv::Mat large(640, 600, CV_8UC1);
+        cv::randu(large, cv::Scalar::all(0), cv::Scalar::all(255));
+        target.copyTo(large(cv::Rect(0, 0, target.cols, target.rows)));
+        
+        ia::MatTileProvider largeProvider(large);
+        ia::TiledPyramid lazy(largeProvider, 3, 32);
+        ia::TiledAligner< ia::AlignInverseCompositional<W> > a;
+        a.setMargin(16);
+        REQUIRE(a.margin() == 16);
+        a.prepare(tmpl, lazy, w, 3);
+        REQUIRE(a.align(w, 100, 0.));
+        
+        REQUIRE(cv::norm(w.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.02));
+        
+        const cv::Rect region = a.region();
+        REQUIRE(region.x % 4 == 0);
+        REQUIRE(region.y % 4 == 0);
+        REQUIRE(region.contains(cv::Point(250, 190)));
+        
+        // The finest level alone consists of 19 x 20 tiles
+        REQUIRE(lazy.numTilesDecoded() < 120);
+        
+        // Regions keep their size while the template moves
+        W moved;
+        moved.setParameters(expected + W::Traits::ParamType(-3, 2, 0));
+        REQUIRE(a.align(moved, 100, 0.));
+        REQUIRE(cv::norm(moved.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.02));
+        REQUIRE(a.region().size() == region.size());
+        
+        // Target gradients are computed along with the region
+        ia::TiledAligner< ia::AlignForwardAdditive<W> > fa;
+        fa.setMargin(16);
+        W wf;
+        wf.setParameters(expected + W::Traits::ParamType(2, -2, 0.01));
+        fa.prepare(tmpl, lazy, wf, 3);
+        REQUIRE(fa.align(wf, 100, 0.));
+        REQUIRE(cv::norm(wf.parameters() - expected, cv::NORM_L1) == Catch::Detail::Approx(0).epsilon(0.02));
+        
+        // Templates missing the target are not aligned
+        W outside;
+        outside.setParameters(W::Traits::ParamType(1000, 1000, 0));
+        REQUIRE(!a.align(outside, 10, 0.));
+        REQUIRE(outside.parameters()(0) == 1000);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,96 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_ALLOCATION_COUNTER_H
+#define IMAGE_ALIGN_ALLOCATION_COUNTER_H
+
+/**
+    Heap allocation counter shared by benchmarks and tests.
+ 
+    Allocations are counted by intercepting malloc on glibc and operator new elsewhere. 
+    The latter misses allocations of OpenCV, which uses malloc. Replaces global allocation
+    functions, hence must be included by exactly one translation unit of an executable.
+ */
+
+#include <opencv2/core/core.hpp>
+#include <cstdlib>
+#include <new>
+
+static int g_allocations = 0;
+
+#if defined(__GLIBC__)
+
+extern "C" {
+    void *__libc_malloc(size_t n);
+    void *__libc_calloc(size_t n, size_t s);
+    void *__libc_realloc(void *p, size_t n);
+    void *__libc_memalign(size_t a, size_t n);
+    
+    void *malloc(size_t n) {
+        CV_XADD(&g_allocations, 1);
+        return __libc_malloc(n);
+    }
+    
+    void *calloc(size_t n, size_t s) {
+        CV_XADD(&g_allocations, 1);
+        return __libc_calloc(n, s);
+    }
+    
+    void *realloc(void *p, size_t n) {
+        CV_XADD(&g_allocations, 1);
+        return __libc_realloc(p, n);
+    }
+    
+    int posix_memalign(void **p, size_t a, size_t n) {
+        CV_XADD(&g_allocations, 1);
+        *p = __libc_memalign(a, n);
+        return *p ? 0 : 12; // ENOMEM
+    }
+}
+
+#else
+
+void *operator new(size_t n) {
+    CV_XADD(&g_allocations, 1);
+    void *p = std::malloc(n ? n : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t n) {
+    return operator new(n);
+}
+
+void operator delete(void *p) throw() {
+    std::free(p);
+}
+
+void operator delete[](void *p) throw() {
+    std::free(p);
+}
+
+#endif
+
+/** Snapshot of the allocation counter. */
+static int allocations() {
+    return CV_XADD(&g_allocations, 0);
+}
+
+#endif
\ No newline at end of file
@@ -20,6 +20,10 @@ along with AMM.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "catch.hpp"
 #include <imagealign/sampling.h>
+#include <imagealign/gradient.h>
+#include <imagealign/image_pyramid.h>
+#include <imagealign/warp.h>
+#include <string>
 
 
 TEST_CASE("sampling-bilinear")
@@ -74,4 +78,218 @@ TEST_CASE("sampling-nearest")
     REQUIRE(s.sample<uchar>(img, PointType(0.5, 0.5)) == 0);
     REQUIRE(s.sample<uchar>(img, PointType(1.1, 0.0)) == 64);
 
+}
+
+TEST_CASE("sampling-bilinear-batch")
+{
+    namespace ia = imagealign;
+    
+    ia::Sampler<ia::SAMPLE_BILINEAR> s;
+    
+    cv::Mat img(20, 30, CV_32FC1);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    // Mix of interior and border coordinates, count not a multiple of SIMD width.
+    const int n = 203;
+    std::vector<float> x(n), y(n), values(n);
+    for (int i = 0; i < n; ++i) {
+        x[i] = cv::theRNG().uniform(-1.f, 31.f);
+        y[i] = (i % 3 == 0) ? cv::theRNG().uniform(-1.f, 21.f) : cv::theRNG().uniform(0.f, 18.9f);
+    }
+    
+    s.sample<float>(img, &x[0], &y[0], n, &values[0]);
+    
+    for (int i = 0; i < n; ++i) {
+        REQUIRE(values[i] == Catch::Detail::Approx(s.sample<float>(img, x[i], y[i])));
+    }
+}
+
+TEST_CASE("sampling-interleaved-gradients")
+{
+    namespace ia = imagealign;
+    
+    ia::Sampler<ia::SAMPLE_BILINEAR> s;
+    
+    cv::Mat img(40, 30, CV_8UC1);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    ia::ImagePyramid pyr;
+    pyr.create(img, 2, true);
+    
+    REQUIRE(pyr.hasGradients());
+    REQUIRE(pyr.gradientImage(1).size() == pyr[1].size());
+    REQUIRE(pyr.slice(1, 1).hasGradients());
+    
+    // Interpolated precomputed gradients match central differences of interpolated intensities
+    typedef ia::WarpTraits<ia::WARP_TRANSLATION, float> Traits;
+    
+    const int n = 50;
+    std::vector<float> x(n), y(n), values(4 * n);
+    for (int i = 0; i < n; ++i) {
+        x[i] = cv::theRNG().uniform(1.f, 28.f);
+        y[i] = cv::theRNG().uniform(1.f, 38.f);
+    }
+    
+    s.sampleInterleaved<float, 4>(pyr.gradientImage(0), &x[0], &y[0], n, &values[0]);
+    
+    for (int i = 0; i < n; ++i) {
+        Traits::GradientType g = ia::gradient<float, ia::SAMPLE_BILINEAR, Traits>(pyr[0], Traits::PointType(x[i], y[i]));
+        
+        REQUIRE(values[4 * i + 0] == Catch::Detail::Approx(s.sample<float>(pyr[0], x[i], y[i])));
+        REQUIRE(values[4 * i + 1] == Catch::Detail::Approx(g(0)).epsilon(1e-4));
+        REQUIRE(values[4 * i + 2] == Catch::Detail::Approx(g(1)).epsilon(1e-4));
+    }
+}
+
+TEST_CASE("gradient-batch")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat img(40, 30, CV_32FC1);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    typedef ia::WarpTraits<ia::WARP_TRANSLATION, float> Traits;
+    
+    // More coordinates than a single block
+    const int n = 150;
+    std::vector<float> x(n), y(n), gx(n), gy(n);
+    for (int i = 0; i < n; ++i) {
+        x[i] = cv::theRNG().uniform(1.f, 28.f);
+        y[i] = cv::theRNG().uniform(1.f, 38.f);
+    }
+    
+    ia::gradient<float>(img, &x[0], &y[0], n, &gx[0], &gy[0], ia::Sampler<ia::SAMPLE_BILINEAR>());
+    for (int i = 0; i < n; ++i) {
+        Traits::GradientType g = ia::gradient<float, ia::SAMPLE_BILINEAR, Traits>(img, Traits::PointType(x[i], y[i]));
+        REQUIRE(gx[i] == Catch::Detail::Approx(g(0)));
+        REQUIRE(gy[i] == Catch::Detail::Approx(g(1)));
+    }
+    
+    ia::gradient<float>(img, &x[0], &y[0], n, &gx[0], &gy[0], ia::Sampler<ia::SAMPLE_NEAREST>());
+    for (int i = 0; i < n; ++i) {
+        Traits::GradientType g = ia::gradient<float, ia::SAMPLE_NEAREST, Traits>(img, Traits::PointType(x[i], y[i]));
+        REQUIRE(gx[i] == g(0));
+        REQUIRE(gy[i] == g(1));
+    }
+}
+
+TEST_CASE("simd-kernels")
+{
+    namespace ia = imagealign;
+    
+    REQUIRE(ia::simdInstructionSet() != 0);
+    
+    cv::Mat img(20, 30, CV_32FC1);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    // Interior coordinates, count not a multiple of SIMD width.
+    const int n = 203;
+    std::vector<float> x(n), y(n), a(n), b(n), values(n), expected(n), products(n);
+    for (int i = 0; i < n; ++i) {
+        x[i] = cv::theRNG().uniform(0.f, 28.9f);
+        y[i] = cv::theRNG().uniform(0.f, 18.9f);
+        a[i] = cv::theRNG().uniform(-1.f, 1.f);
+        b[i] = cv::theRNG().uniform(-1.f, 1.f);
+    }
+    
+    ia::detail::bilinearInterior<float, float>(img, &x[0], &y[0], n, &expected[0]);
+    
+    double dot = 0;
+    for (int i = 0; i < n; ++i) {
+        dot += double(a[i]) * double(b[i]);
+    }
+    
+    std::vector<const ia::detail::SIMDKernels*> kernels;
+    
+#if defined(IA_USE_DISPATCH)
+    kernels.push_back(&ia::detail::simdKernels());
+    if (cv::checkHardwareSupport(CV_CPU_AVX2))
+        kernels.push_back(ia::detail::simdKernelsAVX2());
+    if (cv::checkHardwareSupport(CV_CPU_AVX_512F))
+        kernels.push_back(ia::detail::simdKernelsAVX512());
+#endif
+    
+    ia::detail::SIMDKernels native = {
+        ia::detail::native::instructionSet(),
+        &ia::detail::native::dotProduct,
+        &ia::detail::native::multiply,
+        &ia::detail::native::bilinearInterior
+    };
+    kernels.push_back(&native);
+    
+#if defined(IA_USE_DISPATCH)
+    // Inline kernels use the baseline instruction set whatever the flags of this translation unit
+    REQUIRE(std::string(native.name) != "avx2");
+    REQUIRE(std::string(native.name) != "avx512");
+#endif
+    
+    for (size_t k = 0; k < kernels.size(); ++k) {
+        const ia::detail::SIMDKernels &s = *kernels[k];
+        
+        REQUIRE(s.dotProduct(&a[0], &b[0], n) == Catch::Detail::Approx(dot).epsilon(1e-4));
+        
+        s.multiply(&a[0], &b[0], &products[0], n);
+        for (int i = 0; i < n; ++i) {
+            REQUIRE(products[i] == a[i] * b[i]);
+        }
+        
+        const int processed = s.bilinearInterior(img.ptr<float>(0), img.cols, &x[0], &y[0], n, &values[0]);
+        REQUIRE(processed >= 0);
+        REQUIRE(processed <= n);
+        for (int i = 0; i < processed; ++i) {
+            REQUIRE(values[i] == Catch::Detail::Approx(expected[i]));
+        }
+    }
+}
+
+TEST_CASE("sampling-fixed-point")
+{
+    namespace ia = imagealign;
+    
+    ia::Sampler<ia::SAMPLE_BILINEAR> s;
+    
+    const int depths[2] = {CV_8U, CV_16U};
+    const double ranges[2] = {255, 65535};
+    
+    for (int d = 0; d < 2; ++d) {
+        cv::Mat img(20, 30, CV_MAKETYPE(depths[d], 1));
+        cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(ranges[d]));
+        
+        cv::Mat imgf;
+        img.convertTo(imgf, CV_32F);
+        
+        // Mix of interior and border coordinates
+        const int n = 203;
+        std::vector<float> x(n), y(n), values(n), expected(n);
+        for (int i = 0; i < n; ++i) {
+            x[i] = cv::theRNG().uniform(-1.f, 31.f);
+            y[i] = (i % 3 == 0) ? cv::theRNG().uniform(-1.f, 21.f) : cv::theRNG().uniform(0.f, 18.9f);
+        }
+        
+        s.sampleToFloat(img, &x[0], &y[0], n, &values[0]);
+        s.sampleToFloat(imgf, &x[0], &y[0], n, &expected[0]);
+        
+        // Weights are quantized to 1/256 per axis
+        for (int i = 0; i < n; ++i) {
+            REQUIRE(std::abs(values[i] - expected[i]) <= ranges[d] / 256.);
+        }
+        
+        // Pixel centers are exact
+        const float px = 7.f, py = 3.f;
+        float v;
+        s.sampleToFloat(img, &px, &py, 1, &v);
+        REQUIRE(v == imgf.at<float>(3, 7));
+        
+        // Pyramids keep the depth, gradients are floating point
+        ia::ImagePyramid pyr;
+        pyr.create(img, 2, true, depths[d]);
+        
+        REQUIRE(pyr.depth() == depths[d]);
+        REQUIRE(pyr[1].depth() == depths[d]);
+        REQUIRE(pyr.gradientImage(1).type() == CV_32FC4);
+        
+        ia::ImagePyramid pyrf;
+        pyrf.create(imgf, 1, true);
+        REQUIRE(cv::norm(pyr.gradientImage(0), pyrf.gradientImage(0), cv::NORM_INF) == 0);
+    }
 }
\ No newline at end of file
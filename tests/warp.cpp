@@ -21,6 +21,7 @@
 #include "catch.hpp"
 
 #include <imagealign/warp.h>
+#include <imagealign/warp_image.h>
 
 TEST_CASE("warp-translational")
 {
@@ -121,4 +122,195 @@ TEST_CASE("warp-similarity")
     
     REQUIRE(wx(0) == Catch::Detail::Approx(-20.f + 5.f).epsilon(0.01));
     REQUIRE(wx(1) == Catch::Detail::Approx(-30.f + 5.f).epsilon(0.01));
+}
+
+TEST_CASE("warp-affine")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpAffineD W;
+    
+    W w;
+    w.setIdentity();
+    
+    REQUIRE(cv::norm(w.parameters()) == 0.0);
+    REQUIRE(w.numParameters() == 6);
+    
+    W::Traits::ParamType p;
+    p << 5, -3, 0.1, 0.2, -0.1, 0.3;
+    w.setParameters(p);
+    REQUIRE(cv::norm(w.parameters() - p) == Catch::Detail::Approx(0));
+    
+    W::Traits::PointType wx = w(W::Traits::PointType(10, 20));
+    REQUIRE(wx(0) == Catch::Detail::Approx(1.1 * 10 - 0.1 * 20 + 5));
+    REQUIRE(wx(1) == Catch::Detail::Approx(0.2 * 10 + 1.3 * 20 - 3));
+    
+    // Scaling affects translation only
+    W ws = w.scaled(1);
+    wx = ws(W::Traits::PointType(20, 40));
+    REQUIRE(wx(0) == Catch::Detail::Approx(2 * (1.1 * 10 - 0.1 * 20 + 5)));
+    REQUIRE(wx(1) == Catch::Detail::Approx(2 * (0.2 * 10 + 1.3 * 20 - 3)));
+    
+    // Inverse compositional step with delta followed by forward compositional step with delta yields original warp
+    W::Traits::ParamType d;
+    d << 0.5, 0.2, 0.01, -0.02, 0.03, 0.01;
+    W w2(w);
+    w2.updateInverseCompositional(d);
+    w2.updateForwardCompositional(d);
+    REQUIRE(cv::norm(w2.parameters() - p) == Catch::Detail::Approx(0).epsilon(1e-8));
+}
+
+TEST_CASE("warp-perspective")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpPerspectiveD W;
+    
+    W w;
+    w.setIdentity();
+    
+    REQUIRE(cv::norm(w.parameters()) == 0.0);
+    REQUIRE(w.numParameters() == 8);
+    
+    W::Traits::ParamType p;
+    p << 5, -3, 0.1, 0.2, -0.1, 0.3, 0.001, -0.002;
+    w.setParameters(p);
+    REQUIRE(cv::norm(w.parameters() - p) == Catch::Detail::Approx(0));
+    
+    W::Traits::PointType x(10, 20);
+    W::Traits::PointType wx = w(x);
+    const double h = 0.001 * 10 - 0.002 * 20 + 1;
+    REQUIRE(wx(0) == Catch::Detail::Approx((1.1 * 10 - 0.1 * 20 + 5) / h));
+    REQUIRE(wx(1) == Catch::Detail::Approx((0.2 * 10 + 1.3 * 20 - 3) / h));
+    
+    // Scaled warp maps scaled points to scaled points
+    W ws = w.scaled(-1);
+    W::Traits::PointType wxs = ws(x * 0.5);
+    REQUIRE(wxs(0) == Catch::Detail::Approx(wx(0) * 0.5));
+    REQUIRE(wxs(1) == Catch::Detail::Approx(wx(1) * 0.5));
+    
+    // Jacobian has to match numeric differentiation
+    W::Traits::JacobianType j = w.jacobian(x);
+    for (int i = 0; i < 8; ++i) {
+        const double eps = 1e-6;
+        W wp, wm;
+        W::Traits::ParamType dp = W::Traits::ParamType::zeros();
+        dp(i, 0) = eps;
+        wp.setParameters(p + dp);
+        wm.setParameters(p - dp);
+        
+        W::Traits::PointType n = (wp(x) - wm(x)) * (1.0 / (2 * eps));
+        REQUIRE(j(0, i) == Catch::Detail::Approx(n(0)).epsilon(1e-5));
+        REQUIRE(j(1, i) == Catch::Detail::Approx(n(1)).epsilon(1e-5));
+    }
+    
+    // Compositions keep the matrix normalized
+    W::Traits::ParamType d;
+    d << 0.5, 0.2, 0.01, -0.02, 0.03, 0.01, 0.0005, 0.0002;
+    W w2(w);
+    w2.updateInverseCompositional(d);
+    REQUIRE(w2.matrix()(2, 2) == Catch::Detail::Approx(1));
+    w2.updateForwardCompositional(d);
+    REQUIRE(cv::norm(w2.parameters() - p) == Catch::Detail::Approx(0).epsilon(1e-8));
+    
+    // Incremental row evaluation including projective division
+    ia::WarpScanline<W> scan(w);
+    scan.start(3, 7);
+    for (int i = 3; i < 100; ++i, scan.next()) {
+        W::Traits::PointType a = scan.point();
+        W::Traits::PointType b = w(W::Traits::PointType(i, 7));
+        REQUIRE(a(0) == Catch::Detail::Approx(b(0)));
+        REQUIRE(a(1) == Catch::Detail::Approx(b(1)));
+    }
+}
+
+TEST_CASE("warp-scanline")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpSimilarityF W;
+    
+    REQUIRE(ia::IsPlanarWarp<W>::value);
+    REQUIRE(!ia::IsPlanarWarp<int>::value);
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(5.f, -3.f, 0.4f, 1.2f));
+    
+    // Incremental evaluation has to match direct evaluation of the warp
+    ia::WarpScanline<W> ws(w);
+    for (int y = 0; y < 50; y += 7) {
+        ws.start(3, y);
+        for (int x = 3; x < 500; ++x, ws.next()) {
+            W::Traits::PointType p = ws.point();
+            W::Traits::PointType q = w(W::Traits::PointType((float)x, (float)y));
+            
+            REQUIRE(p(0) == Catch::Detail::Approx(q(0)).epsilon(0.0001));
+            REQUIRE(p(1) == Catch::Detail::Approx(q(1)).epsilon(0.0001));
+        }
+    }
+}
+
+TEST_CASE("warp-image")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpSimilarityF W;
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(-20.f, 10.f, 0.3f, 1.1f));
+    
+    ia::Sampler<ia::SAMPLE_BILINEAR> s;
+    
+    // Large enough to be processed in parallel chunks of rows
+    cv::Mat src(300, 320, CV_32FC1);
+    cv::randu(src, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    cv::Mat dst;
+    ia::warpImage<float, ia::SAMPLE_BILINEAR>(src, dst, cv::Size(310, 290), w);
+    REQUIRE(dst.size() == cv::Size(310, 290));
+    REQUIRE(dst.type() == CV_32FC1);
+    
+    for (int y = 0; y < dst.rows; y += 13) {
+        for (int x = 0; x < dst.cols; x += 7) {
+            W::Traits::PointType p = w(W::Traits::PointType((float)x, (float)y));
+            REQUIRE(dst.at<float>(y, x) == Catch::Detail::Approx(s.sample<float>(src, p(0), p(1))).epsilon(1e-3));
+        }
+    }
+    
+    // Color images are warped in a single pass, matching per channel results
+    cv::Mat bgr(120, 100, CV_8UC3);
+    cv::randu(bgr, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    cv::Mat warped;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(bgr, warped, cv::Size(90, 110), w);
+    REQUIRE(warped.type() == CV_8UC3);
+    
+    std::vector<cv::Mat> channels;
+    cv::split(bgr, channels);
+    for (int c = 0; c < 3; ++c) {
+        cv::Mat single;
+        ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(channels[c], single, cv::Size(90, 110), w);
+        
+        for (int y = 0; y < single.rows; ++y) {
+            for (int x = 0; x < single.cols; ++x) {
+                REQUIRE(std::abs(int(warped.at<cv::Vec3b>(y, x)[c]) - int(single.at<uchar>(y, x))) <= 1);
+            }
+        }
+    }
+    
+    // Four channel floating point and nearest neighbor sampling
+    cv::Mat rgba(60, 50, CV_32FC4);
+    cv::randu(rgba, cv::Scalar::all(0), cv::Scalar::all(1));
+    
+    ia::warpImage<float, ia::SAMPLE_BILINEAR>(rgba, warped, cv::Size(40, 30), w);
+    REQUIRE(warped.type() == CV_32FC4);
+    
+    ia::warpImage<float, ia::SAMPLE_NEAREST>(rgba, warped, cv::Size(40, 30), w);
+    REQUIRE(warped.type() == CV_32FC4);
+    
+    ia::Sampler<ia::SAMPLE_NEAREST> sn;
+    W::Traits::PointType p = w(W::Traits::PointType(5.f, 7.f));
+    std::vector<cv::Mat> planes;
+    cv::split(rgba, planes);
+    REQUIRE(warped.ptr<float>(7)[5 * 4 + 2] == sn.sample<float>(planes[2], p(0), p(1)));
 }
\ No newline at end of file